@@ -24,10 +24,14 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <cerrno>
 #include <algorithm>
+#include <random>
 
 #include <alsa/asoundlib.h>
 
@@ -39,31 +43,20 @@ using namespace std;
 
 /* ****************  class AudioOutput  **************** */
 
-// Encode a list of samples as signed 16-bit little-endian integers.
-void AudioOutput::samplesToInt16(const SampleVector& samples,
-                                 vector<uint8_t>& bytes)
+// Encode a list of samples in the output format.
+void AudioOutput::encodeSamples(const SampleVector& samples,
+                                vector<uint8_t>& bytes)
 {
-    bytes.resize(2 * samples.size());
-
-    SampleVector::const_iterator i = samples.begin();
-    SampleVector::const_iterator n = samples.end();
-    vector<uint8_t>::iterator k = bytes.begin();
-
-    while (i != n) {
-        Sample s = *(i++);
-        s = max(Sample(-1.0), min(Sample(1.0), s));
-        long v = lrint(s * 32767);
-        unsigned long u = v;
-        *(k++) = u & 0xff;
-        *(k++) = (u >> 8) & 0xff;
-    }
+    bytes.resize(samples.size() * m_converter.sample_size());
+    m_converter.convert(samples.data(), samples.size(), bytes.data());
 }
 
 
 /* ****************  class RawAudioOutput  **************** */
 
 // Construct raw audio writer.
-RawAudioOutput::RawAudioOutput(const string& filename)
+RawAudioOutput::RawAudioOutput(const string& filename, PcmFormat format)
+  : AudioOutput(format)
 {
     if (filename == "-") {
 
@@ -100,7 +93,7 @@ bool RawAudioOutput::write(const SampleVector& samples)
         return false;
 
     // Convert samples to bytes.
-    samplesToInt16(samples, m_bytebuf);
+    encodeSamples(samples, m_bytebuf);
 
     // Write data.
     size_t p = 0;
@@ -129,8 +122,10 @@ bool RawAudioOutput::write(const SampleVector& samples)
 // Construct .WAV writer.
 WavAudioOutput::WavAudioOutput(const std::string& filename,
                                unsigned int samplerate,
-                               bool stereo)
-  : numberOfChannels(stereo ? 2 : 1)
+                               bool stereo,
+                               PcmFormat format)
+  : AudioOutput(format)
+  , numberOfChannels(stereo ? 2 : 1)
   , sampleRate(samplerate)
 {
     m_stream = fopen(filename.c_str(), "wb");
@@ -158,7 +153,7 @@ WavAudioOutput::~WavAudioOutput()
 
     if (!m_zombie) {
 
-        const unsigned bytesPerSample = 2;
+        const unsigned bytesPerSample = m_converter.sample_size();
 
         const long currentPosition = ftell(m_stream);
 
@@ -190,7 +185,7 @@ bool WavAudioOutput::write(const SampleVector& samples)
         return false;
 
     // Convert samples to bytes.
-    samplesToInt16(samples, m_bytebuf);
+    encodeSamples(samples, m_bytebuf);
 
     // Write samples to file.
     size_t k = fwrite(m_bytebuf.data(), 1, m_bytebuf.size(), m_stream);
@@ -208,8 +203,8 @@ bool WavAudioOutput::write(const SampleVector& samples)
 // (Re)write .WAV header.
 bool WavAudioOutput::write_header(unsigned int nsamples)
 {
-    const unsigned bytesPerSample = 2;
-    const unsigned bitsPerSample  = 16;
+    const unsigned bytesPerSample = m_converter.sample_size();
+    const unsigned bitsPerSample  = 8 * bytesPerSample;
 
     enum wFormatTagId
     {
@@ -228,7 +223,9 @@ bool WavAudioOutput::write_header(unsigned int nsamples)
     encode_chunk_id    (wavHeader +  8, "WAVE");
     encode_chunk_id    (wavHeader + 12, "fmt ");
     set_value<uint32_t>(wavHeader + 16, 16);
-    set_value<uint16_t>(wavHeader + 20, WAVE_FORMAT_PCM);
+    set_value<uint16_t>(wavHeader + 20,
+                        (format() == PCM_FLOAT_LE) ? WAVE_FORMAT_IEEE_FLOAT
+                                                   : WAVE_FORMAT_PCM);
     set_value<uint16_t>(wavHeader + 22, numberOfChannels);
     set_value<uint32_t>(wavHeader + 24, sampleRate                                    ); // sample rate
     set_value<uint32_t>(wavHeader + 28, sampleRate * numberOfChannels * bytesPerSample); // byte rate
@@ -268,10 +265,17 @@ void WavAudioOutput::set_value(uint8_t * ptr, T value)
 // Construct ALSA output stream.
 AlsaAudioOutput::AlsaAudioOutput(const std::string& devname,
                                  unsigned int samplerate,
-                                 bool stereo)
+                                 bool stereo,
+                                 unsigned int buffer_time,
+                                 unsigned int period_time,
+                                 PcmFormat format)
 {
     m_pcm = NULL;
     m_nchannels = stereo ? 2 : 1;
+    m_samplerate = samplerate;
+    m_mmap = false;
+    m_buffer_frames = 0;
+    m_period_frames = 0;
 
     int r = snd_pcm_open(&m_pcm, devname.c_str(),
                          SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
@@ -285,18 +289,10 @@ AlsaAudioOutput::AlsaAudioOutput(const std::string& devname,
 
     snd_pcm_nonblock(m_pcm, 0);
 
-    r = snd_pcm_set_params(m_pcm,
-                           SND_PCM_FORMAT_S16_LE,
-                           SND_PCM_ACCESS_RW_INTERLEAVED,
-                           m_nchannels,
-                           samplerate,
-                           1,               // allow soft resampling
-                           500000);         // latency in us
+    if (period_time == 0)
+        period_time = buffer_time / 4;
 
-    if (r < 0) {
-        m_error = "can not set PCM parameters (";
-        m_error += strerror(-r);
-        m_error += ")";
+    if (!configure(samplerate, buffer_time, period_time, format)) {
         m_zombie = true;
     }
 }
@@ -312,31 +308,209 @@ AlsaAudioOutput::~AlsaAudioOutput()
 }
 
 
+// Set hardware and software parameters.
+bool AlsaAudioOutput::configure(unsigned int samplerate,
+                                unsigned int buffer_time,
+                                unsigned int period_time,
+                                PcmFormat format)
+{
+    // Sample formats to try after the requested format, best first.
+    // Float and 32-bit samples need no rounding to 16 bits.
+    static const struct {
+        snd_pcm_format_t    alsa_format;
+        PcmFormat           format;
+    } formats[] = {
+        { SND_PCM_FORMAT_FLOAT_LE,  PCM_FLOAT_LE },
+        { SND_PCM_FORMAT_S32_LE,    PCM_S32_LE },
+        { SND_PCM_FORMAT_S24_3LE,   PCM_S24_3LE },
+        { SND_PCM_FORMAT_S16_LE,    PCM_S16_LE } };
+    const unsigned int nformats = sizeof(formats) / sizeof(formats[0]);
+
+    snd_pcm_hw_params_t *hwparams;
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_hw_params_alloca(&hwparams);
+    snd_pcm_sw_params_alloca(&swparams);
+
+    int r = snd_pcm_hw_params_any(m_pcm, hwparams);
+    if (r < 0)
+        return pcm_error("can not get PCM parameters", r);
+
+    // Prefer direct access to the device buffer.
+    m_mmap = (snd_pcm_hw_params_set_access(
+                  m_pcm, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0);
+    if (!m_mmap) {
+        r = snd_pcm_hw_params_set_access(m_pcm, hwparams,
+                                         SND_PCM_ACCESS_RW_INTERLEAVED);
+        if (r < 0)
+            return pcm_error("can not set PCM access type", r);
+    }
+
+    r = -EINVAL;
+    for (unsigned int pass = 0; pass < 2 && r < 0; pass++) {
+        // First pass: only the requested format, second pass: the others.
+        for (unsigned int i = 0; i < nformats; i++) {
+            if ((pass == 0) != (formats[i].format == format))
+                continue;
+            if (snd_pcm_hw_params_test_format(m_pcm, hwparams,
+                                              formats[i].alsa_format) == 0) {
+                r = snd_pcm_hw_params_set_format(m_pcm, hwparams,
+                                                 formats[i].alsa_format);
+                if (r == 0) {
+                    m_converter.set_format(formats[i].format);
+                    break;
+                }
+            }
+        }
+    }
+    if (r < 0)
+        return pcm_error("can not set PCM sample format", r);
+
+    r = snd_pcm_hw_params_set_channels(m_pcm, hwparams, m_nchannels);
+    if (r < 0)
+        return pcm_error("can not set number of PCM channels", r);
+
+    // Allow soft resampling.
+    snd_pcm_hw_params_set_rate_resample(m_pcm, hwparams, 1);
+    r = snd_pcm_hw_params_set_rate(m_pcm, hwparams, samplerate, 0);
+    if (r < 0)
+        return pcm_error("can not set PCM sample rate", r);
+
+    int dir = 0;
+    r = snd_pcm_hw_params_set_buffer_time_near(m_pcm, hwparams,
+                                               &buffer_time, &dir);
+    if (r < 0)
+        return pcm_error("can not set PCM buffer time", r);
+
+    dir = 0;
+    r = snd_pcm_hw_params_set_period_time_near(m_pcm, hwparams,
+                                               &period_time, &dir);
+    if (r < 0)
+        return pcm_error("can not set PCM period time", r);
+
+    r = snd_pcm_hw_params(m_pcm, hwparams);
+    if (r < 0)
+        return pcm_error("can not set PCM parameters", r);
+
+    snd_pcm_uframes_t buffer_size, period_size;
+    snd_pcm_hw_params_get_buffer_size(hwparams, &buffer_size);
+    snd_pcm_hw_params_get_period_size(hwparams, &period_size, &dir);
+    m_buffer_frames = buffer_size;
+    m_period_frames = period_size;
+
+    // Start playback when the buffer is full (like snd_pcm_set_params),
+    // wake up when a period of space is available.
+    r = snd_pcm_sw_params_current(m_pcm, swparams);
+    if (r >= 0) {
+        r = snd_pcm_sw_params_set_start_threshold(
+                m_pcm, swparams, (buffer_size / period_size) * period_size);
+    }
+    if (r >= 0)
+        r = snd_pcm_sw_params_set_avail_min(m_pcm, swparams, period_size);
+    if (r >= 0)
+        r = snd_pcm_sw_params(m_pcm, swparams);
+    if (r < 0)
+        return pcm_error("can not set PCM software parameters", r);
+
+    return true;
+}
+
+
+// Return a short description of the device configuration.
+string AlsaAudioOutput::describe() const
+{
+    char buf[160];
+    snprintf(buf, sizeof(buf),
+             "%s, %s, buffer %lu frames (%.1f ms), period %lu frames",
+             pcm_format_name(format()),
+             m_mmap ? "mmap" : "read/write",
+             m_buffer_frames,
+             1000.0 * m_buffer_frames / m_samplerate,
+             m_period_frames);
+    return buf;
+}
+
+
 // Write audio data.
 bool AlsaAudioOutput::write(const SampleVector& samples)
 {
     if (m_zombie)
         return false;
 
+    return m_mmap ? write_mmap(samples) : write_rw(samples);
+}
+
+
+// Write audio data directly into the device buffer.
+bool AlsaAudioOutput::write_mmap(const SampleVector& samples)
+{
+    const Sample *src = samples.data();
+    snd_pcm_uframes_t n = samples.size() / m_nchannels;
+    unsigned int framesize = m_nchannels * m_converter.sample_size();
+
+    while (n > 0) {
+
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(m_pcm);
+        if (avail < 0)
+            return pcm_error("write failed", avail);
+
+        if (avail == 0) {
+            // The buffer is full. Start playback if the device is still
+            // waiting for the start threshold, otherwise wait for space.
+            int r;
+            if (snd_pcm_state(m_pcm) == SND_PCM_STATE_PREPARED) {
+                r = snd_pcm_start(m_pcm);
+            } else {
+                r = snd_pcm_wait(m_pcm, -1);
+            }
+            if (r < 0)
+                return pcm_error("write failed", r);
+            continue;
+        }
+
+        // Get the next contiguous part of the ring buffer.
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = min(n, snd_pcm_uframes_t(avail));
+        int r = snd_pcm_mmap_begin(m_pcm, &areas, &offset, &frames);
+        if (r < 0)
+            return pcm_error("write failed", r);
+
+        // With interleaved access, all channels live in the first area.
+        uint8_t *dest = static_cast<uint8_t *>(areas[0].addr)
+                        + areas[0].first / 8
+                        + offset * framesize;
+        m_converter.convert(src, frames * m_nchannels, dest);
+
+        snd_pcm_sframes_t k = snd_pcm_mmap_commit(m_pcm, offset, frames);
+        if (k < 0)
+            return pcm_error("write failed", k);
+        if (snd_pcm_uframes_t(k) != frames)
+            return pcm_error("write failed", -EPIPE);
+
+        src += frames * m_nchannels;
+        n   -= frames;
+    }
+
+    return true;
+}
+
+
+// Write audio data with snd_pcm_writei().
+bool AlsaAudioOutput::write_rw(const SampleVector& samples)
+{
     // Convert samples to bytes.
-    samplesToInt16(samples, m_bytebuf);
+    unsigned int framesize = m_nchannels * m_converter.sample_size();
+    encodeSamples(samples, m_bytebuf);
 
     // Write data.
     unsigned int p = 0;
     unsigned int n = samples.size() / m_nchannels;
-    unsigned int framesize = 2 * m_nchannels;
     while (p < n) {
 
         int k = snd_pcm_writei(m_pcm,
                                m_bytebuf.data() + p * framesize, n - p);
         if (k < 0) {
-            m_error = "write failed (";
-            m_error += strerror(errno);
-            m_error += ")";
-            // After an underrun, ALSA keeps returning error codes until we
-            // explicitly fix the stream.
-            snd_pcm_recover(m_pcm, k, 0);
-            return false;
+            return pcm_error("write failed", k);
         } else {
             p += k;
         }
@@ -345,4 +519,288 @@ bool AlsaAudioOutput::write(const SampleVector& samples)
     return true;
 }
 
+
+// Report error from ALSA.
+bool AlsaAudioOutput::pcm_error(const char *what, long err)
+{
+    m_error = what;
+    m_error += " (";
+    m_error += snd_strerror(err);
+    m_error += ")";
+
+    // After an underrun, ALSA keeps returning error codes until we
+    // explicitly fix the stream.
+    if (m_pcm != NULL)
+        snd_pcm_recover(m_pcm, err, 0);
+
+    return false;
+}
+
+
+/* ****************  class RtpAudioOutput  **************** */
+
+/** Maximum number of messages per sendmmsg() call (UIO_MAXIOV). */
+static const unsigned int rtp_max_messages = 1024;
+
+// Return monotonic time in seconds.
+static double rtp_monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+
+// Store 16-bit and 32-bit values in network byte order.
+static void put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+
+// Construct RTP sender.
+RtpAudioOutput::RtpAudioOutput(const vector<string>& destinations,
+                               unsigned int samplerate,
+                               bool stereo,
+                               unsigned int packet_time,
+                               unsigned int port_offset,
+                               bool pace)
+  : AudioOutput(PCM_S16_LE)
+  , m_fd(-1)
+  , m_nchannels(stereo ? 2 : 1)
+  , m_samplerate(samplerate)
+  , m_pace(pace)
+  , m_start_time(0)
+  , m_frames(0)
+  , m_packets(0)
+  , m_pending(0)
+{
+    // Static payload types 10 and 11 are L16 at 44.1 kHz (RFC 3551);
+    // anything else needs a dynamic type, announced out of band.
+    if (samplerate == 44100)
+        m_payload_type = stereo ? 10 : 11;
+    else
+        m_payload_type = 96;
+
+    unsigned int frame_bytes = 2 * m_nchannels;
+    m_packet_frames = (unsigned int)(uint64_t(samplerate) * packet_time /
+                                     1000000);
+    m_packet_frames = max(1u, min(m_packet_frames, max_payload / frame_bytes));
+    m_packet_bytes = m_packet_frames * frame_bytes;
+
+    // RFC 3550 wants random initial values.
+    random_device rnd;
+    m_ssrc = rnd();
+    m_seq = rnd();
+    m_timestamp = rnd();
+
+    for (const string& dest : destinations) {
+        if (!add_destination(dest, port_offset)) {
+            m_zombie = true;
+            return;
+        }
+    }
+    if (m_dest.empty()) {
+        m_error = "no destination";
+        m_zombie = true;
+        return;
+    }
+
+    m_fd = socket(m_dest[0].ss_family, SOCK_DGRAM, 0);
+    if (m_fd < 0) {
+        m_error = string("can not create socket (") + strerror(errno) + ")";
+        m_zombie = true;
+        return;
+    }
+
+    // Set up the headers and messages once; write() only fills in the
+    // header fields and the payload pointers.
+    unsigned int ndest = m_dest.size();
+    m_batch = max(1u, min(unsigned(max_batch), rtp_max_messages / ndest));
+    m_headers.assign(12 * m_batch, 0);
+    m_iov.resize(2 * m_batch);
+    m_msgs.resize(m_batch * ndest);
+    memset(m_msgs.data(), 0, m_msgs.size() * sizeof(struct mmsghdr));
+    for (unsigned int k = 0; k < m_batch; k++) {
+        m_iov[2*k].iov_base = m_headers.data() + 12 * k;
+        m_iov[2*k].iov_len  = 12;
+        m_iov[2*k+1].iov_len = m_packet_bytes;
+        for (unsigned int d = 0; d < ndest; d++) {
+            struct msghdr& msg = m_msgs[k * ndest + d].msg_hdr;
+            msg.msg_name    = &m_dest[d];
+            msg.msg_namelen = m_destlen[d];
+            msg.msg_iov     = &m_iov[2*k];
+            msg.msg_iovlen  = 2;
+        }
+    }
+}
+
+
+// Destructor.
+RtpAudioOutput::~RtpAudioOutput()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+
+// Resolve destination.
+bool RtpAudioOutput::add_destination(const string& dest,
+                                     unsigned int port_offset)
+{
+    size_t sep = dest.rfind(':');
+    if (sep == string::npos || sep == 0) {
+        m_error = "invalid destination '" + dest + "' (expected host:port)";
+        return false;
+    }
+
+    string host = dest.substr(0, sep);
+    if (host.size() > 2 && host[0] == '[' && host[host.size()-1] == ']')
+        host = host.substr(1, host.size() - 2);
+
+    char *endp;
+    long port = strtol(dest.c_str() + sep + 1, &endp, 10);
+    if (*endp != '\0' || endp == dest.c_str() + sep + 1 ||
+        port <= 0 || port + port_offset > 65535) {
+        m_error = "invalid port in destination '" + dest + "'";
+        return false;
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = m_dest.empty() ? AF_UNSPEC : m_dest[0].ss_family;
+    hints.ai_socktype = SOCK_DGRAM;
+    string service = to_string(port + port_offset);
+    int r = getaddrinfo(host.c_str(), service.c_str(), &hints, &res);
+    if (r != 0) {
+        m_error = "can not resolve '" + host + "' (" + gai_strerror(r) + ")";
+        return false;
+    }
+
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    memcpy(&addr, res->ai_addr, res->ai_addrlen);
+    m_dest.push_back(addr);
+    m_destlen.push_back(res->ai_addrlen);
+    freeaddrinfo(res);
+
+    return true;
+}
+
+
+// Write audio data.
+bool RtpAudioOutput::write(const SampleVector& samples)
+{
+    if (m_zombie)
+        return false;
+
+    // Encode behind the samples left over from the previous call,
+    // then swap to big-endian.
+    size_t nbytes = 2 * samples.size();
+    if (m_payload.size() < m_pending + nbytes)
+        m_payload.resize(m_pending + nbytes);
+    uint8_t *p = m_payload.data() + m_pending;
+    m_converter.convert(samples.data(), samples.size(), p);
+    for (size_t i = 0; i < nbytes; i += 2)
+        swap(p[i], p[i+1]);
+    m_pending += nbytes;
+
+    size_t npackets = m_pending / m_packet_bytes;
+    bool ok = send_packets(npackets);
+
+    // Keep the remainder for the next packet.
+    size_t sent = npackets * m_packet_bytes;
+    m_pending -= sent;
+    if (m_pending > 0)
+        memmove(m_payload.data(), m_payload.data() + sent, m_pending);
+
+    return ok;
+}
+
+
+// Send npackets from the start of the payload buffer.
+bool RtpAudioOutput::send_packets(size_t npackets)
+{
+    unsigned int ndest = m_dest.size();
+
+    for (size_t p = 0; p < npackets; p += m_batch) {
+
+        size_t n = min<size_t>(m_batch, npackets - p);
+        for (size_t k = 0; k < n; k++) {
+            uint8_t *h = m_headers.data() + 12 * k;
+            h[0] = 0x80;                // version 2
+            h[1] = m_payload_type;
+            put_be16(h + 2, m_seq);
+            put_be32(h + 4, m_timestamp);
+            put_be32(h + 8, m_ssrc);
+            m_seq++;
+            m_timestamp += m_packet_frames;
+            m_iov[2*k+1].iov_base =
+                m_payload.data() + (p + k) * m_packet_bytes;
+        }
+
+        if (m_pace)
+            pace();
+
+        size_t nmsg = n * ndest;
+        size_t done = 0;
+        while (done < nmsg) {
+            int r = sendmmsg(m_fd, m_msgs.data() + done, nmsg - done, 0);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                m_error = string("send failed (") + strerror(errno) + ")";
+                return false;
+            }
+            done += r;
+        }
+
+        m_frames  += n * m_packet_frames;
+        m_packets += n;
+    }
+
+    return true;
+}
+
+
+// Wait until the audio sent so far is due.
+void RtpAudioOutput::pace()
+{
+    double now = rtp_monotonic_time();
+    if (m_start_time == 0)
+        m_start_time = now;
+
+    double due = m_start_time + double(m_frames) / m_samplerate;
+    if (due > now) {
+        struct timespec ts;
+        double t = due - now;
+        ts.tv_sec  = (time_t)t;
+        ts.tv_nsec = (long)((t - ts.tv_sec) * 1.0e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+// Return a short description of the stream.
+string RtpAudioOutput::describe() const
+{
+    char buf[160];
+    snprintf(buf, sizeof(buf),
+             "L16/%u/%u, payload type %u, %u frames (%.1f ms) per packet, "
+             "%u destination%s",
+             m_samplerate, m_nchannels, m_payload_type, m_packet_frames,
+             m_packet_frames * 1000.0 / m_samplerate,
+             (unsigned int)m_dest.size(), (m_dest.size() == 1) ? "" : "s");
+    return buf;
+}
+
 /* end */
@@ -5,8 +5,10 @@
 #include <cstdio>
 #include <string>
 #include <vector>
+#include <sys/socket.h>
 
 #include "SoftFM.h"
+#include "PcmConvert.h"
 
 
 /** Base class for writing audio data to file or playback. */
@@ -39,16 +41,38 @@ public:
         return (!m_zombie) && m_error.empty();
     }
 
+    /** Set gain which is applied to the samples while encoding them. */
+    void set_gain(double gain)
+    {
+        m_converter.set_gain(gain);
+    }
+
+    /** Enable or disable TPDF dither (for 16-bit and 24-bit samples). */
+    void set_dither(bool dither)
+    {
+        m_converter.set_dither(dither);
+    }
+
+    /** Return format of the encoded samples. */
+    PcmFormat format() const
+    {
+        return m_converter.format();
+    }
+
 protected:
     /** Constructor. */
-    AudioOutput() : m_zombie(false) { }
+    explicit AudioOutput(PcmFormat format=PCM_S16_LE)
+        : m_zombie(false)
+        , m_converter(format)
+    { }
 
-    /** Encode a list of samples as signed 16-bit little-endian integers. */
-    static void samplesToInt16(const SampleVector& samples,
-                               std::vector<std::uint8_t>& bytes);
+    /** Encode a list of samples in the output format. */
+    void encodeSamples(const SampleVector& samples,
+                       std::vector<std::uint8_t>& bytes);
 
-    std::string m_error;
-    bool        m_zombie;
+    std::string  m_error;
+    bool         m_zombie;
+    PcmConverter m_converter;
 
 private:
     AudioOutput(const AudioOutput&);            // no copy constructor
@@ -56,7 +80,7 @@ private:
 };
 
 
-/** Write audio data as raw signed 16-bit little-endian data. */
+/** Write audio data as raw samples (default signed 16-bit little-endian). */
 class RawAudioOutput : public AudioOutput
 {
 public:
@@ -65,8 +89,10 @@ public:
      * Construct raw audio writer.
      *
      * filename :: file name (including path) or "-" to write to stdout
+     * format   :: sample format
      */
-    RawAudioOutput(const std::string& filename);
+    RawAudioOutput(const std::string& filename,
+                   PcmFormat format=PCM_S16_LE);
 
     ~RawAudioOutput();
     bool write(const SampleVector& samples);
@@ -88,10 +114,12 @@ public:
      * filename     :: file name (including path) or "-" to write to stdout
      * samplerate   :: audio sample rate in Hz
      * stereo       :: true if the output stream contains stereo data
+     * format       :: sample format
      */
     WavAudioOutput(const std::string& filename,
                    unsigned int samplerate,
-                   bool stereo);
+                   bool stereo,
+                   PcmFormat format=PCM_S16_LE);
 
     ~WavAudioOutput();
     bool write(const SampleVector& samples);
@@ -113,29 +141,165 @@ private:
 };
 
 
-/** Write audio data to ALSA device. */
+/**
+ * Write audio data to ALSA device.
+ *
+ * If the device supports it, samples are converted directly into the
+ * ring buffer of the device (mmap access) instead of being copied
+ * through snd_pcm_writei(). The sample format is the requested format
+ * if the device supports it, otherwise FLOAT_LE, S32_LE, S24_3LE or
+ * S16_LE, whichever the device supports first.
+ */
 class AlsaAudioOutput : public AudioOutput
 {
 public:
 
+    /** Default device buffer time in microseconds. */
+    static const unsigned int default_buffer_time = 500000;
+
     /**
      * Construct ALSA output stream.
      *
      * dename       :: ALSA PCM device
      * samplerate   :: audio sample rate in Hz
      * stereo       :: true if the output stream contains stereo data
+     * buffer_time  :: device buffer time in microseconds
+     * period_time  :: device period time in microseconds,
+     *                 or 0 to use 1/4 of the buffer time
+     * format       :: preferred sample format
      */
     AlsaAudioOutput(const std::string& devname,
                     unsigned int samplerate,
-                    bool stereo);
+                    bool stereo,
+                    unsigned int buffer_time=default_buffer_time,
+                    unsigned int period_time=0,
+                    PcmFormat format=PCM_FLOAT_LE);
 
     ~AlsaAudioOutput();
     bool write(const SampleVector& samples);
 
+    /** Return a short description of the device configuration. */
+    std::string describe() const;
+
 private:
+
+    /** Set hardware and software parameters. Return false on error. */
+    bool configure(unsigned int samplerate,
+                   unsigned int buffer_time,
+                   unsigned int period_time,
+                   PcmFormat format);
+
+    /** Write audio data directly into the device buffer. */
+    bool write_mmap(const SampleVector& samples);
+
+    /** Write audio data with snd_pcm_writei(). */
+    bool write_rw(const SampleVector& samples);
+
+    /** Report error from ALSA and return false. */
+    bool pcm_error(const char *what, long err);
+
     unsigned int         m_nchannels;
+    unsigned int         m_samplerate;
+    bool                 m_mmap;
+    unsigned long        m_buffer_frames;
+    unsigned long        m_period_frames;
     struct _snd_pcm *    m_pcm;
     std::vector<std::uint8_t> m_bytebuf;
 };
 
+
+
+/**
+ * Send audio data as RTP packets over UDP (RFC 3550).
+ *
+ * The payload is L16 (RFC 3551): signed 16-bit big-endian samples,
+ * interleaved for stereo. Samples are encoded once into a contiguous
+ * payload buffer; every packet is a preallocated 12-byte header plus
+ * a slice of that buffer, and the packets of a block are passed to the
+ * kernel in batches with sendmmsg(). Each packet goes to every
+ * destination from the same buffers, so fanning out costs one message
+ * per destination and no extra encoding or copying.
+ *
+ * The RTP timestamp counts audio frames, starting at a random value;
+ * samples which do not fill a whole packet wait for the next write().
+ */
+class RtpAudioOutput : public AudioOutput
+{
+public:
+
+    /** Default packet time in microseconds. */
+    static const unsigned int default_packet_time = 5000;
+
+    /** Maximum payload per packet in bytes (fits a 1500-byte MTU). */
+    static const unsigned int max_payload = 1440;
+
+    /** Maximum number of packets per sendmmsg() call. */
+    static const unsigned int max_batch = 64;
+
+    /**
+     * Construct RTP sender.
+     *
+     * destinations :: list of "host:port" or "[ipv6-address]:port"
+     * samplerate   :: audio sample rate in Hz
+     * stereo       :: true if the output stream contains stereo data
+     * packet_time  :: audio per packet in microseconds (limited by
+     *                 max_payload)
+     * port_offset  :: added to the port of each destination
+     * pace         :: send at the audio sample rate instead of as fast
+     *                 as write() is called (for sources which are not
+     *                 real-time)
+     */
+    RtpAudioOutput(const std::vector<std::string>& destinations,
+                   unsigned int samplerate,
+                   bool stereo,
+                   unsigned int packet_time=default_packet_time,
+                   unsigned int port_offset=0,
+                   bool pace=false);
+
+    ~RtpAudioOutput();
+    bool write(const SampleVector& samples);
+
+    /** Return a short description of the stream. */
+    std::string describe() const;
+
+    /** Return number of packets sent (to each destination). */
+    std::uint64_t packets_sent() const
+    {
+        return m_packets;
+    }
+
+private:
+
+    /** Resolve destination and add it to m_dest. Return false on error. */
+    bool add_destination(const std::string& dest, unsigned int port_offset);
+
+    /** Send npackets from the start of the payload buffer. */
+    bool send_packets(std::size_t npackets);
+
+    /** Wait until the audio sent so far is due. */
+    void pace();
+
+    int                  m_fd;
+    unsigned int         m_nchannels;
+    unsigned int         m_samplerate;
+    unsigned int         m_payload_type;
+    unsigned int         m_packet_frames;
+    unsigned int         m_packet_bytes;
+    unsigned int         m_batch;
+    bool                 m_pace;
+    double               m_start_time;
+    std::uint32_t        m_ssrc;
+    std::uint16_t        m_seq;
+    std::uint32_t        m_timestamp;
+    std::uint64_t        m_frames;
+    std::uint64_t        m_packets;
+    std::vector<struct sockaddr_storage> m_dest;
+    std::vector<socklen_t> m_destlen;
+    std::vector<std::uint8_t> m_payload;    // pending payload bytes
+    std::size_t          m_pending;
+    std::vector<std::uint8_t> m_headers;    // max_batch RTP headers
+    std::vector<struct iovec> m_iov;        // header + payload per packet
+    std::vector<struct mmsghdr> m_msgs;     // one per packet and destination
+};
+
 #endif
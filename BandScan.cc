@@ -0,0 +1,189 @@
+
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+#include "BandScan.h"
+
+using namespace std;
+
+
+/** Return FFT size for a resolution of at most 2.5 kHz per bin. */
+static unsigned int scan_fft_size(double sample_rate)
+{
+    unsigned int n = 64;
+    while (sample_rate / n > 2500)
+        n *= 2;
+    return n;
+}
+
+
+/* ****************  class BandScanner  **************** */
+
+constexpr double BandScanner::channel_spacing;
+constexpr double BandScanner::channel_halfwidth;
+constexpr double BandScanner::burst_time;
+
+
+// Construct scanner.
+BandScanner::BandScanner(double sample_rate, double threshold)
+    : m_sample_rate(sample_rate)
+    , m_threshold(threshold)
+    , m_spectrum(scan_fft_size(sample_rate))
+
+    // Decoder for the candidates, as softfm -H would decode them.
+    , m_decoder(sample_rate,
+                0.25 * sample_rate,
+                48000,
+                true,
+                FmDecoder::default_deemphasis,
+                FmDecoder::default_bandwidth_if,
+                FmDecoder::default_freq_dev,
+                FmDecoder::default_bandwidth_pcm,
+                max(1, int(sample_rate /
+                           (1u << FmDecoder::choose_halfband_stages(
+                                      sample_rate)) / 215.0e3)),
+                1,
+                FmDecoder::choose_halfband_stages(sample_rate))
+{ }
+
+
+// Return tuner frequencies which cover the band.
+vector<double> BandScanner::plan_steps(double fmin, double fmax) const
+{
+    // Each step covers [center - half, center + half); the edges of the
+    // IF band are not used because the tuner filter rolls off there.
+    double half = 0.4 * m_sample_rate;
+    vector<double> steps;
+    for (double c = fmin + half; c - half <= fmax; c += 2 * half)
+        steps.push_back(c);
+    return steps;
+}
+
+
+// Return power of a channel.
+double BandScanner::channel_power(double offset) const
+{
+    int n = m_power.size();
+    double bin = m_sample_rate / n;
+    int kmin = max(0, int(ceil((offset - channel_halfwidth) / bin)) + n / 2);
+    int kmax = min(n - 1, int(floor((offset + channel_halfwidth) / bin)) + n / 2);
+
+    double p = 0;
+    for (int k = kmin; k <= kmax; k++)
+        p += m_power[k];
+    return p;
+}
+
+
+// Decode a channel.
+bool BandScanner::decode_channel(const IQSampleVector& burst, double offset)
+{
+    const unsigned int block_length = 65536;
+
+    if (burst.size() < block_length)
+        return false;
+
+    m_decoder.retune(offset);
+    m_decoder.prime_filters();
+
+    for (size_t p = 0; p + block_length <= burst.size(); p += block_length) {
+        m_block.assign(burst.begin() + p, burst.begin() + p + block_length);
+        m_decoder.process(m_block, m_audio);
+    }
+
+    return true;
+}
+
+
+// Analyze a burst of samples.
+unsigned int BandScanner::scan_burst(const IQSampleVector& burst,
+                                     double center,
+                                     double fmin, double fmax,
+                                     vector<Station>& stations)
+{
+    m_spectrum.process(burst, m_power);
+
+    int n = m_power.size();
+    double bin = m_sample_rate / n;
+    double half = 0.4 * m_sample_rate;
+
+    // Remove the DC offset of the receiver.
+    double dc = 0.5 * (m_power[n/2 - 2] + m_power[n/2 + 2]);
+    m_power[n/2 - 1] = m_power[n/2] = m_power[n/2 + 1] = dc;
+
+    // Noise floor: a low percentile of the bins, since a crowded band
+    // may be occupied by stations for more than half of the spectrum.
+    int kspan = int(half / bin);
+    vector<double> sorted(m_power.begin() + n/2 - kspan,
+                          m_power.begin() + n/2 + kspan);
+    size_t kfloor = sorted.size() / 10;
+    nth_element(sorted.begin(), sorted.begin() + kfloor, sorted.end());
+    double noise = max(sorted[kfloor], 1.0e-20) *
+                   (2 * channel_halfwidth / bin);
+
+    // Grid channels which belong to this step.
+    double lo = max(fmin, center - half);
+    double hi = min(fmax, center + half);
+    vector<double> offsets;
+    for (double f = ceil(lo / channel_spacing) * channel_spacing;
+         f <= hi && f < center + half; f += channel_spacing)
+        offsets.push_back(f - center);
+
+    if (offsets.empty())
+        return 0;
+
+    // Find candidates, and the weakest channel as IF level reference.
+    vector<double> candidates;
+    vector<double> candidate_snr;
+    double weakest = offsets[0];
+    double weakest_power = channel_power(weakest);
+    double edge = 0.5 * m_sample_rate - channel_halfwidth;
+    for (double off : offsets) {
+        double p = channel_power(off);
+        if (p < weakest_power) {
+            weakest = off;
+            weakest_power = p;
+        }
+        double snr = 10 * log10(p / noise);
+        if (snr < m_threshold)
+            continue;
+        if (off - channel_spacing >= -edge &&
+            channel_power(off - channel_spacing) > p)
+            continue;
+        if (off + channel_spacing <= edge &&
+            channel_power(off + channel_spacing) > p)
+            continue;
+        candidates.push_back(off);
+        candidate_snr.push_back(snr);
+    }
+
+    if (candidates.empty() || !decode_channel(burst, weakest))
+        return candidates.size();
+
+    double ref_if_level = max(m_decoder.get_if_level(), 1.0e-10);
+
+    // Check candidates with the decoder.
+    for (unsigned int i = 0; i < candidates.size(); i++) {
+        decode_channel(burst, candidates[i]);
+        double if_level = m_decoder.get_if_level();
+        double if_snr   = 20 * log10(max(if_level, 1.0e-10) / ref_if_level);
+
+        // Noise demodulates to a baseband far above full deviation.
+        if (if_snr < m_threshold || m_decoder.get_baseband_level() > 1.0)
+            continue;
+
+        Station st;
+        st.freq        = center + candidates[i];
+        st.snr         = candidate_snr[i];
+        st.if_level    = if_level;
+        st.if_snr      = if_snr;
+        st.pilot_level = m_decoder.get_pilot_level();
+        st.stereo      = m_decoder.stereo_detected();
+        stations.push_back(st);
+    }
+
+    return candidates.size();
+}
+
+/* end */
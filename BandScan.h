@@ -0,0 +1,90 @@
+#ifndef SOFTFM_BANDSCAN_H
+#define SOFTFM_BANDSCAN_H
+
+#include <vector>
+
+#include "SoftFM.h"
+#include "Fft.h"
+#include "FmDecode.h"
+
+
+/**
+ * Survey of the FM broadcast band.
+ *
+ * The band is received in steps of 0.8 times the IF sample rate. For each
+ * step, a short burst of IQ samples is analyzed in two passes:
+ *
+ *  1. A windowed FFT power spectrum gives the power of every channel
+ *     on a 100 kHz grid, relative to the noise floor of the spectrum.
+ *     Channels above the threshold which are stronger than both
+ *     neighbouring channels are candidates.
+ *
+ *  2. Each candidate is decoded briefly with an FmDecoder (retuned for
+ *     each candidate, see FmDecoder::retune()). It is reported when its
+ *     IF level is above the IF level of the weakest channel in the burst
+ *     by the threshold and the demodulated signal looks like FM
+ *     broadcast rather than noise. The pilot level tells whether the
+ *     station is stereo.
+ */
+class BandScanner
+{
+public:
+
+    /** Grid of channel frequencies in Hz. */
+    static constexpr double channel_spacing = 100000;
+
+    /** Half width of a channel for the power measurement, in Hz. */
+    static constexpr double channel_halfwidth = 75000;
+
+    /** Recommended length of a burst in seconds. */
+    static constexpr double burst_time = 0.5;
+
+    /** A station found by the scan. */
+    struct Station
+    {
+        double  freq;           // channel frequency in Hz
+        double  snr;            // channel power above noise floor in dB
+        double  if_level;       // RMS IF level (full scale 1.0)
+        double  if_snr;         // IF level above weakest channel in dB
+        double  pilot_level;    // stereo pilot amplitude (nominal 0.1)
+        bool    stereo;         // pilot detected
+    };
+
+    /**
+     * Construct scanner.
+     *
+     * sample_rate  :: IF sample rate in Hz
+     * threshold    :: minimum signal-to-noise ratio in dB
+     */
+    BandScanner(double sample_rate, double threshold=10);
+
+    /** Return tuner frequencies which cover the band [fmin, fmax]. */
+    std::vector<double> plan_steps(double fmin, double fmax) const;
+
+    /**
+     * Analyze a burst of samples received at tuner frequency center.
+     * Channels in [fmin, fmax] within the part of the burst that belongs
+     * to this step are surveyed; confirmed stations are appended to
+     * stations in order of frequency. Return number of candidates.
+     */
+    unsigned int scan_burst(const IQSampleVector& burst, double center,
+                            double fmin, double fmax,
+                            std::vector<Station>& stations);
+
+private:
+    /** Return power of the channel at offset from the tuner frequency. */
+    double channel_power(double offset) const;
+
+    /** Decode a channel; return false if the burst is too short. */
+    bool decode_channel(const IQSampleVector& burst, double offset);
+
+    const double            m_sample_rate;
+    const double            m_threshold;
+    PowerSpectrum           m_spectrum;
+    std::vector<double>     m_power;
+    FmDecoder               m_decoder;
+    IQSampleVector          m_block;
+    SampleVector            m_audio;
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef SOFTFM_BLOCKPOOL_H
+#define SOFTFM_BLOCKPOOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "DataBuffer.h"
+
+
+/**
+ * Pool of sample blocks which are recycled instead of reallocated.
+ *
+ * Blocks are std::vector objects with a reserved capacity of at least
+ * block_size elements. A block is taken from the pool with alloc(),
+ * filled, passed along to other threads and finally handed back with
+ * release(). As long as the pool does not run dry, this avoids malloc()
+ * and free() (and the page faults of fresh memory) in steady state.
+ *
+ * alloc() must always be called from the same thread, and release()
+ * must always be called from the same thread (which may be the other one).
+ * The free list is a single-producer queue: a second thread which calls
+ * release() even occasionally corrupts it. A thread which must give a
+ * block back but does not own the release side keeps the block for its
+ * next alloc() instead.
+ */
+template <class Element>
+class BlockPool
+{
+public:
+
+    /**
+     * Construct block pool.
+     *
+     * block_size   :: minimum capacity of each block (number of elements)
+     * max_blocks   :: maximum number of free blocks kept in the pool
+     * prealloc     :: number of blocks to allocate immediately
+     */
+    BlockPool(std::size_t block_size,
+              unsigned int max_blocks,
+              unsigned int prealloc)
+        : m_block_size(block_size)
+        , m_free(max_blocks)
+        , m_hits(0)
+        , m_misses(0)
+    {
+        for (unsigned int i = 0; i < prealloc && i < max_blocks; i++) {
+            std::vector<Element> block;
+            block.reserve(block_size);
+            m_free.try_push(std::move(block));
+        }
+    }
+
+    /**
+     * Return an empty block with at least block_size capacity.
+     * Allocate a new block if the pool is empty.
+     */
+    std::vector<Element> alloc()
+    {
+        std::vector<Element> block;
+        if (m_free.try_pull(block)) {
+            m_hits.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+            block.reserve(m_block_size);
+        }
+        return block;
+    }
+
+    /**
+     * Give a block back to the pool.
+     * The block is freed if it is too small or if the pool is full.
+     */
+    void release(std::vector<Element>&& block)
+    {
+        if (block.capacity() >= m_block_size) {
+            block.clear();
+            m_free.try_push(std::move(block));
+        }
+    }
+
+    /**
+     * Write to the memory of all free blocks, so that the first use of
+     * a block does not cause page faults.
+     * Must be called before the pool is used by other threads.
+     */
+    void prefault()
+    {
+        std::vector<std::vector<Element>> blocks;
+        std::vector<Element> block;
+        while (m_free.try_pull(block))
+            blocks.push_back(std::move(block));
+        for (std::vector<Element>& b : blocks) {
+            b.resize(m_block_size);
+            b.clear();
+            m_free.try_push(std::move(b));
+        }
+    }
+
+    /** Return number of alloc() calls which were served from the pool. */
+    std::uint64_t hits() const
+    {
+        return m_hits.load(std::memory_order_relaxed);
+    }
+
+    /** Return number of alloc() calls which had to allocate a new block. */
+    std::uint64_t misses() const
+    {
+        return m_misses.load(std::memory_order_relaxed);
+    }
+
+private:
+    const std::size_t           m_block_size;
+    DataBuffer<Element>         m_free;
+    std::atomic<std::uint64_t>  m_hits;
+    std::atomic<std::uint64_t>  m_misses;
+};
+
+#endif
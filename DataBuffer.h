@@ -0,0 +1,202 @@
+#ifndef SOFTFM_DATABUFFER_H
+#define SOFTFM_DATABUFFER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+
+/**
+ * Buffer to move sample data between threads.
+ *
+ * This is a bounded ring of sample blocks for exactly one producer thread
+ * and one consumer thread. Blocks are moved into and out of a fixed array
+ * of slots, so passing a block does not allocate memory.
+ *
+ * The ring positions are atomic counters. Pushing and pulling do not take
+ * a lock as long as the ring is neither full nor empty. A thread which
+ * must wait sleeps on a condition variable; the other side only takes
+ * the lock to wake it up when it knows that somebody is waiting.
+ *
+ * Each block can carry a time stamp from the producer to the consumer.
+ */
+template <class Element>
+class DataBuffer
+{
+public:
+    static const unsigned int default_capacity = 1024;
+
+    /**
+     * Constructor.
+     *
+     * capacity :: maximum number of blocks in the buffer
+     */
+    DataBuffer(unsigned int capacity=default_capacity)
+        : m_slots(capacity)
+        , m_stamps(capacity, 0.0)
+        , m_head(0)
+        , m_tail(0)
+        , m_qlen(0)
+        , m_end_marked(false)
+        , m_waiters(0)
+    { }
+
+    /**
+     * Add samples to the queue, with an optional time stamp.
+     * If the buffer is full, wait until the consumer makes room.
+     */
+    void push(std::vector<Element>&& samples, double stamp=0)
+    {
+        if (!samples.empty()) {
+            std::size_t head = m_head.load(std::memory_order_relaxed);
+            wait_until([this,head]{ return !full(head); });
+            m_qlen.fetch_add(samples.size());
+            m_slots[head % m_slots.size()] = std::move(samples);
+            m_stamps[head % m_slots.size()] = stamp;
+            m_head.store(head + 1);
+            wake();
+        }
+    }
+
+    /**
+     * Add a block to the queue if there is room, without waiting.
+     * Unlike push(), this also accepts empty blocks.
+     * Return false (and leave the block unchanged) if the buffer is full.
+     */
+    bool try_push(std::vector<Element>&& samples, double stamp=0)
+    {
+        std::size_t head = m_head.load(std::memory_order_relaxed);
+        if (full(head))
+            return false;
+        m_qlen.fetch_add(samples.size());
+        m_slots[head % m_slots.size()] = std::move(samples);
+        m_stamps[head % m_slots.size()] = stamp;
+        m_head.store(head + 1);
+        wake();
+        return true;
+    }
+
+    /** Mark the end of the data stream. */
+    void push_end()
+    {
+        m_end_marked.store(true);
+        wake();
+    }
+
+    /** Return number of samples in queue. */
+    std::size_t queued_samples() const
+    {
+        return m_qlen.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * If the queue is non-empty, remove a block from the queue and
+     * return the samples. If the end marker has been reached, return
+     * an empty vector. If the queue is empty, wait until more data is pushed
+     * or until the end marker is pushed.
+     *
+     * If stamp is not NULL, it receives the time stamp of the block.
+     */
+    std::vector<Element> pull(double *stamp=NULL)
+    {
+        std::vector<Element> ret;
+        std::size_t tail = m_tail.load(std::memory_order_relaxed);
+        wait_until([this,tail]{ return !empty(tail) || m_end_marked.load(); });
+        if (!empty(tail)) {
+            ret = std::move(m_slots[tail % m_slots.size()]);
+            if (stamp != NULL)
+                *stamp = m_stamps[tail % m_slots.size()];
+            m_tail.store(tail + 1);
+            m_qlen.fetch_sub(ret.size());
+            wake();
+        }
+        return ret;
+    }
+
+    /**
+     * Remove a block from the queue if one is available, without waiting.
+     * Return false if the queue is empty.
+     */
+    bool try_pull(std::vector<Element>& samples, double *stamp=NULL)
+    {
+        std::size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (empty(tail))
+            return false;
+        samples = std::move(m_slots[tail % m_slots.size()]);
+        if (stamp != NULL)
+            *stamp = m_stamps[tail % m_slots.size()];
+        m_tail.store(tail + 1);
+        m_qlen.fetch_sub(samples.size());
+        wake();
+        return true;
+    }
+
+    /** Return true if the end has been reached at the Pull side. */
+    bool pull_end_reached() const
+    {
+        return m_qlen.load() == 0 && m_end_marked.load();
+    }
+
+    /** Wait until the buffer contains minfill samples or an end marker. */
+    void wait_buffer_fill(std::size_t minfill)
+    {
+        wait_until([this,minfill]{
+            return m_qlen.load() >= minfill || m_end_marked.load(); });
+    }
+
+private:
+    /** Return true if the ring is full (called by the producer). */
+    bool full(std::size_t head) const
+    {
+        return head - m_tail.load() >= m_slots.size();
+    }
+
+    /** Return true if the ring is empty (called by the consumer). */
+    bool empty(std::size_t tail) const
+    {
+        return m_head.load() == tail;
+    }
+
+    /** Wait until the condition becomes true. */
+    template <class Pred>
+    void wait_until(Pred pred)
+    {
+        if (pred())
+            return;
+
+        // Announce that we are going to sleep, then check the condition
+        // again under the lock. Because everything uses sequentially
+        // consistent atomics, the other side either sees m_waiters != 0
+        // or we see its update before waiting.
+        m_waiters.fetch_add(1);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!pred())
+            m_cond.wait(lock);
+        lock.unlock();
+        m_waiters.fetch_sub(1);
+    }
+
+    /** Wake up the other side if it is waiting. */
+    void wake()
+    {
+        if (m_waiters.load() != 0) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            lock.unlock();
+            m_cond.notify_all();
+        }
+    }
+
+    std::vector<std::vector<Element>> m_slots;
+    std::vector<double> m_stamps;
+    std::atomic<std::size_t> m_head;
+    std::atomic<std::size_t> m_tail;
+    std::atomic<std::size_t> m_qlen;
+    std::atomic<bool>   m_end_marked;
+    std::atomic<int>    m_waiters;
+    std::mutex          m_mutex;
+    std::condition_variable m_cond;
+};
+
+#endif
@@ -0,0 +1,97 @@
+
+#include <algorithm>
+#include <cmath>
+
+#include "DriftControl.h"
+
+using namespace std;
+
+
+/* ****************  class DriftControl  **************** */
+
+constexpr double DriftControl::max_correction;
+constexpr double DriftControl::smooth_time;
+constexpr double DriftControl::settle_time;
+
+
+// Construct controller.
+// The loop is tuned as a second-order system with natural frequency
+// 2*pi/loop_time and damping 0.7.
+DriftControl::DriftControl(double sample_rate, double loop_time)
+    : m_sample_rate(sample_rate)
+    , m_kp(2 * 0.7 * (2 * M_PI / loop_time))
+    , m_ki((2 * M_PI / loop_time) * (2 * M_PI / loop_time))
+    , m_last_time(-1)
+    , m_settle_until(-1)
+    , m_fixed_reference(false)
+    , m_locked(false)
+    , m_level(0)
+    , m_reference(0)
+    , m_integral(0)
+    , m_correction(0)
+{ }
+
+
+// Record the buffer fill level and return the new resampling ratio.
+double DriftControl::update(double fill, double t)
+{
+    double level = fill / m_sample_rate;
+
+    if (m_last_time < 0) {
+        // First measurement after (re)start.
+        m_last_time    = t;
+        m_settle_until = t + settle_time;
+        m_level        = level;
+        return ratio();
+    }
+
+    double dt = min(t - m_last_time, smooth_time);
+    m_last_time = t;
+    if (dt <= 0)
+        return ratio();
+
+    m_level += (level - m_level) * dt / smooth_time;
+
+    if (!m_locked) {
+        if (t < m_settle_until)
+            return ratio();
+        // Keep the latency at the level where the buffer settled.
+        m_reference = m_level;
+        m_locked    = true;
+    }
+
+    // Positive error: the buffer grows, so produce fewer samples.
+    double err = m_level - m_reference;
+    double output = m_integral + m_kp * err;
+
+    // Do not integrate while the output is saturated by a large error,
+    // for example the initial burst of samples; that is not drift.
+    if (fabs(output) < max_correction || output * err < 0) {
+        m_integral += m_ki * err * dt;
+        m_integral = max(-max_correction, min(max_correction, m_integral));
+        output = m_integral + m_kp * err;
+    }
+    m_correction = max(-max_correction, min(max_correction, output));
+
+    return ratio();
+}
+
+
+// Set the reference level explicitly.
+void DriftControl::set_reference(double fill)
+{
+    m_reference       = fill / m_sample_rate;
+    m_fixed_reference = true;
+    m_locked          = true;
+}
+
+
+// Restart after a jump of the fill level.
+void DriftControl::restart()
+{
+    m_last_time  = -1;
+    m_locked     = m_fixed_reference;
+    m_correction = m_integral;
+}
+
+/* end */
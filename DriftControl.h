@@ -0,0 +1,97 @@
+#ifndef SOFTFM_DRIFTCONTROL_H
+#define SOFTFM_DRIFTCONTROL_H
+
+
+/**
+ * Closed-loop compensation of clock drift between receiver and sound card.
+ *
+ * The RTL-SDR and the sound card run from different crystals, so audio
+ * is produced slightly faster or slower than it is played, and the output
+ * buffer slowly fills up or runs empty. This controller watches the fill
+ * level of the output buffer and computes a correction of the audio
+ * resampling ratio which keeps the fill level constant.
+ *
+ * The fill level is smoothed over a few seconds (it jumps by one block
+ * on every write). A PI controller turns the deviation from the reference
+ * level into a ratio correction; its integral part converges to the
+ * actual clock drift. The correction is limited to +/- 1000 ppm
+ * (< 2 cent of pitch), and changes smoothly.
+ *
+ * The reference level is either set explicitly, or it is the smoothed
+ * fill level measured after a short settling period. After the buffer
+ * has been refilled or a block dropped, call restart(); the drift
+ * estimate is kept.
+ */
+class DriftControl
+{
+public:
+
+    /** Maximum correction of the resampling ratio. */
+    static constexpr double max_correction = 1.0e-3;
+
+    /**
+     * Construct controller.
+     *
+     * sample_rate  :: rate at which the buffer drains, in samples per
+     *                 second (audio sample rate times channels)
+     * loop_time    :: time constant of the control loop in seconds
+     */
+    explicit DriftControl(double sample_rate, double loop_time=60.0);
+
+    /**
+     * Record the buffer fill level (in samples) at time t
+     * (monotonic, in seconds). Return the new resampling ratio.
+     */
+    double update(double fill, double t);
+
+    /**
+     * Keep the buffer at the specified fill level (in samples), instead
+     * of the level where it settled.
+     */
+    void set_reference(double fill);
+
+    /**
+     * Restart after a jump of the fill level: restart smoothing, and
+     * measure the reference level again unless it was set explicitly.
+     * The drift estimate is kept.
+     */
+    void restart();
+
+    /**
+     * Return resampling ratio, (1 + correction).
+     * A ratio above 1 produces fewer audio samples.
+     */
+    double ratio() const
+    {
+        return 1 + m_correction;
+    }
+
+    /**
+     * Return estimated drift in ppm; positive if the receiver clock is
+     * fast relative to the sound card.
+     */
+    double drift_ppm() const
+    {
+        return m_integral * 1.0e6;
+    }
+
+private:
+    /** Time constant of the fill level smoothing, in seconds. */
+    static constexpr double smooth_time = 5.0;
+
+    /** Time after start or restart before the reference is taken. */
+    static constexpr double settle_time = 10.0;
+
+    const double    m_sample_rate;
+    const double    m_kp, m_ki;
+    double          m_last_time;
+    double          m_settle_until;
+    bool            m_fixed_reference;
+    bool            m_locked;
+    double          m_level;
+    double          m_reference;
+    double          m_integral;
+    double          m_correction;
+};
+
+#endif
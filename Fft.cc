@@ -0,0 +1,127 @@
+
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+#include "Fft.h"
+
+using namespace std;
+
+
+/* ****************  class Fft  **************** */
+
+// Construct FFT.
+Fft::Fft(unsigned int size)
+    : m_size(size)
+    , m_twiddle(size / 2)
+{
+    assert(size >= 2 && (size & (size - 1)) == 0);
+
+    unsigned int bits = 0;
+    while ((1u << bits) < size)
+        bits++;
+
+    // Bit-reversal permutation as a list of swaps.
+    for (unsigned int i = 0; i < size; i++) {
+        unsigned int r = 0;
+        for (unsigned int b = 0; b < bits; b++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        if (i < r) {
+            m_swap.push_back(i);
+            m_swap.push_back(r);
+        }
+    }
+
+    for (unsigned int k = 0; k < size / 2; k++) {
+        double phi = -2.0 * M_PI * k / size;
+        m_twiddle[k] = IQSample(cos(phi), sin(phi));
+    }
+}
+
+
+// Compute the forward transform of a batch.
+void Fft::forward(IQSample *data, unsigned int count) const
+{
+    unsigned int n = m_size;
+
+    for (unsigned int b = 0; b < count; b++) {
+        IQSample *x = data + b * n;
+        for (unsigned int i = 0; i < m_swap.size(); i += 2)
+            swap(x[m_swap[i]], x[m_swap[i+1]]);
+    }
+
+    for (unsigned int len = 2; len <= n; len *= 2) {
+        unsigned int half = len / 2;
+        unsigned int stride = n / len;
+        for (unsigned int b = 0; b < count; b++) {
+            IQSample *x = data + b * n;
+            for (unsigned int p = 0; p < n; p += len) {
+                for (unsigned int k = 0; k < half; k++) {
+                    IQSample t = m_twiddle[k * stride] * x[p + k + half];
+                    x[p + k + half] = x[p + k] - t;
+                    x[p + k] += t;
+                }
+            }
+        }
+    }
+}
+
+
+/* ****************  class PowerSpectrum  **************** */
+
+// Construct spectrum analyzer.
+PowerSpectrum::PowerSpectrum(unsigned int fft_size)
+    : m_fft(fft_size)
+    , m_window(fft_size)
+{
+    // Hann window, scaled so that sum(window) = 1.
+    double wsum = 0;
+    for (unsigned int i = 0; i < fft_size; i++) {
+        double w = 0.5 - 0.5 * cos(2.0 * M_PI * (i + 0.5) / fft_size);
+        m_window[i] = w;
+        wsum += w;
+    }
+    for (unsigned int i = 0; i < fft_size; i++)
+        m_window[i] /= wsum;
+}
+
+
+// Compute the power spectrum.
+void PowerSpectrum::process(const IQSampleVector& samples,
+                            vector<double>& power)
+{
+    unsigned int n = m_fft.size();
+    unsigned int nframes = samples.size() / n;
+
+    power.assign(n, 0.0);
+    if (nframes == 0)
+        return;
+
+    m_buf.resize(batch_frames * n);
+
+    for (unsigned int f0 = 0; f0 < nframes; f0 += batch_frames) {
+        unsigned int nb = min(batch_frames, nframes - f0);
+
+        // Apply window.
+        for (unsigned int b = 0; b < nb; b++) {
+            const IQSample *x = samples.data() + (f0 + b) * n;
+            IQSample *y = m_buf.data() + b * n;
+            for (unsigned int i = 0; i < n; i++)
+                y[i] = x[i] * m_window[i];
+        }
+
+        m_fft.forward(m_buf.data(), nb);
+
+        // Accumulate power, with DC moved to the middle.
+        for (unsigned int b = 0; b < nb; b++) {
+            const IQSample *y = m_buf.data() + b * n;
+            for (unsigned int k = 0; k < n; k++)
+                power[(k + n / 2) % n] += norm(y[k]);
+        }
+    }
+
+    for (unsigned int k = 0; k < n; k++)
+        power[k] /= nframes;
+}
+
+/* end */
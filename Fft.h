@@ -0,0 +1,80 @@
+#ifndef SOFTFM_FFT_H
+#define SOFTFM_FFT_H
+
+#include <vector>
+#include "SoftFM.h"
+
+
+/**
+ * Complex FFT of a fixed power-of-2 size, for batches of transforms.
+ *
+ * This is an iterative radix-2 transform with precomputed twiddle factors
+ * and bit-reversal permutation. A batch of transforms is processed one
+ * butterfly stage at a time over all transforms, so the twiddle factors
+ * of a stage are loaded once per batch.
+ */
+class Fft
+{
+public:
+
+    /** Construct FFT for transforms of size (power of 2, >= 2). */
+    explicit Fft(unsigned int size);
+
+    /** Return transform size. */
+    unsigned int size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * Compute the forward transform, X[k] = sum x[n] * exp(-2*pi*j*k*n/N),
+     * in place for count consecutive blocks of size() samples.
+     */
+    void forward(IQSample *data, unsigned int count) const;
+
+private:
+    unsigned int                m_size;
+    std::vector<unsigned int>   m_swap;     // pairs of indices to swap
+    IQSampleVector              m_twiddle;  // exp(-2*pi*j*k/N), k < N/2
+};
+
+
+/**
+ * Averaged power spectrum of IQ samples (Welch method).
+ *
+ * The input is cut into non-overlapping frames of fft_size samples,
+ * each frame is multiplied with a Hann window and transformed, and the
+ * power in each bin is averaged over all frames.
+ */
+class PowerSpectrum
+{
+public:
+
+    /** Construct spectrum analyzer with fft_size bins (power of 2). */
+    explicit PowerSpectrum(unsigned int fft_size);
+
+    /** Return number of bins. */
+    unsigned int size() const
+    {
+        return m_fft.size();
+    }
+
+    /**
+     * Compute the power spectrum of all complete frames in samples.
+     *
+     * power receives size() bins, in order of frequency from -fs/2 to
+     * +fs/2 (DC at index size()/2). A full-scale complex tone at the
+     * center of a bin gives power 1 in that bin.
+     */
+    void process(const IQSampleVector& samples, std::vector<double>& power);
+
+private:
+    /** Number of frames transformed as one batch. */
+    static const unsigned int batch_frames = 16;
+
+    Fft                 m_fft;
+    std::vector<IQSample::value_type> m_window;
+    IQSampleVector      m_buf;
+};
+
+#endif
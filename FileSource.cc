@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "FileSource.h"
+#include "IQConvert.h"
+
+using namespace std;
+
+
+/** Return true if the file name ends with the specified suffix. */
+static bool has_suffix(const string& filename, const char *suffix)
+{
+    size_t n = strlen(suffix);
+    return filename.size() >= n &&
+           strcasecmp(filename.c_str() + filename.size() - n, suffix) == 0;
+}
+
+
+// Open and map IQ file.
+FileSource::FileSource(const string& filename,
+                       FileFormat format,
+                       uint32_t sample_rate,
+                       uint32_t frequency,
+                       unsigned int block_length)
+    : m_format(format)
+    , m_sample_rate(sample_rate)
+    , m_frequency(frequency)
+    , m_block_length(block_length)
+    , m_data(NULL)
+    , m_map_size(0)
+    , m_num_samples(0)
+    , m_pos(0)
+{
+    if (m_format == FORMAT_AUTO) {
+        if (has_suffix(filename, ".cf32") ||
+            has_suffix(filename, ".cfile") ||
+            has_suffix(filename, ".fc32")) {
+            m_format = FORMAT_CF32;
+        } else {
+            m_format = FORMAT_U8;
+        }
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        m_error =  "Can not open '" + filename + "' (";
+        m_error += strerror(errno);
+        m_error += ")";
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        m_error =  "Can not stat '" + filename + "' (";
+        m_error += strerror(errno);
+        m_error += ")";
+        close(fd);
+        return;
+    }
+
+    size_t sample_size = (m_format == FORMAT_CF32) ? sizeof(IQSample) : 2;
+    m_map_size = st.st_size;
+    m_num_samples = m_map_size / sample_size;
+    if (m_num_samples == 0) {
+        m_error = "File '" + filename + "' contains no samples";
+        close(fd);
+        return;
+    }
+
+    void *p = mmap(NULL, m_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        m_error =  "Can not map '" + filename + "' (";
+        m_error += strerror(errno);
+        m_error += ")";
+        return;
+    }
+
+    // We read the file exactly once from start to end.
+    madvise(p, m_map_size, MADV_SEQUENTIAL);
+
+    m_data = static_cast<const uint8_t *>(p);
+}
+
+
+// Unmap file.
+FileSource::~FileSource()
+{
+    if (m_data)
+        munmap(const_cast<uint8_t *>(m_data), m_map_size);
+}
+
+
+// Fetch a bunch of samples from the file.
+bool FileSource::get_samples(IQSampleVector& samples)
+{
+    if (!m_data)
+        return false;
+
+    size_t n = min(size_t(m_block_length), m_num_samples - m_pos);
+    samples.resize(n);
+
+    if (m_format == FORMAT_CF32) {
+        memcpy(samples.data(), m_data + m_pos * sizeof(IQSample),
+               n * sizeof(IQSample));
+    } else {
+        if (m_raw_tap != NULL)
+            m_raw_tap->write_raw(m_data + 2 * m_pos, 2 * n);
+        iq_convert_u8(m_data + 2 * m_pos, samples.data(), n);
+    }
+
+    m_pos += n;
+
+    return true;
+}
+
+/* end */
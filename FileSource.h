@@ -0,0 +1,106 @@
+#ifndef SOFTFM_FILESOURCE_H
+#define SOFTFM_FILESOURCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "SoftFM.h"
+#include "SampleSource.h"
+
+
+/**
+ * Read IQ samples from a recording.
+ *
+ * The file is memory-mapped and converted block by block, so samples are
+ * delivered as fast as the consumer can take them. This makes it possible
+ * to rerun a capture through the decoder for testing and benchmarking.
+ */
+class FileSource : public SampleSource
+{
+public:
+
+    /** Sample format of the file. */
+    enum FileFormat {
+        FORMAT_AUTO,    // guess from file name extension
+        FORMAT_U8,      // unsigned 8-bit I/Q pairs, as written by rtl_sdr
+        FORMAT_CF32     // native 32-bit float I/Q pairs (GNU Radio cfile)
+    };
+
+    /**
+     * Open and map IQ file.
+     *
+     * filename     :: name of the file
+     * format       :: sample format
+     * sample_rate  :: sample rate of the recording in Hz
+     * frequency    :: center frequency of the recording in Hz
+     * block_length :: number of samples per block
+     */
+    FileSource(const std::string& filename,
+               FileFormat format,
+               std::uint32_t sample_rate,
+               std::uint32_t frequency,
+               unsigned int block_length);
+
+    /** Unmap file. */
+    virtual ~FileSource();
+
+    FileSource(const FileSource&) = delete;
+    FileSource& operator=(const FileSource&) = delete;
+
+    virtual std::uint32_t get_sample_rate() { return m_sample_rate; }
+
+    virtual std::uint32_t get_frequency() { return m_frequency; }
+
+    virtual bool get_samples(IQSampleVector& samples);
+
+    virtual bool is_realtime() const { return false; }
+
+    /** Pass raw samples to tap; only for 8-bit files. */
+    virtual bool set_raw_tap(RawSampleTap *tap)
+    {
+        if (tap != NULL && m_format != FORMAT_U8)
+            return false;
+        m_raw_tap = tap;
+        return true;
+    }
+
+    /** Return total number of samples in the file. */
+    std::size_t get_num_samples() const
+    {
+        return m_num_samples;
+    }
+
+    /** Return sample format of the file. */
+    FileFormat get_format() const
+    {
+        return m_format;
+    }
+
+    /** Return the last error, or return an empty string if there is no error. */
+    virtual std::string error()
+    {
+        std::string ret(m_error);
+        m_error.clear();
+        return ret;
+    }
+
+    /** Return true if the file is OK, return false if there is an error. */
+    virtual operator bool() const
+    {
+        return m_data != NULL && m_error.empty();
+    }
+
+private:
+    FileFormat          m_format;
+    std::uint32_t       m_sample_rate;
+    std::uint32_t       m_frequency;
+    unsigned int        m_block_length;
+    const std::uint8_t *m_data;
+    std::size_t         m_map_size;
+    std::size_t         m_num_samples;
+    std::size_t         m_pos;
+    std::string         m_error;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <cmath>
 #include <cstdint>
 #include <algorithm>
+#include <array>
 #include <complex>
 
 #include "Filter.h"
@@ -49,23 +50,197 @@ static void make_lanczos_coeff(unsigned int filter_order, double cutoff,
 }
 
 
-/* ****************  class FineTuner  **************** */
-
-// Construct finetuner.
-FineTuner::FineTuner(unsigned int table_size, int freq_shift)
-    : m_index(0)
-    , m_table(table_size)
+/** Fill the sin/cos table of a table-driven oscillator. */
+static void make_tuning_table(unsigned int table_size, int freq_shift,
+                              IQSampleVector& table)
 {
+    table.resize(table_size);
     double phase_step = 2.0 * M_PI / double(table_size);
     for (unsigned int i = 0; i < table_size; i++) {
         double phi = (((int64_t)freq_shift * i) % table_size) * phase_step;
         double pcos = cos(phi);
         double psin = sin(phi);
-        m_table[i] = IQSample(pcos, psin);
+        table[i] = IQSample(pcos, psin);
+    }
+}
+
+
+/* ****************  Fixed-order FIR kernels  **************** */
+
+static FirKernel selected_fir_kernel = FIR_KERNEL_AUTO;
+
+
+// Select the FIR kernels.
+void fir_kernel_select(FirKernel kernel)
+{
+    selected_fir_kernel = kernel;
+}
+
+
+// Return name of the currently selected FIR kernels.
+const char * fir_kernel_name()
+{
+    switch (selected_fir_kernel) {
+        case FIR_KERNEL_GENERIC:    return "generic";
+        case FIR_KERNEL_DIRECT:     return "fixed-order, direct form";
+        case FIR_KERNEL_FFT:        return "overlap-save";
+        default:                    return "fixed-order";
     }
 }
 
 
+/**
+ * Complex FIR filter with (Taps) real coefficients.
+ *
+ * The samples are viewed as an array of interleaved floats, so that both
+ * components of each output are computed by the same float loop. The
+ * output is produced in short chunks with one pass per tap; each pass is
+ * a vectorized multiply-add over the chunk, which stays in L1 cache.
+ */
+template <unsigned int Taps>
+static void fir_iq_fixed(const IQSample::value_type *coeff,
+                         const IQSample *x, IQSample *y, unsigned int n)
+{
+    typedef IQSample::value_type T;
+    const unsigned int chunk = 512;
+
+    alignas(16) array<T, Taps> c;
+    copy(coeff, coeff + Taps, c.begin());
+
+    const T *xf = reinterpret_cast<const T *>(x);
+    T *yf = reinterpret_cast<T *>(y);
+
+    for (unsigned int k0 = 0; k0 < 2 * n; k0 += chunk) {
+        unsigned int m = min(chunk, 2 * n - k0);
+        const T *inp = xf + k0;
+        T *out = yf + k0;
+        for (unsigned int k = 0; k < m; k++)
+            out[k] = inp[k] * c[0];
+        for (unsigned int j = 1; j < Taps; j++) {
+            T cj = c[j];
+            const T *inj = inp + 2 * j;
+            for (unsigned int k = 0; k < m; k++)
+                out[k] += inj[k] * cj;
+        }
+    }
+}
+
+
+/** Return fixed-order kernel for a complex FIR filter, or NULL. */
+static LowPassFilterFirIQ::Kernel fir_iq_kernel(unsigned int taps)
+{
+    if (selected_fir_kernel == FIR_KERNEL_GENERIC)
+        return NULL;
+
+    switch (taps) {
+        case 11:    return fir_iq_fixed<11>;    // IF filter
+        default:    return NULL;
+    }
+}
+
+
+/**
+ * Dot product of two arrays of (N) samples.
+ *
+ * The sum is split into four partial sums over the quarters of the
+ * arrays, which the compiler vectorizes as independent chains, so the
+ * loop is not limited by the latency of the additions.
+ */
+template <unsigned int N>
+static Sample dot_product_fixed(const Sample *a, const Sample *b)
+{
+    const unsigned int q = N / 4;
+    Sample y0 = 0, y1 = 0, y2 = 0, y3 = 0;
+    for (unsigned int i = 0; i < q; i++) {
+        y0 += a[i]       * b[i];
+        y1 += a[q + i]   * b[q + i];
+        y2 += a[2*q + i] * b[2*q + i];
+        y3 += a[3*q + i] * b[3*q + i];
+    }
+    for (unsigned int i = 4 * q; i < N; i++)
+        y0 += a[i] * b[i];
+    return (y0 + y1) + (y2 + y3);
+}
+
+
+/** Return fixed-order dot product kernel for (taps), or NULL. */
+static DownsampleFilter::Kernel dot_product_kernel(unsigned int taps)
+{
+    if (selected_fir_kernel == FIR_KERNEL_GENERIC)
+        return NULL;
+
+    // Lengths used by the decoder at the common RTL-SDR rates
+    // 0.96, 1.0, 1.024, 1.2, 1.44, 1.5, 1.6, 1.8, 1.92, 2.048, 2.4, 2.56,
+    // 2.88 and 3.2 MS/s with 48 kHz audio, with and without half-band or
+    // IF decimation. A filter with a polyphase bank uses (order + 1) taps,
+    // otherwise (order) taps.
+    switch (taps) {
+        // Baseband downsampler, order 8 * downsample with
+        // downsample = int(demodulator rate / 215 kHz) = 1 .. 14.
+        case 8:     return dot_product_fixed<8>;
+        case 16:    return dot_product_fixed<16>;
+        case 32:    return dot_product_fixed<32>;
+        case 40:    return dot_product_fixed<40>;
+        case 48:    return dot_product_fixed<48>;
+        case 56:    return dot_product_fixed<56>;
+        case 64:    return dot_product_fixed<64>;
+        case 72:    return dot_product_fixed<72>;
+        case 88:    return dot_product_fixed<88>;
+        case 104:   return dot_product_fixed<104>;
+        case 112:   return dot_product_fixed<112>;
+        // Audio resampler, order (baseband rate / 1 kHz) at 218 .. 400 kS/s
+        // baseband; all with a polyphase bank.
+        case 219:   return dot_product_fixed<219>;
+        case 222:   return dot_product_fixed<222>;
+        case 226:   return dot_product_fixed<226>;
+        case 228:   return dot_product_fixed<228>;
+        case 229:   return dot_product_fixed<229>;
+        case 233:   return dot_product_fixed<233>;
+        case 241:   return dot_product_fixed<241>;
+        case 251:   return dot_product_fixed<251>;
+        case 257:   return dot_product_fixed<257>;
+        case 301:   return dot_product_fixed<301>;
+        case 321:   return dot_product_fixed<321>;
+        case 334:   return dot_product_fixed<334>;
+        case 342:   return dot_product_fixed<342>;
+        case 361:   return dot_product_fixed<361>;
+        case 376:   return dot_product_fixed<376>;
+        case 401:   return dot_product_fixed<401>;
+        // Short FIR filter of HybridDownsampleFilter, at half (or at
+        // 300 kS/s a third) of these rates.
+        case 101:   return dot_product_fixed<101>;
+        case 110:   return dot_product_fixed<110>;
+        case 111:   return dot_product_fixed<111>;
+        case 113:   return dot_product_fixed<113>;
+        case 114:   return dot_product_fixed<114>;
+        case 115:   return dot_product_fixed<115>;
+        case 117:   return dot_product_fixed<117>;
+        case 121:   return dot_product_fixed<121>;
+        case 126:   return dot_product_fixed<126>;
+        case 129:   return dot_product_fixed<129>;
+        default:    return NULL;
+    }
+}
+
+
+/* ****************  class FineTuner  **************** */
+
+// Construct finetuner.
+FineTuner::FineTuner(unsigned int table_size, int freq_shift)
+    : m_index(0)
+{
+    make_tuning_table(table_size, freq_shift, m_table);
+}
+
+
+// Change the frequency shift.
+void FineTuner::set_shift(unsigned int table_size, int freq_shift)
+{
+    make_tuning_table(table_size, freq_shift, m_table);
+    m_index = 0;
+}
+
+
 // Process samples.
 void FineTuner::process(const IQSampleVector& samples_in,
                         IQSampleVector& samples_out)
@@ -87,13 +262,149 @@ void FineTuner::process(const IQSampleVector& samples_in,
 }
 
 
+/* ****************  class OverlapSaveFilter  **************** */
+
+const unsigned int OverlapSaveFilter::min_taps_iq;
+const unsigned int OverlapSaveFilter::min_taps_real;
+
+
+/** Return FFT size for overlap-save with (taps) coefficients. */
+static unsigned int overlap_save_fft_size(unsigned int taps)
+{
+    // About 3/4 of each transform yields output samples.
+    unsigned int n = 64;
+    while (n < 4 * taps)
+        n *= 2;
+    return n;
+}
+
+
+// Return true if overlap-save should be used for this filter.
+bool OverlapSaveFilter::preferred(unsigned int taps, unsigned int min_taps,
+                                  unsigned int downsample)
+{
+    switch (selected_fir_kernel) {
+        case FIR_KERNEL_AUTO:   return taps >= min_taps * downsample;
+        case FIR_KERNEL_FFT:    return true;
+        default:                return false;
+    }
+}
+
+
+// Construct filter.
+OverlapSaveFilter::OverlapSaveFilter(const vector<double>& coeff)
+    : m_taps(coeff.size())
+    , m_fft(overlap_save_fft_size(coeff.size()))
+    , m_spectrum(m_fft.size())
+    , m_buf(m_fft.size())
+{
+    assert(m_taps > 0);
+
+    // y[i] = sum_j x[i+j] * coeff[j] is the circular convolution of x
+    // with h[k] = coeff[-k mod N], whose spectrum is conj(FFT(coeff))
+    // for real coefficients.
+    unsigned int n = m_fft.size();
+    fill(m_spectrum.begin(), m_spectrum.end(), IQSample(0));
+    for (unsigned int j = 0; j < m_taps; j++)
+        m_spectrum[j] = IQSample(coeff[j], 0);
+    m_fft.forward(m_spectrum.data(), 1);
+    for (unsigned int k = 0; k < n; k++)
+        m_spectrum[k] = conj(m_spectrum[k]) / IQSample::value_type(n);
+}
+
+
+// Convolve m_buf with the filter.
+void OverlapSaveFilter::convolve()
+{
+    unsigned int n = m_fft.size();
+    IQSample *buf = m_buf.data();
+    const IQSample *h = m_spectrum.data();
+
+    m_fft.forward(buf, 1);
+    for (unsigned int k = 0; k < n; k++)
+        buf[k] = conj(buf[k] * h[k]);
+    m_fft.forward(buf, 1);
+}
+
+
+// Filter IQ samples.
+void OverlapSaveFilter::process(const IQSample *x, IQSample *y,
+                                unsigned int n)
+{
+    unsigned int nfft = m_fft.size();
+    unsigned int step = nfft - m_taps + 1;
+    IQSample *buf = m_buf.data();
+
+    for (unsigned int i0 = 0; i0 < n; i0 += step) {
+        unsigned int m = min(step, n - i0);
+        unsigned int len = m + m_taps - 1;
+        copy(x + i0, x + i0 + len, buf);
+        fill(buf + len, buf + nfft, IQSample(0));
+        convolve();
+        for (unsigned int i = 0; i < m; i++)
+            y[i0 + i] = conj(buf[i]);
+    }
+}
+
+
+// Filter real samples.
+void OverlapSaveFilter::process(const Sample *x, Sample *y, unsigned int n)
+{
+    typedef IQSample::value_type T;
+    unsigned int nfft = m_fft.size();
+    unsigned int step = nfft - m_taps + 1;
+    IQSample *buf = m_buf.data();
+
+    // Segment a in the real part, the next segment b in the imaginary part.
+    for (unsigned int i0 = 0; i0 < n; i0 += 2 * step) {
+        unsigned int ma = min(step, n - i0);
+        unsigned int mb = (n - i0 > step) ? min(step, n - i0 - step) : 0;
+        unsigned int lena = ma + m_taps - 1;
+        unsigned int lenb = (mb > 0) ? mb + m_taps - 1 : 0;
+        const Sample *xa = x + i0;
+        const Sample *xb = xa + step;
+        unsigned int k = 0;
+        for (; k < lenb; k++)
+            buf[k] = IQSample(T(xa[k]), T(xb[k]));
+        for (; k < lena; k++)
+            buf[k] = IQSample(T(xa[k]), 0);
+        fill(buf + lena, buf + nfft, IQSample(0));
+        convolve();
+        for (unsigned int i = 0; i < ma; i++)
+            y[i0 + i] = buf[i].real();
+        for (unsigned int i = 0; i < mb; i++)
+            y[i0 + step + i] = -buf[i].imag();
+    }
+}
+
+
 /* ****************  class LowPassFilterFirIQ  **************** */
 
+// Compute Lanczos FIR coefficients.
+shared_ptr<const LowPassFilterFirIQ::Coefficients>
+LowPassFilterFirIQ::make_coeff(unsigned int filter_order, double cutoff)
+{
+    shared_ptr<Coefficients> coeff = make_shared<Coefficients>();
+    make_lanczos_coeff(filter_order, cutoff, *coeff);
+    return coeff;
+}
+
+
 // Construct low-pass filter.
 LowPassFilterFirIQ::LowPassFilterFirIQ(unsigned int filter_order, double cutoff)
-    : m_state(filter_order)
+    : LowPassFilterFirIQ(make_coeff(filter_order, cutoff))
+{ }
+
+
+// Construct low-pass filter from precomputed coefficients.
+LowPassFilterFirIQ::LowPassFilterFirIQ(shared_ptr<const Coefficients> coeff)
+    : m_coeff(coeff)
+    , m_state(coeff->size() - 1)
+    , m_kernel(fir_iq_kernel(coeff->size()))
 {
-    make_lanczos_coeff(filter_order, cutoff, m_coeff);
+    if (OverlapSaveFilter::preferred(coeff->size(),
+                                     OverlapSaveFilter::min_taps_iq))
+        m_fast.reset(new OverlapSaveFilter(coeff->data(), coeff->size()));
 }
 
 
@@ -103,6 +414,7 @@ void LowPassFilterFirIQ::process(const IQSampleVector& samples_in,
 {
     unsigned int order = m_state.size();
     unsigned int n = samples_in.size();
+    const Coefficients& coeff = *m_coeff;
 
     samples_out.resize(n);
 
@@ -113,24 +425,42 @@ void LowPassFilterFirIQ::process(const IQSampleVector& samples_in,
     // faster to scan forward through the array. The result is still correct
     // because the coefficients are symmetric.
 
+    if (m_fast) {
+
+        // Fast convolution over the history followed by the new samples.
+        m_buf.resize(order + n);
+        copy(m_state.begin(), m_state.end(), m_buf.begin());
+        copy(samples_in.begin(), samples_in.end(), m_buf.begin() + order);
+        m_fast->process(m_buf.data(), samples_out.data(), n);
+        copy(m_buf.end() - order, m_buf.end(), m_state.begin());
+        return;
+    }
+
     // The first few samples need data from m_state.
     unsigned int i = 0;
     for (; i < n && i < order; i++) {
         IQSample y = 0;
         for (unsigned int j = 0; j < order - i; j++)
-            y += m_state[i+j] * m_coeff[j];
+            y += m_state[i+j] * coeff[j];
         for (unsigned int j = order - i; j <= order; j++)
-            y += samples_in[i-order+j] * m_coeff[j];
+            y += samples_in[i-order+j] * coeff[j];
         samples_out[i] = y;
     }
 
     // Remaining samples only need data from samples_in.
-    for (; i < n; i++) {
-        IQSample y = 0;
-        IQSampleVector::const_iterator inp = samples_in.begin() + i - order;
-        for (unsigned int j = 0; j <= order; j++)
-            y += inp[j] * m_coeff[j];
-        samples_out[i] = y;
+    if (m_kernel != NULL) {
+        if (i < n)
+            m_kernel(coeff.data(), samples_in.data() + i - order,
+                     samples_out.data() + i, n - i);
+    } else {
+        for (; i < n; i++) {
+            IQSample y = 0;
+            IQSampleVector::const_iterator inp =
+                samples_in.begin() + i - order;
+            for (unsigned int j = 0; j <= order; j++)
+                y += inp[j] * coeff[j];
+            samples_out[i] = y;
+        }
     }
 
     // Update m_state.
@@ -143,26 +473,450 @@ void LowPassFilterFirIQ::process(const IQSampleVector& samples_in,
 }
 
 
+// Clear the filter history.
+void LowPassFilterFirIQ::reset()
+{
+    fill(m_state.begin(), m_state.end(), IQSample(0));
+}
+
+
+/* ****************  class DownsampleFilterIQ  **************** */
+
+// Construct combined tuner and downsampler.
+DownsampleFilterIQ::DownsampleFilterIQ(unsigned int table_size,
+                                       int freq_shift,
+                                       unsigned int filter_order,
+                                       double cutoff,
+                                       unsigned int downsample)
+    : DownsampleFilterIQ(table_size, freq_shift,
+                         LowPassFilterFirIQ::make_coeff(filter_order, cutoff),
+                         downsample)
+{ }
+
+
+// Construct combined tuner and downsampler from precomputed coefficients.
+DownsampleFilterIQ::DownsampleFilterIQ(
+        unsigned int table_size,
+        int freq_shift,
+        shared_ptr<const LowPassFilterFirIQ::Coefficients> coeff,
+        unsigned int downsample)
+    : m_downsample(downsample)
+    , m_pos(0)
+    , m_index(0)
+    , m_coeff(coeff)
+    , m_buf(coeff->size() - 1)
+{
+    assert(downsample >= 1);
+    make_tuning_table(table_size, freq_shift, m_table);
+}
+
+
+// Change the frequency shift.
+void DownsampleFilterIQ::set_shift(unsigned int table_size, int freq_shift)
+{
+    make_tuning_table(table_size, freq_shift, m_table);
+    m_index = 0;
+}
+
+
+// Clear the filter history and restart the oscillator.
+void DownsampleFilterIQ::reset()
+{
+    m_pos   = 0;
+    m_index = 0;
+    m_buf.assign(m_coeff->size() - 1, IQSample(0));
+}
+
+
+// Process samples.
+void DownsampleFilterIQ::process(const IQSampleVector& samples_in,
+                                 IQSampleVector& samples_out)
+{
+    unsigned int order = m_coeff->size() - 1;
+    unsigned int n = samples_in.size();
+
+    // m_buf holds the last (order) mixed samples from the previous block.
+    // Append the new samples, mixed with the local oscillator, so that
+    // the filter below can scan a contiguous array without branches.
+    m_buf.resize(order + n);
+
+    unsigned int tblidx = m_index;
+    unsigned int tblsiz = m_table.size();
+    for (unsigned int i = 0; i < n; i++) {
+        m_buf[order + i] = samples_in[i] * m_table[tblidx];
+        tblidx++;
+        if (tblidx == tblsiz)
+            tblidx = 0;
+    }
+    m_index = tblidx;
+
+    // Compute only the output samples which are kept after decimation.
+    // Output sample at input position p uses m_buf[p .. p+order].
+    // NOTE: The coefficients are symmetric, so we can scan them forward.
+    unsigned int p = m_pos;
+    unsigned int pstep = m_downsample;
+    samples_out.resize((n > p) ? (n - p + pstep - 1) / pstep : 0);
+
+    const IQSample::value_type *coeff = m_coeff->data();
+    unsigned int i = 0;
+    for (; p < n; p += pstep, i++) {
+        const IQSample::value_type *inp =
+            reinterpret_cast<const IQSample::value_type *>(&m_buf[p]);
+        IQSample::value_type yre = 0, yim = 0;
+        for (unsigned int j = 0; j <= order; j++) {
+            yre += inp[2*j]   * coeff[j];
+            yim += inp[2*j+1] * coeff[j];
+        }
+        samples_out[i] = IQSample(yre, yim);
+    }
+
+    assert(i == samples_out.size());
+    m_pos = p - n;
+
+    // Keep the last (order) samples for the next block.
+    copy(m_buf.end() - order, m_buf.end(), m_buf.begin());
+    m_buf.resize(order);
+}
+
+
+/* ****************  class HalfBandDecimatorIQ  **************** */
+
+/** Modified Bessel function of the first kind, order 0. */
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; term > 1.0e-12 * sum; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+
+/**
+ * Prepare half-band filter with (4*k-1) taps, Kaiser window.
+ * Return all taps, including the zeros.
+ */
+static vector<double> make_halfband_coeff(unsigned int k)
+{
+    // Kaiser window parameter for ~ 60 dB stopband attenuation.
+    const double beta = 5.65;
+
+    int half = 2 * k - 1;
+    vector<double> coeff(2 * half + 1);
+
+    double ysum = 0.0;
+    for (int n = -half; n <= half; n++) {
+        double y = 0;
+        if (n == 0) {
+            y = 0.5;
+        } else if (n % 2 != 0) {
+            double r = double(n) / (half + 1);
+            y = sin(M_PI * n / 2) / (M_PI * n) *
+                bessel_i0(beta * sqrt(1 - r * r)) / bessel_i0(beta);
+        }
+        coeff[n + half] = y;
+        ysum += y;
+    }
+
+    // Apply correction factor to ensure unit gain at DC.
+    for (double& c : coeff)
+        c /= ysum;
+
+    return coeff;
+}
+
+
+/** Return worst-case gain of a filter in the band [fmin, 0.5]. */
+static double stopband_gain(const vector<double>& coeff, double fmin)
+{
+    const int npoints = 64;
+    int half = coeff.size() / 2;
+    double gmax = 0;
+    for (int p = 0; p <= npoints; p++) {
+        double f = fmin + (0.5 - fmin) * p / npoints;
+        double g = coeff[half];
+        for (int n = 1; n <= half; n++)
+            g += 2 * coeff[half + n] * cos(2 * M_PI * f * n);
+        gmax = max(gmax, fabs(g));
+    }
+    return gmax;
+}
+
+
+// Construct half-band decimator cascade.
+HalfBandDecimatorIQ::HalfBandDecimatorIQ(unsigned int num_stages,
+                                         double bandwidth)
+    : HalfBandDecimatorIQ(make_coeff(num_stages, bandwidth))
+{ }
+
+
+// Construct cascade from precomputed coefficients.
+HalfBandDecimatorIQ::HalfBandDecimatorIQ(shared_ptr<const Coefficients> coeff)
+    : m_coeff(coeff)
+    , m_stages(coeff->stages.size())
+{
+    reset();
+}
+
+
+// Design the filters of a cascade.
+shared_ptr<const HalfBandDecimatorIQ::Coefficients>
+HalfBandDecimatorIQ::make_coeff(unsigned int num_stages, double bandwidth)
+{
+    shared_ptr<Coefficients> result = make_shared<Coefficients>();
+    result->stages.resize(num_stages);
+
+    for (unsigned int s = 0; s < num_stages; s++) {
+
+        // Band edge relative to the input rate of this stage.
+        double fpass = bandwidth * (1u << s);
+        assert(fpass > 0 && fpass <= 0.2);
+
+        // Choose the shortest filter which rejects everything that would
+        // alias into [-fpass, fpass] after decimation.
+        unsigned int k = 2;
+        vector<double> coeff = make_halfband_coeff(k);
+        while (k < 32 && stopband_gain(coeff, 0.5 - fpass) > 1.0e-3) {
+            k++;
+            coeff = make_halfband_coeff(k);
+        }
+
+        // Keep only the non-zero taps at positions 0, 2, ... (2*k-2);
+        // the other half follows from symmetry.
+        Coefficients::StageCoeff& stage = result->stages[s];
+        stage.coeff.resize(k);
+        for (unsigned int j = 0; j < k; j++)
+            stage.coeff[j] = coeff[2 * j];
+        stage.center = coeff[2 * k - 1];
+    }
+
+    return result;
+}
+
+
+// Clear the filter history.
+void HalfBandDecimatorIQ::reset()
+{
+    for (unsigned int s = 0; s < m_stages.size(); s++) {
+        unsigned int k = m_coeff->stages[s].coeff.size();
+        m_stages[s].pos = 0;
+        m_stages[s].buf.assign(4 * k - 2, IQSample(0));
+    }
+}
+
+
+// Process samples.
+void HalfBandDecimatorIQ::process(const IQSampleVector& samples_in,
+                                  IQSampleVector& samples_out)
+{
+    unsigned int nstage = m_stages.size();
+    const IQSampleVector *inp = &samples_in;
+
+    if (nstage == 0) {
+        samples_out.assign(samples_in.begin(), samples_in.end());
+        return;
+    }
+
+    for (unsigned int s = 0; s < nstage; s++) {
+        IQSampleVector& out = (s + 1 == nstage) ? samples_out : m_tmp[s % 2];
+        process_stage(m_coeff->stages[s], m_stages[s], *inp, out);
+        inp = &out;
+    }
+}
+
+
+// Run one stage.
+void HalfBandDecimatorIQ::process_stage(const Coefficients::StageCoeff& sc,
+                                        Stage& stage,
+                                        const IQSampleVector& samples_in,
+                                        IQSampleVector& samples_out)
+{
+    unsigned int k = sc.coeff.size();
+    unsigned int hist = 4 * k - 2;
+    unsigned int n = samples_in.size();
+
+    // stage.buf holds the last (hist) input samples from the previous
+    // block; append the new samples.
+    stage.buf.resize(hist + n);
+    copy(samples_in.begin(), samples_in.end(), stage.buf.begin() + hist);
+
+    // Output sample i uses stage.buf[p+2*i .. p+2*i+hist].
+    // Its non-zero taps are at the even positions p+2*i+2*m (m = 0 .. 2*k-1)
+    // and at the center p+2*i+2*k-1.
+    unsigned int p = stage.pos;
+    unsigned int nout = (n > p) ? (n - p + 1) / 2 : 0;
+    samples_out.resize(nout);
+
+    m_even_re.resize(chunk_size + 2 * k - 1);
+    m_even_im.resize(chunk_size + 2 * k - 1);
+    m_out_re.resize(chunk_size);
+    m_out_im.resize(chunk_size);
+
+    const IQSample::value_type *coeff = sc.coeff.data();
+    IQSample::value_type *ere = m_even_re.data();
+    IQSample::value_type *eim = m_even_im.data();
+    IQSample::value_type *yre = m_out_re.data();
+    IQSample::value_type *yim = m_out_im.data();
+
+    for (unsigned int i0 = 0; i0 < nout; i0 += chunk_size) {
+        unsigned int nc = min(nout - i0, (unsigned int)chunk_size);
+        const IQSample *x = stage.buf.data() + p + 2 * i0;
+
+        // Split the even positions into separate real and imaginary
+        // arrays, so the filter below is a set of contiguous loops.
+        for (unsigned int m = 0; m < nc + 2 * k - 1; m++) {
+            ere[m] = x[2*m].real();
+            eim[m] = x[2*m].imag();
+        }
+
+        // Center tap.
+        for (unsigned int i = 0; i < nc; i++) {
+            yre[i] = sc.center * x[2*i+2*k-1].real();
+            yim[i] = sc.center * x[2*i+2*k-1].imag();
+        }
+
+        // Pairs of symmetric taps, one pass per pair.
+        for (unsigned int j = 0; j < k; j++) {
+            IQSample::value_type c = coeff[j];
+            const IQSample::value_type *are = ere + j;
+            const IQSample::value_type *bre = ere + 2 * k - 1 - j;
+            const IQSample::value_type *aim = eim + j;
+            const IQSample::value_type *bim = eim + 2 * k - 1 - j;
+            for (unsigned int i = 0; i < nc; i++) {
+                yre[i] += c * (are[i] + bre[i]);
+                yim[i] += c * (aim[i] + bim[i]);
+            }
+        }
+
+        for (unsigned int i = 0; i < nc; i++)
+            samples_out[i0 + i] = IQSample(yre[i], yim[i]);
+    }
+
+    stage.pos = p + 2 * nout - n;
+
+    // Keep the last (hist) samples for the next block.
+    copy(stage.buf.end() - hist, stage.buf.end(), stage.buf.begin());
+    stage.buf.resize(hist);
+}
+
+
 /* ****************  class DownsampleFilter  **************** */
 
+/** Compute dot product of two sample arrays. */
+static inline Sample dot_product(const Sample *a, const Sample *b,
+                                 unsigned int n)
+{
+    // Written as a plain loop so that the compiler vectorizes it
+    // (this relies on -ffast-math to allow reordering of the sum).
+    Sample y = 0;
+    for (unsigned int i = 0; i < n; i++)
+        y += a[i] * b[i];
+    return y;
+}
+
+
 // Construct low-pass filter with optional downsampling.
 DownsampleFilter::DownsampleFilter(unsigned int filter_order, double cutoff,
                                    double downsample, bool integer_factor)
-    : m_downsample(downsample)
-    , m_downsample_int(integer_factor ? lrint(downsample) : 0)
-    , m_pos_int(0)
-    , m_pos_frac(0)
-    , m_state(filter_order)
+    : DownsampleFilter(make_coeff(filter_order, cutoff,
+                                  downsample, integer_factor))
+{ }
+
+
+// Construct filter from precomputed coefficients.
+DownsampleFilter::DownsampleFilter(shared_ptr<const Coefficients> coeff)
+    : m_coeff(coeff)
+    , m_order(coeff->order)
+    , m_downsample_int(coeff->downsample_int)
+    , m_bank_step(coeff->bank_step)
+    , m_kernel_order(NULL)
+    , m_kernel_bank(NULL)
+{
+    // Look up only the kernel which the filter uses, so that the
+    // table below needs no entries for unused lengths.
+    if (coeff->bank_phases > 0)
+        m_kernel_bank = dot_product_kernel(coeff->order + 1);
+    else
+        m_kernel_order = dot_product_kernel(coeff->order);
+
+    if (coeff->downsample_int != 0 &&
+        OverlapSaveFilter::preferred(coeff->order,
+                                     OverlapSaveFilter::min_taps_real,
+                                     coeff->downsample_int))
+        m_fast.reset(new OverlapSaveFilter(coeff->coeff.data(),
+                                           coeff->order));
+    reset();
+}
+
+
+// Compute the filter coefficients.
+shared_ptr<const DownsampleFilter::Coefficients>
+DownsampleFilter::make_coeff(unsigned int filter_order, double cutoff,
+                             double downsample, bool integer_factor)
 {
     assert(downsample >= 1);
     assert(filter_order > 1);
 
+    shared_ptr<Coefficients> result = make_shared<Coefficients>();
+    result->order          = filter_order;
+    result->downsample     = downsample;
+    result->downsample_int = integer_factor ? lrint(downsample) : 0;
+    result->bank_phases    = 0;
+    result->bank_step      = 0;
+
     // Force the first coefficient to zero and append an extra zero at the
     // end of the array. This ensures we can always obtain (filter_order+1)
     // coefficients by linear interpolation between adjacent array elements.
-    make_lanczos_coeff(filter_order - 1, cutoff, m_coeff);
-    m_coeff.insert(m_coeff.begin(), 0);
-    m_coeff.push_back(0);
+    SampleVector coeff;
+    make_lanczos_coeff(filter_order - 1, cutoff, coeff);
+    coeff.insert(coeff.begin(), 0);
+    coeff.push_back(0);
+
+    // Store coefficients in reverse order, such that output samples
+    // can be computed as a forward scan over the input history.
+    // rcoeff[k] = coeff[order-k] for k = 0 .. order-1.
+    // (The final zero coefficient coeff[0] is dropped.)
+    SampleVector& rcoeff = result->coeff;
+    rcoeff.resize(filter_order);
+    for (unsigned int k = 0; k < filter_order; k++)
+        rcoeff[k] = coeff[filter_order - k];
+
+    if (result->downsample_int == 0) {
+
+        // If the fractional downsample factor is a ratio of small integers
+        // (step / phases), the output positions cycle through a small set
+        // of fractional offsets. Precompute an interpolated filter kernel
+        // for each offset, so that every output sample is a single
+        // dot product.
+        for (unsigned int q = 1; q <= max_bank_phases; q++) {
+            double p = downsample * q;
+            if (fabs(p - floor(p + 0.5)) < 1.0e-9 * p) {
+                result->bank_phases = q;
+                result->bank_step   = lrint(p);
+                break;
+            }
+        }
+
+        unsigned int nph = result->bank_phases;
+        if (nph > 0) {
+            // Kernel for phase q covers inputs [pi, pi + order] with
+            // weights k0 * rcoeff[k] + k1 * rcoeff[k-1].
+            unsigned int len = filter_order + 1;
+            result->bank.assign(nph * len, 0);
+            for (unsigned int q = 0; q < nph; q++) {
+                Sample k1 = Sample(q) / Sample(nph);
+                Sample k0 = 1 - k1;
+                Sample *kern = result->bank.data() + q * len;
+                for (unsigned int k = 0; k < filter_order; k++) {
+                    kern[k]   += k0 * rcoeff[k];
+                    kern[k+1] += k1 * rcoeff[k];
+                }
+            }
+        }
+    }
+
+    return result;
 }
 
 
@@ -170,47 +924,203 @@ DownsampleFilter::DownsampleFilter(unsigned int filter_order, double cutoff,
 void DownsampleFilter::process(const SampleVector& samples_in,
                                SampleVector& samples_out)
 {
-    unsigned int order = m_state.size();
-    unsigned int n = samples_in.size();
+    process_input(samples_in.data(), NULL, 1, samples_in.size(), samples_out);
+}
+
+
+// Process the product of two signals.
+void DownsampleFilter::process_product(const SampleVector& x,
+                                       const SampleVector& y,
+                                       Sample scale,
+                                       SampleVector& samples_out)
+{
+    assert(x.size() == y.size());
+    process_input(x.data(), y.data(), scale, x.size(), samples_out);
+}
+
+
+// Fill the filter history with a constant value.
+void DownsampleFilter::prime(Sample x)
+{
+    fill(m_buf.begin(), m_buf.begin() + m_order, x);
+}
+
+
+// Advance the output position without computing output.
+unsigned int DownsampleFilter::skip(unsigned int n)
+{
+    // Same position arithmetic as process_input().
+    if (m_downsample_int != 0) {
+        unsigned int p = m_pos_int;
+        unsigned int pstep = m_downsample_int;
+        unsigned int n_out = (n > p) ? (n - p + pstep - 1) / pstep : 0;
+        m_pos_int = p + n_out * pstep - n;
+        return n_out;
+    } else if (m_bank_phases > 0) {
+        unsigned int nph = m_bank_phases;
+        unsigned int pstep = m_bank_step;
+        unsigned int p = m_bank_pos;
+        unsigned int n_out = (n * nph > p) ? (n * nph - p + pstep - 1) / pstep
+                                           : 0;
+        m_bank_pos = p + n_out * pstep - n * nph;
+        return n_out;
+    } else {
+        Sample p = m_pos_frac;
+        Sample pstep = m_downsample;
+        unsigned int i = 0;
+        Sample pf = p;
+        while (unsigned(int(pf)) < n) {
+            i++;
+            pf = p + i * pstep;
+        }
+        m_pos_frac = pf - n;
+        if (m_pos_frac < 0)
+            m_pos_frac = 0;
+        return i;
+    }
+}
+
+
+// Clear the filter history.
+void DownsampleFilter::reset()
+{
+    m_downsample  = m_coeff->downsample;
+    m_pos_int     = 0;
+    m_pos_frac    = 0;
+    m_bank_phases = m_coeff->bank_phases;
+    m_bank_pos    = 0;
+    m_buf.assign(m_order, 0);
+}
+
+
+/** Copy n input samples x[i], or (x[i] * scale * y[i]), to dest. */
+static inline void load_input(Sample *dest, const Sample *x, const Sample *y,
+                              Sample scale, unsigned int n)
+{
+    if (y == NULL) {
+        copy(x, x + n, dest);
+    } else {
+        for (unsigned int i = 0; i < n; i++)
+            dest[i] = x[i] * (scale * y[i]);
+    }
+}
+
+
+// Process input samples.
+void DownsampleFilter::process_input(const Sample *x, const Sample *y,
+                                     Sample scale, unsigned int n,
+                                     SampleVector& samples_out)
+{
+    unsigned int order = m_order;
+    unsigned int chunk = chunk_size;
+    const Sample *coeff = m_coeff->coeff.data();
+
+    // The input is processed in chunks. m_buf holds the last (order)
+    // input samples, followed by the current chunk. Filter kernels are
+    // simple dot products over a contiguous part of m_buf, without
+    // special cases at block boundaries, and the working set stays
+    // in cache.
+    //
+    // Output samples are produced at input position p, relative to the
+    // start of the current chunk, and use m_buf[p .. p+order-1], i.e.
+    // the (order) input samples preceding position p. Fractional
+    // positions additionally use m_buf[p+order].
 
     if (m_downsample_int != 0) {
 
         // Integer downsample factor, no linear interpolation.
         // This is relatively simple.
-
         unsigned int p = m_pos_int;
         unsigned int pstep = m_downsample_int;
 
-        samples_out.resize((n - p + pstep - 1) / pstep);
+        samples_out.resize((n > p) ? (n - p + pstep - 1) / pstep : 0);
+
+        // Fast convolution runs over the whole block, then decimates.
+        if (m_fast)
+            chunk = n;
 
-        // The first few samples need data from m_state.
         unsigned int i = 0;
-        for (; p < n && p < order; p += pstep, i++) {
-            Sample y = 0;
-            for (unsigned int j = 1; j <= p; j++)
-                y += samples_in[p-j] * m_coeff[j];
-            for (unsigned int j = p + 1; j <= order; j++)
-                y += m_state[order+p-j] * m_coeff[j];
-            samples_out[i] = y;
-        }
+        for (unsigned int c0 = 0; c0 < n; c0 += chunk) {
+            unsigned int c = min(chunk, n - c0);
+            m_buf.resize(order + c);
+            load_input(m_buf.data() + order, x + c0, y ? y + c0 : NULL,
+                       scale, c);
+
+            if (m_fast) {
+                m_fast_out.resize(c);
+                m_fast->process(m_buf.data(), m_fast_out.data(), c);
+                for (; p < c; p += pstep, i++)
+                    samples_out[i] = m_fast_out[p];
+            } else if (m_kernel_order != NULL) {
+                for (; p < c; p += pstep, i++)
+                    samples_out[i] = m_kernel_order(coeff, m_buf.data() + p);
+            } else {
+                for (; p < c; p += pstep, i++)
+                    samples_out[i] = dot_product(coeff, m_buf.data() + p,
+                                                 order);
+            }
+            p -= c;
 
-        // Remaining samples only need data from samples_in.
-        for (; p < n; p += pstep, i++) {
-            Sample y = 0;
-            for (unsigned int j = 1; j <= order; j++)
-                y += samples_in[p-j] * m_coeff[j];
-            samples_out[i] = y;
+            copy(m_buf.end() - order, m_buf.end(), m_buf.begin());
         }
 
         assert(i == samples_out.size());
 
         // Update index of start position in text sample block.
-        m_pos_int = p - n;
+        m_pos_int = p;
+
+    } else if (m_bank_phases > 0) {
+
+        // Fractional downsample factor (step / phases) with small integers.
+        // Track the position exactly, in units of (1 / phases) samples,
+        // and use the precomputed kernel for each fractional offset.
+        unsigned int nph = m_bank_phases;
+        unsigned int pstep = m_bank_step;
+        unsigned int len = order + 1;
+        unsigned int p = m_bank_pos;
+
+        unsigned int n_out = (n * nph > p) ? (n * nph - p + pstep - 1) / pstep
+                                           : 0;
+        samples_out.resize(n_out);
+
+        unsigned int i = 0;
+        for (unsigned int c0 = 0; c0 < n; c0 += chunk) {
+            unsigned int c = min(chunk, n - c0);
+            m_buf.resize(order + c);
+            load_input(m_buf.data() + order, x + c0, y ? y + c0 : NULL,
+                       scale, c);
+
+            if (m_kernel_bank != NULL) {
+                for (; p < c * nph; p += pstep, i++) {
+                    unsigned int pi = p / nph;
+                    unsigned int q  = p % nph;
+                    samples_out[i] = m_kernel_bank(
+                        m_coeff->bank.data() + q * len, m_buf.data() + pi);
+                }
+            } else {
+                for (; p < c * nph; p += pstep, i++) {
+                    unsigned int pi = p / nph;
+                    unsigned int q  = p % nph;
+                    samples_out[i] = dot_product(
+                        m_coeff->bank.data() + q * len, m_buf.data() + pi,
+                        len);
+                }
+            }
+            p -= c * nph;
+
+            copy(m_buf.end() - order, m_buf.end(), m_buf.begin());
+        }
+
+        assert(i == n_out);
+        m_bank_pos = p;
 
     } else {
 
-        // Fractional downsample factor via linear interpolation of
-        // the FIR coefficient table. This is a bitch.
+        // Arbitrary fractional downsample factor via linear interpolation
+        // of the FIR coefficient table. Interpolating each coefficient,
+        //   sum_k (k0 * coeff[k] + k1 * coeff[k-1]) * x[pi+k],
+        // is the same as interpolating between two dot products with
+        // the same coefficients at adjacent input offsets.
 
         // Estimate number of output samples we can produce in this run.
         Sample p = m_pos_frac;
@@ -223,21 +1133,32 @@ void DownsampleFilter::process(const SampleVector& samples_in,
         unsigned int i = 0;
         Sample pf = p;
         unsigned int pi = int(pf);
-        while (pi < n) {
-            Sample k1 = pf - pi;
-            Sample k0 = 1 - k1;
-
-            Sample y = 0;
-            for (unsigned int j = 0; j <= order; j++) {
-                Sample k = m_coeff[j] * k0 + m_coeff[j+1] * k1;
-                Sample s = (j <= pi) ? samples_in[pi-j] : m_state[order+pi-j];
-                y += k * s;
+        for (unsigned int c0 = 0; c0 < n; c0 += chunk) {
+            unsigned int c = min(chunk, n - c0);
+            m_buf.resize(order + c);
+            load_input(m_buf.data() + order, x + c0, y ? y + c0 : NULL,
+                       scale, c);
+
+            while (pi < c0 + c) {
+                Sample k1 = pf - pi;
+                Sample k0 = 1 - k1;
+                const Sample *inp = m_buf.data() + (pi - c0);
+                Sample y0, y1;
+                if (m_kernel_order != NULL) {
+                    y0 = m_kernel_order(coeff, inp);
+                    y1 = m_kernel_order(coeff, inp + 1);
+                } else {
+                    y0 = dot_product(coeff, inp, order);
+                    y1 = dot_product(coeff, inp + 1, order);
+                }
+                samples_out[i] = k0 * y0 + k1 * y1;
+
+                i++;
+                pf = p + i * pstep;
+                pi = int(pf);
             }
-            samples_out[i] = y;
 
-            i++;
-            pf = p + i * pstep;
-            pi = int(pf);
+            copy(m_buf.end() - order, m_buf.end(), m_buf.begin());
         }
 
         // We may overestimate the number of samples by 1 or 2.
@@ -251,14 +1172,313 @@ void DownsampleFilter::process(const SampleVector& samples_in,
             m_pos_frac = 0;
     }
 
-    // Update m_state.
-    if (n < order) {
-        copy(m_state.begin() + n, m_state.end(), m_state.begin());
-        copy(samples_in.begin(), samples_in.end(), m_state.end() - n);
+    // Only the history of (order) samples remains in m_buf.
+    m_buf.resize(order);
+}
+
+
+/* ****************  class HybridDownsampleFilter  **************** */
+
+// Compute the filter coefficients.
+shared_ptr<const HybridDownsampleFilter::Coefficients>
+HybridDownsampleFilter::make_coeff(unsigned int filter_order, double cutoff,
+                                   double downsample, bool prefilter)
+{
+    assert(downsample >= 1);
+
+    shared_ptr<Coefficients> result = make_shared<Coefficients>();
+
+    // Keep at least twice the output rate after decimation, so the
+    // fractional FIR filter still has room for its transition band.
+    unsigned int d = prefilter ? max(1, int(downsample / 2)) : 1;
+    result->decimation = d;
+    result->b0 = 1;
+    result->a1 = 0;
+    result->a2 = 0;
+
+    if (d > 1) {
+        typedef complex<double> CDbl;
+
+        // Cutoff well above the audio band, to limit the passband droop
+        // to ~ 0.1 dB.
+        double w = 2 * M_PI * 2.5 * cutoff;
+
+        // Poles 1 and 2 are a conjugate pair.
+        // Continuous domain:
+        //   p_k = w * exp( (2*k + n - 1) / (2*n) * pi * j)
+        CDbl p1s = w * exp((2*1 + 2 - 1) / double(2 * 2) * CDbl(0, M_PI));
+
+        // Map poles to discrete-domain via matched Z transform.
+        CDbl p1z = exp(p1s);
+
+        // Discrete-domain transfer function:
+        //   H(z) = b0 / (1 - (p1+p2)/z + p1*p2/z**2)
+        // with p2 = conj(p1), and b0 for unit DC gain.
+        result->a1 = -2 * real(p1z);
+        result->a2 = abs(p1z*p1z);
+        result->b0 = 1 + result->a1 + result->a2;
+    }
+
+    result->fir = DownsampleFilter::make_coeff(
+        max(2u, filter_order / d), cutoff * d, downsample / d, false);
+
+    return result;
+}
+
+
+// Construct filter from precomputed coefficients.
+HybridDownsampleFilter::HybridDownsampleFilter(
+        shared_ptr<const Coefficients> coeff)
+    : m_coeff(coeff)
+    , m_fir(coeff->fir)
+    , m_phase(0)
+    , m_y1(0)
+    , m_y2(0)
+{ }
+
+
+// Process samples.
+void HybridDownsampleFilter::process(const SampleVector& samples_in,
+                                     SampleVector& samples_out)
+{
+    if (m_coeff->decimation == 1) {
+        m_fir.process(samples_in, samples_out);
     } else {
-        copy(samples_in.end() - order, samples_in.end(), m_state.begin());
+        prefilter(samples_in.data(), NULL, 1, samples_in.size());
+        m_fir.process(m_buf, samples_out);
+    }
+}
+
+
+// Process the product of two signals.
+void HybridDownsampleFilter::process_product(const SampleVector& x,
+                                             const SampleVector& y,
+                                             Sample scale,
+                                             SampleVector& samples_out)
+{
+    if (m_coeff->decimation == 1) {
+        m_fir.process_product(x, y, scale, samples_out);
+    } else {
+        assert(x.size() == y.size());
+        prefilter(x.data(), y.data(), scale, x.size());
+        m_fir.process(m_buf, samples_out);
     }
+}
+
+
+// Set the filter state for a constant input.
+void HybridDownsampleFilter::prime(Sample x)
+{
+    m_y1 = x;
+    m_y2 = x;
+    m_fir.prime(x);
+}
+
+
+// Advance by n input samples without output.
+unsigned int HybridDownsampleFilter::skip(unsigned int n)
+{
+    unsigned int d = m_coeff->decimation;
+    if (d == 1)
+        return m_fir.skip(n);
+
+    // Same decimation phase as prefilter().
+    unsigned int p = m_phase;
+    unsigned int m = (n > p) ? (n - p + d - 1) / d : 0;
+    m_phase = p + m * d - n;
+    return m_fir.skip(m);
+}
+
 
+// Clear the filter state.
+void HybridDownsampleFilter::reset()
+{
+    m_phase = 0;
+    m_y1    = 0;
+    m_y2    = 0;
+    m_fir.reset();
+}
+
+
+// Prefilter and decimate input samples into m_buf.
+void HybridDownsampleFilter::prefilter(const Sample *x, const Sample *y,
+                                       Sample scale, unsigned int n)
+{
+    unsigned int d = m_coeff->decimation;
+    Sample b0 = m_coeff->b0, a1 = m_coeff->a1, a2 = m_coeff->a2;
+    Sample y1 = m_y1, y2 = m_y2;
+
+    // Two samples per step from the state before the pair, so that the
+    // two outputs do not wait for each other:
+    //   y[i]   = b0*x[i] - a1*y[i-1] - a2*y[i-2]
+    //   y[i+1] = b0*x[i+1] - a1*b0*x[i] + (a1^2-a2)*y[i-1] + a1*a2*y[i-2]
+    Sample c0 = -a1 * b0, c1 = a1 * a1 - a2, c2 = a1 * a2;
+
+    m_iir.resize(n);
+    Sample *z = m_iir.data();
+
+    unsigned int i = 0;
+    for (; i + 1 < n; i += 2) {
+        Sample v0 = (y == NULL) ? x[i]   : x[i]   * (scale * y[i]);
+        Sample v1 = (y == NULL) ? x[i+1] : x[i+1] * (scale * y[i+1]);
+        Sample out0 = b0 * v0 - a1 * y1 - a2 * y2;
+        Sample out1 = b0 * v1 + c0 * v0 + c1 * y1 + c2 * y2;
+        z[i]   = out0;
+        z[i+1] = out1;
+        y2 = out0;
+        y1 = out1;
+    }
+    for (; i < n; i++) {
+        Sample v = (y == NULL) ? x[i] : x[i] * (scale * y[i]);
+        Sample out = b0 * v - a1 * y1 - a2 * y2;
+        z[i] = out;
+        y2 = y1;
+        y1 = out;
+    }
+
+    // Keep every d-th output; m_phase is the position of the next one.
+    unsigned int p = m_phase;
+    m_buf.resize((n > p) ? (n - p + d - 1) / d : 0);
+    for (unsigned int k = 0; k < m_buf.size(); k++)
+        m_buf[k] = z[p + k * d];
+
+    m_phase = p + m_buf.size() * d - n;
+    m_y1 = y1;
+    m_y2 = y2;
+}
+
+
+/* ****************  class DriftResampler  **************** */
+
+// Construct resampler with ratio 1.
+DriftResampler::DriftResampler()
+    : m_table(kernel_table())
+{
+    reset();
+}
+
+
+// Return the kernel table.
+const SampleVector& DriftResampler::kernel_table()
+{
+    // Kernel q approximates the input at position (num_taps/2 - 1 + d),
+    // d = q / num_phases, relative to its first tap. The extra kernel
+    // for d = 1 is the interpolation end point of the last interval.
+    static const SampleVector table = []{
+        const double beta = 8.0;
+        const double half = num_taps / 2;
+        SampleVector t((num_phases + 1) * num_taps);
+        for (unsigned int q = 0; q <= num_phases; q++) {
+            double d = double(q) / num_phases;
+            for (unsigned int k = 0; k < num_taps; k++) {
+                double x = k - (half - 1) - d;
+                double r = x / half;
+                double w = (fabs(r) < 1) ?
+                    bessel_i0(beta * sqrt(1 - r * r)) / bessel_i0(beta) : 0;
+                double s = (x == 0) ? 1 : sin(M_PI * x) / (M_PI * x);
+                t[q * num_taps + k] = s * w;
+            }
+        }
+        return t;
+    }();
+    return table;
+}
+
+
+// Change the ratio of input samples to output samples.
+void DriftResampler::set_ratio(double ratio)
+{
+    if (!m_active && ratio != 1) {
+        // The next output sample is the first sample of the next block,
+        // at position num_taps in m_buf.
+        m_active = true;
+        m_pos    = num_taps - (num_taps / 2 - 1);
+    }
+    m_ratio = ratio;
+}
+
+
+// Resample a block in place.
+void DriftResampler::process(SampleVector& samples)
+{
+    unsigned int n = samples.size();
+
+    if (!m_active) {
+        // Pass through, but keep the history for a later start.
+        if (n >= num_taps) {
+            copy(samples.end() - num_taps, samples.end(), m_buf.begin());
+        } else {
+            copy(m_buf.begin() + n, m_buf.end(), m_buf.begin());
+            copy(samples.begin(), samples.end(), m_buf.end() - n);
+        }
+        return;
+    }
+
+    m_buf.resize(num_taps + n);
+    copy(samples.begin(), samples.end(), m_buf.begin() + num_taps);
+
+    // Output positions are (p0 + i * ratio), computed from the start of
+    // the block so that rounding errors do not accumulate. The last
+    // kernel may start at position n, where it ends at the last sample.
+    double p0 = m_pos;
+    double pend = double(n) + 1;
+    unsigned int n_out = (p0 < pend) ? int((pend - p0) / m_ratio) + 2 : 0;
+    samples.resize(n_out);
+
+    unsigned int i = 0;
+    for (double p = p0; p < pend; p = p0 + (++i) * m_ratio) {
+        unsigned int pi = int(p);
+        double u = (p - pi) * num_phases;
+        unsigned int q = min(int(u), int(num_phases) - 1);
+        Sample k1 = u - q;
+        Sample k0 = 1 - k1;
+        const Sample *inp = m_buf.data() + pi;
+        const Sample *kern = m_table.data() + q * num_taps;
+        Sample y0 = dot_product_fixed<num_taps>(kern, inp);
+        Sample y1 = dot_product_fixed<num_taps>(kern + num_taps, inp);
+        samples[i] = k0 * y0 + k1 * y1;
+    }
+
+    assert(i <= n_out);
+    samples.resize(i);
+
+    m_pos = p0 + i * m_ratio - n;
+    copy(m_buf.end() - num_taps, m_buf.end(), m_buf.begin());
+    m_buf.resize(num_taps);
+}
+
+
+// Fill the history with a constant value.
+void DriftResampler::prime(Sample x)
+{
+    fill(m_buf.begin(), m_buf.begin() + num_taps, x);
+}
+
+
+// Advance by n input samples without output.
+unsigned int DriftResampler::skip(unsigned int n)
+{
+    if (!m_active)
+        return n;
+
+    // Same output positions as process().
+    double p0 = m_pos;
+    double pend = double(n) + 1;
+    unsigned int i = 0;
+    for (double p = p0; p < pend; p = p0 + (++i) * m_ratio)
+        ;
+    m_pos = p0 + i * m_ratio - n;
+    return i;
+}
+
+
+// Clear the history and return to ratio 1.
+void DriftResampler::reset()
+{
+    m_active = false;
+    m_ratio  = 1;
+    m_pos    = 0;
+    m_buf.assign(num_taps, 0);
 }
 
 
@@ -268,13 +1488,6 @@ void DownsampleFilter::process(const SampleVector& samples_in,
 LowPassFilterRC::LowPassFilterRC(double timeconst)
     : m_timeconst(timeconst)
     , m_y1(0)
-{
-}
-
-
-// Process samples.
-void LowPassFilterRC::process(const SampleVector& samples_in,
-                              SampleVector& samples_out)
 {
     /*
      * Continuous domain:
@@ -283,8 +1496,17 @@ void LowPassFilterRC::process(const SampleVector& samples_in,
      * Discrete domain:
      *   H(z) = (1 - exp(-1/timeconst)) / (1 - exp(-1/timeconst) / z)
      */
-    Sample a1 = - exp(-1/m_timeconst);;
-    Sample b0 = 1 + a1;
+    m_a1 = - exp(-1/m_timeconst);
+    m_b0 = 1 + m_a1;
+}
+
+
+// Process samples.
+void LowPassFilterRC::process(const SampleVector& samples_in,
+                              SampleVector& samples_out)
+{
+    Sample a1 = m_a1;
+    Sample b0 = m_b0;
 
     unsigned int n = samples_in.size();
     samples_out.resize(n);
@@ -303,8 +1525,8 @@ void LowPassFilterRC::process(const SampleVector& samples_in,
 // Process samples in-place.
 void LowPassFilterRC::process_inplace(SampleVector& samples)
 {
-    Sample a1 = - exp(-1/m_timeconst);;
-    Sample b0 = 1 + a1;
+    Sample a1 = m_a1;
+    Sample b0 = m_b0;
 
     unsigned int n = samples.size();
 
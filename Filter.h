@@ -1,8 +1,36 @@
 #ifndef SOFTFM_FILTER_H
 #define SOFTFM_FILTER_H
 
+#include <memory>
 #include <vector>
 #include "SoftFM.h"
+#include "Fft.h"
+
+
+/** Implementation of the FIR filter loops. */
+enum FirKernel {
+    FIR_KERNEL_AUTO,        // fixed-order kernels where available,
+                            // overlap-save above the crossover
+    FIR_KERNEL_GENERIC,     // loops over a run-time filter order
+    FIR_KERNEL_DIRECT,      // as AUTO, but never overlap-save
+    FIR_KERNEL_FFT          // overlap-save for every filter order
+};
+
+/**
+ * Select the FIR kernels for LowPassFilterFirIQ and DownsampleFilter.
+ *
+ * The filter orders which follow from the standard sample rates have
+ * kernels with the number of taps as a template parameter, which the
+ * compiler unrolls and vectorizes for that exact length; other orders
+ * use the generic loops. Filters longer than the crossover of
+ * OverlapSaveFilter use fast convolution instead. This only affects
+ * filters constructed after the call (mainly for benchmarks). All kinds
+ * give the same results up to rounding.
+ */
+void fir_kernel_select(FirKernel kernel);
+
+/** Return name of the currently selected FIR kernels. */
+const char * fir_kernel_name();
 
 
 /** Fine tuner which shifts the frequency of an IQ signal by a fixed offset. */
@@ -21,6 +49,12 @@ public:
      */
     FineTuner(unsigned int table_size, int freq_shift);
 
+    /**
+     * Change the frequency shift (see constructor) and restart the
+     * oscillator. The table is only reallocated if it grows.
+     */
+    void set_shift(unsigned int table_size, int freq_shift);
+
     /** Process samples. */
     void process(const IQSampleVector& samples_in, IQSampleVector& samples_out);
 
@@ -30,26 +64,265 @@ private:
 };
 
 
+/**
+ * Fast convolution with a real FIR filter by the overlap-save method.
+ *
+ * Computes y[i] = sum_j x[i+j] * coeff[j] (j < taps) for i < n, from
+ * (n + taps - 1) contiguous input samples, like the fixed-order FIR
+ * kernels. The filter history is kept by the caller.
+ *
+ * The input is cut into segments of (fft_size - taps + 1) output samples.
+ * Each segment is transformed, multiplied with the spectrum of the
+ * filter and transformed back; the wrapped-around part of the circular
+ * convolution is not used. The cost per sample grows with log(taps)
+ * instead of taps. Real signals are filtered two segments at a time,
+ * as real and imaginary part of one complex transform.
+ *
+ * The transforms use single precision, as IQSample.
+ */
+class OverlapSaveFilter
+{
+public:
+
+    /**
+     * Minimum number of taps for which overlap-save is faster than the
+     * direct form (measured with softfm_bench, see NOTES.txt).
+     * Filters with decimation compute only every downsample-th output in
+     * direct form, so their crossover is downsample times higher.
+     */
+    static const unsigned int min_taps_iq   = 112;
+    static const unsigned int min_taps_real = 72;
+
+    /** Return true if overlap-save should be used for this filter. */
+    static bool preferred(unsigned int taps, unsigned int min_taps,
+                          unsigned int downsample=1);
+
+    /** Construct filter with (taps) coefficients. */
+    template <class T>
+    OverlapSaveFilter(const T *coeff, unsigned int taps)
+        : OverlapSaveFilter(std::vector<double>(coeff, coeff + taps))
+    { }
+
+    /** Return number of taps. */
+    unsigned int taps() const
+    {
+        return m_taps;
+    }
+
+    /** Filter IQ samples. */
+    void process(const IQSample *x, IQSample *y, unsigned int n);
+
+    /** Filter real samples. */
+    void process(const Sample *x, Sample *y, unsigned int n);
+
+private:
+    explicit OverlapSaveFilter(const std::vector<double>& coeff);
+
+    /**
+     * Replace m_buf by its circular convolution with the filter,
+     * conjugated (the inverse transform is a forward transform of the
+     * conjugate).
+     */
+    void convolve();
+
+    unsigned int        m_taps;
+    Fft                 m_fft;
+    IQSampleVector      m_spectrum;     // conj(FFT(filter)) / fft_size
+    IQSampleVector      m_buf;
+};
+
+
 /** Low-pass filter for IQ samples, based on Lanczos FIR filter. */
 class LowPassFilterFirIQ
 {
 public:
 
+    /** FIR coefficients; immutable, shared between filters. */
+    typedef std::vector<IQSample::value_type> Coefficients;
+
     /**
-     * Construct low-pass filter.
+     * Compute Lanczos FIR coefficients.
      *
      * filter_order :: FIR filter order.
      * cutoff       :: Cutoff frequency relative to the full sample rate
      *                 (valid range 0.0 ... 0.5).
      */
+    static std::shared_ptr<const Coefficients> make_coeff(
+        unsigned int filter_order, double cutoff);
+
+    /** Construct low-pass filter (see make_coeff()). */
     LowPassFilterFirIQ(unsigned int filter_order, double cutoff);
 
+    /** Construct low-pass filter from precomputed coefficients. */
+    explicit LowPassFilterFirIQ(std::shared_ptr<const Coefficients> coeff);
+
     /** Process samples. */
     void process(const IQSampleVector& samples_in, IQSampleVector& samples_out);
 
+    /** Clear the filter history. */
+    void reset();
+
+    /**
+     * Fixed-order kernel, computes y[i] = sum_j x[i+j] * coeff[j]
+     * for i < n.
+     */
+    typedef void (*Kernel)(const IQSample::value_type *coeff,
+                           const IQSample *x, IQSample *y, unsigned int n);
+
 private:
-    std::vector<IQSample::value_type> m_coeff;
+    std::shared_ptr<const Coefficients> m_coeff;
     IQSampleVector  m_state;
+    Kernel          m_kernel;           // NULL for the generic loop
+    std::unique_ptr<OverlapSaveFilter> m_fast;  // NULL for direct form
+    IQSampleVector  m_buf;              // history and input for m_fast
+};
+
+
+/**
+ *  Fine tuner combined with decimating low-pass filter for IQ samples.
+ *
+ *  Step 1: Frequency shift by a table-driven oscillator (as FineTuner)
+ *  Step 2: Low-pass filter based on Lanczos FIR filter
+ *  Step 3: Decimation by an integer factor
+ *
+ *  The filter is evaluated as a polyphase decimator: only the output
+ *  samples which survive decimation are computed, so the cost per input
+ *  sample is (filter_order + 1) / downsample multiply-adds.
+ */
+class DownsampleFilterIQ
+{
+public:
+
+    /**
+     * Construct combined tuner and downsampler.
+     *
+     * table_size   :: Size of internal sin/cos tables (see FineTuner).
+     * freq_shift   :: Frequency shift in units of (sample_rate / table_size).
+     * filter_order :: FIR filter order.
+     * cutoff       :: Cutoff frequency relative to the full input sample rate
+     *                 (valid range 0.0 .. 0.5 / downsample).
+     * downsample   :: Integer decimation factor (>= 1).
+     *
+     * The output sample rate is (input_sample_rate / downsample).
+     */
+    DownsampleFilterIQ(unsigned int table_size, int freq_shift,
+                       unsigned int filter_order, double cutoff,
+                       unsigned int downsample);
+
+    /**
+     * Construct combined tuner and downsampler from precomputed
+     * coefficients (see LowPassFilterFirIQ::make_coeff()).
+     */
+    DownsampleFilterIQ(unsigned int table_size, int freq_shift,
+                       std::shared_ptr<const LowPassFilterFirIQ::Coefficients>
+                           coeff,
+                       unsigned int downsample);
+
+    /** Change the frequency shift (see FineTuner::set_shift()). */
+    void set_shift(unsigned int table_size, int freq_shift);
+
+    /** Process samples. */
+    void process(const IQSampleVector& samples_in, IQSampleVector& samples_out);
+
+    /** Clear the filter history and restart the oscillator. */
+    void reset();
+
+private:
+    unsigned int    m_downsample;
+    unsigned int    m_pos;
+    unsigned int    m_index;
+    IQSampleVector  m_table;
+    std::shared_ptr<const LowPassFilterFirIQ::Coefficients> m_coeff;
+    IQSampleVector  m_buf;
+};
+
+
+/**
+ *  Cascade of half-band decimators for IQ samples.
+ *
+ *  Each stage is a symmetric half-band FIR filter (Kaiser window),
+ *  followed by decimation by 2. Every other coefficient of a half-band
+ *  filter is zero, so a stage with (4*k-1) taps needs only (k+1)
+ *  multiplications per output sample.
+ *
+ *  The length of each stage is chosen for 60 dB rejection of aliases
+ *  into the band [-bandwidth, +bandwidth]. The early stages have a wide
+ *  transition band and need only a few taps; the last stage needs the
+ *  longest filter but runs at the lowest rate. The cost per input sample
+ *  therefore hardly depends on the total decimation factor.
+ */
+class HalfBandDecimatorIQ
+{
+public:
+
+    /**
+     * Construct half-band decimator cascade.
+     *
+     * num_stages   :: Number of stages; the decimation factor is
+     *                 2^num_stages (0 to pass samples unchanged).
+     * bandwidth    :: Half bandwidth of the wanted signal relative to the
+     *                 input sample rate (valid range 0.0 .. 0.2 / 2^(num_stages-1)).
+     */
+    HalfBandDecimatorIQ(unsigned int num_stages, double bandwidth);
+
+    /** Filter coefficients of all stages; immutable, shared. */
+    struct Coefficients
+    {
+        struct StageCoeff
+        {
+            std::vector<IQSample::value_type> coeff;    // non-zero taps,
+                                                        // one side
+            IQSample::value_type center;                // center tap
+        };
+        std::vector<StageCoeff> stages;
+    };
+
+    /** Design the filters of a cascade (see constructor). */
+    static std::shared_ptr<const Coefficients> make_coeff(
+        unsigned int num_stages, double bandwidth);
+
+    /** Construct cascade from precomputed coefficients. */
+    explicit HalfBandDecimatorIQ(std::shared_ptr<const Coefficients> coeff);
+
+    /** Process samples. */
+    void process(const IQSampleVector& samples_in, IQSampleVector& samples_out);
+
+    /** Clear the filter history. */
+    void reset();
+
+    /** Return the total decimation factor. */
+    unsigned int downsample() const
+    {
+        return 1u << m_stages.size();
+    }
+
+    /** Return the number of filter taps (including zeros) of a stage. */
+    unsigned int num_taps(unsigned int stage) const
+    {
+        return 4 * m_coeff->stages[stage].coeff.size() - 1;
+    }
+
+private:
+    /** Number of output samples computed per pass over the buffers. */
+    static const unsigned int chunk_size = 1024;
+
+    /** State of one decimation stage. */
+    struct Stage
+    {
+        unsigned int    pos;
+        IQSampleVector  buf;
+    };
+
+    /** Run one stage. */
+    void process_stage(const Coefficients::StageCoeff& coeff, Stage& stage,
+                       const IQSampleVector& samples_in,
+                       IQSampleVector& samples_out);
+
+    std::shared_ptr<const Coefficients> m_coeff;
+    std::vector<Stage>  m_stages;
+    IQSampleVector      m_tmp[2];
+    std::vector<IQSample::value_type> m_even_re, m_even_im;
+    std::vector<IQSample::value_type> m_out_re, m_out_im;
 };
 
 
@@ -58,6 +331,13 @@ private:
  *
  *  Step 1: Low-pass filter based on Lanczos FIR filter
  *  Step 2: (optional) Decimation by an arbitrary factor (integer or float)
+ *
+ * Input is processed in cache-sized chunks appended to the filter history,
+ * so every output sample is a plain dot product over contiguous memory.
+ * Fractional factors which are a ratio of small integers use a
+ * precomputed bank of interpolated coefficients, one per output phase.
+ * Long filters with an integer factor use OverlapSaveFilter on whole
+ * blocks instead.
  */
 class DownsampleFilter
 {
@@ -78,16 +358,222 @@ public:
     DownsampleFilter(unsigned int filter_order, double cutoff,
                      double downsample=1, bool integer_factor=true);
 
+    /** Filter kernel and polyphase bank; immutable, shared. */
+    struct Coefficients
+    {
+        unsigned int    order;
+        double          downsample;
+        unsigned int    downsample_int;     // 0 for a fractional factor
+        SampleVector    coeff;              // reversed, (order) taps
+        unsigned int    bank_phases;        // 0 if there is no bank
+        unsigned int    bank_step;
+        SampleVector    bank;
+    };
+
+    /** Compute the filter coefficients (see constructor). */
+    static std::shared_ptr<const Coefficients> make_coeff(
+        unsigned int filter_order, double cutoff,
+        double downsample=1, bool integer_factor=true);
+
+    /** Construct filter from precomputed coefficients. */
+    explicit DownsampleFilter(std::shared_ptr<const Coefficients> coeff);
+
     /** Process samples. */
     void process(const SampleVector& samples_in, SampleVector& samples_out);
 
+    /**
+     * Process the product (x[i] * scale * y[i]) of two signals of equal
+     * length. The product is formed while the input is copied into the
+     * filter buffer, so it needs no separate pass over the samples.
+     */
+    void process_product(const SampleVector& x, const SampleVector& y,
+                         Sample scale, SampleVector& samples_out);
+
+    /**
+     * Fill the filter history as if the input had been constant at x
+     * before the first sample, to avoid a start-up transient.
+     */
+    void prime(Sample x);
+
+    /**
+     * Advance the output position as if n input samples had been
+     * processed, without computing output. Return the number of output
+     * samples that process() would have produced. The filter history
+     * is left unchanged; prime() it before processing again.
+     */
+    unsigned int skip(unsigned int n);
+
+    /** Clear the filter history. */
+    void reset();
+
+    /** Fixed-order kernel, returns the dot product of two arrays. */
+    typedef Sample (*Kernel)(const Sample *a, const Sample *b);
+
 private:
+    /** Number of input samples processed per pass over m_buf. */
+    static const unsigned int chunk_size = 4096;
+
+    /**
+     * Process n input samples x[i], or (x[i] * scale * y[i]) if y is
+     * not NULL.
+     */
+    void process_input(const Sample *x, const Sample *y, Sample scale,
+                       unsigned int n, SampleVector& samples_out);
+
+    /** Maximum number of phases in the precomputed polyphase bank. */
+    static const unsigned int max_bank_phases = 64;
+
+    std::shared_ptr<const Coefficients> m_coeff;
+    unsigned int    m_order;
     double          m_downsample;
     unsigned int    m_downsample_int;
     unsigned int    m_pos_int;
     Sample          m_pos_frac;
-    SampleVector    m_coeff;
-    SampleVector    m_state;
+    unsigned int    m_bank_phases;
+    unsigned int    m_bank_step;
+    unsigned int    m_bank_pos;
+    SampleVector    m_buf;
+    Kernel          m_kernel_order;     // (order) taps, or NULL
+    Kernel          m_kernel_bank;      // (order + 1) taps, or NULL
+    std::unique_ptr<OverlapSaveFilter> m_fast;  // integer factor only,
+                                                // NULL for direct form
+    SampleVector    m_fast_out;
+};
+
+
+/**
+ * Downsampler with an IIR prefilter and a short FIR filter.
+ *
+ * Step 1: 2nd order Butterworth low-pass IIR filter
+ * Step 2: Decimation by an integer factor D
+ * Step 3: DownsampleFilter with a fractional factor at the decimated rate
+ *
+ * The transition band of the FIR filter has the same width in Hz as in
+ * a single DownsampleFilter, but at 1/D of the sample rate, so it needs
+ * only 1/D of the taps. The prefilter only has to suppress the signal
+ * which folds into the audio band by the decimation; it causes a small
+ * droop and a phase shift in the passband.
+ *
+ * With D = 1 the prefilter is bypassed and the output is the same as
+ * from a DownsampleFilter with the full filter order.
+ */
+class HybridDownsampleFilter
+{
+public:
+
+    /** Prefilter and FIR coefficients; immutable, shared. */
+    struct Coefficients
+    {
+        unsigned int    decimation;     // 1 if there is no prefilter
+        Sample          b0, a1, a2;     // prefilter
+        std::shared_ptr<const DownsampleFilter::Coefficients> fir;
+    };
+
+    /**
+     * Compute the filter coefficients.
+     *
+     * filter_order :: FIR filter order without prefilter
+     * cutoff       :: Cutoff frequency relative to the full input sample rate
+     *                 (valid range 0.0 .. 0.5)
+     * downsample   :: Fractional decimation factor (>= 1)
+     * prefilter    :: True to use the IIR prefilter with decimation by
+     *                 D = floor(downsample / 2), at least 1
+     */
+    static std::shared_ptr<const Coefficients> make_coeff(
+        unsigned int filter_order, double cutoff,
+        double downsample, bool prefilter);
+
+    /** Construct filter from precomputed coefficients. */
+    explicit HybridDownsampleFilter(
+        std::shared_ptr<const Coefficients> coeff);
+
+    /** Process samples. */
+    void process(const SampleVector& samples_in, SampleVector& samples_out);
+
+    /** Process the product (x[i] * scale * y[i]) of two signals. */
+    void process_product(const SampleVector& x, const SampleVector& y,
+                         Sample scale, SampleVector& samples_out);
+
+    /** Set the filter state as if the input had been constant at x. */
+    void prime(Sample x);
+
+    /** Advance by n input samples without output (see DownsampleFilter). */
+    unsigned int skip(unsigned int n);
+
+    /** Clear the filter state. */
+    void reset();
+
+private:
+    /**
+     * Prefilter and decimate n input samples x[i], or
+     * (x[i] * scale * y[i]) if y is not NULL.
+     */
+    void prefilter(const Sample *x, const Sample *y, Sample scale,
+                   unsigned int n);
+
+    std::shared_ptr<const Coefficients> m_coeff;
+    DownsampleFilter m_fir;
+    unsigned int    m_phase;
+    Sample          m_y1, m_y2;
+    SampleVector    m_iir;
+    SampleVector    m_buf;
+};
+
+
+/**
+ * Resampler for a ratio close to 1, e.g. to compensate clock drift.
+ *
+ * Each output sample is interpolated from 16 input samples with a
+ * Kaiser-windowed sinc kernel. The kernel is tabulated at 128 fractional
+ * offsets, and the two nearest table entries are interpolated linearly.
+ * Up to 0.34 times the sample rate (15 kHz at 44.1 kHz), the error is
+ * about -70 dB. The cost does not depend on the filter in front of it.
+ *
+ * As long as the ratio is exactly 1, samples pass unchanged and without
+ * delay. The first ratio other than 1 starts the interpolator at the
+ * current position; that block is 8 samples (half the kernel) shorter,
+ * but no samples are skipped or repeated.
+ */
+class DriftResampler
+{
+public:
+
+    /** Construct resampler with ratio 1. */
+    DriftResampler();
+
+    /**
+     * Change the ratio of input samples to output samples.
+     * A ratio above 1 produces fewer output samples.
+     */
+    void set_ratio(double ratio);
+
+    /** Resample a block in place. */
+    void process(SampleVector& samples);
+
+    /** Fill the history as if the input had been constant at x. */
+    void prime(Sample x);
+
+    /** Advance by n input samples without output (see DownsampleFilter). */
+    unsigned int skip(unsigned int n);
+
+    /** Clear the history and return to ratio 1 and pass-through. */
+    void reset();
+
+private:
+    /** Number of kernel taps. */
+    static const unsigned int num_taps = 16;
+
+    /** Number of tabulated fractional offsets. */
+    static const unsigned int num_phases = 128;
+
+    /** Return the kernel table, (num_phases + 1) x (num_taps). */
+    static const SampleVector& kernel_table();
+
+    const SampleVector& m_table;
+    bool            m_active;
+    double          m_ratio;
+    double          m_pos;      // position of the next kernel in m_buf
+    SampleVector    m_buf;      // (num_taps) samples history, then input
 };
 
 
@@ -109,8 +595,28 @@ public:
     /** Process samples in-place. */
     void process_inplace(SampleVector& samples);
 
+    /** Process one sample. */
+    Sample process_sample(Sample x)
+    {
+        m_y1 = m_b0 * x - m_a1 * m_y1;
+        return m_y1;
+    }
+
+    /** Set the state to the steady state for a constant input x. */
+    void prime(Sample x)
+    {
+        m_y1 = m_b0 * x / (1 + m_a1);
+    }
+
+    /** Clear the filter state. */
+    void reset()
+    {
+        m_y1 = 0;
+    }
+
 private:
     double  m_timeconst;
+    Sample  m_a1, m_b0;
     Sample  m_y1;
 };
 
@@ -156,6 +662,28 @@ public:
     /** Process samples in-place. */
     void process_inplace(SampleVector& samples);
 
+    /** Process one sample. */
+    Sample process_sample(Sample x)
+    {
+        Sample y = b0 * x + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+        x2 = x1; x1 = x;
+        y2 = y1; y1 = y;
+        return y;
+    }
+
+    /** Set the state to the steady state for a constant input x. */
+    void prime(Sample x)
+    {
+        x1 = x2 = x;
+        y1 = y2 = 0;
+    }
+
+    /** Clear the filter state. */
+    void reset()
+    {
+        prime(0);
+    }
+
 private:
     Sample b0, b1, b2, a1, a2;
     Sample x1, x2, y1, y2;
@@ -1,35 +1,75 @@
 
 #include <cassert>
 #include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <tuple>
 
 #include "FmDecode.h"
 
 using namespace std;
 
 
-/** Fast approximation of atan function. */
-static inline Sample fast_atan(Sample x)
+/**
+ * Fast approximation of atan2 function.
+ *
+ * This function is branch-free so that the compiler can vectorize loops
+ * which call it. The argument is reduced to [0, 1] via min/max of |x| and |y|,
+ * then atan is approximated by an odd polynomial, and the result is mapped
+ * back to the correct octant.
+ *
+ * Polynomial coefficients from Abramowitz and Stegun, 4.4.47 and 4.4.49,
+ * and a 3rd order minimax fit (max error 0.005 rad).
+ */
+template <PhaseDiscriminator::AtanAccuracy accuracy>
+static inline float fast_atan2(float y, float x)
 {
-    // http://stackoverflow.com/questions/7378187/approximating-inverse-trigonometric-funcions
-
-    Sample y = 1;
-    Sample p = 0;
-
-    if (x < 0) {
-        x = -x;
-        y = -1;
+    float ax = fabsf(x);
+    float ay = fabsf(y);
+    float mn = min(ax, ay);
+    float mx = max(ax, ay);
+    float a = mn / max(mx, 1.0e-30f);
+    float s = a * a;
+    float r;
+
+    switch (accuracy) {
+        case PhaseDiscriminator::ATAN_HIGH:
+            r = -0.0161657367f + s * 0.0028662257f;
+            r =  0.0429096138f + s * r;
+            r = -0.0752896400f + s * r;
+            r =  0.1065626393f + s * r;
+            r = -0.1420889944f + s * r;
+            r =  0.1999355085f + s * r;
+            r = -0.3333314528f + s * r;
+            r =  1.0f          + s * r;
+            break;
+        case PhaseDiscriminator::ATAN_MEDIUM:
+            r = -0.0851330f + s * 0.0208351f;
+            r =  0.1801410f + s * r;
+            r = -0.3302995f + s * r;
+            r =  0.9998660f + s * r;
+            break;
+        default:
+            r =  0.97239411f - 0.19194795f * s;
+            break;
     }
+    r *= a;
 
-    if (x > 1) {
-        p = y;
-        y = -y;
-        x = 1 / x;
-    }
+    r = (ay > ax) ? float(M_PI_2) - r : r;
+    r = (x < 0) ? float(M_PI) - r : r;
+    return copysignf(r, y);
+}
 
-    const Sample b = 0.596227;
-    y *= (b*x + x*x) / (1 + 2*b*x + x*x);
 
-    return (y + p) * Sample(M_PI_2);
+/** Compute phase difference of complex samples in batch. */
+template <PhaseDiscriminator::AtanAccuracy accuracy>
+static void phase_batch(const float *re, const float *im, float *phase,
+                        unsigned int n)
+{
+    for (unsigned int i = 0; i < n; i++) {
+        phase[i] = fast_atan2<accuracy>(im[i], re[i]);
+    }
 }
 
 
@@ -38,6 +78,8 @@ static IQSample::value_type rms_level_approx(const IQSampleVector& samples)
 {
     unsigned int n = samples.size();
     n = (n + 63) / 64;
+    if (n == 0)
+        return 0;
 
     IQSample::value_type level = 0;
     for (unsigned int i = 0; i < n; i++) {
@@ -53,8 +95,10 @@ static IQSample::value_type rms_level_approx(const IQSampleVector& samples)
 /* ****************  class PhaseDiscriminator  **************** */
 
 // Construct phase discriminator.
-PhaseDiscriminator::PhaseDiscriminator(double max_freq_dev)
+PhaseDiscriminator::PhaseDiscriminator(double max_freq_dev,
+                                       AtanAccuracy accuracy)
     : m_freq_scale_factor(1.0 / (max_freq_dev * 2.0 * M_PI))
+    , m_accuracy(accuracy)
 { }
 
 
@@ -67,13 +111,54 @@ void PhaseDiscriminator::process(const IQSampleVector& samples_in,
 
     samples_out.resize(n);
 
-    for (unsigned int i = 0; i < n; i++) {
-        IQSample s1(samples_in[i]);
-        IQSample d(conj(s0) * s1);
-// TODO : implement fast approximation of atan2
-        Sample w = atan2(d.imag(), d.real());
-        samples_out[i] = w * m_freq_scale_factor;
-        s0 = s1;
+    if (m_accuracy == ATAN_EXACT) {
+
+        for (unsigned int i = 0; i < n; i++) {
+            IQSample s1(samples_in[i]);
+            IQSample d(conj(s0) * s1);
+            Sample w = atan2(d.imag(), d.real());
+            samples_out[i] = w * m_freq_scale_factor;
+            s0 = s1;
+        }
+
+        m_last_sample = s0;
+        return;
+    }
+
+    // Process samples in small batches: first compute the phase
+    // differences as separate real/imaginary arrays, then run
+    // the polynomial atan2 over the whole batch.
+    const unsigned int batch = 256;
+    float dre[batch], dim[batch], phase[batch];
+
+    for (unsigned int p = 0; p < n; p += batch) {
+        unsigned int k = min(batch, n - p);
+
+        // d = conj(s0) * s1, where s0 is the previous input sample.
+        const float *inp = reinterpret_cast<const float *>(&samples_in[p]);
+        dre[0] = s0.real() * inp[0] + s0.imag() * inp[1];
+        dim[0] = s0.real() * inp[1] - s0.imag() * inp[0];
+        for (unsigned int i = 1; i < k; i++) {
+            dre[i] = inp[2*i-2] * inp[2*i]   + inp[2*i-1] * inp[2*i+1];
+            dim[i] = inp[2*i-2] * inp[2*i+1] - inp[2*i-1] * inp[2*i];
+        }
+        s0 = samples_in[p+k-1];
+
+        switch (m_accuracy) {
+            case ATAN_HIGH:
+                phase_batch<ATAN_HIGH>(dre, dim, phase, k);
+                break;
+            case ATAN_MEDIUM:
+                phase_batch<ATAN_MEDIUM>(dre, dim, phase, k);
+                break;
+            default:
+                phase_batch<ATAN_LOW>(dre, dim, phase, k);
+                break;
+        }
+
+        for (unsigned int i = 0; i < k; i++) {
+            samples_out[p+i] = phase[i] * m_freq_scale_factor;
+        }
     }
 
     m_last_sample = s0;
@@ -105,8 +190,6 @@ PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth, double minsignal)
     // Set valid signal threshold.
     m_minsignal  = minsignal;
     m_lock_delay = int(20.0 / bandwidth);
-    m_lock_cnt   = 0;
-    m_pilot_level = 0;
 
     // Create 2nd order filter for I/Q representation of phase error.
     // Filter has two poles, unit DC gain.
@@ -125,8 +208,22 @@ PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth, double minsignal)
     // the frequency. Then the frequency is integrated to produce the phase.
     // These integrators form the two remaining poles, both at z = 1.
 
+    // The oscillator is advanced by rotating it; the rotation for the
+    // center frequency is precomputed.
+    m_center_freq = freq * 2.0 * M_PI;
+    m_center_cos  = cos(m_center_freq);
+    m_center_sin  = sin(m_center_freq);
+
+    m_sample_cnt = 0;
+    reset();
+}
+
+
+// Restart the loop from the center frequency.
+void PilotPhaseLock::reset()
+{
     // Initialize frequency and phase.
-    m_freq  = freq * 2.0 * M_PI;
+    m_freq  = m_center_freq;
     m_phase = 0;
 
     m_phasor_i1 = 0;
@@ -135,16 +232,20 @@ PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth, double minsignal)
     m_phasor_q2 = 0;
     m_loopfilter_x1 = 0;
 
+    m_lock_cnt    = 0;
+    m_pilot_level = 0;
+
     // Initialize PPS generator.
     m_pilot_periods = 0;
     m_pps_cnt       = 0;
-    m_sample_cnt    = 0;
+    m_pps_events.clear();
 }
 
 
 // Process samples.
 void PilotPhaseLock::process(const SampleVector& samples_in,
-                             SampleVector& samples_out)
+                             SampleVector& samples_out,
+                             IQSampleVector *carrier57)
 {
     unsigned int n = samples_in.size();
 
@@ -156,79 +257,123 @@ void PilotPhaseLock::process(const SampleVector& samples_in,
     if (n > 0)
         m_pilot_level = 1000.0;
 
-    for (unsigned int i = 0; i < n; i++) {
-
-        // Generate locked pilot tone.
-        Sample psin = sin(m_phase);
-        Sample pcos = cos(m_phase);
-
-        // Generate double-frequency output.
-        // sin(2*x) = 2 * sin(x) * cos(x)
-        samples_out[i] = 2 * psin * pcos;
-
-        // Multiply locked tone with input.
-        Sample x = samples_in[i];
-        Sample phasor_i = psin * x;
-        Sample phasor_q = pcos * x;
-
-        // Run IQ phase error through low-pass filter.
-        phasor_i = m_phasor_b0 * phasor_i
-                   - m_phasor_a1 * m_phasor_i1
-                   - m_phasor_a2 * m_phasor_i2;
-        phasor_q = m_phasor_b0 * phasor_q
-                   - m_phasor_a1 * m_phasor_q1
-                   - m_phasor_a2 * m_phasor_q2;
-        m_phasor_i2 = m_phasor_i1;
-        m_phasor_i1 = phasor_i;
-        m_phasor_q2 = m_phasor_q1;
-        m_phasor_q1 = phasor_q;
-
-        // Convert I/Q ratio to estimate of phase error.
-        Sample phase_err;
-        if (phasor_i > abs(phasor_q)) {
-            // We are within +/- 45 degrees from lock.
-            // Use simple linear approximation of arctan.
-            phase_err = phasor_q / phasor_i;
-        } else if (phasor_q > 0) {
-            // We are lagging more than 45 degrees behind the input.
-            phase_err = 1;
-        } else {
-            // We are more than 45 degrees ahead of the input.
-            phase_err = -1;
-        }
+    // The locked pilot tone is stored in samples_out (sine) and
+    // m_osc_cos (cosine), and turned into the output after the loop.
+    m_osc_cos.resize(n);
+
+    for (unsigned int i0 = 0; i0 < n; i0 += rotator_interval) {
+        unsigned int iend = min(n, i0 + rotator_interval);
+
+        // Start the oscillator from the exact phase.
+        double osc_re = cos(m_phase);
+        double osc_im = sin(m_phase);
+
+        for (unsigned int i = i0; i < iend; i++) {
+
+            // Locked pilot tone.
+            Sample psin = osc_im;
+            Sample pcos = osc_re;
+            samples_out[i] = psin;
+            m_osc_cos[i]   = pcos;
+
+            // Multiply locked tone with input.
+            Sample x = samples_in[i];
+            Sample phasor_i = psin * x;
+            Sample phasor_q = pcos * x;
+
+            // Run IQ phase error through low-pass filter.
+            phasor_i = m_phasor_b0 * phasor_i
+                       - m_phasor_a1 * m_phasor_i1
+                       - m_phasor_a2 * m_phasor_i2;
+            phasor_q = m_phasor_b0 * phasor_q
+                       - m_phasor_a1 * m_phasor_q1
+                       - m_phasor_a2 * m_phasor_q2;
+            m_phasor_i2 = m_phasor_i1;
+            m_phasor_i1 = phasor_i;
+            m_phasor_q2 = m_phasor_q1;
+            m_phasor_q1 = phasor_q;
+
+            // Convert I/Q ratio to estimate of phase error.
+            Sample phase_err;
+            if (phasor_i > abs(phasor_q)) {
+                // We are within +/- 45 degrees from lock.
+                // Use simple linear approximation of arctan.
+                phase_err = phasor_q / phasor_i;
+            } else if (phasor_q > 0) {
+                // We are lagging more than 45 degrees behind the input.
+                phase_err = 1;
+            } else {
+                // We are more than 45 degrees ahead of the input.
+                phase_err = -1;
+            }
 
-        // Detect pilot level (conservative).
-        m_pilot_level = min(m_pilot_level, phasor_i);
-
-        // Run phase error through loop filter and update frequency estimate.
-        m_freq += m_loopfilter_b0 * phase_err
-                  + m_loopfilter_b1 * m_loopfilter_x1;
-        m_loopfilter_x1 = phase_err;
-
-        // Limit frequency to allowable range.
-        m_freq = max(m_minfreq, min(m_maxfreq, m_freq));
-
-        // Update locked phase.
-        m_phase += m_freq;
-        if (m_phase > 2.0 * M_PI) {
-            m_phase -= 2.0 * M_PI;
-            m_pilot_periods++;
-
-            // Generate pulse-per-second.
-            if (m_pilot_periods == pilot_frequency) {
-                m_pilot_periods = 0;
-                if (was_locked) {
-                    struct PpsEvent ev;
-                    ev.pps_index      = m_pps_cnt;
-                    ev.sample_index   = m_sample_cnt + i;
-                    ev.block_position = double(i) / double(n);
-                    m_pps_events.push_back(ev);
-                    m_pps_cnt++;
+            // Detect pilot level (conservative).
+            m_pilot_level = min(m_pilot_level, phasor_i);
+
+            // Run phase error through loop filter and update frequency
+            // estimate.
+            m_freq += m_loopfilter_b0 * phase_err
+                      + m_loopfilter_b1 * m_loopfilter_x1;
+            m_loopfilter_x1 = phase_err;
+
+            // Limit frequency to allowable range.
+            m_freq = max(m_minfreq, min(m_maxfreq, m_freq));
+
+            // Update locked phase.
+            m_phase += m_freq;
+            if (m_phase > 2.0 * M_PI) {
+                m_phase -= 2.0 * M_PI;
+                m_pilot_periods++;
+
+                // Generate pulse-per-second.
+                if (m_pilot_periods == pilot_frequency) {
+                    m_pilot_periods = 0;
+                    if (was_locked) {
+                        struct PpsEvent ev;
+                        ev.pps_index      = m_pps_cnt;
+                        ev.sample_index   = m_sample_cnt + i;
+                        ev.block_position = double(i) / double(n);
+                        m_pps_events.push_back(ev);
+                        m_pps_cnt++;
+                    }
                 }
             }
+
+            // Rotate the oscillator by m_freq.
+            // The rotation is the precomputed rotation for the center
+            // frequency times a rotation by the (small) deviation d from
+            // the center, for which the Taylor series is exact to double
+            // precision because |d| <= 2*pi*bandwidth.
+            double d  = m_freq - m_center_freq;
+            double d2 = d * d;
+            double dcos = 1 - d2 * (0.5 - d2 * (1.0 / 24));
+            double dsin = d * (1 - d2 * (1.0 / 6));
+            double rot_re = m_center_cos * dcos - m_center_sin * dsin;
+            double rot_im = m_center_sin * dcos + m_center_cos * dsin;
+            double t = osc_re * rot_re - osc_im * rot_im;
+            osc_im   = osc_im * rot_re + osc_re * rot_im;
+            osc_re   = t;
         }
     }
 
+    // Generate triple-frequency carrier for RDS.
+    // cos(3*x) = cos(x) * (4 * cos(x)^2 - 3)
+    // sin(3*x) = sin(x) * (3 - 4 * sin(x)^2)
+    if (carrier57 != NULL) {
+        carrier57->resize(n);
+        for (unsigned int i = 0; i < n; i++) {
+            Sample s = samples_out[i];
+            Sample c = m_osc_cos[i];
+            (*carrier57)[i] = IQSample(c * (4 * c * c - 3),
+                                       s * (4 * s * s - 3));
+        }
+    }
+
+    // Generate double-frequency output.
+    // sin(2*x) = 2 * sin(x) * cos(x)
+    for (unsigned int i = 0; i < n; i++)
+        samples_out[i] = 2 * samples_out[i] * m_osc_cos[i];
+
     // Update lock status.
     if (2 * m_pilot_level > m_minsignal) {
         if (m_lock_cnt < m_lock_delay)
@@ -249,8 +394,138 @@ void PilotPhaseLock::process(const SampleVector& samples_in,
 }
 
 
+/* ****************  class FmFilterPlan  **************** */
+
+FmFilterPlan::Key::Key(double sample_rate_if, double sample_rate_pcm,
+                       double bandwidth_if, double bandwidth_pcm,
+                       unsigned int downsample, unsigned int if_downsample,
+                       unsigned int halfband_stages,
+                       bool hybrid_resampler)
+    : sample_rate_if(sample_rate_if)
+    , sample_rate_pcm(sample_rate_pcm)
+    , bandwidth_if(bandwidth_if)
+    , bandwidth_pcm(bandwidth_pcm)
+    , downsample(downsample)
+    , if_downsample(if_downsample)
+    , halfband_stages(halfband_stages)
+    , hybrid_resampler(hybrid_resampler)
+{ }
+
+
+bool FmFilterPlan::Key::operator<(const Key& other) const
+{
+    return tie(sample_rate_if, sample_rate_pcm, bandwidth_if, bandwidth_pcm,
+               downsample, if_downsample, halfband_stages,
+               hybrid_resampler) <
+           tie(other.sample_rate_if, other.sample_rate_pcm,
+               other.bandwidth_if, other.bandwidth_pcm,
+               other.downsample, other.if_downsample, other.halfband_stages,
+               other.hybrid_resampler);
+}
+
+
+// Return the plan for the specified parameters.
+shared_ptr<const FmFilterPlan> FmFilterPlan::get(const Key& key)
+{
+    static mutex cache_mutex;
+    static map<Key, shared_ptr<const FmFilterPlan>> cache;
+
+    lock_guard<mutex> lock(cache_mutex);
+    shared_ptr<const FmFilterPlan>& plan = cache[key];
+    if (!plan)
+        plan = make_shared<FmFilterPlan>(key);
+    return plan;
+}
+
+
+// Compute a plan.
+FmFilterPlan::FmFilterPlan(const Key& key)
+    : key(key)
+    , sample_rate_baseband(key.sample_rate_if /
+                           (key.if_downsample << key.halfband_stages) /
+                           key.downsample)
+
+    // IF filter.
+    // After half-band decimation the short filter is much steeper in Hz;
+    // the half-band stages already reject neighbouring stations, so the
+    // cutoff is widened to leave the outer FM sidebands intact.
+    , iffilter(LowPassFilterFirIQ::make_coeff(
+        10,
+        ((key.halfband_stages > 0) ? 1.3 : 1.0) * key.bandwidth_if *
+            (1u << key.halfband_stages) / key.sample_rate_if))
+
+    // Combined tuner and IF downsampler.
+    // The filter order is scaled with the decimation factor such that
+    // the transition band stays well inside the decimated bandwidth.
+    , ifdownsampler(LowPassFilterFirIQ::make_coeff(
+        16 * key.if_downsample,
+        key.bandwidth_if / key.sample_rate_if))
+
+    // Half-band decimator cascade.
+    , halfband(HalfBandDecimatorIQ::make_coeff(
+        key.halfband_stages,
+        key.bandwidth_if / key.sample_rate_if))
+
+    // Baseband downsampler.
+    , resample_baseband(DownsampleFilter::make_coeff(
+        8 * key.downsample, 0.4 / key.downsample, key.downsample, true))
+
+    // Audio resampler, for both the mono and the stereo channel.
+    , resample_audio(HybridDownsampleFilter::make_coeff(
+        int(sample_rate_baseband / 1000.0),                 // filter_order
+        key.bandwidth_pcm / sample_rate_baseband,           // cutoff
+        sample_rate_baseband / key.sample_rate_pcm,         // downsample
+        key.hybrid_resampler))                              // prefilter
+{
+    assert(key.if_downsample == 1 || key.halfband_stages == 0);
+}
+
+
 /* ****************  class FmDecoder  **************** */
 
+/** Measure the time between successive steps of a processing stage. */
+class StageTimer
+{
+public:
+    StageTimer()
+        : m_last(chrono::steady_clock::now())
+    { }
+
+    /** Add the time since the previous step to the specified stage. */
+    void step(double *stage_time, FmDecoder::Stage stage)
+    {
+        chrono::steady_clock::time_point t = chrono::steady_clock::now();
+        double dt = chrono::duration<double>(t - m_last).count();
+        stage_time[stage] = max(stage_time[stage], 0.0) + dt;
+        m_last = t;
+    }
+
+private:
+    chrono::steady_clock::time_point m_last;
+};
+
+
+/**
+ * Return size of the tuning table.
+ *
+ * The table determines the tuning resolution. The default of 64 entries
+ * is enough for the standard quarter-sample-rate offset; arbitrary
+ * offsets (multi-station mode) need a larger table to get within 1 kHz.
+ */
+static int tuning_table_size(double sample_rate_if, double tuning_offset)
+{
+    int size = 64;
+    while (size < 65536) {
+        double step = sample_rate_if / size;
+        double err  = fabs(tuning_offset - step * rint(tuning_offset / step));
+        if (err <= 1000)
+            break;
+        size *= 2;
+    }
+    return size;
+}
+
+
 FmDecoder::FmDecoder(double sample_rate_if,
                      double tuning_offset,
                      double sample_rate_pcm,
@@ -259,51 +534,62 @@ FmDecoder::FmDecoder(double sample_rate_if,
                      double bandwidth_if,
                      double freq_dev,
                      double bandwidth_pcm,
-                     unsigned int downsample)
+                     unsigned int downsample,
+                     unsigned int if_downsample,
+                     unsigned int halfband_stages,
+                     PhaseDiscriminator::AtanAccuracy atan_accuracy,
+                     bool   pipelined,
+                     bool   hybrid_resampler)
 
     // Initialize member fields
-    : m_sample_rate_if(sample_rate_if)
-    , m_sample_rate_baseband(sample_rate_if / downsample)
-    , m_tuning_table_size(64)
-    , m_tuning_shift(lrint(-64.0 * tuning_offset / sample_rate_if))
+    : m_plan(FmFilterPlan::get(FmFilterPlan::Key(
+        sample_rate_if, sample_rate_pcm, bandwidth_if, bandwidth_pcm,
+        downsample, if_downsample, halfband_stages, hybrid_resampler)))
+    , m_sample_rate_if(sample_rate_if)
+    , m_sample_rate_baseband(m_plan->sample_rate_baseband)
+    , m_tuning_table_size(tuning_table_size(sample_rate_if, tuning_offset))
+    , m_tuning_shift(lrint(-double(m_tuning_table_size) * tuning_offset /
+                           sample_rate_if))
     , m_freq_dev(freq_dev)
     , m_downsample(downsample)
+    , m_if_downsample(if_downsample)
+    , m_halfband_stages(halfband_stages)
     , m_stereo_enabled(stereo)
-    , m_stereo_detected(false)
+    , m_pipelined(pipelined)
     , m_if_level(0)
     , m_baseband_mean(0)
     , m_baseband_level(0)
-
-    // Construct FineTuner
+    , m_audio_level(0)
+    , m_prime(false)
+    , m_resample_ratio(1)
+    , m_audio_ratio(1)
+    , m_squelch_level(0)
+    , m_squelch_open(true)
+    , m_squelch_restart(false)
+
+    // Construct filters from the plan.
     , m_finetuner(m_tuning_table_size, m_tuning_shift)
-
-    // Construct LowPassFilterFirIQ
-    , m_iffilter(10, bandwidth_if / sample_rate_if)
+    , m_iffilter(m_plan->iffilter)
+    , m_ifdownsampler(m_tuning_table_size, m_tuning_shift,
+                      m_plan->ifdownsampler, if_downsample)
+    , m_halfband(m_plan->halfband)
 
     // Construct PhaseDiscriminator
-    , m_phasedisc(freq_dev / sample_rate_if)
+    , m_phasedisc(freq_dev * (if_downsample << halfband_stages) /
+                  sample_rate_if,
+                  atan_accuracy)
 
     // Construct DownsampleFilter for baseband
-    , m_resample_baseband(8 * downsample, 0.4 / downsample, downsample, true)
+    , m_resample_baseband(m_plan->resample_baseband)
 
     // Construct PilotPhaseLock
     , m_pilotpll(pilot_freq / m_sample_rate_baseband,       // freq
                  50 / m_sample_rate_baseband,               // bandwidth
                  0.04)                                      // minsignal
 
-    // Construct DownsampleFilter for mono channel
-    , m_resample_mono(
-        int(m_sample_rate_baseband / 1000.0),               // filter_order
-        bandwidth_pcm / m_sample_rate_baseband,             // cutoff
-        m_sample_rate_baseband / sample_rate_pcm,           // downsample
-        false)                                              // integer_factor
-
-    // Construct DownsampleFilter for stereo channel
-    , m_resample_stereo(
-        int(m_sample_rate_baseband / 1000.0),               // filter_order
-        bandwidth_pcm / m_sample_rate_baseband,             // cutoff
-        m_sample_rate_baseband / sample_rate_pcm,           // downsample
-        false)                                              // integer_factor
+    // Construct HybridDownsampleFilter for mono and stereo channel
+    , m_resample_mono(m_plan->resample_audio)
+    , m_resample_stereo(m_plan->resample_audio)
 
     // Construct HighPassFilterIir
     , m_dcblock_mono(30.0 / sample_rate_pcm)
@@ -315,133 +601,635 @@ FmDecoder::FmDecoder(double sample_rate_if,
     , m_deemph_stereo(
         (deemphasis == 0) ? 1.0 : (deemphasis * sample_rate_pcm * 1.0e-6))
 
+    // Prepare pipeline.
+    , m_blocks(pipelined ? pipeline_depth : 1)
+    , m_pipe_head(0)
+    , m_pipe_tail(0)
+    , m_pipe_quit(false)
+    , m_mono_quit(false)
+    , m_mono_request(NULL)
+    , m_mono_done(false)
+
+{
+    reset_status();
+
+    for (Block& blk : m_blocks) {
+        blk.state = BLOCK_FREE;
+        blk.prime = false;
+        blk.resample_ratio = 1;
+        blk.squelch_level = 0;
+    }
+
+    // Start worker threads.
+    if (m_pipelined) {
+        m_if_thread    = thread(&FmDecoder::if_worker, this);
+        m_audio_thread = thread(&FmDecoder::audio_worker, this);
+        if (m_stereo_enabled)
+            m_mono_thread = thread(&FmDecoder::mono_worker, this);
+    }
+}
+
+
+// Return number of half-band stages for an IF sample rate.
+unsigned int FmDecoder::choose_halfband_stages(double sample_rate_if,
+                                               double bandwidth_if)
+{
+    unsigned int stages = 0;
+    while (sample_rate_if / (2u << stages) >= 3 * bandwidth_if)
+        stages++;
+    return stages;
+}
+
+
+// Stop worker threads.
+FmDecoder::~FmDecoder()
 {
-    // nothing more to do
+    {
+        lock_guard<mutex> lock(m_pipe_mutex);
+        m_pipe_quit = true;
+    }
+    m_pipe_cond.notify_all();
+
+    if (m_if_thread.joinable())
+        m_if_thread.join();
+    if (m_audio_thread.joinable())
+        m_audio_thread.join();
+
+    // The audio thread may have been waiting for the mono chain of a
+    // block which was still in flight; stop the mono thread only now.
+    {
+        lock_guard<mutex> lock(m_pipe_mutex);
+        m_mono_quit = true;
+    }
+    m_pipe_cond.notify_all();
+
+    if (m_mono_thread.joinable())
+        m_mono_thread.join();
+}
+
+
+// Enable RDS decoding.
+void FmDecoder::enable_rds(RdsDecoder::GroupCallback callback)
+{
+    m_rds_callback = callback;
+    m_rds.reset(new RdsDecoder(m_sample_rate_baseband, callback));
+}
+
+
+// Tune to another station.
+void FmDecoder::retune(double tuning_offset)
+{
+    // The worker threads are idle when no blocks are pending.
+    assert(pending_blocks() == 0);
+
+    m_tuning_table_size = tuning_table_size(m_sample_rate_if, tuning_offset);
+    m_tuning_shift = lrint(-double(m_tuning_table_size) * tuning_offset /
+                           m_sample_rate_if);
+    if (m_if_downsample > 1)
+        m_ifdownsampler.set_shift(m_tuning_table_size, m_tuning_shift);
+    else
+        m_finetuner.set_shift(m_tuning_table_size, m_tuning_shift);
+
+    // Clear the state of all filters.
+    m_ifdownsampler.reset();
+    m_iffilter.reset();
+    m_halfband.reset();
+    m_phasedisc.prime(IQSample(0));
+    m_resample_baseband.reset();
+    reset_audio_chain();
+    m_squelch_open    = true;
+    m_squelch_restart = false;
+
+    m_if_level       = 0;
+    m_baseband_mean  = 0;
+    m_baseband_level = 0;
+    m_audio_level    = 0;
+    m_prime          = false;
+    reset_status();
+
+    // Restart RDS; the queued blocks belong to the old station.
+    if (m_rds)
+        m_rds.reset(new RdsDecoder(m_sample_rate_baseband, m_rds_callback));
 }
 
 
 void FmDecoder::process(const IQSampleVector& samples_in,
                         SampleVector& audio)
 {
-    // Fine tuning.
-    m_finetuner.process(samples_in, m_buf_iftuned);
+    if (!m_pipelined) {
+
+        // Run both stages directly.
+        Block& blk = m_blocks[0];
+        blk.resample_ratio = m_resample_ratio;
+        blk.squelch_level  = m_squelch_level;
+        process_if(samples_in, blk);
+        process_audio(blk);
+
+        // Swap rather than copy; the caller's buffer becomes the
+        // output buffer for the next block.
+        swap(audio, blk.audio);
+        m_status = blk.status;
+        record_stage_times(m_status);
+
+        return;
+    }
+
+    // Queue new input block.
+    // We never keep more than (pipeline_depth - 1) blocks pending between
+    // calls, so the next slot is always free.
+    if (!samples_in.empty()) {
+        Block& blk = m_blocks[m_pipe_head % pipeline_depth];
+        assert(blk.state == BLOCK_FREE);
+        blk.samples_in.assign(samples_in.begin(), samples_in.end());
+        blk.resample_ratio = m_resample_ratio;
+        blk.squelch_level  = m_squelch_level;
+        {
+            lock_guard<mutex> lock(m_pipe_mutex);
+            blk.state = BLOCK_IF;
+        }
+        m_pipe_cond.notify_all();
+        m_pipe_head++;
+    }
+
+    // Return oldest block when the pipeline is full, or when flushing.
+    unsigned int pending = m_pipe_head - m_pipe_tail;
+    if (pending == pipeline_depth || (samples_in.empty() && pending > 0)) {
+        Block& blk = m_blocks[m_pipe_tail % pipeline_depth];
+        {
+            unique_lock<mutex> lock(m_pipe_mutex);
+            m_pipe_cond.wait(lock, [&blk]{ return blk.state == BLOCK_DONE; });
+            blk.state = BLOCK_FREE;
+        }
+        swap(audio, blk.audio);
+        m_status = blk.status;
+        record_stage_times(m_status);
+        m_pipe_tail++;
+    } else {
+        audio.clear();
+    }
+}
 
-    // Low pass filter to isolate station.
-    m_iffilter.process(m_buf_iftuned, m_buf_iffiltered);
+
+// Worker thread running the IF stage.
+void FmDecoder::if_worker()
+{
+    for (unsigned int k = 0; ; k = (k + 1) % pipeline_depth) {
+        Block& blk = m_blocks[k];
+        {
+            unique_lock<mutex> lock(m_pipe_mutex);
+            m_pipe_cond.wait(lock, [this,&blk]{
+                return m_pipe_quit || blk.state == BLOCK_IF; });
+            if (m_pipe_quit)
+                return;
+        }
+        process_if(blk.samples_in, blk);
+        {
+            lock_guard<mutex> lock(m_pipe_mutex);
+            blk.state = BLOCK_AUDIO;
+        }
+        m_pipe_cond.notify_all();
+    }
+}
+
+
+// Worker thread running the audio stage.
+void FmDecoder::audio_worker()
+{
+    for (unsigned int k = 0; ; k = (k + 1) % pipeline_depth) {
+        Block& blk = m_blocks[k];
+        {
+            unique_lock<mutex> lock(m_pipe_mutex);
+            m_pipe_cond.wait(lock, [this,&blk]{
+                return m_pipe_quit || blk.state == BLOCK_AUDIO; });
+            if (m_pipe_quit)
+                return;
+        }
+        process_audio(blk);
+        {
+            lock_guard<mutex> lock(m_pipe_mutex);
+            blk.state = BLOCK_DONE;
+        }
+        m_pipe_cond.notify_all();
+    }
+}
+
+
+// Worker thread running the mono chain in parallel with stereo.
+void FmDecoder::mono_worker()
+{
+    for (;;) {
+        const SampleVector *samples_baseband;
+        {
+            unique_lock<mutex> lock(m_pipe_mutex);
+            m_pipe_cond.wait(lock, [this]{
+                return m_mono_quit || m_mono_request != NULL; });
+            if (m_mono_request == NULL)
+                return;
+            samples_baseband = m_mono_request;
+            m_mono_request = NULL;
+        }
+        process_mono(*samples_baseband, m_mono_time);
+        {
+            lock_guard<mutex> lock(m_pipe_mutex);
+            m_mono_done = true;
+        }
+        m_pipe_cond.notify_all();
+    }
+}
+
+
+// IF stage: tuning, IF filter, phase discriminator, baseband downsampling.
+void FmDecoder::process_if(const IQSampleVector& samples_in, Block& blk)
+{
+    double *stage_time = blk.status.stage_time;
+    fill(stage_time, stage_time + num_stages, -1.0);
+
+    StageTimer total_timer;
+    StageTimer timer;
+
+    if (m_if_downsample > 1) {
+
+        // Fine tuning, low pass filter and decimation in one step.
+        m_ifdownsampler.process(samples_in, m_buf_iffiltered);
+
+    } else {
+
+        // Fine tuning.
+        m_finetuner.process(samples_in, m_buf_iftuned);
+        timer.step(stage_time, STAGE_TUNER);
+
+        // Optionally reduce the sample rate with half-band filters.
+        const IQSampleVector *if_samples = &m_buf_iftuned;
+        if (m_halfband_stages > 0) {
+            m_halfband.process(m_buf_iftuned, m_buf_ifdecimated);
+            if_samples = &m_buf_ifdecimated;
+        }
+
+        // Low pass filter to isolate station.
+        m_iffilter.process(*if_samples, m_buf_iffiltered);
+    }
+
+    // Prime the filters with the first block that has any samples.
+    bool prime = m_prime && !m_buf_iffiltered.empty();
+    blk.prime = prime;
+    if (prime) {
+        m_phasedisc.prime(m_buf_iffiltered[0]);
+        m_prime = false;
+    }
 
     // Measure IF level.
+    // A short last block of a file may leave no samples after decimation;
+    // it does not change the levels.
     double if_rms = rms_level_approx(m_buf_iffiltered);
-    m_if_level = 0.95 * m_if_level + 0.05 * if_rms;
+    if (!m_buf_iffiltered.empty())
+        m_if_level = prime ? if_rms : (0.95 * m_if_level + 0.05 * if_rms);
+    timer.step(stage_time, STAGE_IF_FILTER);
 
     // Extract carrier frequency.
     m_phasedisc.process(m_buf_iffiltered, m_buf_baseband);
+    timer.step(stage_time, STAGE_DISCRIMINATOR);
 
     // Downsample baseband signal to reduce processing.
     if (m_downsample > 1) {
-        SampleVector tmp(move(m_buf_baseband));
-        m_resample_baseband.process(tmp, m_buf_baseband);
+        if (prime) {
+            // Start from the average frequency offset of this block.
+            double mean, rms;
+            samples_mean_rms(m_buf_baseband, mean, rms);
+            m_resample_baseband.prime(mean);
+        }
+        m_resample_baseband.process(m_buf_baseband, blk.baseband);
+    } else {
+        swap(blk.baseband, m_buf_baseband);
     }
 
     // Measure baseband level.
     double baseband_mean, baseband_rms;
-    samples_mean_rms(m_buf_baseband, baseband_mean, baseband_rms);
-    m_baseband_mean  = 0.95 * m_baseband_mean + 0.05 * baseband_mean;
-    m_baseband_level = 0.95 * m_baseband_level + 0.05 * baseband_rms;
-
-    // Extract mono audio signal.
-    m_resample_mono.process(m_buf_baseband, m_buf_mono);
+    samples_mean_rms(blk.baseband, baseband_mean, baseband_rms);
+    if (prime) {
+        m_baseband_mean  = baseband_mean;
+        m_baseband_level = baseband_rms;
+    } else if (!blk.baseband.empty()) {
+        m_baseband_mean  = 0.95 * m_baseband_mean + 0.05 * baseband_mean;
+        m_baseband_level = 0.95 * m_baseband_level + 0.05 * baseband_rms;
+    }
+    timer.step(stage_time, STAGE_RESAMPLE);
 
-    // DC blocking and de-emphasis.
-    m_dcblock_mono.process_inplace(m_buf_mono);
-    m_deemph_mono.process_inplace(m_buf_mono);
+    blk.status.if_level       = m_if_level;
+    blk.status.if_block_level = m_buf_iffiltered.empty() ? m_if_level : if_rms;
+    blk.status.baseband_mean  = m_baseband_mean;
+    blk.status.baseband_level = m_baseband_level;
 
-    if (m_stereo_enabled) {
+    total_timer.step(stage_time, STAGE_TOTAL);
+}
 
-        // Lock on stereo pilot.
-        m_pilotpll.process(m_buf_baseband, m_buf_rawstereo);
-        m_stereo_detected = m_pilotpll.locked();
 
-        // Demodulate stereo signal.
-        demod_stereo(m_buf_baseband, m_buf_rawstereo);
+// Audio stage: mono and stereo audio chains.
+void FmDecoder::process_audio(Block& blk)
+{
+    double *stage_time = blk.status.stage_time;
 
-        // Extract audio and downsample.
-        // NOTE: This MUST be done even if no stereo signal is detected yet,
-        // because the downsamplers for mono and stereo signal must be
-        // kept in sync.
-        m_resample_stereo.process(m_buf_rawstereo, m_buf_stereo);
+    StageTimer total_timer;
 
-        // DC blocking and de-emphasis.
-        m_dcblock_stereo.process_inplace(m_buf_stereo);
-        m_deemph_stereo.process_inplace(m_buf_stereo);
+    fill(m_mono_time, m_mono_time + num_stages, -1.0);
 
-        if (m_stereo_detected) {
+    // Apply a new resampling ratio to both chains at the same block,
+    // so they keep producing the same number of samples.
+    if (blk.resample_ratio != m_audio_ratio) {
+        m_drift_mono.set_ratio(blk.resample_ratio);
+        m_drift_stereo.set_ratio(blk.resample_ratio);
+        m_audio_ratio = blk.resample_ratio;
+    }
 
-            // Extract left/right channels from mono/stereo signals.
-            stereo_to_left_right(m_buf_mono, m_buf_stereo, audio);
+    // Skip the audio chain while the squelch is closed.
+    blk.status.squelched = update_squelch(blk);
+    if (blk.status.squelched) {
+        total_timer.step(stage_time, STAGE_TOTAL);
+        return;
+    }
 
-        } else {
+    // Prime the mono chain with the frequency offset of the first block,
+    // so the DC blocking filter does not have to settle. The stereo
+    // signal has no DC component, so zero is the right initial state.
+    bool prime = blk.prime || m_squelch_restart;
+    if (m_squelch_restart) {
+        restart_audio_chain();
+        m_squelch_restart = false;
+    }
+    if (prime) {
+        m_resample_mono.prime(blk.status.baseband_mean);
+        m_drift_mono.prime(blk.status.baseband_mean);
+        m_dcblock_mono.prime(blk.status.baseband_mean);
+    }
 
-            // Duplicate mono signal in left/right channels.
-            mono_to_left_right(m_buf_mono, audio);
+    if (m_stereo_enabled && m_pipelined) {
 
+        // The mono and stereo chains are independent;
+        // run the mono chain in its own thread.
+        {
+            lock_guard<mutex> lock(m_pipe_mutex);
+            m_mono_request = &blk.baseband;
+            m_mono_done = false;
         }
+        m_pipe_cond.notify_all();
+
+        process_stereo(blk.baseband, stage_time);
+
+        unique_lock<mutex> lock(m_pipe_mutex);
+        m_pipe_cond.wait(lock, [this]{ return m_mono_done; });
 
     } else {
 
-        // Just return mono channel.
-        audio = move(m_buf_mono);
+        process_mono(blk.baseband, m_mono_time);
+        if (m_stereo_enabled)
+            process_stereo(blk.baseband, stage_time);
+        else if (m_rds)
+            process_pilot(blk.baseband, stage_time);
+
+    }
 
+    // Add the time of the mono chain.
+    for (int k = 0; k < num_stages; k++) {
+        if (m_mono_time[k] >= 0)
+            stage_time[k] = max(stage_time[k], 0.0) + m_mono_time[k];
     }
+
+    bool stereo_detected = m_stereo_enabled && m_pilotpll.locked();
+
+    blk.status.stereo_detected = stereo_detected;
+    blk.status.pilot_level     = m_pilotpll.get_pilot_level();
+    blk.status.pps_events      = m_pilotpll.get_pps_events();
+
+    // DC blocking, de-emphasis, left/right channels and audio level.
+    StageTimer timer;
+    double audio_rms;
+    postprocess_audio(stereo_detected, blk.audio, audio_rms);
+    if (!blk.audio.empty()) {
+        m_audio_level = prime ? audio_rms
+                              : (0.95 * m_audio_level + 0.05 * audio_rms);
+    }
+    blk.status.audio_level = m_audio_level;
+    timer.step(stage_time, STAGE_DEEMPHASIS);
+
+    total_timer.step(stage_time, STAGE_TOTAL);
 }
 
 
-// Demodulate stereo L-R signal.
-void FmDecoder::demod_stereo(const SampleVector& samples_baseband,
-                             SampleVector& samples_rawstereo)
+// Update the squelch state for a block.
+bool FmDecoder::update_squelch(Block& blk)
 {
-    // Just multiply the baseband signal with the double-frequency pilot.
-    // And multiply by two to get the full amplitude.
-    // That's all.
+    if (blk.squelch_level <= 0) {
+        m_squelch_open = true;
+        return false;
+    }
 
-    unsigned int n = samples_baseband.size();
-    assert(n == samples_rawstereo.size());
+    // Open at the squelch level, close 3 dB below it.
+    double level = blk.status.if_block_level;
+    if (m_squelch_open) {
+        m_squelch_open = (level >= blk.squelch_level * M_SQRT1_2);
+        if (m_squelch_open)
+            return false;
+    } else if (level >= blk.squelch_level) {
+        m_squelch_open    = true;
+        m_squelch_restart = true;
+        return false;
+    }
 
-    for (unsigned int i = 0; i < n; i++) {
-        samples_rawstereo[i] *= 2 * samples_baseband[i];
+    // Return silence with the same number of samples as the audio chain,
+    // and advance its resampling positions as if it had processed the
+    // block. The audio timeline does not shift when the squelch opens.
+    unsigned int n_in = blk.baseband.size();
+    unsigned int n = m_drift_mono.skip(m_resample_mono.skip(n_in));
+    if (m_stereo_enabled)
+        m_drift_stereo.skip(m_resample_stereo.skip(n_in));
+    blk.audio.assign(m_stereo_enabled ? 2 * n : n, 0);
+
+    blk.status.stereo_detected = false;
+    blk.status.pilot_level     = 0;
+    blk.status.pps_events.clear();
+    m_audio_level = 0;
+    blk.status.audio_level     = 0;
+    return true;
+}
+
+
+// Mono audio chain.
+void FmDecoder::process_mono(const SampleVector& samples_baseband,
+                             double *stage_time)
+{
+    StageTimer timer;
+
+    // Extract mono audio signal.
+    // DC blocking and de-emphasis follow in postprocess_audio().
+    m_resample_mono.process(samples_baseband, m_buf_mono);
+    m_drift_mono.process(m_buf_mono);
+    timer.step(stage_time, STAGE_RESAMPLE);
+}
+
+
+// Pilot PLL and RDS hand-over.
+void FmDecoder::process_pilot(const SampleVector& samples_baseband,
+                              double *stage_time)
+{
+    StageTimer timer;
+
+    // Lock on stereo pilot.
+    m_pilotpll.process(samples_baseband, m_buf_pilot38,
+                       m_rds ? &m_buf_carrier57 : NULL);
+    timer.step(stage_time, STAGE_PLL);
+
+    // Hand the baseband over to the RDS decoder.
+    if (m_rds) {
+        m_rds->process(samples_baseband, m_buf_carrier57);
+        timer.step(stage_time, STAGE_RDS);
     }
 }
 
 
-// Duplicate mono signal in left/right channels.
-void FmDecoder::mono_to_left_right(const SampleVector& samples_mono,
-                                   SampleVector& audio)
+// Stereo audio chain.
+void FmDecoder::process_stereo(const SampleVector& samples_baseband,
+                               double *stage_time)
 {
-    unsigned int n = samples_mono.size();
+    process_pilot(samples_baseband, stage_time);
+
+    StageTimer timer;
+
+    // Demodulate stereo signal, extract audio and downsample.
+    // Demodulation just multiplies the baseband signal with the
+    // double-frequency pilot, and by two to get the full amplitude;
+    // the resampler does this while loading its input.
+    // NOTE: This MUST be done even if no stereo signal is detected yet,
+    // because the downsamplers for mono and stereo signal must be
+    // kept in sync.
+    m_resample_stereo.process_product(m_buf_pilot38, samples_baseband, 2,
+                                      m_buf_stereo);
+    m_drift_stereo.process(m_buf_stereo);
+    timer.step(stage_time, STAGE_RESAMPLE);
+
+    // DC blocking and de-emphasis follow in postprocess_audio().
+}
 
-    audio.resize(2*n);
-    for (unsigned int i = 0; i < n; i++) {
-        Sample m = samples_mono[i];
-        audio[2*i]   = m;
-        audio[2*i+1] = m;
+
+// Restart the audio stage after the squelch opens.
+void FmDecoder::restart_audio_chain()
+{
+    // Keep the resampling positions, which update_squelch() advanced
+    // while the squelch was closed; only the signal history is stale.
+    // The mono chain is primed with the baseband mean by the caller.
+    m_pilotpll.reset();
+    m_resample_stereo.prime(0);
+    m_drift_stereo.prime(0);
+    m_dcblock_mono.reset();
+    m_dcblock_stereo.reset();
+    m_deemph_mono.reset();
+    m_deemph_stereo.reset();
+}
+
+
+// Reset the filters of the audio stage.
+void FmDecoder::reset_audio_chain()
+{
+    m_pilotpll.reset();
+    m_resample_mono.reset();
+    m_resample_stereo.reset();
+    m_drift_mono.reset();
+    m_drift_stereo.reset();
+    m_dcblock_mono.reset();
+    m_dcblock_stereo.reset();
+    m_deemph_mono.reset();
+    m_deemph_stereo.reset();
+
+    // The drift resamplers are back at ratio 1; the requested
+    // ratio is applied again with the next block.
+    m_audio_ratio = 1;
+}
+
+
+// Reset the status of the most recently returned block.
+void FmDecoder::reset_status()
+{
+    m_status.if_level        = 0;
+    m_status.if_block_level  = 0;
+    m_status.baseband_mean   = 0;
+    m_status.baseband_level  = 0;
+    m_status.audio_level     = 0;
+    m_status.pilot_level     = 0;
+    m_status.stereo_detected = false;
+    m_status.squelched       = false;
+    m_status.pps_events.clear();
+    fill(m_status.stage_time, m_status.stage_time + num_stages, -1.0);
+}
+
+
+// Record stage times of a returned block.
+void FmDecoder::record_stage_times(const BlockStatus& status)
+{
+    for (int k = 0; k < num_stages; k++) {
+        if (status.stage_time[k] >= 0)
+            m_stage_stats[k].add(status.stage_time[k]);
     }
 }
 
 
-// Extract left/right channels from mono/stereo signals.
-void FmDecoder::stereo_to_left_right(const SampleVector& samples_mono,
-                                     const SampleVector& samples_stereo,
-                                     SampleVector& audio)
+// Return short name of a stage.
+const char * FmDecoder::stage_name(Stage stage)
 {
-    unsigned int n = samples_mono.size();
-    assert(n == samples_stereo.size());
+    switch (stage) {
+        case STAGE_TUNER:           return "tuner";
+        case STAGE_IF_FILTER:       return "if_filter";
+        case STAGE_DISCRIMINATOR:   return "discriminator";
+        case STAGE_RESAMPLE:        return "resample";
+        case STAGE_PLL:             return "pll";
+        case STAGE_RDS:             return "rds";
+        case STAGE_DEEMPHASIS:      return "deemphasis";
+        case STAGE_TOTAL:           return "total";
+        default:                    return "unknown";
+    }
+}
+
+
+// Finish audio in a single pass.
+void FmDecoder::postprocess_audio(bool stereo_detected, SampleVector& audio,
+                                  double& audio_rms)
+{
+    unsigned int n = m_buf_mono.size();
+    double vsumsq = 0;
+
+    if (!m_stereo_enabled) {
+
+        // Just return mono channel.
+        audio.resize(n);
+        for (unsigned int i = 0; i < n; i++) {
+            Sample m = m_deemph_mono.process_sample(
+                           m_dcblock_mono.process_sample(m_buf_mono[i]));
+            audio[i] = m;
+            vsumsq  += m * m;
+        }
+
+    } else {
+
+        // The stereo filters run even if no stereo signal is detected,
+        // to keep their state in sync with the signal.
+        assert(n == m_buf_stereo.size());
+        audio.resize(2*n);
+        for (unsigned int i = 0; i < n; i++) {
+            Sample m = m_deemph_mono.process_sample(
+                           m_dcblock_mono.process_sample(m_buf_mono[i]));
+            Sample s = m_deemph_stereo.process_sample(
+                           m_dcblock_stereo.process_sample(m_buf_stereo[i]));
+            if (!stereo_detected) {
+                // Duplicate mono signal in left/right channels.
+                s = 0;
+            }
+            Sample l = m + s;
+            Sample r = m - s;
+            audio[2*i]   = l;
+            audio[2*i+1] = r;
+            vsumsq += l * l + r * r;
+        }
 
-    audio.resize(2*n);
-    for (unsigned int i = 0; i < n; i++) {
-        Sample m = samples_mono[i];
-        Sample s = samples_stereo[i];
-        audio[2*i]   = m + s;
-        audio[2*i+1] = m - s;
     }
+
+    audio_rms = audio.empty() ? 0 : sqrt(vsumsq / audio.size());
 }
 
 /* end */
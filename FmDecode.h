@@ -1,11 +1,17 @@
 #ifndef SOFTFM_FMDECODE_H
 #define SOFTFM_FMDECODE_H
 
+#include <condition_variable>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include "SoftFM.h"
 #include "Filter.h"
+#include "LatencyStats.h"
+#include "RdsDecoder.h"
 
 
 /* Detect frequency by phase discrimination between successive samples. */
@@ -13,13 +19,24 @@ class PhaseDiscriminator
 {
 public:
 
+    /** Accuracy of the phase computation. */
+    enum AtanAccuracy {
+        ATAN_EXACT,     // libm atan2()
+        ATAN_HIGH,      // polynomial, max error ~ 1e-7 rad
+        ATAN_MEDIUM,    // polynomial, max error ~ 1e-5 rad
+        ATAN_LOW        // polynomial, max error ~ 5e-3 rad
+    };
+
     /**
      * Construct phase discriminator.
      *
      * max_freq_dev :: Full scale frequency deviation relative to the
      *                 full sample frequency.
+     * accuracy     :: Accuracy of the phase computation. The polynomial
+     *                 approximations are branch-free and vectorize well.
      */
-    PhaseDiscriminator(double max_freq_dev);
+    PhaseDiscriminator(double max_freq_dev,
+                       AtanAccuracy accuracy=ATAN_EXACT);
 
     /**
      * Process samples.
@@ -28,8 +45,15 @@ public:
      */
     void process(const IQSampleVector& samples_in, SampleVector& samples_out);
 
+    /** Set the previous input sample, so the first output is meaningful. */
+    void prime(IQSample s)
+    {
+        m_last_sample = s;
+    }
+
 private:
     const Sample m_freq_scale_factor;
+    const AtanAccuracy m_accuracy;
     IQSample     m_last_sample;
 };
 
@@ -63,8 +87,21 @@ public:
     /**
      * Process samples and extract 19 kHz pilot tone.
      * Generate phase-locked 38 kHz tone with unit amplitude.
+     *
+     * If carrier57 is not NULL, it receives the phase-locked 57 kHz
+     * carrier for RDS (third harmonic of the pilot) as a complex tone
+     * exp(-j * 3 * phase), so that multiplying with it shifts the RDS
+     * subcarrier to zero frequency.
      */
-    void process(const SampleVector& samples_in, SampleVector& samples_out);
+    void process(const SampleVector& samples_in, SampleVector& samples_out,
+                 IQSampleVector *carrier57=NULL);
+
+    /**
+     * Restart the loop from the center frequency, unlocked, e.g. after
+     * tuning to another station. PPS numbering restarts; the sample
+     * index of PPS events keeps counting.
+     */
+    void reset();
 
     /** Return true if the phase-locked loop is locked. */
     bool locked() const
@@ -85,12 +122,23 @@ public:
     }
 
 private:
-    Sample  m_minfreq, m_maxfreq;
+    /**
+     * Number of samples after which the oscillator is restarted from
+     * the exact phase, so rounding errors of the rotator can not grow.
+     */
+    static const unsigned int rotator_interval = 256;
+
+    double  m_minfreq, m_maxfreq;
+    double  m_center_freq;
+    double  m_center_cos, m_center_sin;
     Sample  m_phasor_b0, m_phasor_a1, m_phasor_a2;
     Sample  m_phasor_i1, m_phasor_i2, m_phasor_q1, m_phasor_q2;
     Sample  m_loopfilter_b0, m_loopfilter_b1;
     Sample  m_loopfilter_x1;
-    Sample  m_freq, m_phase;
+    // Frequency and phase of the locked oscillator are always double,
+    // even in a single precision build, because the PPS timing is
+    // derived from the phase.
+    double  m_freq, m_phase;
     Sample  m_minsignal;
     Sample  m_pilot_level;
     int     m_lock_delay;
@@ -99,6 +147,67 @@ private:
     std::uint64_t         m_pps_cnt;
     std::uint64_t         m_sample_cnt;
     std::vector<PpsEvent> m_pps_events;
+    SampleVector          m_osc_cos;
+};
+
+
+/**
+ * Precomputed filter coefficients for FmDecoder.
+ *
+ * A plan holds every coefficient table of the decoder which depends only
+ * on the sample rates, bandwidths and decimation factors, not on the
+ * tuning offset. Plans are immutable and shared by reference counting:
+ * all decoders with the same parameters (several stations, or a decoder
+ * created again after changing frequency) use the same tables, and the
+ * mono and stereo resamplers share one kernel.
+ */
+class FmFilterPlan
+{
+public:
+
+    /** Decoder parameters which determine the coefficients. */
+    struct Key
+    {
+        double          sample_rate_if;
+        double          sample_rate_pcm;
+        double          bandwidth_if;
+        double          bandwidth_pcm;
+        unsigned int    downsample;
+        unsigned int    if_downsample;
+        unsigned int    halfband_stages;
+        bool            hybrid_resampler;
+
+        /** See FmDecoder::FmDecoder() for the parameters. */
+        Key(double sample_rate_if, double sample_rate_pcm,
+            double bandwidth_if, double bandwidth_pcm,
+            unsigned int downsample, unsigned int if_downsample,
+            unsigned int halfband_stages, bool hybrid_resampler);
+
+        bool operator<(const Key& other) const;
+    };
+
+    /**
+     * Return the plan for the specified parameters.
+     * Plans are cached for the lifetime of the process, so each set of
+     * parameters is computed only once. Thread-safe.
+     */
+    static std::shared_ptr<const FmFilterPlan> get(const Key& key);
+
+    /** Compute a plan (bypassing the cache). */
+    explicit FmFilterPlan(const Key& key);
+
+    FmFilterPlan(const FmFilterPlan&) = delete;
+    FmFilterPlan& operator=(const FmFilterPlan&) = delete;
+
+    const Key       key;
+    const double    sample_rate_baseband;
+
+    const std::shared_ptr<const LowPassFilterFirIQ::Coefficients> iffilter;
+    const std::shared_ptr<const LowPassFilterFirIQ::Coefficients> ifdownsampler;
+    const std::shared_ptr<const HalfBandDecimatorIQ::Coefficients> halfband;
+    const std::shared_ptr<const DownsampleFilter::Coefficients> resample_baseband;
+    const std::shared_ptr<const HybridDownsampleFilter::Coefficients>
+        resample_audio;
 };
 
 
@@ -112,6 +221,19 @@ public:
     static constexpr double default_bandwidth_pcm =  15000;
     static constexpr double pilot_freq            =  19000;
 
+    /** Processing stages for which the time per block is measured. */
+    enum Stage {
+        STAGE_TUNER,            // fine tuning
+        STAGE_IF_FILTER,        // IF filter (and IF decimation)
+        STAGE_DISCRIMINATOR,    // phase discriminator
+        STAGE_RESAMPLE,         // baseband and audio downsampling
+        STAGE_PLL,              // pilot PLL and stereo demodulation
+        STAGE_RDS,              // hand-over to the RDS decoder
+        STAGE_DEEMPHASIS,       // DC blocking and de-emphasis
+        STAGE_TOTAL,            // complete decoder
+        num_stages
+    };
+
     /**
      * Construct FM decoder.
      *
@@ -131,6 +253,26 @@ public:
      *                     (15 kHz for broadcast FM)
      * downsample       :: Downsampling factor to apply after FM demodulation.
      *                     Set to 1 to disable.
+     * if_downsample    :: Downsampling factor to apply to the IF signal
+     *                     before FM demodulation, or 1 to disable.
+     *                     When enabled, tuning, IF filtering and decimation
+     *                     are done in a single polyphase filter with
+     *                     a longer FIR filter.
+     * halfband_stages  :: Number of half-band decimation stages to apply to
+     *                     the tuned IF signal before the IF filter, or 0
+     *                     to disable. The IF filter and phase discriminator
+     *                     then run at sample_rate_if / 2^halfband_stages
+     *                     (see choose_halfband_stages()).
+     *                     Can not be combined with if_downsample > 1.
+     * atan_accuracy    :: Accuracy of the phase discriminator.
+     * pipelined        :: True to run the IF stage and the audio stage
+     *                     in separate worker threads (see process()).
+     * hybrid_resampler :: True to resample the audio with an IIR prefilter
+     *                     and a shorter FIR filter (HybridDownsampleFilter)
+     *                     instead of a single long FIR filter.
+     *
+     * The filter coefficients are taken from FmFilterPlan::get(), so
+     * a decoder with previously used parameters is cheap to construct.
      */
     FmDecoder(double sample_rate_if,
               double tuning_offset,
@@ -140,7 +282,30 @@ public:
               double bandwidth_if=default_bandwidth_if,
               double freq_dev=default_freq_dev,
               double bandwidth_pcm=default_bandwidth_pcm,
-              unsigned int downsample=1);
+              unsigned int downsample=1,
+              unsigned int if_downsample=1,
+              unsigned int halfband_stages=0,
+              PhaseDiscriminator::AtanAccuracy atan_accuracy=
+                  PhaseDiscriminator::ATAN_EXACT,
+              bool   pipelined=false,
+              bool   hybrid_resampler=false);
+
+    /** Stop worker threads. */
+    ~FmDecoder();
+
+    /**
+     * Return number of half-band stages for an IF sample rate.
+     *
+     * This is the largest number of stages which keeps the decimated
+     * rate at least 3 times the IF bandwidth (300 .. 600 kS/s for
+     * broadcast FM).
+     */
+    static unsigned int choose_halfband_stages(
+        double sample_rate_if,
+        double bandwidth_if=default_bandwidth_if);
+
+    FmDecoder(const FmDecoder&) = delete;
+    FmDecoder& operator=(const FmDecoder&) = delete;
 
     /**
      * Process IQ samples and return audio samples.
@@ -149,14 +314,111 @@ public:
      * channels are interleaved in the output vector (even if no stereo
      * signal is detected). If the decoder is set in mono mode, the output
      * vector only contains samples for one channel.
+     *
+     * In pipelined mode, the block is queued and the audio of an earlier
+     * block is returned; the output lags the input by pipeline_delay()
+     * blocks, and audio is empty while the pipeline is filling up.
+     * Passing an empty input block returns the next pending output block
+     * without queueing new input. The concatenated output is exactly
+     * the same as in single-threaded mode.
+     *
+     * The status functions below (levels, stereo detection, PPS events)
+     * always describe the block which was most recently returned.
      */
     void process(const IQSampleVector& samples_in,
                  SampleVector& audio);
 
+    /**
+     * Tune to another station, at the specified frequency offset from the
+     * receiver LO (see constructor), or restart the decoder after the LO
+     * frequency was changed.
+     *
+     * The filter state, PLL and levels are reset as in a new decoder,
+     * but the coefficients and buffers are kept; only the tuning table
+     * is recomputed (and grows if the offset needs a finer resolution).
+     * An RDS decoder is restarted, so its station information is cleared.
+     * In pipelined mode, all pending blocks must have been returned first
+     * (see pending_blocks()).
+     */
+    void retune(double tuning_offset);
+
+    /**
+     * Initialize the filters from the first input block.
+     *
+     * Normally the decoder starts with all filter state at zero, and the
+     * first block of audio contains start-up transients. After calling
+     * this function, the state is set up from the first block as if the
+     * signal had been present before, so that the first block can be
+     * played. Must be called before the first block is processed,
+     * or after retune().
+     */
+    void prime_filters()
+    {
+        m_prime = true;
+    }
+
+    /**
+     * Adjust the audio resampling ratio by a factor close to 1, e.g. to
+     * compensate clock drift between receiver and sound card. A ratio
+     * above 1 produces fewer audio samples. Takes effect from the next
+     * block passed to process().
+     */
+    void set_resample_ratio(double ratio)
+    {
+        m_resample_ratio = ratio;
+    }
+
+    /**
+     * Set squelch level (RMS IF level, where full scale is 1.0), or 0 to
+     * disable squelch. While the IF level of the blocks is below this
+     * level, the audio stage is skipped and silence is returned (with the
+     * normal number of samples). The squelch closes again when the level
+     * drops 3 dB below the squelch level. When it opens, the audio
+     * chain restarts with primed filters. The resampling positions
+     * advance while the squelch is closed, so the number of audio
+     * samples is exactly the same as without squelch. Takes effect from
+     * the next block passed to process().
+     */
+    void set_squelch(double level)
+    {
+        m_squelch_level = level;
+    }
+
+    /** Return true if the squelch was closed for the most recent block. */
+    bool squelched() const
+    {
+        return m_status.squelched;
+    }
+
+    /**
+     * Enable RDS decoding in a separate thread (see RdsDecoder).
+     * The callback is called for each decoded group, from the RDS thread.
+     * Must be called before the first block is processed.
+     */
+    void enable_rds(RdsDecoder::GroupCallback callback);
+
+    /** Return the RDS decoder, or NULL if RDS decoding is not enabled. */
+    const RdsDecoder * rds() const
+    {
+        return m_rds.get();
+    }
+
+    /** Return number of blocks by which the output lags the input. */
+    unsigned int pipeline_delay() const
+    {
+        return m_pipelined ? (pipeline_depth - 1) : 0;
+    }
+
+    /** Return number of queued blocks for which no output was returned. */
+    unsigned int pending_blocks() const
+    {
+        return m_pipe_head - m_pipe_tail;
+    }
+
     /** Return true if a stereo signal is detected. */
     bool stereo_detected() const
     {
-        return m_stereo_detected;
+        return m_status.stereo_detected;
     }
 
     /** Return actual frequency offset in Hz with respect to receiver LO. */
@@ -164,78 +426,232 @@ public:
     {
         double tuned = - m_tuning_shift * m_sample_rate_if /
                        double(m_tuning_table_size);
-        return tuned + m_baseband_mean * m_freq_dev;
+        return tuned + m_status.baseband_mean * m_freq_dev;
     }
 
     /** Return RMS IF level (where full scale IQ signal is 1.0). */
     double get_if_level() const
     {
-        return m_if_level;
+        return m_status.if_level;
     }
 
     /** Return RMS baseband signal level (where nominal level is 0.707). */
     double get_baseband_level() const
     {
-        return m_baseband_level;
+        return m_status.baseband_level;
+    }
+
+    /**
+     * Return RMS audio level (where a full-scale sine is 0.707), before
+     * the nominal output gain.
+     */
+    double get_audio_level() const
+    {
+        return m_status.audio_level;
     }
 
     /** Return amplitude of stereo pilot (nominal level is 0.1). */
     double get_pilot_level() const
     {
-        return m_pilotpll.get_pilot_level();
+        return m_status.pilot_level;
     }
 
     /** Return PPS events from the most recently processed block. */
     std::vector<PilotPhaseLock::PpsEvent> get_pps_events() const
     {
-        return m_pilotpll.get_pps_events();
+        return m_status.pps_events;
+    }
+
+    /**
+     * Return distribution of the time per block spent in a stage.
+     *
+     * Times are in seconds, measured with a monotonic clock in the thread
+     * which runs the stage, and recorded for each block returned by
+     * process(). In pipelined mode the stages overlap, so STAGE_TOTAL
+     * (the sum of the IF stage and the audio stage) may exceed the time
+     * between blocks without the decoder falling behind.
+     */
+    LatencyStats& stage_stats(Stage stage)
+    {
+        return m_stage_stats[stage];
     }
 
+    /** Return short name of a stage. */
+    static const char * stage_name(Stage stage);
+
 private:
-    /** Demodulate stereo L-R signal. */
-    void demod_stereo(const SampleVector& samples_baseband,
-                      SampleVector& samples_stereo);
+    /** Number of blocks in the pipeline, including the one being queued. */
+    static const unsigned int pipeline_depth = 3;
+
+    /** Status information which travels along with each block. */
+    struct BlockStatus
+    {
+        double  if_level;
+        double  if_block_level;     // not smoothed
+        double  baseband_mean;
+        double  baseband_level;
+        double  audio_level;
+        double  pilot_level;
+        bool    stereo_detected;
+        bool    squelched;
+        std::vector<PilotPhaseLock::PpsEvent> pps_events;
+        double  stage_time[num_stages];     // negative if not run
+    };
 
-    /** Duplicate mono signal in left/right channels. */
-    void mono_to_left_right(const SampleVector& samples_mono,
-                            SampleVector& audio);
+    /** Position of a block in the pipeline. */
+    enum BlockState { BLOCK_FREE, BLOCK_IF, BLOCK_AUDIO, BLOCK_DONE };
 
-    /** Extract left/right channels from mono/stereo signals. */
-    void stereo_to_left_right(const SampleVector& samples_mono,
-                              const SampleVector& samples_stereo,
-                              SampleVector& audio);
+    /** Data block passed between pipeline stages. */
+    struct Block
+    {
+        BlockState      state;
+        IQSampleVector  samples_in;
+        SampleVector    baseband;
+        SampleVector    audio;
+        BlockStatus     status;
+        bool            prime;      // audio stage must prime its filters
+        double          resample_ratio;
+        double          squelch_level;
+    };
+
+    /**
+     * IF stage: tuning, IF filter, phase discriminator and baseband
+     * downsampling. Only touches the IF stage state.
+     */
+    void process_if(const IQSampleVector& samples_in, Block& blk);
+
+    /** Audio stage: mono and stereo audio chains. */
+    void process_audio(Block& blk);
+
+    /**
+     * Update the squelch state of the audio stage for a block.
+     * Return true if the audio chain must be skipped.
+     */
+    bool update_squelch(Block& blk);
+
+    /**
+     * Restart the audio stage when the squelch opens. Clears the signal
+     * history but keeps the resampling positions.
+     */
+    void restart_audio_chain();
+
+    /** Reset the filters of the audio stage. */
+    void reset_audio_chain();
+
+    /**
+     * Mono audio chain, part of the audio stage.
+     * Add the time spent in each stage to stage_time[].
+     */
+    void process_mono(const SampleVector& samples_baseband,
+                      double *stage_time);
+
+    /**
+     * Pilot PLL, and hand-over to the RDS decoder; part of the stereo
+     * chain, or run on its own for RDS in mono mode.
+     */
+    void process_pilot(const SampleVector& samples_baseband,
+                       double *stage_time);
+
+    /** Stereo audio chain, part of the audio stage. */
+    void process_stereo(const SampleVector& samples_baseband,
+                        double *stage_time);
+
+    /** Reset the status of the most recently returned block. */
+    void reset_status();
+
+    /** Record stage times of a returned block. */
+    void record_stage_times(const BlockStatus& status);
+
+    /** Worker thread running the IF stage. */
+    void if_worker();
+
+    /** Worker thread running the audio stage. */
+    void audio_worker();
+
+    /** Worker thread running the mono chain in parallel with stereo. */
+    void mono_worker();
+
+    /**
+     * Finish audio in a single pass: DC blocking and de-emphasis of the
+     * mono and stereo signals, conversion to left/right channels and
+     * measurement of the RMS level.
+     *
+     * Left/right channels are interleaved in the output when stereo
+     * decoding is enabled (the mono signal is duplicated if no stereo
+     * signal is detected).
+     */
+    void postprocess_audio(bool stereo_detected, SampleVector& audio,
+                           double& audio_rms);
 
     // Data members.
+    const std::shared_ptr<const FmFilterPlan> m_plan;
     const double    m_sample_rate_if;
     const double    m_sample_rate_baseband;
-    const int       m_tuning_table_size;
-    const int       m_tuning_shift;
+    int             m_tuning_table_size;
+    int             m_tuning_shift;
     const double    m_freq_dev;
     const unsigned int m_downsample;
+    const unsigned int m_if_downsample;
+    const unsigned int m_halfband_stages;
     const bool      m_stereo_enabled;
-    bool            m_stereo_detected;
+    const bool      m_pipelined;
     double          m_if_level;
     double          m_baseband_mean;
     double          m_baseband_level;
+    double          m_audio_level;
+    bool            m_prime;
+    double          m_resample_ratio;   // requested by the caller
+    double          m_audio_ratio;      // applied in the audio stage
+    double          m_squelch_level;    // requested by the caller
+    bool            m_squelch_open;     // audio stage squelch state
+    bool            m_squelch_restart;  // restart audio chain when open
+    BlockStatus     m_status;
+    LatencyStats    m_stage_stats[num_stages];
 
     IQSampleVector  m_buf_iftuned;
+    IQSampleVector  m_buf_ifdecimated;
     IQSampleVector  m_buf_iffiltered;
     SampleVector    m_buf_baseband;
     SampleVector    m_buf_mono;
-    SampleVector    m_buf_rawstereo;
+    SampleVector    m_buf_pilot38;      // phase-locked 38 kHz tone from the PLL
     SampleVector    m_buf_stereo;
+    IQSampleVector  m_buf_carrier57;
 
     FineTuner           m_finetuner;
     LowPassFilterFirIQ  m_iffilter;
+    DownsampleFilterIQ  m_ifdownsampler;
+    HalfBandDecimatorIQ m_halfband;
     PhaseDiscriminator  m_phasedisc;
     DownsampleFilter    m_resample_baseband;
     PilotPhaseLock      m_pilotpll;
-    DownsampleFilter    m_resample_mono;
-    DownsampleFilter    m_resample_stereo;
+    HybridDownsampleFilter m_resample_mono;
+    HybridDownsampleFilter m_resample_stereo;
+    DriftResampler      m_drift_mono;
+    DriftResampler      m_drift_stereo;
     HighPassFilterIir   m_dcblock_mono;
     HighPassFilterIir   m_dcblock_stereo;
     LowPassFilterRC     m_deemph_mono;
     LowPassFilterRC     m_deemph_stereo;
+    std::unique_ptr<RdsDecoder> m_rds;
+    RdsDecoder::GroupCallback   m_rds_callback;
+
+    // Pipeline state.
+    // Blocks are handed from stage to stage by changing their state under
+    // m_pipe_mutex; the contents of a block are only touched by the stage
+    // which currently owns it.
+    std::vector<Block>  m_blocks;
+    unsigned int        m_pipe_head;
+    unsigned int        m_pipe_tail;
+    bool                m_pipe_quit;
+    bool                m_mono_quit;        // set after the audio thread ends
+    const SampleVector *m_mono_request;
+    bool                m_mono_done;
+    double              m_mono_time[num_stages];
+    std::mutex          m_pipe_mutex;
+    std::condition_variable m_pipe_cond;
+    std::thread         m_if_thread;
+    std::thread         m_audio_thread;
+    std::thread         m_mono_thread;
 };
 
 #endif
@@ -0,0 +1,260 @@
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOFTFM_IQCONV_X86 1
+#endif
+
+#if defined(__aarch64__) || (defined(__arm__) && defined(__ARM_NEON))
+#include <arm_neon.h>
+#define SOFTFM_IQCONV_NEON 1
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#include "IQConvert.h"
+
+using namespace std;
+
+
+// NOTE: The conversion (b - 128) / 128 is computed as b * (1/128) - 1.
+// Both operations are exact in single precision, so every kernel gives
+// bit-identical results.
+//
+// Since IQSample is std::complex<float>, an array of n samples is laid
+// out as 2*n floats in the same order as the input bytes. The kernels
+// therefore simply convert a byte array to a float array.
+
+typedef void (*ConvertFunc)(const uint8_t *buf, float *out, unsigned int n);
+
+static const float conv_scale = 1.0f / 128.0f;
+
+
+/** Plain scalar conversion of n bytes. */
+static void convert_scalar(const uint8_t *buf, float *out, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; i++) {
+        out[i] = buf[i] * conv_scale - 1.0f;
+    }
+}
+
+
+/** Return lookup table with converted values for all byte values. */
+static const float * convert_table()
+{
+    static float table[256];
+    static bool initialized = [] {
+        for (int i = 0; i < 256; i++)
+            table[i] = i * conv_scale - 1.0f;
+        return true;
+    }();
+    (void)initialized;
+    return table;
+}
+
+
+/** Table-driven conversion of n bytes. */
+static void convert_lut(const uint8_t *buf, float *out, unsigned int n)
+{
+    const float *table = convert_table();
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        out[i]   = table[buf[i]];
+        out[i+1] = table[buf[i+1]];
+        out[i+2] = table[buf[i+2]];
+        out[i+3] = table[buf[i+3]];
+    }
+    for (; i < n; i++) {
+        out[i] = table[buf[i]];
+    }
+}
+
+
+#ifdef SOFTFM_IQCONV_X86
+
+/** SSE2 conversion, 16 bytes per iteration. */
+__attribute__((target("sse2")))
+static void convert_sse2(const uint8_t *buf, float *out, unsigned int n)
+{
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128  scale = _mm_set1_ps(conv_scale);
+    const __m128  one   = _mm_set1_ps(1.0f);
+
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i b   = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i wlo = _mm_unpacklo_epi8(b, zero);
+        __m128i whi = _mm_unpackhi_epi8(b, zero);
+        __m128  f0  = _mm_cvtepi32_ps(_mm_unpacklo_epi16(wlo, zero));
+        __m128  f1  = _mm_cvtepi32_ps(_mm_unpackhi_epi16(wlo, zero));
+        __m128  f2  = _mm_cvtepi32_ps(_mm_unpacklo_epi16(whi, zero));
+        __m128  f3  = _mm_cvtepi32_ps(_mm_unpackhi_epi16(whi, zero));
+        _mm_storeu_ps(out + i,      _mm_sub_ps(_mm_mul_ps(f0, scale), one));
+        _mm_storeu_ps(out + i + 4,  _mm_sub_ps(_mm_mul_ps(f1, scale), one));
+        _mm_storeu_ps(out + i + 8,  _mm_sub_ps(_mm_mul_ps(f2, scale), one));
+        _mm_storeu_ps(out + i + 12, _mm_sub_ps(_mm_mul_ps(f3, scale), one));
+    }
+
+    convert_scalar(buf + i, out + i, n - i);
+}
+
+
+/** AVX2 conversion, 32 bytes per iteration. */
+__attribute__((target("avx2")))
+static void convert_avx2(const uint8_t *buf, float *out, unsigned int n)
+{
+    const __m256 scale = _mm256_set1_ps(conv_scale);
+    const __m256 one   = _mm256_set1_ps(1.0f);
+
+    unsigned int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (unsigned int k = 0; k < 32; k += 8) {
+            __m128i b = _mm_loadl_epi64((const __m128i *)(buf + i + k));
+            __m256  f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(b));
+            _mm256_storeu_ps(out + i + k,
+                             _mm256_sub_ps(_mm256_mul_ps(f, scale), one));
+        }
+    }
+
+    convert_scalar(buf + i, out + i, n - i);
+}
+
+#endif // SOFTFM_IQCONV_X86
+
+
+#ifdef SOFTFM_IQCONV_NEON
+
+/** NEON conversion, 16 bytes per iteration. */
+static void convert_neon(const uint8_t *buf, float *out, unsigned int n)
+{
+    const float32x4_t one = vdupq_n_f32(1.0f);
+
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t b   = vld1q_u8(buf + i);
+        uint16x8_t wlo = vmovl_u8(vget_low_u8(b));
+        uint16x8_t whi = vmovl_u8(vget_high_u8(b));
+        float32x4_t f0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(wlo)));
+        float32x4_t f1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(wlo)));
+        float32x4_t f2 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(whi)));
+        float32x4_t f3 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(whi)));
+        vst1q_f32(out + i,      vsubq_f32(vmulq_n_f32(f0, conv_scale), one));
+        vst1q_f32(out + i + 4,  vsubq_f32(vmulq_n_f32(f1, conv_scale), one));
+        vst1q_f32(out + i + 8,  vsubq_f32(vmulq_n_f32(f2, conv_scale), one));
+        vst1q_f32(out + i + 12, vsubq_f32(vmulq_n_f32(f3, conv_scale), one));
+    }
+
+    convert_scalar(buf + i, out + i, n - i);
+}
+
+#endif // SOFTFM_IQCONV_NEON
+
+
+/** Return true if the CPU supports the specified kernel. */
+static bool kernel_supported(IQConvertKernel kernel)
+{
+#ifdef SOFTFM_IQCONV_X86
+    // Needed because this may run during static initialization.
+    __builtin_cpu_init();
+#endif
+
+    switch (kernel) {
+        case IQCONV_SCALAR:
+        case IQCONV_LUT:
+            return true;
+#ifdef SOFTFM_IQCONV_X86
+        case IQCONV_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case IQCONV_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#ifdef SOFTFM_IQCONV_NEON
+        case IQCONV_NEON:
+#if defined(__arm__)
+            return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+            return true;
+#endif
+#endif
+        default:
+            return false;
+    }
+}
+
+
+/** Return conversion function for the specified (supported) kernel. */
+static ConvertFunc kernel_func(IQConvertKernel kernel)
+{
+    switch (kernel) {
+#ifdef SOFTFM_IQCONV_X86
+        case IQCONV_SSE2:   return convert_sse2;
+        case IQCONV_AVX2:   return convert_avx2;
+#endif
+#ifdef SOFTFM_IQCONV_NEON
+        case IQCONV_NEON:   return convert_neon;
+#endif
+        case IQCONV_LUT:    return convert_lut;
+        default:            return convert_scalar;
+    }
+}
+
+
+/** Return fastest kernel supported by this CPU. */
+static IQConvertKernel detect_kernel()
+{
+    static const IQConvertKernel preferred[] = {
+        IQCONV_AVX2, IQCONV_SSE2, IQCONV_NEON };
+
+    for (IQConvertKernel k : preferred) {
+        if (kernel_supported(k))
+            return k;
+    }
+
+    // No SIMD; table lookup avoids slow int-to-float conversion.
+    return IQCONV_LUT;
+}
+
+
+static IQConvertKernel  selected_kernel = detect_kernel();
+static ConvertFunc      selected_func   = kernel_func(selected_kernel);
+
+
+// Convert raw unsigned 8-bit IQ data to complex samples.
+void iq_convert_u8(const uint8_t *buf, IQSample *samples, unsigned int n)
+{
+    selected_func(buf, reinterpret_cast<float *>(samples), 2 * n);
+}
+
+
+// Select conversion kernel.
+bool iq_convert_select(IQConvertKernel kernel)
+{
+    if (kernel == IQCONV_AUTO)
+        kernel = detect_kernel();
+
+    if (!kernel_supported(kernel))
+        return false;
+
+    selected_kernel = kernel;
+    selected_func   = kernel_func(kernel);
+    return true;
+}
+
+
+// Return name of the currently selected conversion kernel.
+const char * iq_convert_kernel_name()
+{
+    switch (selected_kernel) {
+        case IQCONV_SCALAR: return "scalar";
+        case IQCONV_LUT:    return "lut";
+        case IQCONV_SSE2:   return "sse2";
+        case IQCONV_AVX2:   return "avx2";
+        case IQCONV_NEON:   return "neon";
+        default:            return "unknown";
+    }
+}
+
+/* end */
@@ -0,0 +1,44 @@
+#ifndef SOFTFM_IQCONVERT_H
+#define SOFTFM_IQCONVERT_H
+
+#include <cstdint>
+
+#include "SoftFM.h"
+
+
+/** Available kernels for conversion of 8-bit IQ data. */
+enum IQConvertKernel {
+    IQCONV_AUTO,        // pick the fastest kernel supported by the CPU
+    IQCONV_SCALAR,      // plain C++ loop
+    IQCONV_LUT,         // 256-entry lookup table, for CPUs without SIMD
+    IQCONV_SSE2,
+    IQCONV_AVX2,
+    IQCONV_NEON
+};
+
+
+/**
+ * Convert raw unsigned 8-bit IQ data (as produced by RTL-SDR) to
+ * complex samples.
+ *
+ * buf      :: 2 * n bytes, alternating I and Q
+ * samples  :: output array for n samples
+ *
+ * Each byte b is converted to (b - 128) / 128.
+ * All kernels produce exactly the same results.
+ */
+void iq_convert_u8(const std::uint8_t *buf, IQSample *samples,
+                   unsigned int n);
+
+/**
+ * Select conversion kernel.
+ *
+ * Return false if the kernel is not supported by this CPU or build.
+ * In that case the current selection is not changed.
+ */
+bool iq_convert_select(IQConvertKernel kernel);
+
+/** Return name of the currently selected conversion kernel. */
+const char * iq_convert_kernel_name();
+
+#endif
@@ -0,0 +1,445 @@
+
+#define _FILE_OFFSET_BITS 64
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef SOFTFM_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "IqRecorder.h"
+
+using namespace std;
+
+
+/** Alignment of buffers, file offsets and sizes for O_DIRECT. */
+static const unsigned int direct_alignment = 4096;
+
+
+/* ****************  class IqRecorder  **************** */
+
+// Return true if compression is available.
+bool IqRecorder::compression_available()
+{
+#ifdef SOFTFM_HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+// Open the first file and start the writer thread.
+IqRecorder::IqRecorder(const string& filename,
+                       uint64_t rotate_bytes,
+                       bool compress,
+                       bool blocking,
+                       unsigned int num_buffers,
+                       unsigned int buffer_size)
+    : m_filename(filename)
+    , m_rotate_bytes(rotate_bytes)
+    , m_compress(compress)
+    , m_blocking(blocking)
+    , m_buffer_size(buffer_size)
+    , m_buffers(num_buffers + 1, NULL)
+    , m_length(num_buffers, 0)
+    , m_fill(0)
+    , m_quit(false)
+    , m_fd(-1)
+    , m_stage(NULL)
+    , m_stage_fill(0)
+    , m_file_bytes(0)
+    , m_zstream(NULL)
+    , m_recorded(0)
+    , m_dropped(0)
+    , m_written(0)
+    , m_file_index(0)
+    , m_direct(true)
+    , m_failed(false)
+{
+    assert(num_buffers >= 2);
+    assert(buffer_size > 0 && buffer_size % direct_alignment == 0);
+    assert(rotate_bytes % 2 == 0);
+
+    // Allocate all buffers up front; the last one is the staging buffer.
+    for (unsigned int i = 0; i <= num_buffers; i++) {
+        void *p = NULL;
+        if (posix_memalign(&p, direct_alignment, buffer_size) != 0) {
+            fail("out of memory");
+            return;
+        }
+        m_buffers[i] = static_cast<uint8_t*>(p);
+    }
+    m_stage = m_buffers.back();
+    m_buffers.pop_back();
+
+    for (unsigned int i = 1; i < num_buffers; i++)
+        m_free_queue.push_back(i);
+
+    if (compress) {
+#ifdef SOFTFM_HAVE_ZLIB
+        // Fastest level; window bits 15 + 16 selects the gzip format.
+        z_stream *z = new z_stream;
+        memset(z, 0, sizeof(*z));
+        if (deflateInit2(z, 1, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            delete z;
+            fail("can not initialize zlib");
+            return;
+        }
+        m_zstream = z;
+#else
+        fail("compression not available (built without zlib)");
+        return;
+#endif
+    }
+
+    // Open the first file now, so that errors show up immediately.
+    if (!open_file())
+        return;
+
+    m_thread = thread(&IqRecorder::writer_run, this);
+}
+
+
+// Stop recording.
+IqRecorder::~IqRecorder()
+{
+    close();
+
+    if (m_fd >= 0)
+        ::close(m_fd);
+
+#ifdef SOFTFM_HAVE_ZLIB
+    if (m_zstream != NULL) {
+        z_stream *z = static_cast<z_stream*>(m_zstream);
+        deflateEnd(z);
+        delete z;
+    }
+#endif
+
+    for (uint8_t *p : m_buffers)
+        free(p);
+    free(m_stage);
+}
+
+
+// Queue samples for writing.
+void IqRecorder::write_raw(const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+
+        if (m_fill < 0) {
+            // All buffers were busy; continue as soon as one is free.
+            unique_lock<mutex> lock(m_mutex);
+            while (m_blocking && m_free_queue.empty() && !m_failed)
+                m_cond.wait(lock);
+            if (!m_free_queue.empty()) {
+                m_fill = m_free_queue.front();
+                m_free_queue.pop_front();
+                m_length[m_fill] = 0;
+            }
+            lock.unlock();
+            if (m_fill < 0) {
+                m_dropped += len;
+                return;
+            }
+        }
+
+        size_t fill = m_length[m_fill];
+        size_t k = min(len, m_buffer_size - fill);
+        memcpy(m_buffers[m_fill] + fill, data, k);
+        m_length[m_fill] = fill + k;
+        data += k;
+        len  -= k;
+
+        if (m_length[m_fill] == m_buffer_size) {
+            // Hand the full buffer to the writer and take a free one.
+            unique_lock<mutex> lock(m_mutex);
+            m_full_queue.push_back(m_fill);
+            m_fill = -1;
+            if (!m_free_queue.empty()) {
+                m_fill = m_free_queue.front();
+                m_free_queue.pop_front();
+                m_length[m_fill] = 0;
+            }
+            lock.unlock();
+            m_cond.notify_all();
+        }
+    }
+}
+
+
+// Write the queued samples and stop the writer thread.
+void IqRecorder::close()
+{
+    if (!m_thread.joinable())
+        return;
+
+    unique_lock<mutex> lock(m_mutex);
+    if (m_fill >= 0 && m_length[m_fill] > 0)
+        m_full_queue.push_back(m_fill);
+    m_fill = -1;
+    m_quit = true;
+    lock.unlock();
+    m_cond.notify_all();
+
+    m_thread.join();
+}
+
+
+// Return the last error.
+string IqRecorder::error()
+{
+    unique_lock<mutex> lock(m_mutex);
+    return m_error;
+}
+
+
+// Record an error.
+void IqRecorder::fail(const string& msg)
+{
+    unique_lock<mutex> lock(m_mutex);
+    if (m_error.empty())
+        m_error = msg;
+    m_failed = true;
+}
+
+
+// Return name of file number index.
+string IqRecorder::file_name(unsigned int index) const
+{
+    if (m_rotate_bytes == 0)
+        return m_filename;
+
+    // Insert the sequence number before the first extension.
+    size_t base = m_filename.rfind('/');
+    base = (base == string::npos) ? 0 : base + 1;
+    size_t dot = m_filename.find('.', base);
+    if (dot == string::npos || dot == base)
+        dot = m_filename.size();
+
+    char seq[16];
+    snprintf(seq, sizeof(seq), "-%04u", index);
+    return m_filename.substr(0, dot) + seq + m_filename.substr(dot);
+}
+
+
+// Open the next file.
+bool IqRecorder::open_file()
+{
+    string name = file_name(m_file_index.load());
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    // Not every file system supports O_DIRECT (e.g. tmpfs).
+    m_fd = -1;
+    if (m_direct)
+        m_fd = open(name.c_str(), flags | O_DIRECT, 0666);
+    if (m_fd < 0 && (!m_direct || errno == EINVAL)) {
+        m_direct = false;
+        m_fd = open(name.c_str(), flags, 0666);
+    }
+    if (m_fd < 0) {
+        fail("can not open '" + name + "' (" + strerror(errno) + ")");
+        return false;
+    }
+
+#ifdef SOFTFM_HAVE_ZLIB
+    if (m_zstream != NULL)
+        deflateReset(static_cast<z_stream*>(m_zstream));
+#endif
+
+    m_stage_fill = 0;
+    m_file_bytes = 0;
+    m_file_index++;
+    return true;
+}
+
+
+// Flush the staging buffer and close the file.
+bool IqRecorder::close_file()
+{
+    if (m_fd < 0)
+        return true;
+
+    bool ok = true;
+    if (m_compress)
+        ok = deflate_samples(NULL, 0);
+    if (ok && m_stage_fill > 0)
+        ok = write_out(m_stage_fill);
+    m_stage_fill = 0;
+
+    if (::close(m_fd) != 0 && ok) {
+        fail(string("close failed (") + strerror(errno) + ")");
+        ok = false;
+    }
+    m_fd = -1;
+    return ok;
+}
+
+
+// Add samples to the current file, rotating files as needed.
+bool IqRecorder::write_samples(const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+
+        if (m_fd < 0 ||
+            (m_rotate_bytes > 0 && m_file_bytes == m_rotate_bytes)) {
+            if (!close_file() || !open_file())
+                return false;
+        }
+
+        size_t k = len;
+        if (m_rotate_bytes > 0)
+            k = min<uint64_t>(k, m_rotate_bytes - m_file_bytes);
+
+        bool ok = m_compress ? deflate_samples(data, k) : stage(data, k);
+        if (!ok)
+            return false;
+
+        m_file_bytes += k;
+        data += k;
+        len  -= k;
+    }
+
+    return true;
+}
+
+
+// Append bytes to the staging buffer.
+bool IqRecorder::stage(const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        size_t k = min(len, m_buffer_size - m_stage_fill);
+        memcpy(m_stage + m_stage_fill, data, k);
+        m_stage_fill += k;
+        data += k;
+        len  -= k;
+        if (m_stage_fill == m_buffer_size) {
+            if (!write_out(m_stage_fill))
+                return false;
+            m_stage_fill = 0;
+        }
+    }
+    return true;
+}
+
+
+// Compress samples into the staging buffer.
+bool IqRecorder::deflate_samples(const uint8_t *data, size_t len)
+{
+#ifdef SOFTFM_HAVE_ZLIB
+    z_stream *z = static_cast<z_stream*>(m_zstream);
+    int flush = (data == NULL) ? Z_FINISH : Z_NO_FLUSH;
+
+    z->next_in  = const_cast<Bytef*>(data);
+    z->avail_in = len;
+
+    while (true) {
+        z->next_out  = m_stage + m_stage_fill;
+        z->avail_out = m_buffer_size - m_stage_fill;
+        int r = deflate(z, flush);
+        if (r == Z_STREAM_ERROR) {
+            fail("compression failed");
+            return false;
+        }
+        m_stage_fill = m_buffer_size - z->avail_out;
+
+        if (m_stage_fill == m_buffer_size) {
+            if (!write_out(m_stage_fill))
+                return false;
+            m_stage_fill = 0;
+        } else if ((flush == Z_FINISH) ? (r == Z_STREAM_END)
+                                       : (z->avail_in == 0)) {
+            return true;
+        }
+    }
+#else
+    (void)data;
+    (void)len;
+    return false;
+#endif
+}
+
+
+// Write n bytes of the staging buffer to the file.
+bool IqRecorder::write_out(size_t n)
+{
+    // O_DIRECT writes must be a multiple of the block size; the last
+    // part of a file goes through the page cache.
+    int flags = fcntl(m_fd, F_GETFL);
+    if ((flags & O_DIRECT) != 0 && n % direct_alignment != 0) {
+        flags &= ~O_DIRECT;
+        fcntl(m_fd, F_SETFL, flags);
+    }
+
+    size_t p = 0;
+    while (p < n) {
+        ssize_t k = ::write(m_fd, m_stage + p, n - p);
+        if (k < 0 && errno == EINVAL && (flags & O_DIRECT) != 0) {
+            // The file system accepted O_DIRECT at open, but not for
+            // writing; continue without it for this and later files.
+            flags &= ~O_DIRECT;
+            fcntl(m_fd, F_SETFL, flags);
+            m_direct = false;
+            continue;
+        }
+        if (k <= 0) {
+            if (k == 0 || errno != EINTR) {
+                fail(string("write failed (") + strerror(errno) + ")");
+                return false;
+            }
+        } else {
+            p += k;
+            m_written += k;
+        }
+    }
+
+    return true;
+}
+
+
+// Body of the writer thread.
+void IqRecorder::writer_run()
+{
+    unique_lock<mutex> lock(m_mutex);
+
+    while (true) {
+
+        while (m_full_queue.empty() && !m_quit)
+            m_cond.wait(lock);
+
+        if (m_full_queue.empty())
+            break;
+
+        int b = m_full_queue.front();
+        m_full_queue.pop_front();
+        size_t len = m_length[b];
+        lock.unlock();
+
+        // The disk may block here for a long time; the source thread
+        // meanwhile fills the other buffers, or drops samples.
+        if (!m_failed && write_samples(m_buffers[b], len))
+            m_recorded += len;
+        else
+            m_dropped += len;
+
+        lock.lock();
+        m_free_queue.push_back(b);
+        m_cond.notify_all();
+    }
+
+    lock.unlock();
+
+    if (!m_failed)
+        close_file();
+}
+
+/* end */
@@ -0,0 +1,185 @@
+#ifndef SOFTFM_IQRECORDER_H
+#define SOFTFM_IQRECORDER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SampleSource.h"
+
+
+/**
+ * Recorder of the raw 8-bit IQ samples of a source, in rtl_sdr format.
+ *
+ * The source thread copies samples into a ring of preallocated buffers;
+ * a dedicated writer thread takes full buffers from the ring and writes
+ * them to disk. The source thread never waits for the disk: when all
+ * buffers are waiting to be written, new samples are dropped and counted
+ * instead, so that a disk stall can not make the receiver lose USB
+ * blocks. Sources which are not real-time (files) may instead wait for
+ * a free buffer.
+ *
+ * The writer copies (or compresses) the samples into an aligned staging
+ * buffer and writes it in large blocks with O_DIRECT, bypassing the page
+ * cache, on file systems which support it. Optionally the samples are
+ * compressed with zlib (gzip format, fastest level). A new file can be
+ * started after every (rotate_bytes) samples; file names then get a
+ * sequence number, "rec.u8" -> "rec-0000.u8", "rec-0001.u8", ...
+ */
+class IqRecorder : public RawSampleTap
+{
+public:
+
+    /** Size of one ring buffer and of the staging buffer in bytes. */
+    static const unsigned int default_buffer_size = 1 << 20;
+
+    /** Default number of ring buffers (about 7 seconds at 2.4 MS/s). */
+    static const unsigned int default_num_buffers = 32;
+
+    /** Return true if compression is available in this build. */
+    static bool compression_available();
+
+    /**
+     * Open the first file and start the writer thread.
+     *
+     * filename     :: name of the recording
+     * rotate_bytes :: start a new file after this many bytes of samples,
+     *                 or 0 to write a single file
+     * compress     :: compress with zlib (gzip format)
+     * blocking     :: wait for a free buffer instead of dropping samples
+     * num_buffers  :: number of ring buffers (>= 2)
+     * buffer_size  :: size of each buffer in bytes (multiple of 4096)
+     */
+    IqRecorder(const std::string& filename,
+               std::uint64_t rotate_bytes=0,
+               bool compress=false,
+               bool blocking=false,
+               unsigned int num_buffers=default_num_buffers,
+               unsigned int buffer_size=default_buffer_size);
+
+    /** Stop recording (see close()). */
+    virtual ~IqRecorder();
+
+    IqRecorder(const IqRecorder&) = delete;
+    IqRecorder& operator=(const IqRecorder&) = delete;
+
+    /**
+     * Queue samples for writing; drop them (or wait, if blocking) if all
+     * buffers are busy.
+     */
+    virtual void write_raw(const std::uint8_t *data, std::size_t len);
+
+    /**
+     * Write the samples queued so far, close the file and stop the
+     * writer thread. write_raw() must not be called during or after this.
+     */
+    void close();
+
+    /** Return number of sample bytes stored in the recording. */
+    std::uint64_t recorded_bytes() const
+    {
+        return m_recorded.load();
+    }
+
+    /** Return number of sample bytes dropped because the disk was slow. */
+    std::uint64_t dropped_bytes() const
+    {
+        return m_dropped.load();
+    }
+
+    /** Return number of bytes written to disk (after compression). */
+    std::uint64_t written_bytes() const
+    {
+        return m_written.load();
+    }
+
+    /** Return number of files started. */
+    unsigned int num_files() const
+    {
+        return m_file_index.load();
+    }
+
+    /** Return true if O_DIRECT writes are in use. */
+    bool direct_io() const
+    {
+        return m_direct.load();
+    }
+
+    /** Return the last error, or return an empty string if there is no error. */
+    std::string error();
+
+    /** Return true if the recorder is OK, return false if there is an error. */
+    operator bool() const
+    {
+        return !m_failed.load();
+    }
+
+private:
+    /** Return name of file number index. */
+    std::string file_name(unsigned int index) const;
+
+    /** Open the next file. Return false if an error occurred. */
+    bool open_file();
+
+    /** Flush staging buffer and compressor, and close the file. */
+    bool close_file();
+
+    /** Add samples to the current file, rotating files as needed. */
+    bool write_samples(const std::uint8_t *data, std::size_t len);
+
+    /** Append bytes to the staging buffer, writing it out when full. */
+    bool stage(const std::uint8_t *data, std::size_t len);
+
+    /** Run compressor over samples, or finish the stream if data is NULL. */
+    bool deflate_samples(const std::uint8_t *data, std::size_t len);
+
+    /** Write n bytes of the staging buffer to the file. */
+    bool write_out(std::size_t n);
+
+    /** Record an error from the writer thread. */
+    void fail(const std::string& msg);
+
+    /** Body of the writer thread. */
+    void writer_run();
+
+    const std::string       m_filename;
+    const std::uint64_t     m_rotate_bytes;
+    const bool              m_compress;
+    const bool              m_blocking;
+    const unsigned int      m_buffer_size;
+
+    // The buffers; owned by the source thread (m_fill), queued in
+    // m_full_queue, or free in m_free_queue.
+    std::vector<std::uint8_t *> m_buffers;
+    std::vector<std::size_t> m_length;
+    int                     m_fill;             // -1 while dropping
+    std::deque<int>         m_full_queue;
+    std::deque<int>         m_free_queue;
+    bool                    m_quit;
+    std::mutex              m_mutex;
+    std::condition_variable m_cond;
+    std::thread             m_thread;
+
+    // State of the writer thread.
+    int                     m_fd;
+    std::uint8_t           *m_stage;
+    std::size_t             m_stage_fill;
+    std::uint64_t           m_file_bytes;       // samples in current file
+    void                   *m_zstream;          // z_stream, or NULL
+
+    std::atomic<std::uint64_t> m_recorded;
+    std::atomic<std::uint64_t> m_dropped;
+    std::atomic<std::uint64_t> m_written;
+    std::atomic<unsigned int> m_file_index;
+    std::atomic<bool>       m_direct;
+    std::atomic<bool>       m_failed;
+    std::string             m_error;            // protected by m_mutex
+};
+
+#endif
@@ -0,0 +1,89 @@
+
+#include <algorithm>
+#include <cmath>
+
+#include "LatencyStats.h"
+
+using namespace std;
+
+
+/** Lower edge of the first non-zero bin. Smaller values count as 0. */
+static const double min_value = 1.0e-7;
+
+
+/* ****************  class LatencyStats  **************** */
+
+// Construct empty statistics.
+LatencyStats::LatencyStats()
+    : m_bins(num_bins, 0)
+    , m_count(0)
+    , m_sum(0)
+    , m_max(0)
+{ }
+
+
+// Record one value.
+void LatencyStats::add(double value)
+{
+    int bin = 0;
+    if (value >= min_value) {
+        bin = 1 + int(bins_per_octave * log2(value / min_value));
+        bin = min(bin, num_bins - 1);
+    } else {
+        value = max(value, 0.0);
+    }
+
+    lock_guard<mutex> lock(m_mutex);
+    m_bins[bin]++;
+    m_count++;
+    m_sum += value;
+    m_max = max(m_max, value);
+}
+
+
+// Return summary of the values recorded so far.
+LatencyStats::Summary LatencyStats::summary(bool reset)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    Summary s;
+    s.count = m_count;
+    s.mean  = (m_count > 0) ? (m_sum / m_count) : 0;
+    s.max   = m_max;
+    s.p50   = 0;
+    s.p90   = 0;
+    s.p99   = 0;
+
+    // Walk the bins once, picking up each percentile on the way.
+    const double fractions[3] = { 0.50, 0.90, 0.99 };
+    double *results[3] = { &s.p50, &s.p90, &s.p99 };
+    uint64_t cum = 0;
+    int k = 0;
+    for (int bin = 0; bin < num_bins && k < 3; bin++) {
+        cum += m_bins[bin];
+        while (k < 3 && m_count > 0 && cum >= fractions[k] * m_count) {
+            *results[k] = min(bin_value(bin), m_max);
+            k++;
+        }
+    }
+
+    if (reset) {
+        fill(m_bins.begin(), m_bins.end(), 0);
+        m_count = 0;
+        m_sum   = 0;
+        m_max   = 0;
+    }
+
+    return s;
+}
+
+
+// Return representative value of a bin (geometric center).
+double LatencyStats::bin_value(int bin)
+{
+    if (bin == 0)
+        return 0;
+    return min_value * exp2((bin - 0.5) / bins_per_octave);
+}
+
+/* end */
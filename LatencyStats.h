@@ -0,0 +1,63 @@
+#ifndef SOFTFM_LATENCYSTATS_H
+#define SOFTFM_LATENCYSTATS_H
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+
+/**
+ * Distribution of durations, for reporting percentiles.
+ *
+ * Values are counted in logarithmic bins (4 per octave, from 0.1 us
+ * to several minutes), so recording a value is cheap and percentiles
+ * are accurate to about 10%. Durations are in seconds, but any
+ * non-negative quantity (e.g. seconds of buffered data) can be tracked.
+ *
+ * add() and summary() may be called from different threads.
+ */
+class LatencyStats
+{
+public:
+
+    /** Summary of the recorded values. */
+    struct Summary
+    {
+        std::uint64_t count;
+        double  mean;
+        double  p50;
+        double  p90;
+        double  p99;
+        double  max;
+    };
+
+    /** Construct empty statistics. */
+    LatencyStats();
+
+    LatencyStats(const LatencyStats&) = delete;
+    LatencyStats& operator=(const LatencyStats&) = delete;
+
+    /** Record one value. */
+    void add(double value);
+
+    /**
+     * Return summary of the values recorded so far.
+     * If reset is true, start a new measurement interval.
+     */
+    Summary summary(bool reset);
+
+private:
+    static const int bins_per_octave = 4;
+    static const int num_bins = 4 * 32;
+
+    /** Return representative value of a bin. */
+    static double bin_value(int bin);
+
+    std::mutex                  m_mutex;
+    std::vector<std::uint32_t>  m_bins;
+    std::uint64_t               m_count;
+    double                      m_sum;
+    double                      m_max;
+};
+
+#endif
@@ -0,0 +1,138 @@
+
+#include <cassert>
+
+#include "MultiDecode.h"
+
+using namespace std;
+
+
+/* ****************  class MultiFmDecoder  **************** */
+
+// Construct multi-station decoder.
+MultiFmDecoder::MultiFmDecoder(double sample_rate_if,
+                               const vector<double>& tuning_offsets,
+                               double sample_rate_pcm,
+                               bool   stereo,
+                               double bandwidth_pcm,
+                               unsigned int downsample,
+                               unsigned int if_downsample,
+                               unsigned int halfband_stages,
+                               PhaseDiscriminator::AtanAccuracy atan_accuracy,
+                               bool   pipelined,
+                               bool   hybrid_resampler,
+                               unsigned int num_threads)
+    : m_input(NULL)
+    , m_output(NULL)
+    , m_generation(0)
+    , m_busy(0)
+    , m_quit(false)
+{
+    assert(!tuning_offsets.empty());
+
+    for (double offset : tuning_offsets) {
+        m_decoders.emplace_back(new FmDecoder(
+            sample_rate_if,                     // sample_rate_if
+            offset,                             // tuning_offset
+            sample_rate_pcm,                    // sample_rate_pcm
+            stereo,                             // stereo
+            FmDecoder::default_deemphasis,      // deemphasis
+            FmDecoder::default_bandwidth_if,    // bandwidth_if
+            FmDecoder::default_freq_dev,        // freq_dev
+            bandwidth_pcm,                      // bandwidth_pcm
+            downsample,                         // downsample
+            if_downsample,                      // if_downsample
+            halfband_stages,                    // halfband_stages
+            atan_accuracy,                      // atan_accuracy
+            pipelined,                          // pipelined
+            hybrid_resampler));                 // hybrid_resampler
+    }
+
+    // No point in having more threads than stations.
+    if (num_threads > m_decoders.size())
+        num_threads = m_decoders.size();
+
+    for (unsigned int t = 1; t < num_threads; t++)
+        m_threads.emplace_back(&MultiFmDecoder::worker, this, t);
+}
+
+
+// Stop worker threads.
+MultiFmDecoder::~MultiFmDecoder()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_cond.notify_all();
+
+    for (thread& t : m_threads)
+        t.join();
+}
+
+
+// Process IQ samples and return audio samples for each station.
+void MultiFmDecoder::process(const IQSampleVector& samples_in,
+                             vector<SampleVector>& audio)
+{
+    assert(audio.size() == m_decoders.size());
+
+    if (m_threads.empty()) {
+        for (unsigned int i = 0; i < m_decoders.size(); i++)
+            m_decoders[i]->process(samples_in, audio[i]);
+        return;
+    }
+
+    // Hand the block to the worker threads.
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_input  = &samples_in;
+        m_output = &audio;
+        m_busy   = m_threads.size();
+        m_generation++;
+    }
+    m_cond.notify_all();
+
+    // Do our own share.
+    process_share(0);
+
+    // Wait until all workers are done.
+    unique_lock<mutex> lock(m_mutex);
+    m_cond.wait(lock, [this]{ return m_busy == 0; });
+}
+
+
+// Process the stations which belong to the specified thread.
+void MultiFmDecoder::process_share(unsigned int thread_index)
+{
+    unsigned int nthread = m_threads.size() + 1;
+    for (unsigned int i = thread_index; i < m_decoders.size(); i += nthread)
+        m_decoders[i]->process(*m_input, (*m_output)[i]);
+}
+
+
+// Worker thread.
+void MultiFmDecoder::worker(unsigned int thread_index)
+{
+    uint64_t generation = 0;
+
+    for (;;) {
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_cond.wait(lock, [this,generation]{
+                return m_quit || m_generation != generation; });
+            if (m_quit)
+                return;
+            generation = m_generation;
+        }
+
+        process_share(thread_index);
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_busy--;
+        }
+        m_cond.notify_all();
+    }
+}
+
+/* end */
@@ -0,0 +1,111 @@
+#ifndef SOFTFM_MULTIDECODE_H
+#define SOFTFM_MULTIDECODE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "SoftFM.h"
+#include "FmDecode.h"
+
+
+/**
+ * Decode several FM stations from one IQ stream.
+ *
+ * Each station has its own FmDecoder, which shifts the station to
+ * baseband and decimates it (with if_downsample > 1 this is a single
+ * polyphase filter per station). The IQ block is shared by all stations.
+ *
+ * Decoders are distributed over a small pool of worker threads.
+ * Each thread owns a fixed subset of the stations, so the state of
+ * a decoder is only ever touched by one thread. The calling thread
+ * processes a share of the stations itself.
+ */
+class MultiFmDecoder
+{
+public:
+
+    /**
+     * Construct multi-station decoder.
+     *
+     * sample_rate_if   :: IQ sample rate in Hz.
+     * tuning_offsets   :: Frequency offset in Hz of each station with
+     *                     respect to the receiver LO frequency.
+     * num_threads      :: Number of threads, including the calling thread.
+     *
+     * The remaining arguments are passed to each FmDecoder.
+     */
+    MultiFmDecoder(double sample_rate_if,
+                   const std::vector<double>& tuning_offsets,
+                   double sample_rate_pcm,
+                   bool   stereo,
+                   double bandwidth_pcm,
+                   unsigned int downsample,
+                   unsigned int if_downsample,
+                   unsigned int halfband_stages,
+                   PhaseDiscriminator::AtanAccuracy atan_accuracy,
+                   bool   pipelined,
+                   bool   hybrid_resampler,
+                   unsigned int num_threads);
+
+    /** Stop worker threads. */
+    ~MultiFmDecoder();
+
+    MultiFmDecoder(const MultiFmDecoder&) = delete;
+    MultiFmDecoder& operator=(const MultiFmDecoder&) = delete;
+
+    /** Return number of stations. */
+    unsigned int num_stations() const
+    {
+        return m_decoders.size();
+    }
+
+    /** Return number of threads, including the calling thread. */
+    unsigned int num_threads() const
+    {
+        return m_threads.size() + 1;
+    }
+
+    /** Return decoder for the specified station. */
+    const FmDecoder& station(unsigned int index) const
+    {
+        return *m_decoders[index];
+    }
+
+    FmDecoder& station(unsigned int index)
+    {
+        return *m_decoders[index];
+    }
+
+    /**
+     * Process IQ samples and return audio samples for each station.
+     *
+     * audio must contain one vector per station;
+     * see FmDecoder::process() for the contents.
+     */
+    void process(const IQSampleVector& samples_in,
+                 std::vector<SampleVector>& audio);
+
+private:
+    /** Process the stations which belong to the specified thread. */
+    void process_share(unsigned int thread_index);
+
+    /** Worker thread. */
+    void worker(unsigned int thread_index);
+
+    std::vector<std::unique_ptr<FmDecoder>> m_decoders;
+    std::vector<std::thread>    m_threads;
+
+    const IQSampleVector *      m_input;
+    std::vector<SampleVector> * m_output;
+    std::uint64_t               m_generation;
+    unsigned int                m_busy;
+    bool                        m_quit;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_cond;
+};
+
+#endif
@@ -0,0 +1,454 @@
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOFTFM_PCMCONV_X86 1
+#endif
+
+#if defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+#include <arm_neon.h>
+#define SOFTFM_PCMCONV_NEON 1
+#endif
+
+#include "PcmConvert.h"
+
+using namespace std;
+
+
+// NOTE: Every kernel computes round(clip(x * gain + dither) * 32767)
+// with the same operations in the same precision (Sample type), and
+// rounds to nearest-even like lrint(). The results are therefore
+// bit-identical. The SIMD kernels only exist for little-endian CPUs,
+// so they store the 16-bit values directly.
+//
+// Clipping happens before the conversion to integer; the saturating
+// pack instructions then never actually saturate, but they are the
+// cheapest way to narrow 32-bit values.
+
+typedef void (*ConvertFunc)(const Sample *in, const Sample *dither,
+                            size_t n, Sample gain, uint8_t *out);
+
+
+/** Plain scalar conversion of n samples to signed 16-bit. */
+static void convert_s16_scalar(const Sample *in, const Sample *dither,
+                               size_t n, Sample gain, uint8_t *out)
+{
+    for (size_t i = 0; i < n; i++) {
+        Sample s = in[i] * gain;
+        if (dither)
+            s += dither[i];
+        s = max(Sample(-1.0), min(Sample(1.0), s));
+        long v = lrint(s * 32767);
+        unsigned long u = v;
+        out[2*i]   = u & 0xff;
+        out[2*i+1] = (u >> 8) & 0xff;
+    }
+}
+
+
+#ifdef SOFTFM_PCMCONV_X86
+
+/** SSE2 conversion to signed 16-bit, 8 samples per iteration. */
+__attribute__((target("sse2")))
+static void convert_s16_sse2(const Sample *in, const Sample *dither,
+                             size_t n, Sample gain, uint8_t *out)
+{
+    size_t i = 0;
+
+#ifdef SOFTFM_FLOAT_SAMPLES
+    const __m128 g     = _mm_set1_ps(gain);
+    const __m128 lo    = _mm_set1_ps(-1.0f);
+    const __m128 hi    = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), g);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), g);
+        if (dither) {
+            a = _mm_add_ps(a, _mm_loadu_ps(dither + i));
+            b = _mm_add_ps(b, _mm_loadu_ps(dither + i + 4));
+        }
+        a = _mm_mul_ps(_mm_max_ps(lo, _mm_min_ps(hi, a)), scale);
+        b = _mm_mul_ps(_mm_max_ps(lo, _mm_min_ps(hi, b)), scale);
+        _mm_storeu_si128((__m128i *)(out + 2 * i),
+                         _mm_packs_epi32(_mm_cvtps_epi32(a),
+                                         _mm_cvtps_epi32(b)));
+    }
+#else
+    const __m128d g     = _mm_set1_pd(gain);
+    const __m128d lo    = _mm_set1_pd(-1.0);
+    const __m128d hi    = _mm_set1_pd(1.0);
+    const __m128d scale = _mm_set1_pd(32767.0);
+    for (; i + 8 <= n; i += 8) {
+        __m128i v[2];
+        for (unsigned int k = 0; k < 2; k++) {
+            __m128d a = _mm_mul_pd(_mm_loadu_pd(in + i + 4 * k), g);
+            __m128d b = _mm_mul_pd(_mm_loadu_pd(in + i + 4 * k + 2), g);
+            if (dither) {
+                a = _mm_add_pd(a, _mm_loadu_pd(dither + i + 4 * k));
+                b = _mm_add_pd(b, _mm_loadu_pd(dither + i + 4 * k + 2));
+            }
+            a = _mm_mul_pd(_mm_max_pd(lo, _mm_min_pd(hi, a)), scale);
+            b = _mm_mul_pd(_mm_max_pd(lo, _mm_min_pd(hi, b)), scale);
+            v[k] = _mm_unpacklo_epi64(_mm_cvtpd_epi32(a), _mm_cvtpd_epi32(b));
+        }
+        _mm_storeu_si128((__m128i *)(out + 2 * i),
+                         _mm_packs_epi32(v[0], v[1]));
+    }
+#endif
+
+    convert_s16_scalar(in + i, dither ? dither + i : NULL, n - i, gain,
+                       out + 2 * i);
+}
+
+
+/** AVX conversion to signed 16-bit, 8 (float) or 16 (double) samples
+    per iteration. */
+__attribute__((target("avx")))
+static void convert_s16_avx(const Sample *in, const Sample *dither,
+                            size_t n, Sample gain, uint8_t *out)
+{
+    size_t i = 0;
+
+#ifdef SOFTFM_FLOAT_SAMPLES
+    const __m256 g     = _mm256_set1_ps(gain);
+    const __m256 lo    = _mm256_set1_ps(-1.0f);
+    const __m256 hi    = _mm256_set1_ps(1.0f);
+    const __m256 scale = _mm256_set1_ps(32767.0f);
+    for (; i + 8 <= n; i += 8) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(in + i), g);
+        if (dither)
+            a = _mm256_add_ps(a, _mm256_loadu_ps(dither + i));
+        a = _mm256_mul_ps(_mm256_max_ps(lo, _mm256_min_ps(hi, a)), scale);
+        __m256i v = _mm256_cvtps_epi32(a);
+        _mm_storeu_si128((__m128i *)(out + 2 * i),
+                         _mm_packs_epi32(_mm256_castsi256_si128(v),
+                                         _mm256_extractf128_si256(v, 1)));
+    }
+#else
+    const __m256d g     = _mm256_set1_pd(gain);
+    const __m256d lo    = _mm256_set1_pd(-1.0);
+    const __m256d hi    = _mm256_set1_pd(1.0);
+    const __m256d scale = _mm256_set1_pd(32767.0);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v[4];
+        for (unsigned int k = 0; k < 4; k++) {
+            __m256d a = _mm256_mul_pd(_mm256_loadu_pd(in + i + 4 * k), g);
+            if (dither)
+                a = _mm256_add_pd(a, _mm256_loadu_pd(dither + i + 4 * k));
+            a = _mm256_mul_pd(_mm256_max_pd(lo, _mm256_min_pd(hi, a)), scale);
+            v[k] = _mm256_cvtpd_epi32(a);
+        }
+        _mm_storeu_si128((__m128i *)(out + 2 * i),
+                         _mm_packs_epi32(v[0], v[1]));
+        _mm_storeu_si128((__m128i *)(out + 2 * i + 16),
+                         _mm_packs_epi32(v[2], v[3]));
+    }
+#endif
+
+    convert_s16_scalar(in + i, dither ? dither + i : NULL, n - i, gain,
+                       out + 2 * i);
+}
+
+#endif // SOFTFM_PCMCONV_X86
+
+
+#ifdef SOFTFM_PCMCONV_NEON
+
+/** NEON conversion to signed 16-bit, 8 samples per iteration. */
+static void convert_s16_neon(const Sample *in, const Sample *dither,
+                             size_t n, Sample gain, uint8_t *out)
+{
+    size_t i = 0;
+
+#ifdef SOFTFM_FLOAT_SAMPLES
+    const float32x4_t lo = vdupq_n_f32(-1.0f);
+    const float32x4_t hi = vdupq_n_f32(1.0f);
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t a = vmulq_n_f32(vld1q_f32(in + i), gain);
+        float32x4_t b = vmulq_n_f32(vld1q_f32(in + i + 4), gain);
+        if (dither) {
+            a = vaddq_f32(a, vld1q_f32(dither + i));
+            b = vaddq_f32(b, vld1q_f32(dither + i + 4));
+        }
+        a = vmulq_n_f32(vmaxq_f32(lo, vminq_f32(hi, a)), 32767.0f);
+        b = vmulq_n_f32(vmaxq_f32(lo, vminq_f32(hi, b)), 32767.0f);
+        vst1q_s16((int16_t *)(out + 2 * i),
+                  vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(a)),
+                               vqmovn_s32(vcvtnq_s32_f32(b))));
+    }
+#else
+    const float64x2_t lo = vdupq_n_f64(-1.0);
+    const float64x2_t hi = vdupq_n_f64(1.0);
+    for (; i + 8 <= n; i += 8) {
+        int32x2_t v[4];
+        for (unsigned int k = 0; k < 4; k++) {
+            float64x2_t a = vmulq_n_f64(vld1q_f64(in + i + 2 * k), gain);
+            if (dither)
+                a = vaddq_f64(a, vld1q_f64(dither + i + 2 * k));
+            a = vmulq_n_f64(vmaxq_f64(lo, vminq_f64(hi, a)), 32767.0);
+            v[k] = vmovn_s64(vcvtnq_s64_f64(a));
+        }
+        vst1q_s16((int16_t *)(out + 2 * i),
+                  vcombine_s16(vqmovn_s32(vcombine_s32(v[0], v[1])),
+                               vqmovn_s32(vcombine_s32(v[2], v[3]))));
+    }
+#endif
+
+    convert_s16_scalar(in + i, dither ? dither + i : NULL, n - i, gain,
+                       out + 2 * i);
+}
+
+#endif // SOFTFM_PCMCONV_NEON
+
+
+/** Conversion of n samples to signed 24-bit in 3 bytes. */
+static void convert_s24(const Sample *in, const Sample *dither,
+                        size_t n, Sample gain, uint8_t *out)
+{
+    for (size_t i = 0; i < n; i++) {
+        Sample s = in[i] * gain;
+        if (dither)
+            s += dither[i];
+        s = max(Sample(-1.0), min(Sample(1.0), s));
+        long v = lrint(s * 8388607);
+        unsigned long u = v;
+        out[3*i]   = u & 0xff;
+        out[3*i+1] = (u >> 8) & 0xff;
+        out[3*i+2] = (u >> 16) & 0xff;
+    }
+}
+
+
+/** Conversion of n samples to signed 32-bit. */
+static void convert_s32(const Sample *in, size_t n, Sample gain,
+                        uint8_t *out)
+{
+    for (size_t i = 0; i < n; i++) {
+        Sample s = max(Sample(-1.0), min(Sample(1.0), in[i] * gain));
+        int32_t v = lrint(double(s) * 2147483647.0);
+        uint32_t u = v;
+        out[4*i]   = u & 0xff;
+        out[4*i+1] = (u >> 8) & 0xff;
+        out[4*i+2] = (u >> 16) & 0xff;
+        out[4*i+3] = (u >> 24) & 0xff;
+    }
+}
+
+
+/** Conversion of n samples to 32-bit float. */
+static void convert_float(const Sample *in, size_t n, Sample gain,
+                          uint8_t *out)
+{
+    for (size_t i = 0; i < n; i++) {
+        float s = max(Sample(-1.0), min(Sample(1.0), in[i] * gain));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(out + 4 * i, &s, 4);
+#else
+        uint32_t u;
+        memcpy(&u, &s, 4);
+        out[4*i]   = u & 0xff;
+        out[4*i+1] = (u >> 8) & 0xff;
+        out[4*i+2] = (u >> 16) & 0xff;
+        out[4*i+3] = (u >> 24) & 0xff;
+#endif
+    }
+}
+
+
+/** Return true if the CPU supports the specified kernel. */
+static bool kernel_supported(PcmConvertKernel kernel)
+{
+#ifdef SOFTFM_PCMCONV_X86
+    // Needed because this may run during static initialization.
+    __builtin_cpu_init();
+#endif
+
+    switch (kernel) {
+        case PCMCONV_SCALAR:
+            return true;
+#ifdef SOFTFM_PCMCONV_X86
+        case PCMCONV_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case PCMCONV_AVX:
+            return __builtin_cpu_supports("avx");
+#endif
+#ifdef SOFTFM_PCMCONV_NEON
+        case PCMCONV_NEON:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+
+/** Return conversion function for the specified (supported) kernel. */
+static ConvertFunc kernel_func(PcmConvertKernel kernel)
+{
+    switch (kernel) {
+#ifdef SOFTFM_PCMCONV_X86
+        case PCMCONV_SSE2:  return convert_s16_sse2;
+        case PCMCONV_AVX:   return convert_s16_avx;
+#endif
+#ifdef SOFTFM_PCMCONV_NEON
+        case PCMCONV_NEON:  return convert_s16_neon;
+#endif
+        default:            return convert_s16_scalar;
+    }
+}
+
+
+/** Return fastest kernel supported by this CPU. */
+static PcmConvertKernel detect_kernel()
+{
+    static const PcmConvertKernel preferred[] = {
+        PCMCONV_AVX, PCMCONV_SSE2, PCMCONV_NEON };
+
+    for (PcmConvertKernel k : preferred) {
+        if (kernel_supported(k))
+            return k;
+    }
+
+    return PCMCONV_SCALAR;
+}
+
+
+static PcmConvertKernel selected_kernel = detect_kernel();
+static ConvertFunc      selected_func   = kernel_func(selected_kernel);
+
+
+// Return the number of bytes per sample in the specified format.
+unsigned int pcm_sample_size(PcmFormat format)
+{
+    switch (format) {
+        case PCM_S16_LE:    return 2;
+        case PCM_S24_3LE:   return 3;
+        default:            return 4;
+    }
+}
+
+
+// Return name of the specified format.
+const char * pcm_format_name(PcmFormat format)
+{
+    switch (format) {
+        case PCM_S16_LE:    return "S16_LE";
+        case PCM_S24_3LE:   return "S24_3LE";
+        case PCM_S32_LE:    return "S32_LE";
+        case PCM_FLOAT_LE:  return "FLOAT_LE";
+        default:            return "unknown";
+    }
+}
+
+
+// Parse format name.
+bool pcm_parse_format(const string& name, PcmFormat& format)
+{
+    if (name == "s16") {
+        format = PCM_S16_LE;
+    } else if (name == "s24") {
+        format = PCM_S24_3LE;
+    } else if (name == "s32") {
+        format = PCM_S32_LE;
+    } else if (name == "float") {
+        format = PCM_FLOAT_LE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+// Select kernel for conversion to 16-bit samples.
+bool pcm_convert_select(PcmConvertKernel kernel)
+{
+    if (kernel == PCMCONV_AUTO)
+        kernel = detect_kernel();
+
+    if (!kernel_supported(kernel))
+        return false;
+
+    selected_kernel = kernel;
+    selected_func   = kernel_func(kernel);
+    return true;
+}
+
+
+// Return name of the currently selected conversion kernel.
+const char * pcm_convert_kernel_name()
+{
+    switch (selected_kernel) {
+        case PCMCONV_SCALAR: return "scalar";
+        case PCMCONV_SSE2:   return "sse2";
+        case PCMCONV_AVX:    return "avx";
+        case PCMCONV_NEON:   return "neon";
+        default:             return "unknown";
+    }
+}
+
+
+/* ****************  class PcmConverter  **************** */
+
+// Construct converter.
+PcmConverter::PcmConverter(PcmFormat format, double gain, bool dither)
+    : m_format(format)
+    , m_gain(gain)
+    , m_dither(dither)
+    , m_rng(0x12345678)
+{ }
+
+
+// Convert n samples.
+void PcmConverter::convert(const Sample *samples, size_t n, uint8_t *dest)
+{
+    const Sample *dither = NULL;
+
+    switch (m_format) {
+        case PCM_S16_LE:
+            if (m_dither) {
+                make_dither(n, Sample(1.0 / 32767));
+                dither = m_ditherbuf.data();
+            }
+            selected_func(samples, dither, n, m_gain, dest);
+            break;
+        case PCM_S24_3LE:
+            if (m_dither) {
+                make_dither(n, Sample(1.0 / 8388607));
+                dither = m_ditherbuf.data();
+            }
+            convert_s24(samples, dither, n, m_gain, dest);
+            break;
+        case PCM_S32_LE:
+            convert_s32(samples, n, m_gain, dest);
+            break;
+        case PCM_FLOAT_LE:
+            convert_float(samples, n, m_gain, dest);
+            break;
+    }
+}
+
+
+// Fill m_ditherbuf with n dither values.
+void PcmConverter::make_dither(size_t n, Sample lsb)
+{
+    // The difference of two independent uniform values on [0, 1) has
+    // a triangular distribution on (-1, 1). Both values are taken from
+    // one 32-bit xorshift step.
+    const Sample scale = lsb / 65536;
+    uint32_t x = m_rng;
+
+    m_ditherbuf.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        m_ditherbuf[i] = Sample(int(x & 0xffff) - int(x >> 16)) * scale;
+    }
+
+    m_rng = x;
+}
+
+/* end */
@@ -0,0 +1,123 @@
+#ifndef SOFTFM_PCMCONVERT_H
+#define SOFTFM_PCMCONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "SoftFM.h"
+
+
+/** Encoding of audio samples. */
+enum PcmFormat {
+    PCM_S16_LE,         // signed 16-bit little-endian integer
+    PCM_S24_3LE,        // signed 24-bit little-endian integer in 3 bytes
+    PCM_S32_LE,         // signed 32-bit little-endian integer
+    PCM_FLOAT_LE        // 32-bit little-endian IEEE float
+};
+
+
+/** Available kernels for conversion to 16-bit samples. */
+enum PcmConvertKernel {
+    PCMCONV_AUTO,       // pick the fastest kernel supported by the CPU
+    PCMCONV_SCALAR,     // plain C++ loop
+    PCMCONV_SSE2,
+    PCMCONV_AVX,
+    PCMCONV_NEON
+};
+
+
+/** Return the number of bytes per sample in the specified format. */
+unsigned int pcm_sample_size(PcmFormat format);
+
+/** Return name of the specified format (e.g. "S16_LE"). */
+const char * pcm_format_name(PcmFormat format);
+
+/**
+ * Parse format name: "s16", "s24", "s32" or "float".
+ * Return false if the name is not recognized.
+ */
+bool pcm_parse_format(const std::string& name, PcmFormat& format);
+
+/**
+ * Select kernel for conversion to 16-bit samples.
+ *
+ * Return false if the kernel is not supported by this CPU or build.
+ * In that case the current selection is not changed.
+ */
+bool pcm_convert_select(PcmConvertKernel kernel);
+
+/** Return name of the currently selected conversion kernel. */
+const char * pcm_convert_kernel_name();
+
+
+/**
+ * Convert audio samples to PCM data in a single pass.
+ *
+ * Each sample is multiplied by the gain, optionally dithered, clipped to
+ * the range -1.0 .. +1.0 and rounded to the output format.
+ *
+ * Dither is triangular (TPDF) with a peak amplitude of 1 LSB and is only
+ * applied for 16-bit and 24-bit output.
+ *
+ * Conversion to 16-bit uses a SIMD kernel when the CPU supports it.
+ * All kernels produce exactly the same results.
+ */
+class PcmConverter
+{
+public:
+
+    /** Construct converter. */
+    explicit PcmConverter(PcmFormat format=PCM_S16_LE,
+                          double gain=1.0,
+                          bool dither=false);
+
+    /** Return output format. */
+    PcmFormat format() const
+    {
+        return m_format;
+    }
+
+    /** Return the number of bytes per output sample. */
+    unsigned int sample_size() const
+    {
+        return pcm_sample_size(m_format);
+    }
+
+    /** Change output format. */
+    void set_format(PcmFormat format)
+    {
+        m_format = format;
+    }
+
+    /** Change gain. */
+    void set_gain(double gain)
+    {
+        m_gain = gain;
+    }
+
+    /** Enable or disable dither. */
+    void set_dither(bool dither)
+    {
+        m_dither = dither;
+    }
+
+    /**
+     * Convert n samples.
+     * The destination must have room for n * sample_size() bytes.
+     */
+    void convert(const Sample *samples, std::size_t n, std::uint8_t *dest);
+
+private:
+
+    /** Fill m_ditherbuf with n dither values of the specified peak size. */
+    void make_dither(std::size_t n, Sample lsb);
+
+    PcmFormat       m_format;
+    Sample          m_gain;
+    bool            m_dither;
+    std::uint32_t   m_rng;
+    SampleVector    m_ditherbuf;
+};
+
+#endif
@@ -0,0 +1,471 @@
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "RdsDecoder.h"
+#include "FmDecode.h"
+
+using namespace std;
+
+
+/** Offset words of blocks A, B, C, D and C' (IEC 62106 annex A). */
+static const uint32_t offset_word[5] = { 0x0fc, 0x198, 0x168, 0x1b4, 0x350 };
+
+/** Position in the group of each offset word. */
+static const unsigned int offset_block[5] = { 0, 1, 2, 3, 2 };
+
+
+/**
+ * Return the syndrome of a received 26-bit block: the checkword computed
+ * from the 16 information bits (generator polynomial
+ * x^10 + x^8 + x^7 + x^5 + x^4 + x^3 + 1), XOR the received checkword.
+ * For an error-free block, this is the offset word.
+ */
+static uint32_t block_syndrome(uint32_t reg)
+{
+    const uint32_t poly = 0x5b9;
+    uint32_t r = (reg >> 10) << 10;
+    for (int b = 25; b >= 10; b--) {
+        if (r & (1u << b))
+            r ^= poly << (b - 10);
+    }
+    return (r ^ reg) & 0x3ff;
+}
+
+
+/** Convert an RDS character to printable ASCII. */
+static char rds_char(unsigned int c)
+{
+    return (c >= 0x20 && c < 0x7f) ? char(c) : '?';
+}
+
+
+/* ****************  class RdsDecoder  **************** */
+
+constexpr double RdsDecoder::bit_rate;
+
+
+// Construct decoder and start the worker thread.
+RdsDecoder::RdsDecoder(double sample_rate, GroupCallback callback)
+    : m_queue(queue_blocks)
+    , m_pool(0, queue_blocks + 2, 0)
+    , m_callback(callback)
+
+    // Decimate to a few kS/s, at least 3 times the RDS bandwidth
+    // (+/- 2.4 kHz); 240 kS/s becomes 7.5 kS/s.
+    , m_decimator(FmDecoder::choose_halfband_stages(sample_rate, 2400),
+                  2400 / sample_rate)
+    , m_bit_len(sample_rate / m_decimator.downsample() / bit_rate)
+    , m_out_pos(0)
+    , m_clock(0)
+    , m_mag_on(0)
+    , m_mag_half(0)
+    , m_bits_seen(0)
+    , m_carrier_phase(0)
+    , m_carrier_freq(0)
+    , m_last_bit(0)
+    , m_burst_table(1024, 0)
+    , m_reg(0)
+    , m_bit_cnt(0)
+    , m_match_bit(0)
+    , m_match_block(-1)
+    , m_synced(false)
+    , m_bits_left(0)
+    , m_next_block(0)
+    , m_window_blocks(0)
+    , m_window_bad(0)
+    , m_bad_run(0)
+    , m_ps_mask(0)
+    , m_rt_mask(0)
+    , m_rt_ab(-1)
+    , m_groups(0)
+    , m_block_errors(0)
+    , m_dropped(0)
+{
+    // The matched filter correlates with one biphase symbol: +1 during
+    // the first half of the bit, -1 during the second half. Each tap is
+    // the area of the symbol within one sample period, so the filter is
+    // exact for a non-integer number of samples per bit.
+    unsigned int ntaps = (unsigned int)ceil(m_bit_len);
+    m_match_coeff.resize(ntaps);
+    for (unsigned int k = 0; k < ntaps; k++) {
+        double t0 = k, t1 = min(double(k + 1), m_bit_len);
+        double h = 0.5 * m_bit_len;
+        double pos = max(0.0, min(t1, h) - t0);
+        double neg = max(0.0, t1 - max(t0, h));
+        m_match_coeff[k] = pos - neg;
+    }
+    m_match_buf.resize(ntaps - 1);
+    m_match_out.resize(16);
+    assert(m_bit_len + 3 < m_match_out.size());
+
+    // Error patterns of all bursts of 1 or 2 bits, by syndrome.
+    for (unsigned int b = 0; b < 26; b++) {
+        uint32_t e1 = 1u << b;
+        m_burst_table[block_syndrome(e1)] = e1;
+        if (b < 25) {
+            uint32_t e2 = 3u << b;
+            m_burst_table[block_syndrome(e2)] = e2;
+        }
+    }
+
+    fill(m_ps_buf, m_ps_buf + 8, ' ');
+    fill(m_rt_buf, m_rt_buf + 64, ' ');
+    fill(m_group.block, m_group.block + 4, 0);
+    fill(m_group.valid, m_group.valid + 4, false);
+
+    m_info.pi           = -1;
+    m_info.pty          = -1;
+    m_info.tp           = false;
+    m_info.ta           = false;
+    m_info.clock_utc    = -1;
+    m_info.clock_offset = 0;
+
+    m_thread = thread(&RdsDecoder::worker, this);
+}
+
+
+// Stop the worker thread.
+RdsDecoder::~RdsDecoder()
+{
+    m_queue.push_end();
+    m_thread.join();
+}
+
+
+// Queue a block of baseband samples.
+void RdsDecoder::process(const SampleVector& samples_baseband,
+                         const IQSampleVector& carrier)
+{
+    unsigned int n = samples_baseband.size();
+    assert(carrier.size() == n);
+
+    if (n == 0)
+        return;
+
+    // Mix the subcarrier down to zero frequency.
+    IQSampleVector blk = m_pool.alloc();
+    blk.resize(n);
+    for (unsigned int i = 0; i < n; i++)
+        blk[i] = carrier[i] * IQSample::value_type(samples_baseband[i]);
+
+    if (!m_queue.try_push(move(blk)))
+        m_dropped.fetch_add(1, memory_order_relaxed);
+}
+
+
+// Return station information.
+RdsDecoder::Info RdsDecoder::info() const
+{
+    lock_guard<mutex> lock(m_info_mutex);
+    return m_info;
+}
+
+
+// Worker thread.
+void RdsDecoder::worker()
+{
+    while (true) {
+        IQSampleVector blk = m_queue.pull();
+        if (blk.empty())
+            break;
+        m_decimator.process(blk, m_buf_decimated);
+        m_pool.release(move(blk));
+        demodulate(m_buf_decimated);
+    }
+}
+
+
+// Return matched filter output from d samples ago.
+IQSample RdsDecoder::matched_output(double d) const
+{
+    unsigned int mask = m_match_out.size() - 1;
+    unsigned int k = (unsigned int)d;
+    IQSample::value_type f = d - k;
+    IQSample y0 = m_match_out[(m_out_pos - k) & mask];
+    IQSample y1 = m_match_out[(m_out_pos - k - 1) & mask];
+    return y0 + f * (y1 - y0);
+}
+
+
+// Demodulate decimated samples into bits.
+void RdsDecoder::demodulate(const IQSampleVector& samples)
+{
+    const double quarter = 0.25 * m_bit_len;
+    const IQSample::value_type timing_gain = 0.02 * m_bit_len;
+    const double carrier_a = 0.04, carrier_b = 0.0008;
+    const float mag_smooth = 0.01;
+
+    unsigned int ntaps = m_match_coeff.size();
+    unsigned int n = samples.size();
+    unsigned int mask = m_match_out.size() - 1;
+
+    m_match_buf.insert(m_match_buf.end(), samples.begin(), samples.end());
+
+    for (unsigned int i = 0; i < n; i++) {
+
+        // Matched filter.
+        const IQSample *inp = &m_match_buf[i];
+        IQSample y = 0;
+        for (unsigned int k = 0; k < ntaps; k++)
+            y += m_match_coeff[k] * inp[k];
+        m_out_pos = (m_out_pos + 1) & mask;
+        m_match_out[m_out_pos] = y;
+
+        m_clock += 1;
+        if (m_clock < m_bit_len)
+            continue;
+        m_clock -= m_bit_len;
+
+        // The bit ends m_clock samples ago; wait another quarter bit
+        // so the late sample is available.
+        double d = m_clock + quarter;
+        IQSample y_on      = matched_output(d);
+        float    mag_early = abs(matched_output(d + quarter));
+        float    mag_late  = abs(matched_output(d - quarter));
+        float    mag_on    = abs(y_on);
+
+        // Early-late gate: move the sampling point towards the peak.
+        float msum = mag_early + mag_late;
+        if (msum > 0)
+            m_clock -= timing_gain * (mag_late - mag_early) / msum;
+
+        // The gate can also settle half a bit off, between two biphase
+        // symbols, where the output is weaker; move to the stronger point.
+        m_mag_on += mag_smooth * (mag_on - m_mag_on);
+        m_mag_half += mag_smooth * (abs(matched_output(d + 2 * quarter)) -
+                                    m_mag_half);
+        if (++m_bits_seen >= 200 && m_mag_half > 1.2f * m_mag_on) {
+            m_clock -= 2 * quarter;
+            swap(m_mag_on, m_mag_half);
+            m_bits_seen = 0;
+        }
+
+        // Costas loop for the BPSK symbols.
+        IQSample z = y_on * IQSample(cos(m_carrier_phase),
+                                     -sin(m_carrier_phase));
+        float zmag = abs(z);
+        double err = (zmag > 0) ? ((z.real() > 0 ? z.imag() : -z.imag()) /
+                                   zmag)
+                                : 0;
+        m_carrier_freq += carrier_b * err;
+        m_carrier_freq = max(-0.1, min(0.1, m_carrier_freq));
+        m_carrier_phase += m_carrier_freq + carrier_a * err;
+        if (m_carrier_phase > M_PI)
+            m_carrier_phase -= 2 * M_PI;
+        else if (m_carrier_phase < -M_PI)
+            m_carrier_phase += 2 * M_PI;
+
+        // Differential decoding also removes the sign ambiguity.
+        unsigned int raw = (z.real() > 0) ? 1 : 0;
+        receive_bit(raw ^ m_last_bit);
+        m_last_bit = raw;
+    }
+
+    // Keep the filter history for the next block.
+    m_match_buf.erase(m_match_buf.begin(), m_match_buf.end() - (ntaps - 1));
+}
+
+
+// Process one received bit.
+void RdsDecoder::receive_bit(unsigned int bit)
+{
+    m_reg = ((m_reg << 1) | bit) & 0x3ffffff;
+    m_bit_cnt++;
+
+    if (!m_synced) {
+
+        // Look for two blocks in sequence, 26 bits apart.
+        uint32_t syn = block_syndrome(m_reg);
+        for (unsigned int t = 0; t < 5; t++) {
+            if (syn != offset_word[t])
+                continue;
+            unsigned int blk = offset_block[t];
+            if (m_match_block >= 0 && m_bit_cnt - m_match_bit == 26 &&
+                blk == (unsigned int)(m_match_block + 1) % 4) {
+                m_synced        = true;
+                m_bits_left     = 26;
+                m_next_block    = (blk + 1) % 4;
+                m_window_blocks = 0;
+                m_window_bad    = 0;
+                m_bad_run       = 0;
+                fill(m_group.valid, m_group.valid + 4, false);
+                m_group.block[blk] = m_reg >> 10;
+                m_group.valid[blk] = true;
+                if (blk == 3)
+                    receive_group();
+            } else {
+                m_match_bit   = m_bit_cnt;
+                m_match_block = blk;
+            }
+            break;
+        }
+        return;
+    }
+
+    if (--m_bits_left > 0)
+        return;
+    m_bits_left = 26;
+
+    // Check the block against the expected offset word,
+    // and try to correct a short error burst.
+    unsigned int blk = m_next_block;
+    uint32_t syn = block_syndrome(m_reg);
+    uint32_t reg = m_reg;
+    bool ok = (syn == offset_word[blk]) || (blk == 2 && syn == offset_word[4]);
+    if (!ok) {
+        uint32_t e = m_burst_table[syn ^ offset_word[blk]];
+        if (e == 0 && blk == 2)
+            e = m_burst_table[syn ^ offset_word[4]];
+        ok = (e != 0);
+        reg ^= e;
+    }
+
+    m_group.block[blk] = reg >> 10;
+    m_group.valid[blk] = ok;
+    if (ok) {
+        m_bad_run = 0;
+    } else {
+        m_block_errors.fetch_add(1, memory_order_relaxed);
+        m_window_bad++;
+        m_bad_run++;
+    }
+
+    if (blk == 3)
+        receive_group();
+    m_next_block = (blk + 1) % 4;
+
+    // Drop sync when too many blocks are bad.
+    bool lost = (m_bad_run >= max_bad_run);
+    if (++m_window_blocks == 50) {
+        lost = lost || (m_window_bad > max_bad_blocks);
+        m_window_blocks = 0;
+        m_window_bad    = 0;
+    }
+    if (lost) {
+        m_synced      = false;
+        m_match_block = -1;
+    }
+}
+
+
+// Process a complete group.
+void RdsDecoder::receive_group()
+{
+    Group group = m_group;
+    fill(m_group.valid, m_group.valid + 4, false);
+
+    // Without block B, the group type is unknown.
+    if (!group.valid[1])
+        return;
+
+    parse_group(group);
+    m_groups.fetch_add(1, memory_order_relaxed);
+
+    if (m_callback) {
+        Info info = this->info();
+        m_callback(group, info);
+    }
+}
+
+
+// Update station information from a group.
+void RdsDecoder::parse_group(const Group& group)
+{
+    lock_guard<mutex> lock(m_info_mutex);
+
+    const uint16_t *b = group.block;
+    const bool *valid = group.valid;
+
+    if (valid[0])
+        m_info.pi = b[0];
+
+    if (!valid[1])
+        return;
+
+    unsigned int type    = b[1] >> 12;
+    bool         version = (b[1] >> 11) & 1;
+    m_info.tp  = (b[1] >> 10) & 1;
+    m_info.pty = (b[1] >> 5) & 0x1f;
+
+    if (version && valid[2])
+        m_info.pi = b[2];
+
+    if (type == 0) {
+        // Basic tuning: 2 characters of the program service name.
+        m_info.ta = (b[1] >> 4) & 1;
+        unsigned int seg = b[1] & 3;
+        if (!valid[3])
+            return;
+        // Collect the segments in order, so a new name is not mixed
+        // with the old one.
+        if (seg == 0)
+            m_ps_mask = 0;
+        if (m_ps_mask != (1u << seg) - 1)
+            return;
+        m_ps_buf[2*seg]   = rds_char(b[3] >> 8);
+        m_ps_buf[2*seg+1] = rds_char(b[3] & 0xff);
+        m_ps_mask |= 1u << seg;
+        if (m_ps_mask == 0xf)
+            m_info.ps.assign(m_ps_buf, 8);
+
+    } else if (type == 2) {
+        // RadioText: 4 characters (version A) or 2 characters (B).
+        int ab = (b[1] >> 4) & 1;
+        if (ab != m_rt_ab) {
+            // The text A/B flag toggles when a new text starts.
+            fill(m_rt_buf, m_rt_buf + 64, ' ');
+            m_rt_mask = 0;
+            m_rt_ab = ab;
+        }
+        unsigned int seg = b[1] & 0xf;
+        unsigned int nchar = version ? 2 : 4;
+        if (!valid[3] || (!version && !valid[2]))
+            return;
+        char *p = m_rt_buf + nchar * seg;
+        if (version) {
+            p[0] = b[3] >> 8;
+            p[1] = b[3] & 0xff;
+        } else {
+            p[0] = b[2] >> 8;
+            p[1] = b[2] & 0xff;
+            p[2] = b[3] >> 8;
+            p[3] = b[3] & 0xff;
+        }
+        m_rt_mask |= 1u << seg;
+
+        // The text is complete when all segments up to a carriage
+        // return (or all segments) have been received.
+        unsigned int len = nchar * 16;
+        const char *cr = (const char *)memchr(m_rt_buf, '\r', len);
+        unsigned int end = (cr != NULL) ? (cr - m_rt_buf) : len;
+        unsigned int need = (1u << (end / nchar + (end < len))) - 1;
+        if ((m_rt_mask & need) == need) {
+            string text;
+            for (unsigned int i = 0; i < end; i++)
+                text += rds_char((unsigned char)m_rt_buf[i]);
+            while (!text.empty() && text.back() == ' ')
+                text.pop_back();
+            m_info.radiotext = text;
+        }
+
+    } else if (type == 4 && !version && valid[2] && valid[3]) {
+        // Clock time: modified Julian day, UTC hour and minute,
+        // local time offset in half hours.
+        unsigned int mjd    = ((b[1] & 3) << 15) | (b[2] >> 1);
+        unsigned int hour   = ((b[2] & 1) << 4) | (b[3] >> 12);
+        unsigned int minute = (b[3] >> 6) & 0x3f;
+        int offset = (b[3] & 0x1f) * 30;
+        if ((b[3] >> 5) & 1)
+            offset = -offset;
+        if (mjd >= 40587 && hour < 24 && minute < 60) {
+            m_info.clock_utc = (int64_t(mjd) - 40587) * 86400 +
+                               hour * 3600 + minute * 60;
+            m_info.clock_offset = offset;
+        }
+    }
+}
+
+/* end */
@@ -0,0 +1,193 @@
+#ifndef SOFTFM_RDSDECODER_H
+#define SOFTFM_RDSDECODER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SoftFM.h"
+#include "BlockPool.h"
+#include "DataBuffer.h"
+#include "Filter.h"
+
+
+/**
+ * Decoder for RDS data (Radio Data System, IEC 62106) on the 57 kHz
+ * subcarrier of the FM baseband signal.
+ *
+ * The decoder runs as a side chain in its own thread. The audio stage
+ * hands over each baseband block together with the 57 kHz carrier
+ * derived from the pilot PLL; this only mixes the block down into a
+ * queue and never waits. When the queue is full, blocks are dropped.
+ *
+ * The worker thread decimates the mixed signal with half-band filters
+ * to a few kS/s, runs a matched filter for the biphase symbols, recovers
+ * bit timing (early-late gate) and carrier phase (Costas loop), and
+ * decodes the bit stream into groups. Block synchronization uses the
+ * offset words; bursts of up to 2 bit errors per block are corrected
+ * once synchronized.
+ *
+ * Decoded groups are passed to a callback, which runs in the worker
+ * thread; groups in which block B (the group type) was lost are skipped.
+ * Station information (PI, PS, RadioText, clock time) is collected from
+ * the groups.
+ */
+class RdsDecoder
+{
+public:
+
+    /** RDS bit rate in bits per second (57 kHz / 48). */
+    static constexpr double bit_rate = 1187.5;
+
+    /** Group of four blocks. */
+    struct Group
+    {
+        std::uint16_t   block[4];   // blocks A, B, C (or C'), D
+        bool            valid[4];   // false if the block was not received
+    };
+
+    /**
+     * Station information decoded from the groups received so far.
+     * Text fields are only updated when all their segments have been
+     * received; characters outside printable ASCII are shown as '?'.
+     */
+    struct Info
+    {
+        int             pi;         // program identification, -1 if unknown
+        int             pty;        // program type, -1 if unknown
+        bool            tp;         // traffic program
+        bool            ta;         // traffic announcement
+        std::string     ps;         // program service name (8 characters)
+        std::string     radiotext;  // up to 64 characters
+        std::int64_t    clock_utc;  // clock time (Unix time), -1 if unknown
+        int             clock_offset;   // local time offset in minutes
+    };
+
+    /** Callback for each decoded group (called from the worker thread). */
+    typedef std::function<void(const Group&, const Info&)> GroupCallback;
+
+    /**
+     * Construct decoder and start the worker thread.
+     *
+     * sample_rate  :: sample rate of the baseband signal in Hz
+     * callback     :: function to call for each decoded group
+     */
+    RdsDecoder(double sample_rate, GroupCallback callback);
+
+    /** Stop the worker thread. */
+    ~RdsDecoder();
+
+    RdsDecoder(const RdsDecoder&) = delete;
+    RdsDecoder& operator=(const RdsDecoder&) = delete;
+
+    /**
+     * Queue a block of baseband samples for decoding.
+     * carrier is the complex 57 kHz carrier, exp(-j*phase), for each
+     * sample (see PilotPhaseLock::process()). Does not wait.
+     */
+    void process(const SampleVector& samples_baseband,
+                 const IQSampleVector& carrier);
+
+    /** Return station information. */
+    Info info() const;
+
+    /** Return number of decoded groups. */
+    std::uint64_t groups() const
+    {
+        return m_groups.load(std::memory_order_relaxed);
+    }
+
+    /** Return number of blocks which were received with errors. */
+    std::uint64_t block_errors() const
+    {
+        return m_block_errors.load(std::memory_order_relaxed);
+    }
+
+    /** Return number of baseband blocks dropped because the queue was full. */
+    std::uint64_t dropped_blocks() const
+    {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    /** Maximum number of baseband blocks waiting for the worker thread. */
+    static const unsigned int queue_blocks = 32;
+
+    /**
+     * Sync is lost when more blocks are bad in a window of 50 blocks,
+     * or when this many blocks in a row are bad (which quickly ends
+     * a false sync on noise).
+     */
+    static const unsigned int max_bad_blocks = 20;
+    static const unsigned int max_bad_run = 10;
+
+    /** Worker thread. */
+    void worker();
+
+    /** Demodulate decimated samples into bits. */
+    void demodulate(const IQSampleVector& samples);
+
+    /** Return matched filter output from d samples ago (interpolated). */
+    IQSample matched_output(double d) const;
+
+    /** Process one received (differentially decoded) bit. */
+    void receive_bit(unsigned int bit);
+
+    /** Process a complete group. */
+    void receive_group();
+
+    /** Update station information from a group. */
+    void parse_group(const Group& group);
+
+    // Queue between the audio stage and the worker thread.
+    DataBuffer<IQSample>    m_queue;
+    BlockPool<IQSample>     m_pool;
+    GroupCallback           m_callback;
+    std::thread             m_thread;
+
+    // Demodulator.
+    HalfBandDecimatorIQ     m_decimator;
+    IQSampleVector          m_buf_decimated;
+    const double            m_bit_len;      // samples per bit
+    std::vector<IQSample::value_type> m_match_coeff;
+    IQSampleVector          m_match_buf;    // filter history and input
+    IQSampleVector          m_match_out;    // ring of recent outputs
+    unsigned int            m_out_pos;
+    double                  m_clock;        // samples since last bit
+    float                   m_mag_on, m_mag_half;
+    unsigned int            m_bits_seen;
+    double                  m_carrier_phase, m_carrier_freq;
+    unsigned int            m_last_bit;
+
+    // Block synchronization.
+    std::vector<std::uint32_t> m_burst_table;   // syndrome -> error
+    std::uint32_t           m_reg;
+    std::uint64_t           m_bit_cnt;
+    std::uint64_t           m_match_bit;    // bit count of last offset match
+    int                     m_match_block;  // -1 if none
+    bool                    m_synced;
+    unsigned int            m_bits_left;
+    unsigned int            m_next_block;
+    unsigned int            m_window_blocks, m_window_bad;
+    unsigned int            m_bad_run;
+    Group                   m_group;
+
+    // Group parser.
+    char                    m_ps_buf[8];
+    unsigned int            m_ps_mask;
+    char                    m_rt_buf[64];
+    unsigned int            m_rt_mask;
+    int                     m_rt_ab;
+    Info                    m_info;
+    mutable std::mutex      m_info_mutex;
+
+    std::atomic<std::uint64_t> m_groups;
+    std::atomic<std::uint64_t> m_block_errors;
+    std::atomic<std::uint64_t> m_dropped;
+};
+
+#endif
@@ -1,17 +1,39 @@
 
+#include <algorithm>
 #include <climits>
 #include <cstring>
 #include <rtl-sdr.h>
+#include <time.h>
 
 #include "RtlSdrSource.h"
+#include "IQConvert.h"
 
 using namespace std;
 
 
+/** Return monotonic time in seconds. */
+static double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+
 // Open RTL-SDR device.
 RtlSdrSource::RtlSdrSource(int dev_index)
     : m_dev(0)
     , m_block_length(default_block_length)
+    , m_receive_time(0)
+    , m_async(false)
+    , m_async_done(false)
+    , m_async_skip(0)
+    , m_async_dropped(0)
+    , m_async_tail(0)
+    , m_async_count(0)
+    , m_async_fill(0)
+    , m_async_read(0)
+    , m_async_partial(false)
 {
     int r;
 
@@ -31,6 +53,8 @@ RtlSdrSource::RtlSdrSource(int dev_index)
 // Close RTL-SDR device.
 RtlSdrSource::~RtlSdrSource()
 {
+    stop_async();
+
     if (m_dev)
         rtlsdr_close(m_dev);
 }
@@ -117,6 +141,26 @@ uint32_t RtlSdrSource::get_frequency()
 }
 
 
+// Change the center frequency.
+bool RtlSdrSource::set_frequency(uint32_t frequency)
+{
+    if (!m_dev || m_async)
+        return false;
+
+    if (rtlsdr_set_center_freq(m_dev, frequency) < 0) {
+        m_error = "rtlsdr_set_center_freq failed";
+        return false;
+    }
+
+    if (rtlsdr_reset_buffer(m_dev) < 0) {
+        m_error = "rtlsdr_reset_buffer failed";
+        return false;
+    }
+
+    return true;
+}
+
+
 // Return current tuner gain in units of 0.1 dB.
 int RtlSdrSource::get_tuner_gain()
 {
@@ -139,6 +183,152 @@ vector<int> RtlSdrSource::get_tuner_gains()
 }
 
 
+// Start asynchronous streaming.
+bool RtlSdrSource::start_async(unsigned int num_buffers,
+                               unsigned int transfers_per_block)
+{
+    if (!m_dev)
+        return false;
+
+    if (m_async)
+        return true;
+
+    if (num_buffers < 2) {
+        m_error = "need at least 2 buffers for asynchronous streaming";
+        return false;
+    }
+
+    // librtlsdr needs USB transfers of a multiple of 512 bytes.
+    if (transfers_per_block < 1 ||
+        (2 * m_block_length) % (512 * transfers_per_block) != 0) {
+        m_error = "block length is not a multiple of the transfer size";
+        return false;
+    }
+
+    // Allocate all buffers up front; they are recycled while streaming.
+    m_async_ring.assign(num_buffers, vector<uint8_t>(2 * m_block_length));
+    m_async_times.assign(num_buffers, 0.0);
+    m_async_tail     = 0;
+    m_async_count    = 0;
+    m_async_fill     = 0;
+    m_async_read     = 0;
+    m_async_partial  = (transfers_per_block > 1);
+    m_async_done     = false;
+    m_async_skip     = 0;
+    m_async_dropped  = 0;
+    m_async_error.clear();
+    m_async = true;
+
+    m_async_thread = thread(&RtlSdrSource::async_run, this,
+                            num_buffers * transfers_per_block,
+                            2 * m_block_length / transfers_per_block);
+
+    return true;
+}
+
+
+// Stop asynchronous streaming.
+void RtlSdrSource::stop_async()
+{
+    if (!m_async)
+        return;
+
+    rtlsdr_cancel_async(m_dev);
+    m_async_thread.join();
+    m_async = false;
+}
+
+
+// Body of the background thread which runs rtlsdr_read_async().
+void RtlSdrSource::async_run(unsigned int num_transfers,
+                             unsigned int transfer_size)
+{
+    m_async_sched.enter();
+
+    // This call blocks until rtlsdr_cancel_async() is called
+    // or until the device fails.
+    int r = rtlsdr_read_async(m_dev, async_callback, this,
+                              num_transfers, transfer_size);
+
+    unique_lock<mutex> lock(m_async_mutex);
+    if (r < 0)
+        m_async_error = "rtlsdr_read_async failed";
+    m_async_done = true;
+    lock.unlock();
+    m_async_cond.notify_all();
+}
+
+
+// Callback from librtlsdr with a completed USB transfer.
+void RtlSdrSource::async_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+    RtlSdrSource *self = static_cast<RtlSdrSource*>(ctx);
+    self->async_receive(buf, len);
+}
+
+
+// Copy data from a completed USB transfer into the ring.
+void RtlSdrSource::async_receive(const uint8_t *buf, unsigned int len)
+{
+    unsigned int nbuf = m_async_ring.size();
+    unsigned int blksize = 2 * m_block_length;
+    bool completed = false;
+    double now = monotonic_time();
+
+    m_async_sched.sample();
+
+    unique_lock<mutex> lock(m_async_mutex);
+
+    while (len > 0) {
+
+        if (m_async_skip == 0 && m_async_count == nbuf) {
+            // Ring is full; the consumer is not keeping up. Drop one
+            // block, so that the ring stays aligned to block boundaries.
+            // (A full ring has no partly filled block.)
+            m_async_skip = blksize;
+            m_async_dropped++;
+        }
+
+        if (m_async_skip > 0) {
+            unsigned int k = min(len, m_async_skip);
+            buf  += k;
+            len  -= k;
+            m_async_skip -= k;
+            continue;
+        }
+
+        // Copy (part of) the transfer into the next free block.
+        // Copying happens under the lock, but the consumer only touches
+        // complete blocks and never waits on the lock for long.
+        unsigned int head = (m_async_tail + m_async_count) % nbuf;
+        unsigned int k = min(len, blksize - m_async_fill);
+        memcpy(m_async_ring[head].data() + m_async_fill, buf, k);
+        m_async_times[head] = now;
+        buf  += k;
+        len  -= k;
+        m_async_fill += k;
+
+        if (m_async_fill == blksize) {
+            m_async_fill = 0;
+            m_async_count++;
+            completed = true;
+        }
+    }
+
+    lock.unlock();
+    if (completed || m_async_partial)
+        m_async_cond.notify_all();
+}
+
+
+// Return the number of blocks dropped because the ring was full.
+uint64_t RtlSdrSource::async_dropped_blocks()
+{
+    lock_guard<mutex> lock(m_async_mutex);
+    return m_async_dropped;
+}
+
+
 // Fetch a bunch of samples from the device.
 bool RtlSdrSource::get_samples(IQSampleVector& samples)
 {
@@ -147,6 +337,53 @@ bool RtlSdrSource::get_samples(IQSampleVector& samples)
     if (!m_dev)
         return false;
 
+    if (m_async) {
+
+        // Wait until the ring contains a complete block, or in partial
+        // mode, until there is any data that we did not return yet.
+        unique_lock<mutex> lock(m_async_mutex);
+        while (m_async_count == 0 &&
+               !(m_async_partial && m_async_fill > m_async_read) &&
+               !m_async_done)
+            m_async_cond.wait(lock);
+
+        if (m_async_count == 0 &&
+            !(m_async_partial && m_async_fill > m_async_read)) {
+            m_error = m_async_error.empty() ? "async streaming stopped"
+                                            : m_async_error;
+            return false;
+        }
+
+        // Take the rest of the oldest block. If it is not complete
+        // (partial mode), take the part that has been received so far.
+        // The callback only writes behind m_async_fill, so we can convert
+        // the data without holding the lock.
+        unsigned int blksize = 2 * m_block_length;
+        unsigned int tail  = m_async_tail;
+        unsigned int begin = m_async_read;
+        unsigned int end   = (m_async_count > 0) ? blksize : m_async_fill;
+        m_receive_time = m_async_times[tail];
+        lock.unlock();
+
+        unsigned int n = (end - begin) / 2;
+        samples.resize(n);
+        if (m_raw_tap != NULL)
+            m_raw_tap->write_raw(m_async_ring[tail].data() + begin, 2 * n);
+        iq_convert_u8(m_async_ring[tail].data() + begin, samples.data(), n);
+
+        // Give the block back to the ring when it is used up.
+        lock.lock();
+        if (end == blksize) {
+            m_async_tail = (tail + 1) % m_async_ring.size();
+            m_async_count--;
+            m_async_read = 0;
+        } else {
+            m_async_read = end;
+        }
+
+        return true;
+    }
+
     vector<uint8_t> buf(2 * m_block_length);
 
     r = rtlsdr_read_sync(m_dev, buf.data(), 2 * m_block_length, &n_read);
@@ -160,13 +397,12 @@ bool RtlSdrSource::get_samples(IQSampleVector& samples)
         return false;
     }
 
+    m_receive_time = monotonic_time();
+
     samples.resize(m_block_length);
-    for (int i = 0; i < m_block_length; i++) {
-        int32_t re = buf[2*i];
-        int32_t im = buf[2*i+1];
-        samples[i] = IQSample( (re - 128) / IQSample::value_type(128),
-                               (im - 128) / IQSample::value_type(128) );
-    }
+    if (m_raw_tap != NULL)
+        m_raw_tap->write_raw(buf.data(), buf.size());
+    iq_convert_u8(buf.data(), samples.data(), m_block_length);
 
     return true;
 }
@@ -1,24 +1,30 @@
 #ifndef SOFTFM_RTLSDRSOURCE_H
 #define SOFTFM_RTLSDRSOURCE_H
 
+#include <condition_variable>
 #include <cstdint>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "SoftFM.h"
+#include "SampleSource.h"
+#include "ThreadSetup.h"
 
 
-class RtlSdrSource
+class RtlSdrSource : public SampleSource
 {
 public:
 
     static const int default_block_length = 65536;
+    static const int default_async_buffers = 16;
 
     /** Open RTL-SDR device. */
     RtlSdrSource(int dev_index);
 
     /** Close RTL-SDR device. */
-    ~RtlSdrSource();
+    virtual ~RtlSdrSource();
 
     /**
      * Configure RTL-SDR tuner and prepare for streaming.
@@ -37,10 +43,19 @@ public:
                    bool agcmode=false);
 
     /** Return current sample frequency in Hz. */
-    std::uint32_t get_sample_rate();
+    virtual std::uint32_t get_sample_rate();
 
     /** Return current center frequency in Hz. */
-    std::uint32_t get_frequency();
+    virtual std::uint32_t get_frequency();
+
+    /**
+     * Change the center frequency, e.g. to step across the band, without
+     * configuring the rest of the device again. Samples received so far
+     * are discarded. Not allowed during asynchronous streaming.
+     *
+     * Return true for success, false if an error occurred.
+     */
+    bool set_frequency(std::uint32_t frequency);
 
     /** Return current tuner gain in units of 0.1 dB. */
     int get_tuner_gain();
@@ -54,16 +69,69 @@ public:
         return m_devname;
     }
 
+    /**
+     * Start asynchronous streaming.
+     *
+     * A background thread runs rtlsdr_read_async() with num_buffers USB
+     * transfers of one block each permanently queued. Completed transfers
+     * are copied into a ring of num_buffers blocks which are allocated once
+     * and recycled, so that streaming does not allocate memory per block.
+     *
+     * Must be called after configure(). After this, get_samples() takes
+     * blocks from the ring instead of calling rtlsdr_read_sync().
+     *
+     * If transfers_per_block is more than 1, each block is received in
+     * that many smaller USB transfers, and get_samples() returns the part
+     * of a block that has been received so far instead of waiting until
+     * the block is complete. This reduces latency without making the
+     * ring blocks smaller.
+     *
+     * Return true for success, false if an error occurred.
+     */
+    bool start_async(unsigned int num_buffers=default_async_buffers,
+                     unsigned int transfers_per_block=1);
+
+    /** Stop asynchronous streaming (if it is running). */
+    void stop_async();
+
+    /**
+     * Return the number of blocks dropped because the ring was full.
+     * Streaming continues after a drop, with a gap in the samples.
+     */
+    std::uint64_t async_dropped_blocks();
+
+    /**
+     * Return the scheduling of the asynchronous streaming thread.
+     * Configure it before start_async(); read the results after
+     * stop_async().
+     */
+    ThreadSched& async_sched()
+    {
+        return m_async_sched;
+    }
+
     /**
      * Fetch a bunch of samples from the device.
      *
      * This function must be called regularly to maintain streaming.
      * Return true for success, false if an error occurred.
      */
-    bool get_samples(IQSampleVector& samples);
+    virtual bool get_samples(IQSampleVector& samples);
+
+    /** The device delivers samples in real time. */
+    virtual bool is_realtime() const
+    {
+        return true;
+    }
+
+    /** Return the time at which the last samples arrived from USB. */
+    virtual double get_receive_time() const
+    {
+        return m_receive_time;
+    }
 
     /** Return the last error, or return an empty string if there is no error. */
-    std::string error()
+    virtual std::string error()
     {
         std::string ret(m_error);
         m_error.clear();
@@ -71,7 +139,7 @@ public:
     }
 
     /** Return true if the device is OK, return false if there is an error. */
-    operator bool() const
+    virtual operator bool() const
     {
         return m_dev && m_error.empty();
     }
@@ -80,10 +148,46 @@ public:
     static std::vector<std::string> get_device_names();
 
 private:
+    /** Callback from librtlsdr with a completed USB transfer. */
+    static void async_callback(unsigned char *buf, std::uint32_t len,
+                               void *ctx);
+
+    /** Copy data from a completed USB transfer into the ring. */
+    void async_receive(const std::uint8_t *buf, unsigned int len);
+
+    /** Body of the background thread which runs rtlsdr_read_async(). */
+    void async_run(unsigned int num_transfers, unsigned int transfer_size);
+
     struct rtlsdr_dev * m_dev;
     int                 m_block_length;
+    double              m_receive_time;
     std::string         m_devname;
     std::string         m_error;
+
+    // State of asynchronous streaming.
+    // m_async_ring contains m_async_count complete blocks starting
+    // at m_async_tail; m_async_fill bytes of the block following them
+    // have already been received. The first m_async_read bytes of the
+    // block at m_async_tail have already been returned (partial mode).
+    // m_async_times holds the arrival time of the newest data per block.
+    // While the ring is full, a block's worth of data is discarded;
+    // m_async_skip bytes of it remain.
+    bool                m_async;
+    bool                m_async_done;
+    unsigned int        m_async_skip;
+    std::uint64_t       m_async_dropped;
+    std::string         m_async_error;
+    std::vector<std::vector<std::uint8_t>> m_async_ring;
+    unsigned int        m_async_tail;
+    unsigned int        m_async_count;
+    unsigned int        m_async_fill;
+    unsigned int        m_async_read;
+    bool                m_async_partial;
+    std::vector<double> m_async_times;
+    std::mutex          m_async_mutex;
+    std::condition_variable m_async_cond;
+    std::thread         m_async_thread;
+    ThreadSched         m_async_sched;
 };
 
 #endif
@@ -0,0 +1,90 @@
+#ifndef SOFTFM_SAMPLESOURCE_H
+#define SOFTFM_SAMPLESOURCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "SoftFM.h"
+
+
+/** Receiver of the raw data of a source, before conversion to IQSample. */
+class RawSampleTap
+{
+public:
+
+    virtual ~RawSampleTap() { }
+
+    /**
+     * Take a copy of len bytes of unsigned 8-bit I/Q pairs.
+     *
+     * This is called by SampleSource::get_samples(), in the thread which
+     * reads the source; it must not block.
+     */
+    virtual void write_raw(const std::uint8_t *data, std::size_t len) = 0;
+};
+
+
+/** Abstract source of IQ samples. */
+class SampleSource
+{
+public:
+
+    SampleSource()
+        : m_raw_tap(NULL)
+    { }
+
+    virtual ~SampleSource() { }
+
+    /**
+     * Pass all raw samples to tap before they are converted, or stop
+     * if tap is NULL. Return false if the source does not have raw
+     * 8-bit samples.
+     */
+    virtual bool set_raw_tap(RawSampleTap *tap)
+    {
+        m_raw_tap = tap;
+        return true;
+    }
+
+    /** Return sample frequency in Hz. */
+    virtual std::uint32_t get_sample_rate() = 0;
+
+    /** Return center frequency in Hz. */
+    virtual std::uint32_t get_frequency() = 0;
+
+    /**
+     * Fetch a bunch of samples from the source.
+     *
+     * Return true for success, false if an error occurred.
+     * At the end of a finite stream, return true and an empty vector.
+     */
+    virtual bool get_samples(IQSampleVector& samples) = 0;
+
+    /**
+     * Return true if samples arrive at the sample rate (i.e. a receiver),
+     * false if they are delivered as fast as they can be read.
+     */
+    virtual bool is_realtime() const = 0;
+
+    /**
+     * Return the time (CLOCK_MONOTONIC, in seconds) at which the samples
+     * returned by the last call to get_samples() were received from the
+     * hardware, or return 0 if the source does not know.
+     */
+    virtual double get_receive_time() const
+    {
+        return 0;
+    }
+
+    /** Return the last error, or return an empty string if there is no error. */
+    virtual std::string error() = 0;
+
+    /** Return true if the source is OK, return false if there is an error. */
+    virtual operator bool() const = 0;
+
+protected:
+    RawSampleTap *m_raw_tap;
+};
+
+#endif
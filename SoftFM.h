@@ -7,7 +7,14 @@
 typedef std::complex<float> IQSample;
 typedef std::vector<IQSample> IQSampleVector;
 
+// Baseband and audio samples are double precision by default.
+// Build with -DSOFTFM_FLOAT_SAMPLES to use single precision, which halves
+// the memory traffic of all baseband buffers and doubles the SIMD width.
+#ifdef SOFTFM_FLOAT_SAMPLES
+typedef float Sample;
+#else
 typedef double Sample;
+#endif
 typedef std::vector<Sample> SampleVector;
 
 
@@ -15,10 +22,16 @@ typedef std::vector<Sample> SampleVector;
 inline void samples_mean_rms(const SampleVector& samples,
                              double& mean, double& rms)
 {
-    Sample vsum = 0;
-    Sample vsumsq = 0;
+    double vsum = 0;
+    double vsumsq = 0;
 
     unsigned int n = samples.size();
+    if (n == 0) {
+        mean = 0;
+        rms  = 0;
+        return;
+    }
+
     for (unsigned int i = 0; i < n; i++) {
         Sample v = samples[i];
         vsum   += v;
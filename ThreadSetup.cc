@@ -0,0 +1,219 @@
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "ThreadSetup.h"
+
+using namespace std;
+
+
+/* ****************  struct ThreadSetup  **************** */
+
+// Construct setup which changes nothing.
+ThreadSetup::ThreadSetup()
+    : cpu(-1)
+    , policy(SCHED_OTHER)
+    , priority(0)
+{ }
+
+
+// Parse "cpu[:policy:priority]".
+bool ThreadSetup::parse(const string& s)
+{
+    size_t sep1 = s.find(':');
+    string scpu = s.substr(0, sep1);
+
+    if (scpu == "-") {
+        cpu = -1;
+    } else {
+        char *endp;
+        long t = strtol(scpu.c_str(), &endp, 10);
+        if (scpu.empty() || *endp != '\0' || t < 0 || t >= CPU_SETSIZE)
+            return false;
+        cpu = t;
+    }
+
+    policy   = SCHED_OTHER;
+    priority = 0;
+    if (sep1 == string::npos)
+        return true;
+
+    size_t sep2 = s.find(':', sep1 + 1);
+    string spolicy = s.substr(sep1 + 1, sep2 - sep1 - 1);
+    if (spolicy == "fifo")
+        policy = SCHED_FIFO;
+    else if (spolicy == "rr")
+        policy = SCHED_RR;
+    else if (spolicy != "other")
+        return false;
+
+    if (policy == SCHED_OTHER)
+        return (sep2 == string::npos);
+    if (sep2 == string::npos)
+        return false;
+
+    string sprio = s.substr(sep2 + 1);
+    char *endp;
+    long t = strtol(sprio.c_str(), &endp, 10);
+    if (sprio.empty() || *endp != '\0' ||
+        t < sched_get_priority_min(policy) ||
+        t > sched_get_priority_max(policy))
+        return false;
+    priority = t;
+
+    return true;
+}
+
+
+// Return description of the setup.
+string ThreadSetup::describe() const
+{
+    char buf[64];
+    string ret;
+    if (cpu >= 0) {
+        snprintf(buf, sizeof(buf), "cpu %d", cpu);
+        ret = buf;
+    }
+    if (policy != SCHED_OTHER) {
+        snprintf(buf, sizeof(buf), "%s%s %d", ret.empty() ? "" : ", ",
+                 (policy == SCHED_FIFO) ? "fifo" : "rr", priority);
+        ret += buf;
+    }
+    return ret.empty() ? string("default") : ret;
+}
+
+
+// Apply the setup to a thread.
+string ThreadSetup::apply(pthread_t thread) const
+{
+    string err;
+
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        int r = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+        if (r != 0) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "cpu %d", cpu);
+            err = string(buf) + " (" + strerror(r) + ")";
+        }
+    }
+
+    if (policy != SCHED_OTHER) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        int r = pthread_setschedparam(thread, policy, &param);
+        if (r != 0) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%s %d",
+                     (policy == SCHED_FIFO) ? "SCHED_FIFO" : "SCHED_RR",
+                     priority);
+            if (!err.empty())
+                err += ", ";
+            err += string(buf) + " (" + strerror(r) + ")";
+        }
+    }
+
+    return err;
+}
+
+
+// Lock all memory of the process.
+string lock_memory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        return string("mlockall failed (") + strerror(errno) + ")";
+    return string();
+}
+
+
+/* ****************  class SchedDelayMonitor  **************** */
+
+// Construct monitor.
+SchedDelayMonitor::SchedDelayMonitor()
+    : m_fd(-1)
+    , m_last_wait(0)
+    , m_max_wait(0)
+    , m_total_wait(0)
+{ }
+
+
+// Close statistics file.
+SchedDelayMonitor::~SchedDelayMonitor()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+
+// Start monitoring the calling thread.
+void SchedDelayMonitor::start()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task/%ld/schedstat",
+             int(getpid()), long(syscall(SYS_gettid)));
+
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = open(path, O_RDONLY);
+    m_last_wait = read_wait();
+}
+
+
+// Account the waiting time since the previous call.
+void SchedDelayMonitor::sample()
+{
+    if (m_fd < 0)
+        return;
+
+    uint64_t wait = read_wait();
+    if (wait >= m_last_wait) {
+        uint64_t d = wait - m_last_wait;
+        m_max_wait = max(m_max_wait, d);
+        m_total_wait += d;
+    }
+    m_last_wait = wait;
+}
+
+
+// Return the cumulative waiting time of the thread.
+uint64_t SchedDelayMonitor::read_wait()
+{
+    // Format: "<run time ns> <wait time ns> <number of time slices>".
+    char buf[128];
+    ssize_t n = pread(m_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    unsigned long long run, wait;
+    if (sscanf(buf, "%llu %llu", &run, &wait) != 2)
+        return 0;
+    return wait;
+}
+
+
+/* ****************  class ThreadSched  **************** */
+
+// Apply the setup to the calling thread and start monitoring it.
+void ThreadSched::enter()
+{
+    if (!m_enabled)
+        return;
+
+    if (m_setup.active())
+        m_error = m_setup.apply(pthread_self());
+    m_delay.start();
+}
+
+/* end */
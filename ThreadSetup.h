@@ -0,0 +1,175 @@
+#ifndef SOFTFM_THREADSETUP_H
+#define SOFTFM_THREADSETUP_H
+
+#include <cstdint>
+#include <string>
+#include <pthread.h>
+
+
+/**
+ * Scheduling setup of a thread: CPU affinity and real-time policy.
+ *
+ * SCHED_FIFO and SCHED_RR need CAP_SYS_NICE or a sufficient RLIMIT_RTPRIO;
+ * without them the setup fails and the thread keeps running with the
+ * normal policy.
+ */
+struct ThreadSetup
+{
+    int cpu;            // CPU to pin the thread to, or -1
+    int policy;         // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int priority;       // 1 .. 99 for SCHED_FIFO and SCHED_RR
+
+    ThreadSetup();
+
+    /**
+     * Parse "cpu[:policy:priority]", where cpu is a CPU number or "-"
+     * to not pin the thread, and policy is "fifo", "rr" or "other".
+     * Return false if the string is not valid.
+     */
+    bool parse(const std::string& s);
+
+    /** Return true if the setup changes anything. */
+    bool active() const
+    {
+        return cpu >= 0 || policy != SCHED_OTHER;
+    }
+
+    /** Return description, e.g. "cpu 2, fifo 50". */
+    std::string describe() const;
+
+    /**
+     * Apply the setup to a thread.
+     * Return an empty string on success, or describe what failed.
+     */
+    std::string apply(pthread_t thread) const;
+};
+
+
+/**
+ * Lock all current and future memory of the process (mlockall), so that
+ * the sample buffers are resident and no page faults occur in the
+ * real-time threads. Return an empty string on success, or the error.
+ */
+std::string lock_memory();
+
+
+/**
+ * Monitor of the scheduling delay of one thread.
+ *
+ * The kernel accounts the time a thread spends runnable but waiting for
+ * a CPU (/proc/<pid>/task/<tid>/schedstat). sample() takes the waiting
+ * time since the previous call; called once per iteration of the thread's
+ * loop, the largest value is the worst delay in one iteration.
+ *
+ * start() and sample() must be called from the monitored thread; the
+ * results may be read by another thread after that thread has finished.
+ */
+class SchedDelayMonitor
+{
+public:
+
+    SchedDelayMonitor();
+    ~SchedDelayMonitor();
+
+    SchedDelayMonitor(const SchedDelayMonitor&) = delete;
+    SchedDelayMonitor& operator=(const SchedDelayMonitor&) = delete;
+
+    /** Start monitoring the calling thread. */
+    void start();
+
+    /** Account the waiting time since the previous call. */
+    void sample();
+
+    /** Return true if the kernel provides the statistics. */
+    bool available() const
+    {
+        return m_fd >= 0;
+    }
+
+    /** Return worst waiting time in one iteration in seconds. */
+    double max_delay() const
+    {
+        return m_max_wait * 1.0e-9;
+    }
+
+    /** Return total waiting time in seconds. */
+    double total_delay() const
+    {
+        return m_total_wait * 1.0e-9;
+    }
+
+private:
+    /** Return the cumulative waiting time in ns, or 0 on error. */
+    std::uint64_t read_wait();
+
+    int             m_fd;
+    std::uint64_t   m_last_wait;
+    std::uint64_t   m_max_wait;
+    std::uint64_t   m_total_wait;
+};
+
+
+/**
+ * Scheduling of one thread: a ThreadSetup which the thread applies to
+ * itself when it starts, the result, and the scheduling delay.
+ *
+ * Nothing happens until configure() is called, so that threads without
+ * a setup do not pay for monitoring.
+ */
+class ThreadSched
+{
+public:
+
+    ThreadSched()
+        : m_enabled(false)
+    { }
+
+    /** Enable setup and monitoring; call before the thread starts. */
+    void configure(const ThreadSetup& setup)
+    {
+        m_setup = setup;
+        m_enabled = true;
+    }
+
+    /** Apply the setup to the calling thread and start monitoring it. */
+    void enter();
+
+    /** Account the scheduling delay; call once per loop iteration. */
+    void sample()
+    {
+        if (m_enabled)
+            m_delay.sample();
+    }
+
+    /** Return true if configure() was called. */
+    bool enabled() const
+    {
+        return m_enabled;
+    }
+
+    /** Return the setup. */
+    const ThreadSetup& setup() const
+    {
+        return m_setup;
+    }
+
+    /** Return the error of applying the setup, or an empty string. */
+    const std::string& error() const
+    {
+        return m_error;
+    }
+
+    /** Return the scheduling delay statistics. */
+    const SchedDelayMonitor& delay() const
+    {
+        return m_delay;
+    }
+
+private:
+    bool                m_enabled;
+    ThreadSetup         m_setup;
+    std::string         m_error;
+    SchedDelayMonitor   m_delay;
+};
+
+#endif
@@ -0,0 +1,1389 @@
+/*
+ * softfm_bench - Throughput benchmark for the SoftFM DSP blocks.
+ *
+ * Each DSP block is run on synthetic FM broadcast data at typical
+ * IF sample rates. The input of each block is what the real decoder
+ * would feed it, obtained by running the decoder chain once.
+ *
+ * Results are reported per input sample of the block under test,
+ * as text, CSV or JSON.
+ *
+ * With -Q, the complete decoder is instead run in each of its optional
+ * modes and checked against the exact mode and against fixed quality
+ * limits (audio SINAD, stereo separation, pilot lock time, PPS timing,
+ * phase discriminator error). The exact mode is also checked against
+ * its stored results at the common rates. The exit status is 1 if any
+ * check fails.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define SOFTFM_BENCH_TSC 1
+#endif
+
+#include "SoftFM.h"
+#include "IQConvert.h"
+#include "PcmConvert.h"
+#include "Filter.h"
+#include "FmDecode.h"
+#include "Fft.h"
+
+using namespace std;
+
+
+/** Number of IF samples per block, as in softfm. */
+static const unsigned int if_block_length = 65536;
+
+
+/** Return monotonic time in seconds. */
+static double get_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+
+/**
+ * CPU cycle counter.
+ *
+ * Uses the hardware cycle counter via perf_event if the kernel permits it,
+ * otherwise the x86 time stamp counter (which counts at a fixed reference
+ * frequency), otherwise nothing.
+ */
+class CycleCounter
+{
+public:
+    CycleCounter()
+        : m_fd(-1)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size           = sizeof(attr);
+        attr.type           = PERF_TYPE_HARDWARE;
+        attr.config         = PERF_COUNT_HW_CPU_CYCLES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        m_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~CycleCounter()
+    {
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    /** Return name of the counter in use. */
+    const char * source() const
+    {
+        if (m_fd >= 0)
+            return "perf";
+#ifdef SOFTFM_BENCH_TSC
+        return "tsc";
+#else
+        return "none";
+#endif
+    }
+
+    /** Return true if cycles can be counted. */
+    bool available() const
+    {
+        return strcmp(source(), "none") != 0;
+    }
+
+    /** Return current counter value. */
+    uint64_t read_count()
+    {
+        if (m_fd >= 0) {
+            uint64_t v = 0;
+            if (read(m_fd, &v, sizeof(v)) == sizeof(v))
+                return v;
+        }
+#ifdef SOFTFM_BENCH_TSC
+        return __rdtsc();
+#else
+        return 0;
+#endif
+    }
+
+private:
+    int m_fd;
+};
+
+
+/** Result of one benchmark. */
+struct BenchResult
+{
+    string      name;
+    double      rate;           // IF sample rate of the scenario
+    uint64_t    samples;        // input samples processed in total
+    double      seconds;
+    double      cycles;         // negative if not available
+};
+
+
+/** Global benchmark settings. */
+struct BenchConfig
+{
+    double          min_time;
+    string          filter;
+    CycleCounter    counter;
+};
+
+
+/**
+ * Run one benchmark.
+ *
+ * pass     :: function which processes the complete input once
+ * nsamples :: number of input samples processed by one pass
+ *
+ * One untimed pass warms up caches and filter state, then passes are
+ * repeated until the minimum time has elapsed.
+ */
+static bool run_bench(BenchConfig& cfg, vector<BenchResult>& results,
+                      const string& name, double rate, size_t nsamples,
+                      const function<void()>& pass)
+{
+    if (!cfg.filter.empty() && name.find(cfg.filter) == string::npos)
+        return false;
+
+    pass();
+
+    uint64_t npass = 0;
+    double t0 = get_time();
+    uint64_t c0 = cfg.counter.read_count();
+    double t1;
+    do {
+        pass();
+        npass++;
+        t1 = get_time();
+    } while (t1 - t0 < cfg.min_time);
+    uint64_t c1 = cfg.counter.read_count();
+
+    BenchResult r;
+    r.name    = name;
+    r.rate    = rate;
+    r.samples = npass * nsamples;
+    r.seconds = t1 - t0;
+    r.cycles  = cfg.counter.available() ? double(c1 - c0) : -1;
+    results.push_back(r);
+    return true;
+}
+
+
+/**
+ * Generate raw 8-bit IQ data of an FM stereo broadcast.
+ *
+ * The station is at -rate/4 from the center, as softfm tunes it.
+ * Left channel 1 kHz, right channel 1.5 kHz (with amplitude right_level),
+ * 19 kHz pilot starting at phase 0, 75 kHz deviation, plus a little noise.
+ */
+static vector<uint8_t> make_fm_signal(double rate, double seconds,
+                                      double right_level=0.4)
+{
+    size_t n = size_t(rate * seconds);
+    vector<uint8_t> raw(2 * n);
+
+    mt19937 rng(1);
+    normal_distribution<double> noise(0, 2.0);
+
+    double phase = 0;
+    double offset = -0.25 * rate;
+    for (size_t i = 0; i < n; i++) {
+        double t = i / rate;
+        double l = 0.4 * sin(2 * M_PI * 1000 * t);
+        double r = right_level * sin(2 * M_PI * 1500 * t);
+        double mpx = 0.45 * (l + r)
+                   + 0.45 * (l - r) * sin(2 * M_PI * 38000 * t)
+                   + 0.1 * sin(2 * M_PI * 19000 * t);
+        phase += 2 * M_PI * (offset + 75000 * mpx) / rate;
+        phase = fmod(phase, 2 * M_PI);
+        double vi = 127.5 + 100 * cos(phase) + noise(rng);
+        double vq = 127.5 + 100 * sin(phase) + noise(rng);
+        raw[2*i]   = uint8_t(max(0.0, min(255.0, rint(vi))));
+        raw[2*i+1] = uint8_t(max(0.0, min(255.0, rint(vq))));
+    }
+
+    return raw;
+}
+
+
+/** Split a vector into blocks of approximately equal size. */
+template <class T>
+static vector<vector<T>> split_blocks(const vector<T>& v, size_t nblocks)
+{
+    vector<vector<T>> blocks;
+    for (size_t i = 0; i < nblocks; i++) {
+        size_t a = v.size() * i / nblocks;
+        size_t b = v.size() * (i + 1) / nblocks;
+        blocks.emplace_back(v.begin() + a, v.begin() + b);
+    }
+    return blocks;
+}
+
+
+/** Concatenate blocks. */
+template <class T>
+static vector<T> join_blocks(const vector<vector<T>>& blocks)
+{
+    vector<T> v;
+    for (const vector<T>& b : blocks)
+        v.insert(v.end(), b.begin(), b.end());
+    return v;
+}
+
+
+/** Benchmark all DSP blocks at the specified IF sample rate. */
+static void bench_rate(BenchConfig& cfg, vector<BenchResult>& results,
+                       double ifrate, double seconds)
+{
+    const double pcmrate = 48000;
+    const double bandwidth_if = FmDecoder::default_bandwidth_if;
+    const double bandwidth_pcm = FmDecoder::default_bandwidth_pcm;
+    const double freq_dev = FmDecoder::default_freq_dev;
+    const double tuning_offset = -0.25 * ifrate;
+
+    // Same parameters as softfm.
+    unsigned int downsample = max(1, int(ifrate / 215.0e3));
+    double rate_baseband = ifrate / downsample;
+    int table_size = 64;
+    int tuning_shift = lrint(-64.0 * tuning_offset / ifrate);
+
+    vector<uint8_t> raw = make_fm_signal(ifrate, seconds);
+    size_t nif = raw.size() / 2;
+    size_t nblocks = max(size_t(1), nif / if_block_length);
+
+    // Run the decoder chain once to obtain the input of each stage.
+    IQSampleVector iq(nif);
+    iq_convert_u8(raw.data(), iq.data(), nif);
+    vector<IQSampleVector> iq_blocks = split_blocks(iq, nblocks);
+
+    vector<IQSampleVector>  tuned_blocks(nblocks), filtered_blocks(nblocks);
+    vector<SampleVector>    phase_blocks(nblocks), baseband_blocks(nblocks);
+    vector<SampleVector>    audio_blocks(nblocks);
+    {
+        FineTuner           tuner(table_size, tuning_shift);
+        LowPassFilterFirIQ  iffilter(10, bandwidth_if / ifrate);
+        PhaseDiscriminator  phasedisc(freq_dev / ifrate);
+        DownsampleFilter    resample_bb(8 * downsample, 0.4 / downsample,
+                                        downsample, true);
+        DownsampleFilter    resample_mono(int(rate_baseband / 1000.0),
+                                          bandwidth_pcm / rate_baseband,
+                                          rate_baseband / pcmrate, false);
+        for (size_t i = 0; i < nblocks; i++) {
+            tuner.process(iq_blocks[i], tuned_blocks[i]);
+            iffilter.process(tuned_blocks[i], filtered_blocks[i]);
+            phasedisc.process(filtered_blocks[i], phase_blocks[i]);
+            if (downsample > 1)
+                resample_bb.process(phase_blocks[i], baseband_blocks[i]);
+            else
+                baseband_blocks[i] = phase_blocks[i];
+            resample_mono.process(baseband_blocks[i], audio_blocks[i]);
+        }
+    }
+
+    size_t n_baseband = join_blocks(baseband_blocks).size();
+    size_t n_audio = join_blocks(audio_blocks).size();
+
+    // IQ conversion.
+    {
+        vector<vector<uint8_t>> raw_blocks = split_blocks(raw, nblocks);
+        IQSampleVector out;
+        run_bench(cfg, results, "iq_convert_u8", ifrate, nif, [&]{
+            for (const vector<uint8_t>& b : raw_blocks) {
+                out.resize(b.size() / 2);
+                iq_convert_u8(b.data(), out.data(), b.size() / 2);
+            }
+        });
+    }
+
+    // Fine tuner.
+    {
+        FineTuner tuner(table_size, tuning_shift);
+        IQSampleVector out;
+        run_bench(cfg, results, "fine_tuner", ifrate, nif, [&]{
+            for (const IQSampleVector& b : iq_blocks)
+                tuner.process(b, out);
+        });
+    }
+
+    // IF filter; the FIR benchmarks also run with the generic kernels
+    // to compare them with the fixed-order kernels.
+    static const struct {
+        const char *suffix;
+        FirKernel kernel;
+    } fir_kernels[] = {
+        { "",           FIR_KERNEL_AUTO },
+        { "_generic",   FIR_KERNEL_GENERIC } };
+    for (const auto& k : fir_kernels) {
+        fir_kernel_select(k.kernel);
+        LowPassFilterFirIQ iffilter(10, bandwidth_if / ifrate);
+        IQSampleVector out;
+        run_bench(cfg, results, string("lowpass_fir_iq") + k.suffix,
+                  ifrate, nif, [&]{
+            for (const IQSampleVector& b : tuned_blocks)
+                iffilter.process(b, out);
+        });
+    }
+    fir_kernel_select(FIR_KERNEL_AUTO);
+
+    // Long FIR filters in direct form and with overlap-save, to find
+    // the crossover (OverlapSaveFilter::min_taps_iq, min_taps_real).
+    static const struct {
+        const char *suffix;
+        FirKernel kernel;
+    } long_fir_kernels[] = {
+        { "_direct",    FIR_KERNEL_DIRECT },
+        { "_fft",       FIR_KERNEL_FFT } };
+    for (unsigned int taps : { 64, 128, 256, 512 }) {
+        for (const auto& k : long_fir_kernels) {
+            fir_kernel_select(k.kernel);
+            LowPassFilterFirIQ fir_iq(taps - 1, bandwidth_if / ifrate);
+            IQSampleVector out;
+            run_bench(cfg, results,
+                      "fir_iq_" + to_string(taps) + k.suffix,
+                      ifrate, nif, [&]{
+                for (const IQSampleVector& b : tuned_blocks)
+                    fir_iq.process(b, out);
+            });
+        }
+        for (const auto& k : long_fir_kernels) {
+            fir_kernel_select(k.kernel);
+            DownsampleFilter fir_real(taps, 0.1, 1, true);
+            SampleVector out;
+            run_bench(cfg, results,
+                      "fir_real_" + to_string(taps) + k.suffix,
+                      ifrate, nif, [&]{
+                for (const SampleVector& b : phase_blocks)
+                    fir_real.process(b, out);
+            });
+        }
+    }
+    fir_kernel_select(FIR_KERNEL_AUTO);
+
+    // Combined tuner and IF decimator, as used with -i 300k.
+    {
+        unsigned int if_downsample = max(1, int(ifrate / 300.0e3));
+        DownsampleFilterIQ ifdecim(table_size, tuning_shift,
+                                   16 * if_downsample,
+                                   bandwidth_if / ifrate, if_downsample);
+        IQSampleVector out;
+        run_bench(cfg, results, "downsample_iq", ifrate, nif, [&]{
+            for (const IQSampleVector& b : iq_blocks)
+                ifdecim.process(b, out);
+        });
+    }
+
+    // Half-band decimator cascade, on tuned IQ samples.
+    {
+        unsigned int stages = FmDecoder::choose_halfband_stages(ifrate);
+        if (stages > 0) {
+            HalfBandDecimatorIQ halfband(stages, bandwidth_if / ifrate);
+            IQSampleVector out;
+            run_bench(cfg, results, "halfband_iq", ifrate, nif, [&]{
+                for (const IQSampleVector& b : tuned_blocks)
+                    halfband.process(b, out);
+            });
+        }
+    }
+
+    // Phase discriminator at each accuracy.
+    {
+        static const struct {
+            const char *name;
+            PhaseDiscriminator::AtanAccuracy accuracy;
+        } modes[] = {
+            { "phase_disc_exact",  PhaseDiscriminator::ATAN_EXACT },
+            { "phase_disc_high",   PhaseDiscriminator::ATAN_HIGH },
+            { "phase_disc_medium", PhaseDiscriminator::ATAN_MEDIUM },
+            { "phase_disc_low",    PhaseDiscriminator::ATAN_LOW } };
+        for (const auto& m : modes) {
+            PhaseDiscriminator phasedisc(freq_dev / ifrate, m.accuracy);
+            SampleVector out;
+            run_bench(cfg, results, m.name, ifrate, nif, [&]{
+                for (const IQSampleVector& b : filtered_blocks)
+                    phasedisc.process(b, out);
+            });
+        }
+    }
+
+    // Integer downsampling of baseband.
+    for (const auto& k : fir_kernels) {
+        if (downsample > 1) {
+            fir_kernel_select(k.kernel);
+            DownsampleFilter resample_bb(8 * downsample, 0.4 / downsample,
+                                         downsample, true);
+            SampleVector out;
+            run_bench(cfg, results, string("downsample_int") + k.suffix,
+                      ifrate, nif, [&]{
+                for (const SampleVector& b : phase_blocks)
+                    resample_bb.process(b, out);
+            });
+        }
+    }
+    fir_kernel_select(FIR_KERNEL_AUTO);
+
+    // Fractional downsampling from baseband to audio rate.
+    for (const auto& k : fir_kernels) {
+        fir_kernel_select(k.kernel);
+        DownsampleFilter resample_mono(int(rate_baseband / 1000.0),
+                                       bandwidth_pcm / rate_baseband,
+                                       rate_baseband / pcmrate, false);
+        SampleVector out;
+        run_bench(cfg, results, string("downsample_frac") + k.suffix,
+                  ifrate, n_baseband, [&]{
+            for (const SampleVector& b : baseband_blocks)
+                resample_mono.process(b, out);
+        });
+    }
+    fir_kernel_select(FIR_KERNEL_AUTO);
+
+    // The same with IIR prefilter and short FIR filter.
+    {
+        HybridDownsampleFilter resample_mono(
+            HybridDownsampleFilter::make_coeff(int(rate_baseband / 1000.0),
+                                               bandwidth_pcm / rate_baseband,
+                                               rate_baseband / pcmrate,
+                                               true));
+        SampleVector out;
+        run_bench(cfg, results, "downsample_hybrid", ifrate, n_baseband, [&]{
+            for (const SampleVector& b : baseband_blocks)
+                resample_mono.process(b, out);
+        });
+    }
+
+    // Stereo pilot PLL.
+    {
+        PilotPhaseLock pll(FmDecoder::pilot_freq / rate_baseband,
+                           50 / rate_baseband, 0.04);
+        SampleVector out;
+        run_bench(cfg, results, "pilot_pll", ifrate, n_baseband, [&]{
+            for (const SampleVector& b : baseband_blocks)
+                pll.process(b, out);
+        });
+    }
+
+    // DC blocking and de-emphasis filters on audio.
+    {
+        HighPassFilterIir dcblock(30.0 / pcmrate);
+        SampleVector buf;
+        run_bench(cfg, results, "highpass_iir", ifrate, n_audio, [&]{
+            for (const SampleVector& b : audio_blocks) {
+                buf.assign(b.begin(), b.end());
+                dcblock.process_inplace(buf);
+            }
+        });
+    }
+    {
+        LowPassFilterRC deemph(
+            FmDecoder::default_deemphasis * pcmrate * 1.0e-6);
+        SampleVector buf;
+        run_bench(cfg, results, "lowpass_rc", ifrate, n_audio, [&]{
+            for (const SampleVector& b : audio_blocks) {
+                buf.assign(b.begin(), b.end());
+                deemph.process_inplace(buf);
+            }
+        });
+    }
+
+    // Conversion of audio samples to output format, with gain.
+    {
+        static const struct {
+            const char *name;
+            PcmFormat format;
+            bool dither;
+        } modes[] = {
+            { "pcm_convert_s16",        PCM_S16_LE,   false },
+            { "pcm_convert_s16_dither", PCM_S16_LE,   true },
+            { "pcm_convert_s24",        PCM_S24_3LE,  false },
+            { "pcm_convert_float",      PCM_FLOAT_LE, false } };
+        for (const auto& m : modes) {
+            PcmConverter conv(m.format, 0.5, m.dither);
+            vector<uint8_t> out;
+            run_bench(cfg, results, m.name, ifrate, n_audio, [&]{
+                for (const SampleVector& b : audio_blocks) {
+                    out.resize(b.size() * conv.sample_size());
+                    conv.convert(b.data(), b.size(), out.data());
+                }
+            });
+        }
+    }
+
+    // Complete decoder.
+    {
+        static const struct {
+            const char *name;
+            bool stereo;
+            bool ifdecim;
+            bool halfband;
+            bool hybrid;
+        } modes[] = {
+            { "fm_decoder_mono",            false, false, false, false },
+            { "fm_decoder_stereo",          true,  false, false, false },
+            { "fm_decoder_stereo_ifdecim",  true,  true,  false, false },
+            { "fm_decoder_stereo_halfband", true,  false, true,  false },
+            { "fm_decoder_stereo_hybrid",   true,  false, false, true } };
+        for (const auto& m : modes) {
+            unsigned int if_downsample =
+                m.ifdecim ? max(1, int(ifrate / 300.0e3)) : 1;
+            unsigned int stages =
+                m.halfband ? FmDecoder::choose_halfband_stages(ifrate) : 0;
+            double rate = ifrate / (if_downsample << stages);
+            unsigned int ds = max(1, int(rate / 215.0e3));
+            FmDecoder fm(ifrate, tuning_offset, pcmrate, m.stereo,
+                         FmDecoder::default_deemphasis,
+                         bandwidth_if, freq_dev, bandwidth_pcm,
+                         ds, if_downsample, stages,
+                         PhaseDiscriminator::ATAN_EXACT, false, m.hybrid);
+            SampleVector out;
+            run_bench(cfg, results, m.name, ifrate, nif, [&]{
+                for (const IQSampleVector& b : iq_blocks)
+                    fm.process(b, out);
+            });
+        }
+    }
+
+    // Power spectrum of the band scan, at 2.5 kHz resolution or better,
+    // and the decoder with its squelch closed.
+    {
+        unsigned int fft_size = 64;
+        while (ifrate / fft_size > 2500)
+            fft_size *= 2;
+        PowerSpectrum spectrum(fft_size);
+        vector<double> power;
+        run_bench(cfg, results, "fft_power_spectrum", ifrate, nif, [&]{
+            for (const IQSampleVector& b : iq_blocks)
+                spectrum.process(b, power);
+        });
+
+        FmDecoder fm(ifrate, tuning_offset, pcmrate, true,
+                     FmDecoder::default_deemphasis,
+                     bandwidth_if, freq_dev, bandwidth_pcm, downsample);
+        fm.set_squelch(1.0e6);
+        SampleVector out;
+        run_bench(cfg, results, "fm_decoder_squelched", ifrate, nif, [&]{
+            for (const IQSampleVector& b : iq_blocks)
+                fm.process(b, out);
+        });
+    }
+
+    // Changing station, as when scanning the band: computing a filter
+    // plan, constructing a decoder from the cached plan, and retuning
+    // an existing decoder. These count one sample per operation.
+    {
+        FmFilterPlan::Key key(ifrate, pcmrate, bandwidth_if, bandwidth_pcm,
+                              downsample, 1, 0, false);
+        run_bench(cfg, results, "fm_filter_plan", ifrate, 1, [&]{
+            FmFilterPlan plan(key);
+        });
+        run_bench(cfg, results, "fm_decoder_create", ifrate, 1, [&]{
+            FmDecoder fm(ifrate, tuning_offset, pcmrate, true,
+                         FmDecoder::default_deemphasis,
+                         bandwidth_if, freq_dev, bandwidth_pcm, downsample);
+        });
+        FmDecoder fm(ifrate, tuning_offset, pcmrate, true,
+                     FmDecoder::default_deemphasis,
+                     bandwidth_if, freq_dev, bandwidth_pcm, downsample);
+        SampleVector out;
+        fm.process(iq_blocks[0], out);
+        unsigned int hop = 0;
+        run_bench(cfg, results, "fm_decoder_retune", ifrate, 1, [&]{
+            fm.retune(tuning_offset + 200000 * (hop++ % 2));
+        });
+    }
+}
+
+
+/** Number of IF samples per block in the quality tests. */
+static const unsigned int quality_block_length = 16384;
+
+
+/**
+ * Decoder mode checked by the quality tests, with its limits.
+ *
+ * The limits were set from the measured values of each mode at 1 .. 3.2
+ * MS/s (double and float builds) with a few dB to spare. The PPS offset
+ * against the exact mode is only known modulo the pilot period, so it
+ * is not checked for modes with a different filter chain (and delay).
+ * The phase error is measured on the phase discriminator alone, so
+ * "-b atan" checks each accuracy level in isolation as well as through
+ * the decoder.
+ */
+struct QualityMode
+{
+    const char *    name;
+    PhaseDiscriminator::AtanAccuracy atan_accuracy;
+    FirKernel       fir_kernel;
+    bool            halfband;
+    double          ifdecim;        // IF decimation rate, or 0
+    bool            pipelined;
+    bool            hybrid;
+    bool            identical;      // output must equal the exact mode
+    double          min_ref_snr;    // dB, against the exact mode
+    double          min_sinad;      // dB, left channel 1 kHz
+    double          min_separation; // dB, left to right at 1 kHz
+    double          max_lock_time;  // seconds
+    double          max_pps_error;  // seconds, PPS interval error
+    double          max_pps_offset; // seconds, against the exact mode,
+                                    // or -1 for a different filter chain
+    double          max_phase_error; // radians, phase discriminator
+};
+
+/** Limit of the SNR against the exact mode due to the sample type. */
+static const double max_ref_snr = (sizeof(Sample) == sizeof(float)) ? 65 : 200;
+
+static const PhaseDiscriminator::AtanAccuracy atan_exact =
+    PhaseDiscriminator::ATAN_EXACT;
+
+static const QualityMode quality_modes[] = {
+//    name          atan                             fir kernel
+//        halfband ifdecim pipe  hybrid identical
+//        ref_snr sinad  sep   lock   pps_err  pps_ofs  phase_err
+    { "exact",      atan_exact,                      FIR_KERNEL_AUTO,
+          false,   0,      false, false, true,
+          190,    42,    25,   0.5,   10e-6,   0,       1e-6 },
+    { "fir_generic", atan_exact,                     FIR_KERNEL_GENERIC,
+          false,   0,      false, false, false,
+          120,    42,    25,   0.5,   10e-6,   1e-6,    1e-6 },
+    { "pipelined",  atan_exact,                      FIR_KERNEL_AUTO,
+          false,   0,      true,  false, true,
+          190,    42,    25,   0.5,   10e-6,   0,       1e-6 },
+    { "atan_high",  PhaseDiscriminator::ATAN_HIGH,   FIR_KERNEL_AUTO,
+          false,   0,      false, false, false,
+          120,    42,    25,   0.5,   10e-6,   1e-6,    1e-6 },
+    { "atan_medium", PhaseDiscriminator::ATAN_MEDIUM, FIR_KERNEL_AUTO,
+          false,   0,      false, false, false,
+          85,     42,    25,   0.5,   10e-6,   1e-6,    15e-6 },
+    { "atan_low",   PhaseDiscriminator::ATAN_LOW,    FIR_KERNEL_AUTO,
+          false,   0,      false, false, false,
+          55,     42,    25,   0.5,   10e-6,   1e-6,    6e-3 },
+    { "halfband",   atan_exact,                      FIR_KERNEL_AUTO,
+          true,    0,      false, false, false,
+          20,     42,    35,   0.5,   10e-6,   -1,      1e-6 },
+    { "ifdecim",    atan_exact,                      FIR_KERNEL_AUTO,
+          false,   300e3,  false, false, false,
+          22,     42,    33,   0.5,   10e-6,   -1,      1e-6 },
+    { "hybrid",     atan_exact,                      FIR_KERNEL_AUTO,
+          false,   0,      false, true,  false,
+          28,     42,    25,   0.5,   10e-6,   1e-6,    1e-6 } };
+
+
+/**
+ * Stored results of the exact mode on the synthetic signal at one rate.
+ *
+ * The exact mode is the reference of the other modes in the same run;
+ * these values catch a change of the exact mode itself. Measured with
+ * the double build. The float build and other compilers agree within
+ * the tolerances below. The noise of make_fm_signal() comes from the
+ * libstdc++ normal_distribution, so other C++ libraries may differ.
+ */
+struct QualityReference
+{
+    double          rate;           // IF sample rate
+    double          sinad;          // dB
+    double          separation;     // dB
+    double          lock_time;      // seconds
+    double          pps_time;       // seconds, first PPS event
+    double          audio_rms;      // both channels, after settling
+};
+
+static const QualityReference quality_references[] = {
+//    rate     sinad   sep     lock      pps_time       audio_rms
+    { 1.0e6,   45.33,  26.75,  0.425984, 1.409544000,   0.164439 },
+    { 1.5e6,   46.97,  30.48,  0.415061, 1.404124000,   0.166902 },
+    { 1.8e6,   47.71,  33.80,  0.418702, 1.409595556,   0.168418 },
+    { 2.4e6,   48.80,  39.31,  0.416427, 1.409595000,   0.169988 },
+    { 3.2e6,   49.98,  44.77,  0.414720, 1.409594375,   0.170850 } };
+
+/** Tolerances of the exact mode against the stored reference. */
+static const double reference_tol_db   = 0.2;
+static const double reference_tol_pps  = 0.1e-6;
+static const double reference_tol_rms  = 1.0e-3;   // relative
+
+
+/** Output of one decoder run. */
+struct DecodeRun
+{
+    SampleVector    audio;          // interleaved left/right
+    double          lock_time;      // seconds of input, or -1
+    vector<double>  pps_times;      // seconds of input per PPS event
+    double          seconds;        // processing time
+};
+
+
+/** Result of the quality tests of one mode. */
+struct QualityResult
+{
+    string      name;
+    double      rate;
+    double      msps;
+    bool        identical;
+    double      ref_snr;
+    bool        have_audio;     // synthetic input: sinad and separation
+    double      sinad;
+    double      separation;
+    double      lock_time;      // -1 if never locked
+    bool        have_pps;       // at least two PPS events
+    double      pps_error;
+    double      pps_offset;
+    double      phase_error;    // radians, phase discriminator
+    string      failed;         // comma-separated failed checks
+};
+
+
+/** Run the complete decoder over the IQ samples in the specified mode. */
+static DecodeRun decode_quality(const IQSampleVector& iq, double ifrate,
+                                const QualityMode& mode)
+{
+    const double pcmrate = 48000;
+
+    // Same decimation choices as softfm.
+    unsigned int if_downsample = 1;
+    if (mode.ifdecim > 0) {
+        if_downsample = max(1, int(ifrate / mode.ifdecim));
+        while (if_downsample > 1 &&
+               ifrate / if_downsample < 2.5 * FmDecoder::default_bandwidth_if)
+            if_downsample--;
+    }
+    unsigned int halfband_stages =
+        mode.halfband ? FmDecoder::choose_halfband_stages(ifrate) : 0;
+    double demod_rate = ifrate / (if_downsample << halfband_stages);
+    unsigned int downsample = max(1, int(demod_rate / 215.0e3));
+    double rate_baseband = demod_rate / downsample;
+
+    fir_kernel_select(mode.fir_kernel);
+    FmDecoder fm(ifrate, -0.25 * ifrate, pcmrate, true, 50,
+                 FmDecoder::default_bandwidth_if,
+                 FmDecoder::default_freq_dev,
+                 FmDecoder::default_bandwidth_pcm,
+                 downsample, if_downsample, halfband_stages,
+                 mode.atan_accuracy, mode.pipelined, mode.hybrid);
+    fir_kernel_select(FIR_KERNEL_AUTO);
+
+    DecodeRun run;
+    run.lock_time = -1;
+
+    IQSampleVector block;
+    SampleVector audio;
+    size_t pos = 0, nreturned = 0;
+    double t0 = get_time();
+    while (true) {
+        size_t n = min<size_t>(quality_block_length, iq.size() - pos);
+        if (n == 0 && fm.pending_blocks() == 0)
+            break;
+        block.assign(iq.begin() + pos, iq.begin() + pos + n);
+        pos += n;
+
+        fm.process(block, audio);
+        if (audio.empty())
+            continue;
+
+        // The status describes the block which was just returned.
+        double end_time = min(iq.size(), (nreturned + 1) *
+                                         size_t(quality_block_length))
+                          / ifrate;
+        nreturned++;
+        if (run.lock_time < 0 && fm.stereo_detected())
+            run.lock_time = end_time;
+        for (const PilotPhaseLock::PpsEvent& ev : fm.get_pps_events())
+            run.pps_times.push_back(ev.sample_index / rate_baseband);
+        run.audio.insert(run.audio.end(), audio.begin(), audio.end());
+    }
+    run.seconds = get_time() - t0;
+
+    return run;
+}
+
+
+/**
+ * Fit a sine wave of frequency freq to one channel of interleaved
+ * stereo audio, starting at frame start.
+ * Return the amplitude; residual receives the mean square of the rest.
+ */
+static double fit_tone(const SampleVector& audio, unsigned int channel,
+                       size_t start, double freq, double rate,
+                       double *residual=NULL)
+{
+    size_t nframes = audio.size() / 2;
+    if (start >= nframes)
+        return 0;
+
+    // Whole periods only, so the sine, cosine and DC are orthogonal.
+    size_t n = nframes - start;
+    size_t period = size_t(rate / freq);
+    if (fmod(rate, freq) == 0 && n > period)
+        n -= n % period;
+
+    double sc = 0, ss = 0, sdc = 0;
+    for (size_t i = 0; i < n; i++) {
+        double x = audio[2 * (start + i) + channel];
+        double w = 2 * M_PI * freq * (start + i) / rate;
+        sc  += x * cos(w);
+        ss  += x * sin(w);
+        sdc += x;
+    }
+    double a = 2 * sc / n, b = 2 * ss / n, dc = sdc / n;
+
+    if (residual != NULL) {
+        double sr = 0;
+        for (size_t i = 0; i < n; i++) {
+            double x = audio[2 * (start + i) + channel];
+            double w = 2 * M_PI * freq * (start + i) / rate;
+            double e = x - a * cos(w) - b * sin(w) - dc;
+            sr += e * e;
+        }
+        *residual = sr / n;
+    }
+
+    return sqrt(a * a + b * b);
+}
+
+
+/** Return the RMS level of interleaved stereo audio from frame start. */
+static double audio_rms(const SampleVector& audio, size_t start)
+{
+    double s = 0;
+    size_t n = 0;
+    for (size_t i = 2 * start; i < audio.size(); i++, n++)
+        s += double(audio[i]) * audio[i];
+    return (n > 0) ? sqrt(s / n) : 0;
+}
+
+
+/**
+ * Return the SNR in dB of audio against the reference, from frame start,
+ * after the best alignment (up to 64 frames) and gain.
+ */
+static double reference_snr(const SampleVector& audio,
+                            const SampleVector& ref, size_t start)
+{
+    const int max_lag = 64;
+    size_t nframes = min(audio.size(), ref.size()) / 2;
+    if (start + 2 * max_lag >= nframes)
+        return 0;
+    size_t n = nframes - start - 2 * max_lag;
+
+    // Limit to 200 dB; rounding can make the residual slightly negative.
+    double best = 1;
+    for (int lag = -max_lag; lag <= max_lag; lag++) {
+        double sxy = 0, sxx = 0, syy = 0;
+        for (size_t i = 2 * (start + max_lag); i < 2 * (start + max_lag + n);
+             i++) {
+            double x = audio[i + 2 * lag], y = ref[i];
+            sxy += x * y;
+            sxx += x * x;
+            syy += y * y;
+        }
+        if (sxx == 0 || syy == 0)
+            continue;
+        // Residual after the least-squares gain, relative to the reference.
+        double rel = max(1.0e-20, 1 - sxy * sxy / (sxx * syy));
+        best = min(best, rel);
+    }
+
+    return -10 * log10(best);
+}
+
+
+/**
+ * Return the maximum error in radians of the phase discriminator at the
+ * specified accuracy against atan2() in double precision. The input
+ * covers all phase steps and an amplitude range of 60 dB.
+ */
+static double phase_error(PhaseDiscriminator::AtanAccuracy accuracy)
+{
+    const unsigned int n = 65536;
+
+    mt19937 rng(1);
+    uniform_real_distribution<double> step(-M_PI, M_PI);
+    uniform_real_distribution<double> level_db(-60, 0);
+    IQSampleVector iq(n);
+    double phase = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        double a = pow(10, level_db(rng) / 20);
+        phase += step(rng);
+        iq[i] = IQSample(a * cos(phase), a * sin(phase));
+    }
+
+    // Full scale 1 / (2 pi) of the sample rate: output in radians.
+    PhaseDiscriminator phasedisc(0.5 / M_PI, accuracy);
+    phasedisc.prime(iq[0]);
+    SampleVector out;
+    phasedisc.process(iq, out);
+
+    double err = 0;
+    for (unsigned int i = 1; i < n; i++) {
+        complex<double> s0(iq[i-1].real(), iq[i-1].imag());
+        complex<double> s1(iq[i].real(), iq[i].imag());
+        double ref = arg(conj(s0) * s1);
+        err = max(err, fabs(remainder(out[i] - ref, 2 * M_PI)));
+    }
+
+    return err;
+}
+
+
+/**
+ * Run the quality tests on IQ samples at the specified rate.
+ *
+ * With synthetic input (the signal of make_fm_signal() with a silent
+ * right channel), the audio and PPS checks are done as well.
+ */
+static void quality_rate(vector<QualityResult>& results,
+                         const IQSampleVector& iq, double ifrate,
+                         bool synthetic, const string& filter)
+{
+    const double pcmrate = 48000;
+    const double settle_time = 0.5;
+
+    DecodeRun ref;
+    bool have_ref = false;
+
+    for (const QualityMode& mode : quality_modes) {
+
+        if (!filter.empty() && string(mode.name).find(filter) == string::npos &&
+            strcmp(mode.name, "exact") != 0)
+            continue;
+
+        DecodeRun run = decode_quality(iq, ifrate, mode);
+        if (!have_ref) {
+            // The first mode is the exact mode.
+            ref = run;
+            have_ref = true;
+        }
+        if (!filter.empty() && string(mode.name).find(filter) == string::npos)
+            continue;
+
+        QualityResult r;
+        r.name       = mode.name;
+        r.rate       = ifrate;
+        r.msps       = iq.size() / run.seconds * 1.0e-6;
+        r.identical  = (run.audio == ref.audio);
+        r.lock_time  = run.lock_time;
+        r.have_audio = synthetic;
+        r.sinad      = 0;
+        r.separation = 0;
+        r.have_pps   = false;
+        r.pps_error  = 0;
+        r.pps_offset = 0;
+        r.phase_error = phase_error(mode.atan_accuracy);
+
+        // Measure after lock and after the audio filters have settled.
+        double from = max(0.0, max(run.lock_time, ref.lock_time)) +
+                      settle_time;
+        size_t start = size_t(from * pcmrate);
+        r.ref_snr = r.identical ? max_ref_snr
+                                : reference_snr(run.audio, ref.audio, start);
+
+        if (synthetic) {
+            double residual;
+            double left = fit_tone(run.audio, 0, start, 1000, pcmrate,
+                                   &residual);
+            double right = fit_tone(run.audio, 1, start, 1000, pcmrate);
+            if (left > 0)
+                r.sinad = 10 * log10(0.5 * left * left /
+                                     max(residual, 1.0e-20));
+            if (left > 0)
+                r.separation = 20 * log10(left / max(right, 1.0e-10));
+
+            // Events are one second apart. Counting starts when the PLL
+            // locks, so compare the first event with the exact mode
+            // modulo the pilot period.
+            if (run.pps_times.size() >= 2 && !ref.pps_times.empty()) {
+                r.have_pps = true;
+                for (size_t i = 1; i < run.pps_times.size(); i++) {
+                    double d = run.pps_times[i] - run.pps_times[i-1];
+                    r.pps_error = max(r.pps_error, fabs(d - 1.0));
+                }
+                double period = 1.0 / PilotPhaseLock::pilot_frequency;
+                r.pps_offset = remainder(run.pps_times[0] - ref.pps_times[0],
+                                         period);
+            }
+        }
+
+        // Compare the exact mode with its stored results. The lock time
+        // is known to one block.
+        const QualityReference *stored = NULL;
+        if (synthetic && &mode == &quality_modes[0]) {
+            for (const QualityReference& q : quality_references) {
+                if (q.rate == ifrate)
+                    stored = &q;
+            }
+        }
+
+        // Check the limits. Unmeasured values fail only where they
+        // should have been measured.
+        vector<string> failed;
+        if (mode.identical && !r.identical)
+            failed.push_back("identical");
+        if (r.ref_snr < min(mode.min_ref_snr, max_ref_snr))
+            failed.push_back("ref_snr");
+        if (r.phase_error > mode.max_phase_error)
+            failed.push_back("phase_error");
+        if (run.lock_time < 0 || run.lock_time > mode.max_lock_time)
+            failed.push_back("lock");
+        if (synthetic) {
+            if (r.sinad < mode.min_sinad)
+                failed.push_back("sinad");
+            if (r.separation < mode.min_separation)
+                failed.push_back("separation");
+            if (!r.have_pps || r.pps_error > mode.max_pps_error)
+                failed.push_back("pps_error");
+            if (r.have_pps && mode.max_pps_offset >= 0 &&
+                fabs(r.pps_offset) > mode.max_pps_offset)
+                failed.push_back("pps_offset");
+        }
+        if (stored != NULL) {
+            double block_time = quality_block_length / ifrate;
+            if (fabs(r.sinad - stored->sinad) > reference_tol_db ||
+                fabs(r.separation - stored->separation) > reference_tol_db)
+                failed.push_back("stored_audio");
+            if (fabs(run.lock_time - stored->lock_time) > 1.01 * block_time)
+                failed.push_back("stored_lock");
+            if (run.pps_times.empty() ||
+                fabs(run.pps_times[0] - stored->pps_time) > reference_tol_pps)
+                failed.push_back("stored_pps");
+            double rms = audio_rms(run.audio, start);
+            if (fabs(rms / stored->audio_rms - 1) > reference_tol_rms)
+                failed.push_back("stored_rms");
+        }
+        for (size_t i = 0; i < failed.size(); i++)
+            r.failed += (i > 0 ? "," : "") + failed[i];
+
+        results.push_back(r);
+    }
+}
+
+
+/** Format a quality value for the text table; "-" if not measured. */
+static string format_quality(bool measured, double v, double scale,
+                             const char *fmt)
+{
+    if (!measured)
+        return "-";
+    char buf[32];
+    snprintf(buf, sizeof(buf), fmt, v * scale);
+    return buf;
+}
+
+
+/** Print quality results as text table. */
+static void print_quality_text(const vector<QualityResult>& results)
+{
+    printf("%-12s %9s %8s %8s %7s %7s %8s %8s %8s %9s  %s\n",
+           "MODE", "RATE", "MS/S", "REF_DB", "SINAD", "SEP_DB",
+           "LOCK_MS", "PPS_US", "OFS_US", "PHASE_UR", "RESULT");
+    for (const QualityResult& r : results) {
+        printf("%-12s %9.0f %8.2f %8s %7s %7s %8s %8s %8s %9s  %s\n",
+               r.name.c_str(), r.rate, r.msps,
+               r.identical ? "same"
+                           : format_quality(true, r.ref_snr, 1, "%.1f").c_str(),
+               format_quality(r.have_audio, r.sinad, 1, "%.1f").c_str(),
+               format_quality(r.have_audio, r.separation, 1, "%.1f").c_str(),
+               (r.lock_time < 0) ? "never"
+                   : format_quality(true, r.lock_time, 1000, "%.1f").c_str(),
+               format_quality(r.have_pps, r.pps_error, 1.0e6, "%.2f").c_str(),
+               format_quality(r.have_pps, r.pps_offset, 1.0e6, "%.2f").c_str(),
+               format_quality(true, r.phase_error, 1.0e6, "%.2f").c_str(),
+               r.failed.empty() ? "ok" : ("FAIL " + r.failed).c_str());
+    }
+}
+
+
+/** Format a quality value for CSV and JSON; null if not measured. */
+static string format_quality_json(bool measured, double v)
+{
+    if (!measured)
+        return "null";
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", v);
+    return buf;
+}
+
+
+/** Print quality results as CSV. */
+static void print_quality_csv(const vector<QualityResult>& results)
+{
+    printf("mode,rate,msps,identical,ref_snr_db,sinad_db,separation_db,"
+           "lock_time,pps_error,pps_offset,phase_error,failed\n");
+    for (const QualityResult& r : results) {
+        printf("%s,%.0f,%.4f,%d,%s,%s,%s,%s,%s,%s,%s,%s\n",
+               r.name.c_str(), r.rate, r.msps, int(r.identical),
+               format_quality_json(true, r.ref_snr).c_str(),
+               format_quality_json(r.have_audio, r.sinad).c_str(),
+               format_quality_json(r.have_audio, r.separation).c_str(),
+               format_quality_json(r.lock_time >= 0, r.lock_time).c_str(),
+               format_quality_json(r.have_pps, r.pps_error).c_str(),
+               format_quality_json(r.have_pps, r.pps_offset).c_str(),
+               format_quality_json(true, r.phase_error).c_str(),
+               r.failed.c_str());
+    }
+}
+
+
+/** Print quality results as JSON. */
+static void print_quality_json(const vector<QualityResult>& results)
+{
+    printf("{\n");
+    printf("  \"sample_type\": \"%s\",\n",
+           (sizeof(Sample) == sizeof(float)) ? "float" : "double");
+    printf("  \"iq_conversion\": \"%s\",\n", iq_convert_kernel_name());
+    printf("  \"pcm_conversion\": \"%s\",\n", pcm_convert_kernel_name());
+    printf("  \"quality\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const QualityResult& r = results[i];
+        printf("    { \"mode\": \"%s\", \"rate\": %.0f, \"msps\": %.4f, "
+               "\"identical\": %s, \"ref_snr_db\": %s, \"sinad_db\": %s, "
+               "\"separation_db\": %s, \"lock_time\": %s, "
+               "\"pps_error\": %s, \"pps_offset\": %s, "
+               "\"phase_error\": %s, \"failed\": \"%s\" }%s\n",
+               r.name.c_str(), r.rate, r.msps,
+               r.identical ? "true" : "false",
+               format_quality_json(true, r.ref_snr).c_str(),
+               format_quality_json(r.have_audio, r.sinad).c_str(),
+               format_quality_json(r.have_audio, r.separation).c_str(),
+               format_quality_json(r.lock_time >= 0, r.lock_time).c_str(),
+               format_quality_json(r.have_pps, r.pps_error).c_str(),
+               format_quality_json(r.have_pps, r.pps_offset).c_str(),
+               format_quality_json(true, r.phase_error).c_str(),
+               r.failed.c_str(),
+               (i + 1 < results.size()) ? "," : "");
+    }
+    printf("  ]\n");
+    printf("}\n");
+}
+
+
+/** Print results as text table. */
+static void print_text(const vector<BenchResult>& results)
+{
+    printf("%-28s %9s %10s %9s %10s\n",
+           "BENCHMARK", "RATE", "NS/SAMPLE", "MS/S", "CYC/SAMPLE");
+    for (const BenchResult& r : results) {
+        printf("%-28s %9.0f %10.3f %9.2f",
+               r.name.c_str(), r.rate,
+               1.0e9 * r.seconds / r.samples,
+               r.samples / r.seconds * 1.0e-6);
+        if (r.cycles >= 0)
+            printf(" %10.2f\n", r.cycles / r.samples);
+        else
+            printf(" %10s\n", "-");
+    }
+}
+
+
+/** Print results as CSV. */
+static void print_csv(const vector<BenchResult>& results)
+{
+    printf("name,rate,samples,seconds,ns_per_sample,msps,cycles_per_sample\n");
+    for (const BenchResult& r : results) {
+        printf("%s,%.0f,%llu,%.6f,%.4f,%.4f,",
+               r.name.c_str(), r.rate, (unsigned long long)r.samples,
+               r.seconds, 1.0e9 * r.seconds / r.samples,
+               r.samples / r.seconds * 1.0e-6);
+        if (r.cycles >= 0)
+            printf("%.4f\n", r.cycles / r.samples);
+        else
+            printf("\n");
+    }
+}
+
+
+/** Print results as JSON. */
+static void print_json(const vector<BenchResult>& results,
+                       const BenchConfig& cfg)
+{
+    printf("{\n");
+    printf("  \"sample_type\": \"%s\",\n",
+           (sizeof(Sample) == sizeof(float)) ? "float" : "double");
+    printf("  \"iq_conversion\": \"%s\",\n", iq_convert_kernel_name());
+    printf("  \"pcm_conversion\": \"%s\",\n", pcm_convert_kernel_name());
+    printf("  \"cycle_counter\": \"%s\",\n", cfg.counter.source());
+    printf("  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        printf("    { \"name\": \"%s\", \"rate\": %.0f, \"samples\": %llu, "
+               "\"seconds\": %.6f, \"ns_per_sample\": %.4f, "
+               "\"msps\": %.4f, \"cycles_per_sample\": ",
+               r.name.c_str(), r.rate, (unsigned long long)r.samples,
+               r.seconds, 1.0e9 * r.seconds / r.samples,
+               r.samples / r.seconds * 1.0e-6);
+        if (r.cycles >= 0)
+            printf("%.4f }", r.cycles / r.samples);
+        else
+            printf("null }");
+        printf("%s\n", (i + 1 < results.size()) ? "," : "");
+    }
+    printf("  ]\n");
+    printf("}\n");
+}
+
+
+static void usage()
+{
+    fprintf(stderr,
+    "Usage: softfm_bench [options]\n"
+            "  -r rates      Comma-separated IF sample rates in Hz\n"
+            "                (default 1000000,1500000,2400000)\n"
+            "  -t seconds    Minimum run time per benchmark (default 0.5)\n"
+            "  -b name       Only run benchmarks whose name contains name\n"
+            "  -F format     Output format: text, csv or json (default text)\n"
+            "  -Q            Run the quality tests of the decoder modes\n"
+            "                instead of the benchmarks (-b selects modes)\n"
+            "  -I filename   Also run the quality tests on a recorded 8-bit\n"
+            "                IQ file (station at -rate/4, the first rate\n"
+            "                of -r)\n"
+            "\n"
+            "Results are per input sample of each DSP block.\n"
+            "The quality tests exit with status 1 if any check fails.\n"
+            "\n");
+}
+
+
+int main(int argc, char **argv)
+{
+    vector<double> rates;
+    string format("text");
+    BenchConfig cfg;
+    cfg.min_time = 0.5;
+    bool quality = false;
+    string infilename;
+
+    int c;
+    while ((c = getopt(argc, argv, "r:t:b:F:QI:h")) >= 0) {
+        switch (c) {
+            case 'r':
+                {
+                    rates.clear();
+                    string arg(optarg);
+                    size_t pos = 0;
+                    for (;;) {
+                        size_t sep = arg.find(',', pos);
+                        double rate = atof(arg.substr(pos, sep - pos).c_str());
+                        if (rate <= 0) {
+                            usage();
+                            fprintf(stderr, "ERROR: Invalid argument for -r\n");
+                            exit(1);
+                        }
+                        rates.push_back(rate);
+                        if (sep == string::npos)
+                            break;
+                        pos = sep + 1;
+                    }
+                }
+                break;
+            case 't':
+                cfg.min_time = atof(optarg);
+                break;
+            case 'b':
+                cfg.filter = optarg;
+                break;
+            case 'F':
+                format = optarg;
+                if (format != "text" && format != "csv" && format != "json") {
+                    usage();
+                    fprintf(stderr, "ERROR: Invalid argument for -F\n");
+                    exit(1);
+                }
+                break;
+            case 'Q':
+                quality = true;
+                break;
+            case 'I':
+                infilename = optarg;
+                quality = true;
+                break;
+            default:
+                usage();
+                exit(c == 'h' ? 0 : 1);
+        }
+    }
+
+    if (rates.empty())
+        rates = { 1.0e6, 1.5e6, 2.4e6 };
+
+    fprintf(stderr, "softfm_bench: %s samples, IQ conversion %s, "
+                    "PCM conversion %s, cycle counter %s\n",
+            (sizeof(Sample) == sizeof(float)) ? "float" : "double",
+            iq_convert_kernel_name(), pcm_convert_kernel_name(),
+            cfg.counter.source());
+
+    if (quality) {
+        vector<QualityResult> qresults;
+
+        for (double rate : rates) {
+            fprintf(stderr, "running quality tests at %.0f S/s ...\n", rate);
+            vector<uint8_t> raw = make_fm_signal(rate, 4.0, 0.0);
+            IQSampleVector iq(raw.size() / 2);
+            iq_convert_u8(raw.data(), iq.data(), iq.size());
+            quality_rate(qresults, iq, rate, true, cfg.filter);
+        }
+
+        if (!infilename.empty()) {
+            fprintf(stderr, "running quality tests on '%s' ...\n",
+                    infilename.c_str());
+            FILE *f = fopen(infilename.c_str(), "rb");
+            if (f == NULL) {
+                fprintf(stderr, "ERROR: can not open '%s' (%s)\n",
+                        infilename.c_str(), strerror(errno));
+                exit(1);
+            }
+            vector<uint8_t> raw;
+            uint8_t buf[65536];
+            size_t k;
+            while ((k = fread(buf, 1, sizeof(buf), f)) > 0)
+                raw.insert(raw.end(), buf, buf + k);
+            fclose(f);
+            IQSampleVector iq(raw.size() / 2);
+            iq_convert_u8(raw.data(), iq.data(), iq.size());
+            quality_rate(qresults, iq, rates[0], false, cfg.filter);
+        }
+
+        if (format == "csv")
+            print_quality_csv(qresults);
+        else if (format == "json")
+            print_quality_json(qresults);
+        else
+            print_quality_text(qresults);
+
+        for (const QualityResult& r : qresults) {
+            if (!r.failed.empty())
+                return 1;
+        }
+        return 0;
+    }
+
+    vector<BenchResult> results;
+    for (double rate : rates) {
+        fprintf(stderr, "running benchmarks at %.0f S/s ...\n", rate);
+        bench_rate(cfg, results, rate, 1.0);
+    }
+
+    if (format == "csv")
+        print_csv(results);
+    else if (format == "json")
+        print_json(results, cfg);
+    else
+        print_text(results);
+
+    return 0;
+}
+
+/* end */
@@ -17,6 +17,7 @@
  *  with this program; if not, see http://www.gnu.org/licenses/gpl-2.0.html
  */
 
+#include <cstdint>
 #include <cstdlib>
 #include <cstdio>
 #include <climits>
@@ -25,19 +26,32 @@
 #include <cstring>
 #include <algorithm>
 #include <atomic>
-#include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
 #include <unistd.h>
 #include <getopt.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "SoftFM.h"
+#include "BlockPool.h"
+#include "DataBuffer.h"
+#include "SampleSource.h"
 #include "RtlSdrSource.h"
+#include "FileSource.h"
+#include "IQConvert.h"
+#include "PcmConvert.h"
 #include "FmDecode.h"
+#include "MultiDecode.h"
 #include "AudioOutput.h"
+#include "LatencyStats.h"
+#include "DriftControl.h"
+#include "RdsDecoder.h"
+#include "BandScan.h"
+#include "IqRecorder.h"
+#include "ThreadSetup.h"
 
 using namespace std;
 
@@ -46,95 +60,12 @@ using namespace std;
 static atomic_bool stop_flag(false);
 
 
-/** Buffer to move sample data between threads. */
-template <class Element>
-class DataBuffer
+/** Return monotonic time in seconds, for measuring durations. */
+double get_monotonic_time()
 {
-public:
-    /** Constructor. */
-    DataBuffer()
-        : m_qlen(0)
-        , m_end_marked(false)
-    { }
-
-    /** Add samples to the queue. */
-    void push(vector<Element>&& samples)
-    {
-        if (!samples.empty()) {
-            unique_lock<mutex> lock(m_mutex);
-            m_qlen += samples.size();
-            m_queue.push(move(samples));
-            lock.unlock();
-            m_cond.notify_all();
-        }
-    }
-
-    /** Mark the end of the data stream. */
-    void push_end()
-    {
-        unique_lock<mutex> lock(m_mutex);
-        m_end_marked = true;
-        lock.unlock();
-        m_cond.notify_all();
-    }
-
-    /** Return number of samples in queue. */
-    size_t queued_samples()
-    {
-        unique_lock<mutex> lock(m_mutex);
-        return m_qlen;
-    }
-
-    /**
-     * If the queue is non-empty, remove a block from the queue and
-     * return the samples. If the end marker has been reached, return
-     * an empty vector. If the queue is empty, wait until more data is pushed
-     * or until the end marker is pushed.
-     */
-    vector<Element> pull()
-    {
-        vector<Element> ret;
-        unique_lock<mutex> lock(m_mutex);
-        while (m_queue.empty() && !m_end_marked)
-            m_cond.wait(lock);
-        if (!m_queue.empty()) {
-            m_qlen -= m_queue.front().size();
-            swap(ret, m_queue.front());
-            m_queue.pop();
-        }
-        return ret;
-    }
-
-    /** Return true if the end has been reached at the Pull side. */
-    bool pull_end_reached()
-    {
-        unique_lock<mutex> lock(m_mutex);
-        return m_qlen == 0 && m_end_marked;
-    }
-
-    /** Wait until the buffer contains minfill samples or an end marker. */
-    void wait_buffer_fill(size_t minfill)
-    {
-        unique_lock<mutex> lock(m_mutex);
-        while (m_qlen < minfill && !m_end_marked)
-            m_cond.wait(lock);
-    }
-
-private:
-    size_t              m_qlen;
-    bool                m_end_marked;
-    queue<vector<Element>> m_queue;
-    mutex               m_mutex;
-    condition_variable  m_cond;
-};
-
-
-/** Simple linear gain adjustment. */
-void adjust_gain(SampleVector& samples, double gain)
-{
-    for (unsigned int i = 0, n = samples.size(); i < n; i++) {
-        samples[i] *= gain;
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
 }
 
 
@@ -145,55 +76,298 @@ void adjust_gain(SampleVector& samples, double gain)
  * The RTL-SDR library is not capable of buffering large amounts of data.
  * Running this in a background thread ensures that the time between calls
  * to RtlSdrSource::get_samples() is very short.
+ *
+ * Each block is stamped with the time at which it was received,
+ * for measuring the end-to-end latency.
  */
-void read_source_data(RtlSdrSource *rtlsdr, DataBuffer<IQSample> *buf)
+void read_source_data(SampleSource *source, BlockPool<IQSample> *pool,
+                      DataBuffer<IQSample> *buf, LatencyStats *read_stats,
+                      ThreadSched *sched)
 {
-    IQSampleVector iqsamples;
+    sched->enter();
 
     while (!stop_flag.load()) {
 
-        if (!rtlsdr->get_samples(iqsamples)) {
-            fprintf(stderr, "ERROR: RtlSdr: %s\n", rtlsdr->error().c_str());
+        sched->sample();
+
+        IQSampleVector iqsamples = pool->alloc();
+
+        double t0 = get_monotonic_time();
+        bool ok = source->get_samples(iqsamples);
+        double t1 = get_monotonic_time();
+        read_stats->add(t1 - t0);
+
+        if (!ok) {
+            fprintf(stderr, "ERROR: source: %s\n", source->error().c_str());
             exit(1);
         }
 
-        buf->push(move(iqsamples));
+        // End of file.
+        if (iqsamples.empty())
+            break;
+
+        double stamp = source->get_receive_time();
+        buf->push(move(iqsamples), (stamp > 0) ? stamp : t1);
     }
 
     buf->push_end();
 }
 
 
+/** Output state of one radio station. */
+struct Station
+{
+    Station(size_t audio_block_size, unsigned int poolblocks)
+        : freq(0)
+        , pool(audio_block_size,
+               DataBuffer<Sample>::default_capacity,
+               poolblocks)
+        , got_stereo(false)
+        , last_latency(0)
+        , fill_target(0)
+        , underruns(0)
+        , drops(0)
+        , resample_ratio(1)
+        , drift_ppm(0)
+    { }
+
+    double                  freq;
+    unique_ptr<AudioOutput> output;
+    BlockPool<Sample>       pool;           // alloc: main thread,
+                                            // release: output thread
+    DataBuffer<Sample>      buffer;
+    thread                  output_thread;
+    bool                    got_stereo;
+    LatencyStats            write_stats;    // seconds per write
+    LatencyStats            queue_stats;    // seconds of buffered audio
+    LatencyStats            latency_stats;  // seconds from receive to write
+    LatencyStats            latency_total;  // same, for the whole run
+    atomic<double>          last_latency;   // most recent latency
+    atomic<size_t>          fill_target;    // current output buffer target
+    atomic<unsigned int>    underruns;      // output buffer ran empty
+    atomic<unsigned int>    drops;          // blocks dropped to cut delay
+    atomic<double>          resample_ratio; // clock drift compensation
+    atomic<double>          drift_ppm;      // estimated clock drift
+    ThreadSched             output_sched;   // setup of output thread
+
+    /** Write a block to the output and record the latency. */
+    void write(const SampleVector& samples, double stamp)
+    {
+        double t0 = get_monotonic_time();
+        output->write(samples);
+        double t1 = get_monotonic_time();
+        write_stats.add(t1 - t0);
+        if (stamp > 0) {
+            latency_stats.add(t1 - stamp);
+            latency_total.add(t1 - stamp);
+            last_latency.store(t1 - stamp);
+        }
+    }
+};
+
+
+/**
+ * Fill level policy of an output buffer.
+ *
+ * With a fixed buffer, the output thread waits until the buffer holds
+ * target samples whenever it runs empty.
+ *
+ * With an adaptive buffer (max_target > 0), the target also limits the
+ * delay: when the buffer never dropped below the target within a few
+ * seconds, a block is dropped. An underrun raises the target by half,
+ * and every 10 seconds without underrun it is lowered by 10%, always
+ * within min_target .. max_target.
+ *
+ * With drift compensation (drain_rate > 0), the fill level also controls
+ * the audio resampling ratio, so that the buffer neither grows nor runs
+ * empty when the receiver and sound card clocks differ.
+ */
+struct OutputFill
+{
+    size_t  target;
+    size_t  min_target;
+    size_t  max_target;
+    double  drain_rate;     // samples per second, or 0 to disable
+};
+
+
 /**
  * Get data from output buffer and write to output stream.
  *
  * This code runs in a separate thread.
  */
-void write_output_data(AudioOutput *output, DataBuffer<Sample> *buf,
-                       unsigned int buf_minfill)
+void write_output_data(Station *st, OutputFill fill)
 {
+    // Underruns while the device buffer fills up at the start do not count.
+    const double grace_time = 1.0;
+    const double lower_interval = 10.0;
+    const double drop_interval = 2.0;
+
+    bool adaptive = (fill.max_target > 0);
+    bool compensate = (fill.drain_rate > 0);
+    DriftControl drift(compensate ? fill.drain_rate : 1);
+    size_t target = fill.target;
+    if (adaptive)
+        drift.set_reference(target);
+    size_t min_level = SIZE_MAX;
+    double start_time = get_monotonic_time();
+    double next_lower = start_time + lower_interval;
+    double next_drop_check = start_time + drop_interval;
+
+    st->fill_target.store(target);
+
+    st->output_sched.enter();
+
     while (!stop_flag.load()) {
 
-        if (buf->queued_samples() == 0) {
+        st->output_sched.sample();
+
+        if (st->buffer.queued_samples() == 0) {
             // The buffer is empty. Perhaps the output stream is consuming
             // samples faster than we can produce them. Wait until the buffer
             // is back at its nominal level to make sure this does not happen
             // too often.
-            buf->wait_buffer_fill(buf_minfill);
+            double now = get_monotonic_time();
+            if (adaptive && now > start_time + grace_time) {
+                st->underruns++;
+                target = min(fill.max_target, target + target / 2);
+                st->fill_target.store(target);
+                drift.set_reference(target);
+                next_lower = now + lower_interval;
+            }
+            st->buffer.wait_buffer_fill(target);
+            min_level = SIZE_MAX;
+            drift.restart();
         }
 
-        if (buf->pull_end_reached()) {
+        if (st->buffer.pull_end_reached()) {
             // Reached end of stream.
             break;
         }
 
+        if (adaptive) {
+            double now = get_monotonic_time();
+            min_level = min(min_level, st->buffer.queued_samples());
+            if (now >= next_lower) {
+                target = max(fill.min_target, target - target / 10);
+                st->fill_target.store(target);
+                drift.set_reference(target);
+                next_lower = now + lower_interval;
+            }
+            if (now >= next_drop_check) {
+                bool excess = (min_level != SIZE_MAX && min_level > target);
+                min_level = SIZE_MAX;
+                next_drop_check = now + drop_interval;
+                if (excess) {
+                    // The buffer held more than the target all the time;
+                    // drop a block to bring the delay back down.
+                    st->pool.release(st->buffer.pull());
+                    st->drops++;
+                    drift.restart();
+                    continue;
+                }
+            }
+        }
+
+        // Adjust the resampling ratio of the decoder.
+        if (compensate) {
+            st->resample_ratio.store(
+                drift.update(st->buffer.queued_samples(),
+                             get_monotonic_time()));
+            st->drift_ppm.store(drift.drift_ppm());
+        }
+
         // Get samples from buffer and write to output.
-        SampleVector samples = buf->pull();
-        output->write(samples);
-        if (!(*output)) {
-            fprintf(stderr, "ERROR: AudioOutput: %s\n", output->error().c_str());
+        double stamp;
+        SampleVector samples = st->buffer.pull(&stamp);
+        st->write(samples, stamp);
+        if (!(*st->output)) {
+            fprintf(stderr, "ERROR: AudioOutput: %s\n",
+                    st->output->error().c_str());
+        }
+        st->pool.release(move(samples));
+    }
+
+    // Discard remaining blocks so the main thread can not get stuck
+    // pushing into a full buffer.
+    while (!st->buffer.pull_end_reached())
+        st->buffer.pull();
+}
+
+
+/** Return label to prefix messages about a station. */
+string station_label(double freq)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "[%.3f MHz] ", freq * 1.0e-6);
+    return buf;
+}
+
+
+/**
+ * Return output file name for a station.
+ *
+ * With several stations, the frequency is inserted before the extension:
+ * "radio.wav" becomes "radio-94.900M.wav".
+ */
+string station_filename(const string& filename, double freq,
+                        unsigned int nstation)
+{
+    if (nstation <= 1)
+        return filename;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "-%.3fM", freq * 1.0e-6);
+
+    size_t dot = filename.rfind('.');
+    size_t slash = filename.rfind('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+        return filename + buf;
+    return filename.substr(0, dot) + buf + filename.substr(dot);
+}
+
+
+/**
+ * Choose tuner frequency to receive all stations.
+ *
+ * A single station is received at a quarter of the sample rate away
+ * from the tuner frequency, to avoid the DC offset of the receiver.
+ * For multiple stations, the tuner is placed close to the center of
+ * the band, preferably at least one IF bandwidth away from any station.
+ *
+ * Return 0 if the stations do not fit in the IF bandwidth.
+ */
+double choose_tuner_freq(const vector<double>& freqs, double ifrate)
+{
+    if (freqs.size() == 1)
+        return freqs[0] + 0.25 * ifrate;
+
+    double fmin = *min_element(freqs.begin(), freqs.end());
+    double fmax = *max_element(freqs.begin(), freqs.end());
+    double center = 0.5 * (fmin + fmax);
+    double bw = FmDecoder::default_bandwidth_if;
+    double step = 10.0e3;
+
+    // Try positions of increasing distance from the center,
+    // first with the DC constraint, then without it.
+    for (int pass = 0; pass < 2; pass++) {
+        for (int k = 0; k * step < 0.5 * ifrate; k++) {
+            for (int sign = 1; sign >= -1; sign -= 2) {
+                double tuner = center + sign * k * step;
+                bool ok = true;
+                for (double f : freqs) {
+                    double offset = fabs(f - tuner);
+                    if (offset + bw > 0.45 * ifrate ||
+                        (pass == 0 && offset < bw))
+                        ok = false;
+                }
+                if (ok)
+                    return tuner;
+            }
         }
     }
+
+    return 0;
 }
 
 
@@ -215,21 +389,94 @@ void usage()
 {
     fprintf(stderr,
     "Usage: softfm -f freq [options]\n"
+    "       softfm -X fmin,fmax[,snr] [options]\n"
             "  -f freq       Frequency of radio station in Hz\n"
+            "                or comma-separated list to decode several stations\n"
+            "  -X fmin,fmax[,snr]\n"
+            "                Scan the band from fmin to fmax Hz and list the\n"
+            "                stations with a signal-to-noise ratio of at\n"
+            "                least snr dB (default 10)\n"
             "  -d devidx     RTL-SDR device index, 'list' to show device list (default 0)\n"
+            "  -I filename   Read IQ samples from file instead of RTL-SDR\n"
+            "                (8-bit rtl_sdr format, or 32-bit float for\n"
+            "                .cf32/.cfile) as fast as possible\n"
+            "  -c freq       Center frequency of IQ file in Hz (default: the\n"
+            "                frequency where softfm would tune the device;\n"
+            "                required with -X)\n"
             "  -g gain       Set LNA gain in dB, or 'auto' (default auto)\n"
             "  -a            Enable RTL AGC mode (default disabled)\n"
             "  -s ifrate     IF sample rate in Hz (default 1000000)\n"
             "                (valid ranges: [225001, 300000], [900001, 3200000]))\n"
             "  -r pcmrate    Audio sample rate in Hz (default 48000 Hz)\n"
             "  -M            Disable stereo decoding\n"
-            "  -R filename   Write audio data as raw S16_LE samples\n"
+            "  -i rate       Decimate IF signal to approximately this rate\n"
+            "                before demodulation (default: no decimation,\n"
+            "                300 kHz when decoding several stations)\n"
+            "  -H            Decimate IF signal with half-band filters to\n"
+            "                300 .. 600 kHz before the IF filter\n"
+            "  -q accuracy   Phase discriminator accuracy: exact, high, medium\n"
+            "                or low (default exact)\n"
+            "  -p            Run decoder stages in parallel worker threads\n"
+            "  -Y            Resample audio with an IIR prefilter and a\n"
+            "                shorter FIR filter (faster, slight droop and\n"
+            "                phase shift near 15 kHz)\n"
+            "  -R filename   Write audio data as raw samples (default S16_LE)\n"
             "                use filename '-' to write to stdout\n"
             "  -W filename   Write audio data to .WAV file\n"
+            "  -U dest[,dest...][,ms]\n"
+            "                Send audio as RTP (L16) over UDP to each\n"
+            "                destination host:port, with ms of audio per\n"
+            "                packet (default 5); with several stations the\n"
+            "                port is raised by 2 for each next station\n"
+            "  -F format     Audio sample format: s16, s24, s32 or float\n"
+            "                (default s16, for ALSA the best format the\n"
+            "                device supports)\n"
+            "  -D            Add TPDF dither to 16-bit and 24-bit samples\n"
             "  -P [device]   Play audio via ALSA device (default 'default')\n"
+            "                comma-separated list for several stations\n"
+            "  -L ms[,ms]    ALSA device buffer time and period time in ms\n"
+            "                (default 500 ms, period 1/4 of the buffer);\n"
+            "                use with -b 0 for low latency\n"
             "  -T filename   Write pulse-per-second timestamps\n"
             "                use filename '-' to write to stdout\n"
+            "                (for the first station only)\n"
+            "  -E filename   Decode RDS and write one line per group (group\n"
+            "                type, blocks, program service name, RadioText\n"
+            "                and clock time)\n"
+            "                use filename '-' to write to stdout\n"
+            "  -l ms         Low-latency mode for live monitoring with a\n"
+            "                latency budget in ms: small blocks decoded\n"
+            "                while they arrive, ALSA buffer of half the\n"
+            "                budget (unless -L), adaptive audio buffer\n"
+            "                (unless -b) and no discarded first block\n"
+            "  -Q level      Squelch: skip audio decoding and output silence\n"
+            "                while the IF level is below level dB\n"
             "  -b seconds    Set audio buffer size in seconds\n"
+            "  -A nbuf[,len] Use asynchronous USB streaming with nbuf buffers\n"
+            "                of len samples each (default 16 buffers, 65536)\n"
+            "  -B nblocks    Preallocate nblocks IQ and audio sample blocks\n"
+            "                (default 8)\n"
+            "  -O file[,limit][,gz]\n"
+            "                Record the raw 8-bit IQ samples to file while\n"
+            "                decoding; with limit (bytes, e.g. 500M, or\n"
+            "                seconds, e.g. 600s) start a new numbered file\n"
+            "                after each limit; gz compresses with gzip\n"
+            "  -K thread:cpu[:policy:prio],...\n"
+            "                Pin threads to a CPU ('-' for any) and set\n"
+            "                their scheduling policy (fifo, rr or other)\n"
+            "                and priority; thread is source, usb (default\n"
+            "                as source), decode or output; e.g.\n"
+            "                source:1:fifo:60,decode:2:fifo:50,output:3:rr:55\n"
+            "  -m            Lock all memory (mlockall) and prefault the\n"
+            "                sample buffers; needs CAP_IPC_LOCK or a\n"
+            "                sufficient memlock limit\n"
+            "  -S file[,sec] Write a line of JSON statistics (decoder stage\n"
+            "                times, read/write latency, buffer levels) every\n"
+            "                sec seconds (default 10)\n"
+            "                use filename '-' to write to stdout\n"
+            "\n"
+            "With several stations, each station gets its own output; the\n"
+            "frequency is appended to the -R or -W file name.\n"
             "\n");
 }
 
@@ -260,6 +507,23 @@ bool parse_int(const char *s, int& v, bool allow_unit=false)
 }
 
 
+/** Split comma-separated list. */
+vector<string> split_list(const char *s)
+{
+    vector<string> items;
+    string arg(s);
+    size_t pos = 0;
+    for (;;) {
+        size_t sep = arg.find(',', pos);
+        items.push_back(arg.substr(pos, sep - pos));
+        if (sep == string::npos)
+            break;
+        pos = sep + 1;
+    }
+    return items;
+}
+
+
 bool parse_dbl(const char *s, double& v)
 {
     char *endp;
@@ -289,22 +553,282 @@ double get_time()
 }
 
 
+/** Write summary of a distribution as a JSON member and reset it. */
+void write_stats_member(FILE *f, const char *name, LatencyStats& stats)
+{
+    LatencyStats::Summary s = stats.summary(true);
+    fprintf(f,
+            "\"%s\":{\"count\":%llu,\"mean\":%.6g,"
+            "\"p50\":%.6g,\"p90\":%.6g,\"p99\":%.6g,\"max\":%.6g}",
+            name, (unsigned long long)s.count,
+            s.mean, s.p50, s.p90, s.p99, s.max);
+}
+
+
+/**
+ * Write one line of statistics in JSON format.
+ *
+ * All values are in seconds: durations of source reads, audio writes
+ * and decoder stages per block, the amount of data waiting in the
+ * source and output buffers, and the latency from receiving a block
+ * to writing its audio; only the estimated clock drift is in ppm.
+ * Each line covers the interval since the previous line.
+ */
+void write_stats_line(FILE *f, unsigned int block,
+                      LatencyStats& read_stats, LatencyStats& queue_stats,
+                      vector<unique_ptr<Station>>& stations,
+                      MultiFmDecoder& decoder,
+                      const IqRecorder *recorder)
+{
+    fprintf(f, "{\"time\":%.3f,\"block\":%u,", get_time(), block);
+    write_stats_member(f, "source_read", read_stats);
+    fprintf(f, ",");
+    write_stats_member(f, "source_queue", queue_stats);
+    if (recorder != NULL) {
+        fprintf(f, ",\"iq_record\":{\"recorded\":%llu,\"dropped\":%llu,"
+                   "\"written\":%llu,\"files\":%u}",
+                (unsigned long long)recorder->recorded_bytes(),
+                (unsigned long long)recorder->dropped_bytes(),
+                (unsigned long long)recorder->written_bytes(),
+                recorder->num_files());
+    }
+    fprintf(f, ",\"stations\":[");
+
+    for (unsigned int i = 0; i < stations.size(); i++) {
+        Station& st = *stations[i];
+        FmDecoder& fm = decoder.station(i);
+        fprintf(f, "%s{\"freq\":%.0f,", (i > 0) ? "," : "", st.freq);
+        write_stats_member(f, "output_write", st.write_stats);
+        fprintf(f, ",");
+        write_stats_member(f, "output_queue", st.queue_stats);
+        fprintf(f, ",");
+        write_stats_member(f, "latency", st.latency_stats);
+        fprintf(f, ",\"drift_ppm\":%.2f", st.drift_ppm.load());
+        fprintf(f, ",\"stages\":{");
+        for (int k = 0; k < FmDecoder::num_stages; k++) {
+            FmDecoder::Stage stage = FmDecoder::Stage(k);
+            if (k > 0)
+                fprintf(f, ",");
+            write_stats_member(f, FmDecoder::stage_name(stage),
+                               fm.stage_stats(stage));
+        }
+        fprintf(f, "}}");
+    }
+
+    fprintf(f, "]}\n");
+    fflush(f);
+}
+
+
+/**
+ * Write one line for a decoded RDS group.
+ *
+ * This is called from the RDS threads of all stations.
+ */
+void write_rds_line(FILE *f, double freq, const RdsDecoder::Group& group,
+                    const RdsDecoder::Info& info)
+{
+    static mutex rds_mutex;
+    lock_guard<mutex> lock(rds_mutex);
+
+    fprintf(f, "%18.3f %9.3f ", get_time(), freq * 1.0e-6);
+    if (info.pi >= 0)
+        fprintf(f, " %04X", info.pi);
+    else
+        fprintf(f, " ----");
+
+    unsigned int type = group.block[1] >> 12;
+    bool version = (group.block[1] >> 11) & 1;
+    fprintf(f, "  %2u%c ", type, version ? 'B' : 'A');
+
+    for (int k = 0; k < 4; k++) {
+        if (group.valid[k])
+            fprintf(f, " %04X", group.block[k]);
+        else
+            fprintf(f, " ----");
+    }
+    fprintf(f, " ");
+
+    // Show the information carried by this group type.
+    if (type == 0 && !info.ps.empty()) {
+        fprintf(f, " ps=\"%s\"", info.ps.c_str());
+    } else if (type == 2 && !info.radiotext.empty()) {
+        fprintf(f, " rt=\"%s\"", info.radiotext.c_str());
+    } else if (type == 4 && !version && info.clock_utc >= 0) {
+        // Show local time.
+        time_t t = info.clock_utc + 60 * info.clock_offset;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        int offset = abs(info.clock_offset);
+        fprintf(f, " ct=%04d-%02d-%02dT%02d:%02d%c%02d:%02d",
+                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                tm.tm_hour, tm.tm_min,
+                (info.clock_offset < 0) ? '-' : '+',
+                offset / 60, offset % 60);
+    }
+
+    fprintf(f, "\n");
+    fflush(f);
+}
+
+
+/**
+ * Show the scheduling setup of a thread, the worst scheduling delay
+ * observed in one iteration of its loop, and whether the setup failed.
+ */
+void show_thread_sched(const string& prefix, const string& name,
+                       const ThreadSched& sched)
+{
+    string label = name + " thread:";
+    fprintf(stderr, "%s%-19s%s", prefix.c_str(), label.c_str(),
+            sched.setup().describe().c_str());
+    if (sched.delay().available()) {
+        fprintf(stderr, ", worst delay %.2f ms, total %.1f ms",
+                sched.delay().max_delay() * 1000,
+                sched.delay().total_delay() * 1000);
+    }
+    fprintf(stderr, "\n");
+    if (!sched.error().empty()) {
+        fprintf(stderr, "WARNING: %s%s thread setup failed: %s\n",
+                prefix.c_str(), name.c_str(), sched.error().c_str());
+    }
+}
+
+
+/**
+ * Scan the band [fmin, fmax] and write a list of stations to stdout.
+ *
+ * The RTL-SDR device is stepped across the band and a short burst is
+ * analyzed at each step. An IQ file is analyzed in one step at its
+ * center frequency.
+ */
+int run_scan(SampleSource *source, RtlSdrSource *rtlsdr,
+             double fmin, double fmax, double threshold)
+{
+    double ifrate = source->get_sample_rate();
+    BandScanner scanner(ifrate, threshold);
+
+    vector<double> steps;
+    if (rtlsdr != NULL)
+        steps = scanner.plan_steps(fmin, fmax);
+    else
+        steps.push_back(source->get_frequency());
+
+    size_t burst_length = size_t(BandScanner::burst_time * ifrate);
+    vector<BandScanner::Station> found;
+    IQSampleVector burst, samples;
+    unsigned int ncandidates = 0;
+    double start_time = get_time();
+
+    for (unsigned int i = 0; i < steps.size() && !stop_flag.load(); i++) {
+
+        double center = steps[i];
+        if (rtlsdr != NULL) {
+            if (!rtlsdr->set_frequency(lrint(center))) {
+                fprintf(stderr, "\nERROR: RtlSdr: %s\n",
+                        rtlsdr->error().c_str());
+                return 1;
+            }
+            center = rtlsdr->get_frequency();
+
+            // Discard samples received while the tuner settles.
+            if (!source->get_samples(samples)) {
+                fprintf(stderr, "\nERROR: source: %s\n",
+                        source->error().c_str());
+                return 1;
+            }
+        }
+
+        burst.clear();
+        while (burst.size() < burst_length) {
+            if (!source->get_samples(samples)) {
+                fprintf(stderr, "\nERROR: source: %s\n",
+                        source->error().c_str());
+                return 1;
+            }
+            if (samples.empty())
+                break;
+            burst.insert(burst.end(), samples.begin(), samples.end());
+        }
+
+        ncandidates += scanner.scan_burst(burst, center, fmin, fmax, found);
+
+        fprintf(stderr, "\rscanning %8.3f MHz  step %u/%u  "
+                        "candidates=%u  stations=%u ",
+                center * 1.0e-6, i + 1, (unsigned int)steps.size(),
+                ncandidates, (unsigned int)found.size());
+        fflush(stderr);
+    }
+
+    fprintf(stderr, "\nscanned %.3f .. %.3f MHz in %.1f seconds\n",
+            fmin * 1.0e-6, fmax * 1.0e-6, get_time() - start_time);
+
+    printf("#freq_MHz  snr_dB   IF_dB  IF_snr_dB  pilot  stereo\n");
+    for (const BandScanner::Station& st : found) {
+        printf("%9.3f %7.1f %7.1f %10.1f %6.3f  %s\n",
+               st.freq * 1.0e-6, st.snr, 20 * log10(st.if_level),
+               st.if_snr, st.pilot_level, st.stereo ? "yes" : "no");
+    }
+    fflush(stdout);
+
+    return 0;
+}
+
+
 int main(int argc, char **argv)
 {
-    double  freq    = -1;
+    vector<double> freqs;
     int     devidx  = 0;
+    string  infilename;
+    double  centerfreq = -1;
     int     lnagain = INT_MIN;
     bool    agcmode = false;
     double  ifrate  = 1.0e6;
     int     pcmrate = 48000;
     bool    stereo  = true;
-    enum OutputMode { MODE_RAW, MODE_WAV, MODE_ALSA };
+    enum OutputMode { MODE_RAW, MODE_WAV, MODE_ALSA, MODE_RTP };
     OutputMode outmode = MODE_ALSA;
     string  filename;
-    string  alsadev("default");
+    vector<string> alsadevs;
+    vector<string> rtpdests;
+    double  rtp_packet_ms = RtpAudioOutput::default_packet_time / 1000.0;
     string  ppsfilename;
     FILE *  ppsfile = NULL;
+    string  rdsfilename;
+    FILE *  rdsfile = NULL;
+    string  statsfilename;
+    FILE *  statsfile = NULL;
+    string  recfilename;
+    double  rec_limit_bytes = 0;
+    double  rec_limit_secs = 0;
+    bool    rec_compress = false;
+    double  statsinterval = 10;
     double  bufsecs = -1;
+    double  alsabufms = AlsaAudioOutput::default_buffer_time / 1000.0;
+    double  alsaperiodms = 0;
+    PcmFormat pcmformat = PCM_S16_LE;
+    bool    pcmformat_set = false;
+    bool    dither = false;
+    int     asyncbufs = 0;
+    int     blocklen = RtlSdrSource::default_block_length;
+    bool    blocklen_set = false;
+    double  lowlatency_ms = 0;
+    bool    alsabuf_set = false;
+    int     poolblocks = 8;
+    double  ifdecimrate = 0;
+    PhaseDiscriminator::AtanAccuracy atan_accuracy =
+        PhaseDiscriminator::ATAN_EXACT;
+    bool    pipelined = false;
+    bool    halfband = false;
+    bool    hybrid_resampler = false;
+    double  scan_fmin = 0, scan_fmax = 0;
+    double  scan_snr = 10;
+    bool    squelch_set = false;
+    double  squelch_db = 0;
+    bool    sched_set = false;
+    ThreadSetup sched_source, sched_usb, sched_decode, sched_output;
+    bool    sched_usb_set = false;
+    bool    lock_mem = false;
 
     fprintf(stderr,
             "SoftFM - Software decoder for FM broadcast radio with RTL-SDR\n");
@@ -312,32 +836,66 @@ int main(int argc, char **argv)
     const struct option longopts[] = {
         { "freq",       1, NULL, 'f' },
         { "dev",        1, NULL, 'd' },
+        { "input",      1, NULL, 'I' },
+        { "center",     1, NULL, 'c' },
         { "gain",       1, NULL, 'g' },
         { "ifrate",     1, NULL, 's' },
         { "pcmrate",    1, NULL, 'r' },
         { "agc",        0, NULL, 'a' },
         { "mono",       0, NULL, 'M' },
+        { "ifdecim",    1, NULL, 'i' },
+        { "halfband",   0, NULL, 'H' },
+        { "atan",       1, NULL, 'q' },
+        { "pipeline",   0, NULL, 'p' },
         { "raw",        1, NULL, 'R' },
         { "wav",        1, NULL, 'W' },
+        { "format",     1, NULL, 'F' },
+        { "dither",     0, NULL, 'D' },
         { "play",       2, NULL, 'P' },
+        { "latency",    1, NULL, 'L' },
+        { "lowlatency", 1, NULL, 'l' },
         { "pps",        1, NULL, 'T' },
+        { "rds",        1, NULL, 'E' },
         { "buffer",     1, NULL, 'b' },
+        { "async",      1, NULL, 'A' },
+        { "blocks",     1, NULL, 'B' },
+        { "stats",      1, NULL, 'S' },
+        { "record",     1, NULL, 'O' },
+        { "scan",       1, NULL, 'X' },
+        { "squelch",    1, NULL, 'Q' },
+        { "hybrid",     0, NULL, 'Y' },
+        { "sched",      1, NULL, 'K' },
+        { "mlock",      0, NULL, 'm' },
+        { "rtp",        1, NULL, 'U' },
         { NULL,         0, NULL, 0 } };
 
     int c, longindex;
     while ((c = getopt_long(argc, argv,
-                            "f:d:g:s:r:MR:W:P::T:b:a",
+                            "f:d:I:c:g:s:r:Mi:Hq:pR:W:F:DP::L:l:T:E:b:aA:B:S:O:X:Q:YK:mU:",
                             longopts, &longindex)) >= 0) {
         switch (c) {
             case 'f':
-                if (!parse_dbl(optarg, freq) || freq <= 0) {
-                    badarg("-f");
+                freqs.clear();
+                for (const string& item : split_list(optarg)) {
+                    double freq;
+                    if (!parse_dbl(item.c_str(), freq) || freq <= 0) {
+                        badarg("-f");
+                    }
+                    freqs.push_back(freq);
                 }
                 break;
             case 'd':
                 if (!parse_int(optarg, devidx))
                     devidx = -1;
                 break;
+            case 'I':
+                infilename = optarg;
+                break;
+            case 'c':
+                if (!parse_dbl(optarg, centerfreq) || centerfreq <= 0) {
+                    badarg("-c");
+                }
+                break;
             case 'g':
                 if (strcasecmp(optarg, "auto") == 0) {
                     lnagain = INT_MIN;
@@ -372,6 +930,33 @@ int main(int argc, char **argv)
             case 'M':
                 stereo = false;
                 break;
+            case 'p':
+                pipelined = true;
+                break;
+            case 'i':
+                if (!parse_dbl(optarg, ifdecimrate) || ifdecimrate <= 0) {
+                    badarg("-i");
+                }
+                break;
+            case 'H':
+                halfband = true;
+                break;
+            case 'Y':
+                hybrid_resampler = true;
+                break;
+            case 'q':
+                if (strcasecmp(optarg, "exact") == 0) {
+                    atan_accuracy = PhaseDiscriminator::ATAN_EXACT;
+                } else if (strcasecmp(optarg, "high") == 0) {
+                    atan_accuracy = PhaseDiscriminator::ATAN_HIGH;
+                } else if (strcasecmp(optarg, "medium") == 0) {
+                    atan_accuracy = PhaseDiscriminator::ATAN_MEDIUM;
+                } else if (strcasecmp(optarg, "low") == 0) {
+                    atan_accuracy = PhaseDiscriminator::ATAN_LOW;
+                } else {
+                    badarg("-q");
+                }
+                break;
             case 'R':
                 outmode = MODE_RAW;
                 filename = optarg;
@@ -382,12 +967,64 @@ int main(int argc, char **argv)
                 break;
             case 'P':
                 outmode = MODE_ALSA;
+                alsadevs.clear();
                 if (optarg != NULL)
-                    alsadev = optarg;
+                    alsadevs = split_list(optarg);
+                break;
+            case 'U':
+                outmode = MODE_RTP;
+                rtpdests.clear();
+                for (const string& item : split_list(optarg)) {
+                    if (item.size() > 2 &&
+                        item.compare(item.size() - 2, 2, "ms") == 0) {
+                        if (!parse_dbl(item.substr(0, item.size() - 2)
+                                           .c_str(), rtp_packet_ms) ||
+                            rtp_packet_ms < 0.1 || rtp_packet_ms > 100)
+                            badarg("-U");
+                    } else if (!item.empty()) {
+                        rtpdests.push_back(item);
+                    }
+                }
+                if (rtpdests.empty())
+                    badarg("-U");
+                break;
+            case 'F':
+                if (!pcm_parse_format(optarg, pcmformat)) {
+                    badarg("-F");
+                }
+                pcmformat_set = true;
+                break;
+            case 'D':
+                dither = true;
+                break;
+            case 'L':
+                {
+                    string arg(optarg);
+                    size_t sep = arg.find(',');
+                    if (!parse_dbl(arg.substr(0, sep).c_str(), alsabufms) ||
+                        alsabufms < 1) {
+                        badarg("-L");
+                    }
+                    if (sep != string::npos &&
+                        (!parse_dbl(arg.substr(sep + 1).c_str(),
+                                    alsaperiodms) ||
+                         alsaperiodms <= 0 || alsaperiodms > alsabufms)) {
+                        badarg("-L");
+                    }
+                    alsabuf_set = true;
+                }
+                break;
+            case 'l':
+                if (!parse_dbl(optarg, lowlatency_ms) || lowlatency_ms < 10) {
+                    badarg("-l");
+                }
                 break;
             case 'T':
                 ppsfilename = optarg;
                 break;
+            case 'E':
+                rdsfilename = optarg;
+                break;
             case 'b':
                 if (!parse_dbl(optarg, bufsecs) || bufsecs < 0) {
                     badarg("-b");
@@ -396,6 +1033,116 @@ int main(int argc, char **argv)
             case 'a':
                 agcmode = true;
                 break;
+            case 'A':
+                {
+                    string arg(optarg);
+                    size_t sep = arg.find(',');
+                    if (!parse_int(arg.substr(0, sep).c_str(), asyncbufs) ||
+                        asyncbufs < 2) {
+                        badarg("-A");
+                    }
+                    if (sep != string::npos &&
+                        (!parse_int(arg.substr(sep + 1).c_str(), blocklen,
+                                    true) ||
+                         blocklen < 4096)) {
+                        badarg("-A");
+                    }
+                    blocklen_set = (sep != string::npos);
+                }
+                break;
+            case 'B':
+                if (!parse_int(optarg, poolblocks) || poolblocks < 0) {
+                    badarg("-B");
+                }
+                break;
+            case 'S':
+                {
+                    string arg(optarg);
+                    size_t sep = arg.rfind(',');
+                    statsfilename = arg.substr(0, sep);
+                    if (sep != string::npos &&
+                        (!parse_dbl(arg.substr(sep + 1).c_str(),
+                                    statsinterval) ||
+                         statsinterval <= 0)) {
+                        badarg("-S");
+                    }
+                    if (statsfilename.empty()) {
+                        badarg("-S");
+                    }
+                }
+                break;
+            case 'O':
+                {
+                    vector<string> items = split_list(optarg);
+                    if (items.empty() || items[0].empty())
+                        badarg("-O");
+                    recfilename = items[0];
+                    for (size_t i = 1; i < items.size(); i++) {
+                        const string& item = items[i];
+                        if (item == "gz") {
+                            rec_compress = true;
+                        } else if (!item.empty() && item.back() == 's') {
+                            if (!parse_dbl(item.substr(0, item.size() - 1)
+                                               .c_str(), rec_limit_secs) ||
+                                rec_limit_secs <= 0)
+                                badarg("-O");
+                        } else {
+                            if (!parse_dbl(item.c_str(), rec_limit_bytes) ||
+                                rec_limit_bytes < 2)
+                                badarg("-O");
+                        }
+                    }
+                }
+                break;
+            case 'X':
+                {
+                    vector<string> items = split_list(optarg);
+                    if (items.size() < 2 || items.size() > 3 ||
+                        !parse_dbl(items[0].c_str(), scan_fmin) ||
+                        !parse_dbl(items[1].c_str(), scan_fmax) ||
+                        scan_fmin <= 0 || scan_fmax < scan_fmin) {
+                        badarg("-X");
+                    }
+                    if (items.size() == 3 &&
+                        (!parse_dbl(items[2].c_str(), scan_snr) ||
+                         scan_snr <= 0)) {
+                        badarg("-X");
+                    }
+                }
+                break;
+            case 'Q':
+                if (!parse_dbl(optarg, squelch_db) || squelch_db >= 0) {
+                    badarg("-Q");
+                }
+                squelch_set = true;
+                break;
+            case 'K':
+                for (const string& item : split_list(optarg)) {
+                    size_t sep = item.find(':');
+                    string name = item.substr(0, sep);
+                    ThreadSetup setup;
+                    if (sep == string::npos ||
+                        !setup.parse(item.substr(sep + 1))) {
+                        badarg("-K");
+                    }
+                    if (name == "source") {
+                        sched_source = setup;
+                    } else if (name == "usb") {
+                        sched_usb = setup;
+                        sched_usb_set = true;
+                    } else if (name == "decode") {
+                        sched_decode = setup;
+                    } else if (name == "output") {
+                        sched_output = setup;
+                    } else {
+                        badarg("-K");
+                    }
+                }
+                sched_set = true;
+                break;
+            case 'm':
+                lock_mem = true;
+                break;
             default:
                 usage();
                 fprintf(stderr, "ERROR: Invalid command line options\n");
@@ -409,24 +1156,96 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    vector<string> devnames = RtlSdrSource::get_device_names();
-    if (devidx < 0 || (unsigned int)devidx >= devnames.size()) {
-        if (devidx != -1)
-            fprintf(stderr, "ERROR: invalid device index %d\n", devidx);
-        fprintf(stderr, "Found %u devices:\n", (unsigned int)devnames.size());
-        for (unsigned int i = 0; i < devnames.size(); i++) {
-            fprintf(stderr, "%2u: %s\n", i, devnames[i].c_str());
+    if (halfband && ifdecimrate > 0) {
+        usage();
+        fprintf(stderr, "ERROR: Options -i and -H can not be combined\n");
+        exit(1);
+    }
+
+    if (outmode == MODE_RTP && pcmformat_set && pcmformat != PCM_S16_LE) {
+        fprintf(stderr, "ERROR: RTP output only supports format s16\n");
+        exit(1);
+    }
+
+    // Low-latency mode: short blocks which are decoded while they are
+    // still being received, and short output buffers.
+    unsigned int transfers_per_block = 1;
+    if (lowlatency_ms > 0) {
+        if (!blocklen_set) {
+            // About 1/8 of the latency budget per block.
+            blocklen = int(ifrate * lowlatency_ms * 1.0e-3 / 8);
+            blocklen = max(4096, blocklen - blocklen % 4096);
+        }
+        if (asyncbufs == 0) {
+            // Keep room for about half a second of data in the USB ring.
+            asyncbufs = max(int(RtlSdrSource::default_async_buffers),
+                            int(0.5 * ifrate / blocklen) + 1);
+        }
+        transfers_per_block = 4;
+        if (!alsabuf_set) {
+            alsabufms    = lowlatency_ms / 2;
+            alsaperiodms = lowlatency_ms / 8;
         }
+        fprintf(stderr, "low-latency mode:  %.0f ms budget, "
+                        "blocks of %d samples\n",
+                lowlatency_ms, blocklen);
+    }
+
+    if (infilename.empty()) {
+        vector<string> devnames = RtlSdrSource::get_device_names();
+        if (devidx < 0 || (unsigned int)devidx >= devnames.size()) {
+            if (devidx != -1)
+                fprintf(stderr, "ERROR: invalid device index %d\n", devidx);
+            fprintf(stderr, "Found %u devices:\n",
+                    (unsigned int)devnames.size());
+            for (unsigned int i = 0; i < devnames.size(); i++) {
+                fprintf(stderr, "%2u: %s\n", i, devnames[i].c_str());
+            }
+            exit(1);
+        }
+        fprintf(stderr, "using device %d: %s\n",
+                devidx, devnames[devidx].c_str());
+    }
+
+    bool scanning = (scan_fmax > 0);
+    if (scanning && !recfilename.empty()) {
+        fprintf(stderr, "ERROR: Options -O and -X can not be combined\n");
         exit(1);
     }
-    fprintf(stderr, "using device %d: %s\n", devidx, devnames[devidx].c_str());
+    if (scanning) {
+        if (!infilename.empty() && centerfreq <= 0) {
+            fprintf(stderr,
+                    "ERROR: Specify the center frequency of the IQ file "
+                    "with -c\n");
+            exit(1);
+        }
+        // Start at the lower edge of the band.
+        freqs.assign(1, scan_fmin);
+    }
 
-    if (freq <= 0) {
+    if (freqs.empty()) {
         usage();
         fprintf(stderr, "ERROR: Specify a tuning frequency\n");
         exit(1);
     }
 
+    if (freqs.size() > 1) {
+        if (outmode == MODE_RAW && filename == "-") {
+            fprintf(stderr,
+                    "ERROR: Can not write several stations to stdout\n");
+            exit(1);
+        }
+        if (outmode == MODE_ALSA && alsadevs.size() != freqs.size()) {
+            fprintf(stderr,
+                    "ERROR: Specify one ALSA device per station with -P\n");
+            exit(1);
+        }
+        if (ifdecimrate == 0 && !halfband)
+            ifdecimrate = 300.0e3;
+    }
+    if (alsadevs.empty())
+        alsadevs.push_back("default");
+
     // Catch Ctrl-C and SIGTERM
     struct sigaction sigact;
     sigact.sa_handler = handle_sigterm;
@@ -441,63 +1260,207 @@ int main(int argc, char **argv)
                 strerror(errno));
     }
 
-    // Intentionally tune at a higher frequency to avoid DC offset.
-    double tuner_freq = freq + 0.25 * ifrate;
-
-    // Open RTL-SDR device.
-    RtlSdrSource rtlsdr(devidx);
-    if (!rtlsdr) {
-        fprintf(stderr, "ERROR: RtlSdr: %s\n", rtlsdr.error().c_str());
+    // Intentionally tune away from the station(s) to avoid DC offset.
+    double tuner_freq = choose_tuner_freq(freqs, ifrate);
+    if (tuner_freq <= 0) {
+        fprintf(stderr,
+                "ERROR: Stations do not fit in IF bandwidth, "
+                "try a higher IF sample rate\n");
         exit(1);
     }
 
-    // Check LNA gain.
-    if (lnagain != INT_MIN) {
-        vector<int> gains = rtlsdr.get_tuner_gains();
-        if (find(gains.begin(), gains.end(), lnagain) == gains.end()) {
-            if (lnagain != INT_MIN + 1)
-                fprintf(stderr, "ERROR: LNA gain %.1f dB not supported by tuner\n", lnagain * 0.1);
-            fprintf(stderr, "Supported LNA gains: ");
-            for (int g: gains)
-                fprintf(stderr, " %.1f dB ", 0.1 * g);
-            fprintf(stderr, "\n");
+    // Monitor the scheduling of all threads once any setup is requested.
+    bool sched_report = sched_set || lock_mem;
+    if (!sched_usb_set)
+        sched_usb = sched_source;
+
+    unique_ptr<SampleSource> source;
+    RtlSdrSource *scan_rtlsdr = NULL;
+    RtlSdrSource *async_rtlsdr = NULL;
+
+    if (!infilename.empty()) {
+
+        // Open IQ file.
+        if (centerfreq > 0)
+            tuner_freq = centerfreq;
+        FileSource *filesrc = new FileSource(infilename,
+                                             FileSource::FORMAT_AUTO,
+                                             lrint(ifrate),
+                                             lrint(tuner_freq),
+                                             blocklen);
+        source.reset(filesrc);
+        if (!(*filesrc)) {
+            fprintf(stderr, "ERROR: FileSource: %s\n",
+                    filesrc->error().c_str());
             exit(1);
         }
-    }
 
-    // Configure RTL-SDR device and start streaming.
-    rtlsdr.configure(ifrate, tuner_freq, lnagain,
-                     RtlSdrSource::default_block_length, agcmode);
-    if (!rtlsdr) {
-        fprintf(stderr, "ERROR: RtlSdr: %s\n", rtlsdr.error().c_str());
-        exit(1);
-    }
+        fprintf(stderr, "reading IQ file:   '%s' (%s, %.1f seconds)\n",
+                infilename.c_str(),
+                (filesrc->get_format() == FileSource::FORMAT_CF32) ?
+                    "cf32" : "u8",
+                filesrc->get_num_samples() / ifrate);
+        fprintf(stderr, "center frequency:  %.6f MHz\n", tuner_freq * 1.0e-6);
+        fprintf(stderr, "IF sample rate:    %.0f Hz\n", ifrate);
+
+    } else {
+
+        // Open RTL-SDR device.
+        RtlSdrSource *rtlsdr_ptr = new RtlSdrSource(devidx);
+        source.reset(rtlsdr_ptr);
+        RtlSdrSource& rtlsdr = *rtlsdr_ptr;
+        if (!rtlsdr) {
+            fprintf(stderr, "ERROR: RtlSdr: %s\n", rtlsdr.error().c_str());
+            exit(1);
+        }
 
-    tuner_freq = rtlsdr.get_frequency();
-    fprintf(stderr, "device tuned for:  %.6f MHz\n", tuner_freq * 1.0e-6);
+        // Check LNA gain.
+        if (lnagain != INT_MIN) {
+            vector<int> gains = rtlsdr.get_tuner_gains();
+            if (find(gains.begin(), gains.end(), lnagain) == gains.end()) {
+                if (lnagain != INT_MIN + 1)
+                    fprintf(stderr, "ERROR: LNA gain %.1f dB not supported by tuner\n", lnagain * 0.1);
+                fprintf(stderr, "Supported LNA gains: ");
+                for (int g: gains)
+                    fprintf(stderr, " %.1f dB ", 0.1 * g);
+                fprintf(stderr, "\n");
+                exit(1);
+            }
+        }
 
-    if (lnagain == INT_MIN)
-        fprintf(stderr, "LNA gain:          auto\n");
-    else
-        fprintf(stderr, "LNA gain:          %.1f dB\n",
-                0.1 * rtlsdr.get_tuner_gain());
+        // Configure RTL-SDR device and start streaming.
+        rtlsdr.configure(ifrate, tuner_freq, lnagain, blocklen, agcmode);
+        if (!rtlsdr) {
+            fprintf(stderr, "ERROR: RtlSdr: %s\n", rtlsdr.error().c_str());
+            exit(1);
+        }
+
+        if (scanning) {
+            // Step the device across the band with synchronous reads.
+            scan_rtlsdr = rtlsdr_ptr;
+        } else if (asyncbufs > 0) {
+            fprintf(stderr, "async USB streaming with %d buffers", asyncbufs);
+            if (transfers_per_block > 1)
+                fprintf(stderr, ", %u transfers per buffer",
+                        transfers_per_block);
+            fprintf(stderr, "\n");
+            if (sched_report)
+                rtlsdr.async_sched().configure(sched_usb);
+            rtlsdr.start_async(asyncbufs, transfers_per_block);
+            async_rtlsdr = rtlsdr_ptr;
+            if (!rtlsdr) {
+                fprintf(stderr, "ERROR: RtlSdr: %s\n", rtlsdr.error().c_str());
+                exit(1);
+            }
+        }
+
+        tuner_freq = rtlsdr.get_frequency();
+        fprintf(stderr, "device tuned for:  %.6f MHz\n", tuner_freq * 1.0e-6);
+
+        if (lnagain == INT_MIN)
+            fprintf(stderr, "LNA gain:          auto\n");
+        else
+            fprintf(stderr, "LNA gain:          %.1f dB\n",
+                    0.1 * rtlsdr.get_tuner_gain());
 
-    ifrate = rtlsdr.get_sample_rate();
-    fprintf(stderr, "IF sample rate:    %.0f Hz\n", ifrate);
+        ifrate = rtlsdr.get_sample_rate();
+        fprintf(stderr, "IF sample rate:    %.0f Hz\n", ifrate);
 
-    fprintf(stderr, "RTL AGC mode:      %s\n",
-            agcmode ? "enabled" : "disabled");
+        fprintf(stderr, "RTL AGC mode:      %s\n",
+                agcmode ? "enabled" : "disabled");
+    }
+
+    fprintf(stderr, "IQ conversion:     %s\n", iq_convert_kernel_name());
+    fprintf(stderr, "PCM conversion:    %s\n", pcm_convert_kernel_name());
+
+    if (scanning)
+        return run_scan(source.get(), scan_rtlsdr,
+                        scan_fmin, scan_fmax, scan_snr);
+
+    // Record the raw samples, before conversion, in a writer thread.
+    unique_ptr<IqRecorder> recorder;
+    if (!recfilename.empty()) {
+        uint64_t rotate_bytes = 0;
+        if (rec_limit_secs > 0)
+            rotate_bytes = 2 * uint64_t(llrint(rec_limit_secs * ifrate));
+        else if (rec_limit_bytes > 0)
+            rotate_bytes = uint64_t(rec_limit_bytes) & ~uint64_t(1);
+        // Only a receiver must never wait for the disk.
+        recorder.reset(new IqRecorder(recfilename, rotate_bytes,
+                                      rec_compress,
+                                      !source->is_realtime()));
+        if (!(*recorder)) {
+            fprintf(stderr, "ERROR: IqRecorder: %s\n",
+                    recorder->error().c_str());
+            exit(1);
+        }
+        if (!source->set_raw_tap(recorder.get())) {
+            fprintf(stderr,
+                    "ERROR: Can only record IQ samples from an 8-bit "
+                    "source\n");
+            exit(1);
+        }
+        fprintf(stderr, "recording IQ to:   '%s'", recfilename.c_str());
+        if (rotate_bytes > 0)
+            fprintf(stderr, ", new file every %.1f MB",
+                    rotate_bytes * 1.0e-6);
+        if (rec_compress)
+            fprintf(stderr, ", gzip");
+        fprintf(stderr, "\n");
+    }
 
     // Create source data queue.
-    DataBuffer<IQSample> source_buffer;
+    // Make it large enough to hold ~ 20 seconds of data, so that the
+    // "system too slow" warning below triggers long before it fills up.
+    // A file source just waits when the queue is full, so a few
+    // blocks are enough to keep the decoder busy.
+    unsigned int source_capacity =
+        (unsigned int)(20 * ifrate / blocklen * transfers_per_block);
+    if (source_capacity < DataBuffer<IQSample>::default_capacity)
+        source_capacity = DataBuffer<IQSample>::default_capacity;
+    if (!source->is_realtime())
+        source_capacity = 16;
+    DataBuffer<IQSample> source_buffer(source_capacity);
+
+    // Create pool of IQ sample blocks which circulate between
+    // the source thread (alloc) and the main thread (release).
+    BlockPool<IQSample> iq_pool(blocklen, source_capacity, poolblocks);
+    if (lock_mem)
+        iq_pool.prefault();
 
     // Start reading from device in separate thread.
-    thread source_thread(read_source_data, &rtlsdr, &source_buffer);
+    LatencyStats source_read_stats;
+    LatencyStats source_queue_stats;
+    ThreadSched source_sched;
+    if (sched_report)
+        source_sched.configure(sched_source);
+    thread source_thread(read_source_data, source.get(), &iq_pool,
+                         &source_buffer, &source_read_stats, &source_sched);
+
+    // Optionally decimate the IF signal before demodulation.
+    unsigned int if_downsample = 1;
+    if (ifdecimrate > 0) {
+        if_downsample = max(1, int(ifrate / ifdecimrate));
+        // Keep the full IF bandwidth inside the decimated signal.
+        while (if_downsample > 1 &&
+               ifrate / if_downsample < 2.5 * FmDecoder::default_bandwidth_if)
+            if_downsample--;
+        fprintf(stderr, "IF downsampling factor %u\n", if_downsample);
+    }
+
+    // Optionally decimate the tuned IF signal with half-band filters.
+    unsigned int halfband_stages = 0;
+    if (halfband) {
+        halfband_stages = FmDecoder::choose_halfband_stages(ifrate);
+        fprintf(stderr, "IF half-band decimation: %u stages, factor %u\n",
+                halfband_stages, 1u << halfband_stages);
+    }
 
     // The baseband signal is empty above 100 kHz, so we can
     // downsample to ~ 200 kS/s without loss of information.
     // This will speed up later processing stages.
-    unsigned int downsample = max(1, int(ifrate / 215.0e3));
+    double demod_rate = ifrate / (if_downsample << halfband_stages);
+    unsigned int downsample = max(1, int(demod_rate / 215.0e3));
     fprintf(stderr, "baseband downsampling factor %u\n", downsample);
 
     // Prevent aliasing at very low output sample rates.
@@ -505,29 +1468,63 @@ int main(int argc, char **argv)
                                0.45 * pcmrate);
     fprintf(stderr, "audio sample rate: %u Hz\n", pcmrate);
     fprintf(stderr, "audio bandwidth:   %.3f kHz\n", bandwidth_pcm * 1.0e-3);
-
-    // Prepare decoder.
-    FmDecoder fm(ifrate,                            // sample_rate_if
-                 freq - tuner_freq,                 // tuning_offset
-                 pcmrate,                           // sample_rate_pcm
-                 stereo,                            // stereo
-                 FmDecoder::default_deemphasis,     // deemphasis,
-                 FmDecoder::default_bandwidth_if,   // bandwidth_if
-                 FmDecoder::default_freq_dev,       // freq_dev
-                 bandwidth_pcm,                     // bandwidth_pcm
-                 downsample);                       // downsample
+    if (hybrid_resampler)
+        fprintf(stderr, "audio resampler:   IIR prefilter and short FIR\n");
+
+    // Prepare decoders.
+    vector<double> offsets;
+    for (double f : freqs)
+        offsets.push_back(f - tuner_freq);
+    unsigned int nthreads = max(1u, thread::hardware_concurrency());
+    MultiFmDecoder decoder(ifrate,                  // sample_rate_if
+                           offsets,                 // tuning_offsets
+                           pcmrate,                 // sample_rate_pcm
+                           stereo,                  // stereo
+                           bandwidth_pcm,           // bandwidth_pcm
+                           downsample,              // downsample
+                           if_downsample,           // if_downsample
+                           halfband_stages,         // halfband_stages
+                           atan_accuracy,           // atan_accuracy
+                           pipelined,               // pipelined
+                           hybrid_resampler,        // hybrid_resampler
+                           nthreads);               // num_threads
+    unsigned int nstation = decoder.num_stations();
+
+    if (pipelined) {
+        fprintf(stderr, "decoder pipeline:  %u blocks delay\n",
+                decoder.station(0).pipeline_delay());
+    }
+    if (nstation > 1) {
+        fprintf(stderr, "decoding %u stations in %u threads\n",
+                nstation, decoder.num_threads());
+    }
 
     // Calculate number of samples in audio buffer.
     unsigned int outputbuf_samples = 0;
-    if (bufsecs < 0 &&
-        (outmode == MODE_ALSA || (outmode == MODE_RAW && filename == "-"))) {
+    unsigned int outputbuf_min = 0, outputbuf_max = 0;
+    bool interactive =
+        (outmode == MODE_ALSA || (outmode == MODE_RAW && filename == "-"));
+    if (bufsecs < 0 && interactive && lowlatency_ms > 0) {
+        // Adaptive buffer, between one received part of a block
+        // and 1/4 of the latency budget, starting at 1/8.
+        outputbuf_min = (unsigned int)(double(blocklen) * pcmrate / ifrate /
+                                       transfers_per_block) + 1;
+        outputbuf_max = max(outputbuf_min,
+                            (unsigned int)(lowlatency_ms * pcmrate / 4000));
+        outputbuf_samples = min(outputbuf_max,
+                                max(outputbuf_min, outputbuf_max / 2));
+        fprintf(stderr, "output buffer:     adaptive, %.1f ms (%.1f .. %.1f)\n",
+                outputbuf_samples * 1000.0 / pcmrate,
+                outputbuf_min * 1000.0 / pcmrate,
+                outputbuf_max * 1000.0 / pcmrate);
+    } else if (bufsecs < 0 && interactive) {
         // Set default buffer to 1 second for interactive output streams.
         outputbuf_samples = pcmrate;
     } else if (bufsecs > 0) {
         // Calculate nr of samples for configured buffer length.
         outputbuf_samples = (unsigned int)(bufsecs * pcmrate);
     }
-    if (outputbuf_samples > 0) {
+    if (outputbuf_samples > 0 && outputbuf_max == 0) {
         fprintf(stderr, "output buffer:     %.1f seconds\n",
                 outputbuf_samples / double(pcmrate));
     }
@@ -551,110 +1548,340 @@ int main(int argc, char **argv)
         fflush(ppsfile);
     }
 
-    // Prepare output writer.
-    unique_ptr<AudioOutput> audio_output;
-    switch (outmode) {
-        case MODE_RAW:
-            fprintf(stderr, "writing raw 16-bit audio samples to '%s'\n",
-                    filename.c_str());
-            audio_output.reset(new RawAudioOutput(filename));
-            break;
-        case MODE_WAV:
-            fprintf(stderr, "writing audio samples to '%s'\n",
-                    filename.c_str());
-            audio_output.reset(new WavAudioOutput(filename, pcmrate, stereo));
-            break;
-        case MODE_ALSA:
-            fprintf(stderr, "playing audio to ALSA device '%s'\n",
-                    alsadev.c_str());
-            audio_output.reset(new AlsaAudioOutput(alsadev, pcmrate, stereo));
-            break;
+    // Open RDS file.
+    if (!rdsfilename.empty()) {
+        if (rdsfilename == "-") {
+            fprintf(stderr, "writing RDS groups to stdout\n");
+            rdsfile = stdout;
+        } else {
+            fprintf(stderr, "writing RDS groups to '%s'\n",
+                    rdsfilename.c_str());
+            rdsfile = fopen(rdsfilename.c_str(), "w");
+            if (rdsfile == NULL) {
+                fprintf(stderr, "ERROR: can not open '%s' (%s)\n",
+                        rdsfilename.c_str(), strerror(errno));
+                exit(1);
+            }
+        }
+        fprintf(rdsfile, "#        unix_time      freq   pi  grp  "
+                         "blocks A-D           info\n");
+        fflush(rdsfile);
     }
 
-    if (!(*audio_output)) {
-        fprintf(stderr, "ERROR: AudioOutput: %s\n",
-                        audio_output->error().c_str());
-        exit(1);
+    // Open statistics file.
+    if (!statsfilename.empty()) {
+        if (statsfilename == "-") {
+            fprintf(stderr, "writing statistics to stdout\n");
+            statsfile = stdout;
+        } else {
+            fprintf(stderr, "writing statistics to '%s'\n",
+                    statsfilename.c_str());
+            statsfile = fopen(statsfilename.c_str(), "a");
+            if (statsfile == NULL) {
+                fprintf(stderr, "ERROR: can not open '%s' (%s)\n",
+                        statsfilename.c_str(), strerror(errno));
+                exit(1);
+            }
+        }
+    }
+
+    // Prepare output writer for each station.
+    // Leave some margin in the audio blocks for variations in the number
+    // of samples per block.
+    unsigned int nchannel = stereo ? 2 : 1;
+    size_t audio_block_size =
+        nchannel * (size_t(blocklen * double(pcmrate) / ifrate) + 16);
+
+    vector<unique_ptr<Station>> stations;
+    for (unsigned int i = 0; i < nstation; i++) {
+
+        Station *st = new Station(audio_block_size, poolblocks);
+        stations.emplace_back(st);
+        st->freq = freqs[i];
+        if (lock_mem)
+            st->pool.prefault();
+        if (sched_report)
+            st->output_sched.configure(sched_output);
+
+        string name = station_filename(filename, freqs[i], nstation);
+        string prefix = (nstation > 1) ? station_label(freqs[i]) : string();
+
+        switch (outmode) {
+            case MODE_RAW:
+                fprintf(stderr, "%swriting raw %s audio samples to '%s'\n",
+                        prefix.c_str(), pcm_format_name(pcmformat),
+                        name.c_str());
+                st->output.reset(new RawAudioOutput(name, pcmformat));
+                break;
+            case MODE_WAV:
+                fprintf(stderr, "%swriting %s audio samples to '%s'\n",
+                        prefix.c_str(), pcm_format_name(pcmformat),
+                        name.c_str());
+                st->output.reset(
+                    new WavAudioOutput(name, pcmrate, stereo, pcmformat));
+                break;
+            case MODE_ALSA:
+                {
+                    fprintf(stderr, "%splaying audio to ALSA device '%s'\n",
+                            prefix.c_str(), alsadevs[i].c_str());
+                    AlsaAudioOutput *alsa = new AlsaAudioOutput(
+                        alsadevs[i], pcmrate, stereo,
+                        (unsigned int)(alsabufms * 1000),
+                        (unsigned int)(alsaperiodms * 1000),
+                        pcmformat_set ? pcmformat : PCM_FLOAT_LE);
+                    st->output.reset(alsa);
+                    if (*alsa) {
+                        fprintf(stderr, "%sALSA output:       %s\n",
+                                prefix.c_str(), alsa->describe().c_str());
+                    }
+                }
+                break;
+            case MODE_RTP:
+                {
+                    // A file is decoded faster than real time;
+                    // send it at the audio rate.
+                    RtpAudioOutput *rtp = new RtpAudioOutput(
+                        rtpdests, pcmrate, stereo,
+                        (unsigned int)(rtp_packet_ms * 1000),
+                        2 * i, !source->is_realtime());
+                    st->output.reset(rtp);
+                    if (*rtp) {
+                        fprintf(stderr, "%ssending RTP audio: %s\n",
+                                prefix.c_str(), rtp->describe().c_str());
+                    }
+                }
+                break;
+        }
+
+        if (!(*st->output)) {
+            fprintf(stderr, "ERROR: AudioOutput: %s\n",
+                            st->output->error().c_str());
+            exit(1);
+        }
+
+        // Set nominal audio volume.
+        // The gain is applied while the samples are encoded for output.
+        st->output->set_gain(0.5);
+        st->output->set_dither(dither);
+    }
+
+    // Start RDS decoders.
+    if (rdsfile != NULL) {
+        for (unsigned int i = 0; i < nstation; i++) {
+            double freq = freqs[i];
+            decoder.station(i).enable_rds(
+                [rdsfile,freq](const RdsDecoder::Group& group,
+                               const RdsDecoder::Info& info) {
+                    write_rds_line(rdsfile, freq, group, info);
+                });
+        }
     }
 
-    // If buffering enabled, start background output thread.
-    DataBuffer<Sample> output_buffer;
-    thread output_thread;
+    // Enable squelch.
+    if (squelch_set) {
+        fprintf(stderr, "squelch:           IF level %.1f dB\n", squelch_db);
+        for (unsigned int i = 0; i < nstation; i++)
+            decoder.station(i).set_squelch(pow(10.0, squelch_db / 20));
+    }
+
+    // In low-latency mode, play the first block instead of discarding it.
+    if (lowlatency_ms > 0) {
+        for (unsigned int i = 0; i < nstation; i++)
+            decoder.station(i).prime_filters();
+    }
+
+    // If buffering enabled, start background output threads.
     if (outputbuf_samples > 0) {
-        unsigned int nchannel = stereo ? 2 : 1;
-        output_thread = thread(write_output_data,
-                               audio_output.get(),
-                               &output_buffer,
-                               outputbuf_samples * nchannel);
+        OutputFill fill;
+        fill.target     = outputbuf_samples * nchannel;
+        fill.min_target = outputbuf_min * nchannel;
+        fill.max_target = outputbuf_max * nchannel;
+        fill.drain_rate = 0;
+        if (source->is_realtime() && interactive) {
+            // Receiver and sound card clocks differ.
+            fprintf(stderr, "clock drift compensation enabled\n");
+            fill.drain_rate = double(pcmrate) * nchannel;
+        }
+        for (unique_ptr<Station>& st : stations)
+            st->output_thread = thread(write_output_data, st.get(), fill);
     }
 
-    SampleVector audiosamples;
     bool inbuf_length_warning = false;
-    double audio_level = 0;
-    bool got_stereo = false;
+    uint64_t usb_dropped = 0;
+    vector<SampleVector> audioblocks(nstation);
+
+    // Arrival times of the blocks in the decoder pipeline.
+    // The PPS timestamps of a block are interpolated between the arrival
+    // time of the block and of the block before it.
+    deque<double> block_times;
+    block_times.push_back(get_time());
+
+    // Receive times of the blocks in the decoder pipeline.
+    deque<double> block_stamps;
+
+    // Count samples to report throughput.
+    double start_time = get_time();
+    uint64_t total_samples = 0;
+
+    double next_stats_time = get_monotonic_time() + statsinterval;
+
+    // Lock memory now that the buffers exist and the threads run.
+    string lock_error;
+    if (lock_mem) {
+        lock_error = lock_memory();
+        if (lock_error.empty())
+            fprintf(stderr, "memory:            locked\n");
+        else
+            fprintf(stderr, "WARNING: %s\n", lock_error.c_str());
+    }
 
-    double block_time = get_time();
+    // Set up the decoder thread last, so that the other threads
+    // do not inherit its setup.
+    ThreadSched decode_sched;
+    if (sched_report)
+        decode_sched.configure(sched_decode);
+    decode_sched.enter();
 
     // Main loop.
-    for (unsigned int block = 0; !stop_flag.load(); block++) {
+    unsigned int block = 0;
+    while (!stop_flag.load()) {
+
+        decode_sched.sample();
 
         // Check for overflow of source buffer.
-        if (!inbuf_length_warning &&
+        if (source->is_realtime() && !inbuf_length_warning &&
             source_buffer.queued_samples() > 10 * ifrate) {
             fprintf(stderr,
                     "\nWARNING: Input buffer is growing (system too slow)\n");
             inbuf_length_warning = true;
         }
 
+        source_queue_stats.add(source_buffer.queued_samples() / ifrate);
+
+        // Report blocks lost in the USB ring; streaming continues.
+        if (async_rtlsdr != NULL &&
+            async_rtlsdr->async_dropped_blocks() != usb_dropped) {
+            usb_dropped = async_rtlsdr->async_dropped_blocks();
+            fprintf(stderr,
+                    "\nWARNING: USB buffer overflow, %llu blocks dropped\n",
+                    (unsigned long long)usb_dropped);
+        }
+
         // Pull next block from source buffer.
-        IQSampleVector iqsamples = source_buffer.pull();
-        if (iqsamples.empty())
+        // At the end of the stream, keep going until the decoder
+        // pipeline is empty.
+        double stamp = 0;
+        IQSampleVector iqsamples = source_buffer.pull(&stamp);
+        if (iqsamples.empty() && decoder.station(0).pending_blocks() == 0)
             break;
 
-        double prev_block_time = block_time;
-        block_time = get_time();
-
-        // Decode FM signal.
-        fm.process(iqsamples, audiosamples);
+        if (!iqsamples.empty()) {
+            block_times.push_back(get_time());
+            block_stamps.push_back(stamp);
+        }
+        total_samples += iqsamples.size();
+
+        // Decode FM signals.
+        // A block which was not handed to the output thread is used
+        // again; only the output thread releases blocks to the pool.
+        for (unsigned int i = 0; i < nstation; i++) {
+            decoder.station(i).set_resample_ratio(
+                stations[i]->resample_ratio.load());
+            if (audioblocks[i].capacity() == 0)
+                audioblocks[i] = stations[i]->pool.alloc();
+        }
+        decoder.process(iqsamples, audioblocks);
+        iq_pool.release(move(iqsamples));
+
+        // Nothing to do until the decoder pipeline is filled.
+        // (All stations have the same pipeline delay.)
+        if (audioblocks[0].empty())
+            continue;
+
+        double prev_block_time = block_times[0];
+        double block_time = block_times[1];
+        block_times.pop_front();
+        double block_stamp = block_stamps.front();
+        block_stamps.pop_front();
+
+        for (unsigned int i = 0; i < nstation; i++) {
+
+            Station& st = *stations[i];
+            const FmDecoder& fm = decoder.station(i);
+            SampleVector& audiosamples = audioblocks[i];
+
+            // Show stereo status.
+            if (fm.stereo_detected() != st.got_stereo) {
+                st.got_stereo = fm.stereo_detected();
+                string prefix =
+                    (nstation > 1) ? station_label(st.freq) : string();
+                if (st.got_stereo)
+                    fprintf(stderr,
+                            "\n%sgot stereo signal (pilot level = %f)\n",
+                            prefix.c_str(), fm.get_pilot_level());
+                else
+                    fprintf(stderr, "\n%slost stereo signal\n",
+                            prefix.c_str());
+            }
 
-        // Measure audio level.
-        double audio_mean, audio_rms;
-        samples_mean_rms(audiosamples, audio_mean, audio_rms);
-        audio_level = 0.95 * audio_level + 0.05 * audio_rms;
+            // Throw away first block. It is noisy because IF filters
+            // are still starting up (unless the filters were primed).
+            if (block > 0 || lowlatency_ms > 0) {
 
-        // Set nominal audio volume.
-        adjust_gain(audiosamples, 0.5);
+                // Write samples to output.
+                if (outputbuf_samples > 0) {
+                    // Buffered write.
+                    st.buffer.push(move(audiosamples), block_stamp);
+                    st.queue_stats.add(st.buffer.queued_samples() /
+                                       nchannel / double(pcmrate));
+                } else {
+                    // Direct write.
+                    st.write(audiosamples, block_stamp);
+                }
+            }
+        }
 
         // Show statistics.
-        fprintf(stderr,
-                "\rblk=%6d  freq=%8.4fMHz  IF=%+5.1fdB  BB=%+5.1fdB  audio=%+5.1fdB ",
-                block,
-                (tuner_freq + fm.get_tuning_offset()) * 1.0e-6,
-                20*log10(fm.get_if_level()),
-                20*log10(fm.get_baseband_level()) + 3.01,
-                20*log10(audio_level) + 3.01);
-        if (outputbuf_samples > 0) {
-            unsigned int nchannel = stereo ? 2 : 1;
-            size_t buflen = output_buffer.queued_samples();
+        if (nstation == 1) {
+            const FmDecoder& fm = decoder.station(0);
             fprintf(stderr,
-                    " buf=%.1fs ",
-                    buflen / nchannel / double(pcmrate));
+                    "\rblk=%6d  freq=%8.4fMHz  IF=%+5.1fdB  BB=%+5.1fdB  audio=%+5.1fdB ",
+                    block,
+                    (tuner_freq + fm.get_tuning_offset()) * 1.0e-6,
+                    20*log10(fm.get_if_level()),
+                    20*log10(fm.get_baseband_level()) + 3.01,
+                    20*log10(fm.get_audio_level()) + 3.01);
+            if (lowlatency_ms > 0) {
+                size_t buflen = stations[0]->buffer.queued_samples();
+                fprintf(stderr,
+                        " buf=%3.0fms lat=%3.0fms ",
+                        buflen * 1000.0 / nchannel / pcmrate,
+                        stations[0]->last_latency.load() * 1000.0);
+            } else if (outputbuf_samples > 0) {
+                size_t buflen = stations[0]->buffer.queued_samples();
+                fprintf(stderr,
+                        " buf=%.1fs ",
+                        buflen / nchannel / double(pcmrate));
+            }
+            if (squelch_set)
+                fprintf(stderr, "%s", fm.squelched() ? " SQL " : "     ");
+        } else {
+            fprintf(stderr, "\rblk=%6d ", block);
+            for (unsigned int i = 0; i < nstation; i++) {
+                const FmDecoder& fm = decoder.station(i);
+                fprintf(stderr, " %.1f:%+5.1fdB%s",
+                        stations[i]->freq * 1.0e-6,
+                        20*log10(fm.get_if_level()),
+                        fm.squelched() ? "Q" :
+                        fm.stereo_detected() ? "S" : " ");
+            }
         }
         fflush(stderr);
 
-        // Show stereo status.
-        if (fm.stereo_detected() != got_stereo) {
-            got_stereo = fm.stereo_detected();
-            if (got_stereo)
-                fprintf(stderr, "\ngot stereo signal (pilot level = %f)\n",
-                        fm.get_pilot_level());
-            else
-                fprintf(stderr, "\nlost stereo signal\n");
-        }
-
         // Write PPS markers.
         if (ppsfile != NULL) {
-            for (const PilotPhaseLock::PpsEvent& ev : fm.get_pps_events()) {
+            for (const PilotPhaseLock::PpsEvent& ev :
+                    decoder.station(0).get_pps_events()) {
                 double ts = prev_block_time;
                 ts += ev.block_position * (block_time - prev_block_time);
                 fprintf(ppsfile, "%8s %14s %18.6f\n",
@@ -665,30 +1892,160 @@ int main(int argc, char **argv)
             }
         }
 
-        // Throw away first block. It is noisy because IF filters
-        // are still starting up.
-        if (block > 0) {
-
-            // Write samples to output.
-            if (outputbuf_samples > 0) {
-                // Buffered write.
-                output_buffer.push(move(audiosamples));
-            } else {
-                // Direct write.
-                audio_output->write(audiosamples);
-            }
+        // Write statistics.
+        if (statsfile != NULL && get_monotonic_time() >= next_stats_time) {
+            write_stats_line(statsfile, block,
+                             source_read_stats, source_queue_stats,
+                             stations, decoder, recorder.get());
+            next_stats_time += statsinterval;
         }
 
+        block++;
     }
 
+    // After an interrupt, collect the blocks still in the decoder pipeline
+    // so that the worker threads are idle when the decoder is destroyed.
+    while (decoder.station(0).pending_blocks() > 0)
+        decoder.process(IQSampleVector(), audioblocks);
+
     fprintf(stderr, "\n");
 
+    // Write statistics for the last (partial) interval.
+    if (statsfile != NULL) {
+        write_stats_line(statsfile, block,
+                         source_read_stats, source_queue_stats,
+                         stations, decoder, recorder.get());
+    }
+
+    // Show throughput when decoding as fast as possible.
+    if (!source->is_realtime()) {
+        double elapsed = get_time() - start_time;
+        fprintf(stderr,
+                "processed %.1f seconds of IQ data in %.2f seconds: "
+                "%.2f MS/s, %.1fx realtime\n",
+                total_samples / ifrate, elapsed,
+                total_samples / elapsed * 1.0e-6,
+                total_samples / ifrate / elapsed);
+    }
+
+    // Drain source buffer so the source thread can not get stuck
+    // pushing into a full buffer.
+    while (!source_buffer.pull_end_reached())
+        source_buffer.pull();
+
     // Join background threads.
     source_thread.join();
+    if (recorder) {
+        recorder->close();
+        fprintf(stderr, "IQ recording:      %.1f MB in %u file%s, "
+                        "%.1f MB written%s, %.1f MB dropped\n",
+                recorder->recorded_bytes() * 1.0e-6,
+                recorder->num_files(),
+                (recorder->num_files() == 1) ? "" : "s",
+                recorder->written_bytes() * 1.0e-6,
+                recorder->direct_io() ? " (O_DIRECT)" : "",
+                recorder->dropped_bytes() * 1.0e-6);
+        if (!(*recorder))
+            fprintf(stderr, "ERROR: IqRecorder: %s\n",
+                    recorder->error().c_str());
+    }
     if (outputbuf_samples > 0) {
-        output_buffer.push_end();
-        output_thread.join();
+        for (unique_ptr<Station>& st : stations) {
+            st->buffer.push_end();
+            st->output_thread.join();
+        }
+    }
+
+    // Show end-to-end latency, from receiving a block to writing its audio.
+    if (source->is_realtime() || lowlatency_ms > 0) {
+        for (unique_ptr<Station>& st : stations) {
+            LatencyStats::Summary lat = st->latency_total.summary(false);
+            if (lat.count == 0)
+                continue;
+            string prefix =
+                (nstation > 1) ? station_label(st->freq) : string();
+            fprintf(stderr, "%send-to-end latency: mean %.1f ms, "
+                            "p99 %.1f ms, max %.1f ms\n",
+                    prefix.c_str(), lat.mean * 1000, lat.p99 * 1000,
+                    lat.max * 1000);
+            if (st->resample_ratio.load() != 1) {
+                fprintf(stderr, "%sclock drift:       %+.1f ppm\n",
+                        prefix.c_str(), st->drift_ppm.load());
+            }
+            if (outputbuf_max > 0) {
+                fprintf(stderr, "%soutput buffer:     %.1f ms target, "
+                                "%u underruns, %u blocks dropped\n",
+                        prefix.c_str(),
+                        st->fill_target.load() * 1000.0 / nchannel / pcmrate,
+                        st->underruns.load(), st->drops.load());
+            }
+        }
+    }
+
+    if (async_rtlsdr != NULL && async_rtlsdr->async_dropped_blocks() > 0) {
+        fprintf(stderr, "USB buffer:        %llu blocks dropped\n",
+                (unsigned long long)async_rtlsdr->async_dropped_blocks());
+    }
+
+    // Show thread scheduling.
+    if (sched_report) {
+        if (async_rtlsdr != NULL) {
+            async_rtlsdr->stop_async();
+            show_thread_sched("", "usb", async_rtlsdr->async_sched());
+        }
+        show_thread_sched("", "source", source_sched);
+        show_thread_sched("", "decode", decode_sched);
+        for (unsigned int i = 0; i < nstation && outputbuf_samples > 0; i++) {
+            string prefix =
+                (nstation > 1) ? station_label(freqs[i]) : string();
+            show_thread_sched(prefix, "output", stations[i]->output_sched);
+        }
+        if (!lock_error.empty())
+            fprintf(stderr, "WARNING: %s\n", lock_error.c_str());
+    }
+
+    // Show RTP statistics.
+    if (outmode == MODE_RTP) {
+        for (unique_ptr<Station>& st : stations) {
+            const RtpAudioOutput *rtp =
+                static_cast<const RtpAudioOutput*>(st->output.get());
+            string prefix =
+                (nstation > 1) ? station_label(st->freq) : string();
+            fprintf(stderr, "%sRTP:              %llu packets sent\n",
+                    prefix.c_str(),
+                    (unsigned long long)rtp->packets_sent());
+        }
+    }
+
+    // Show RDS statistics.
+    for (unsigned int i = 0; i < nstation && rdsfile != NULL; i++) {
+        const RdsDecoder *rds = decoder.station(i).rds();
+        RdsDecoder::Info info = rds->info();
+        string prefix = (nstation > 1) ? station_label(freqs[i]) : string();
+        fprintf(stderr, "%sRDS:              ", prefix.c_str());
+        if (info.pi >= 0)
+            fprintf(stderr, "PI %04X, ", info.pi);
+        if (!info.ps.empty())
+            fprintf(stderr, "PS \"%s\", ", info.ps.c_str());
+        fprintf(stderr, "%llu groups, %llu block errors, "
+                        "%llu blocks dropped\n",
+                (unsigned long long)rds->groups(),
+                (unsigned long long)rds->block_errors(),
+                (unsigned long long)rds->dropped_blocks());
+    }
+
+    // Show pool statistics.
+    fprintf(stderr, "IQ block pool:     %llu hits, %llu misses\n",
+            (unsigned long long)iq_pool.hits(),
+            (unsigned long long)iq_pool.misses());
+    uint64_t audio_hits = 0, audio_misses = 0;
+    for (unique_ptr<Station>& st : stations) {
+        audio_hits   += st->pool.hits();
+        audio_misses += st->pool.misses();
     }
+    fprintf(stderr, "audio block pool:  %llu hits, %llu misses\n",
+            (unsigned long long)audio_hits,
+            (unsigned long long)audio_misses);
 
     // No cleanup needed; everything handled by destructors.
 